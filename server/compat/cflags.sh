@@ -0,0 +1,16 @@
+#!/bin/sh
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#
+# cflags.sh - Print the extra compiler flags this OS needs to build the
+# server, which is written against OpenBSD. Nothing is printed there.
+#
+#	usage: cflags.sh compatdir
+
+case "$(uname -s)" in
+Linux)
+	echo "-include $1/linux/compat.h -I$1/linux"
+	;;
+esac
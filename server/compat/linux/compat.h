@@ -0,0 +1,169 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Linux portability layer, included ahead of every source file (see
+ * ../cflags.sh). It supplies the OpenBSD interfaces the server uses
+ * that glibc lacks. pledge(2) and unveil(2) are no-ops, and the wg(4)
+ * ioctls only reach the mock and userspace backends: there is no
+ * kernel backend on Linux.
+ */
+
+#ifndef COMPAT_LINUX_H
+#define COMPAT_LINUX_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <net/if.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Interface cloning requests, as on OpenBSD */
+#define SIOCIFCREATE   _IOW('i', 122, struct ifreq)
+#define SIOCIFDESTROY  _IOW('i', 121, struct ifreq)
+
+#if !__GLIBC_PREREQ(2, 38)
+static inline size_t
+strlcpy(char *dst, const char *src, size_t dsize)
+{
+	size_t len = strlen(src);
+
+	if (dsize != 0) {
+		if (len >= dsize)
+			dsize--;
+		else
+			dsize = len;
+		memcpy(dst, src, dsize);
+		dst[dsize] = '\0';
+	}
+
+	return len;
+}
+
+static inline size_t
+strlcat(char *dst, const char *src, size_t dsize)
+{
+	size_t len = strnlen(dst, dsize);
+
+	if (len == dsize)
+		return len + strlen(src);
+
+	return len + strlcpy(dst + len, src, dsize - len);
+}
+#endif
+
+static inline long long
+strtonum(const char *numstr, long long minval, long long maxval,
+    const char **errstrp)
+{
+	long long ll = 0;
+	char *ep;
+
+	*errstrp = NULL;
+	if (minval > maxval) {
+		errno = EINVAL;
+		*errstrp = "invalid";
+		return 0;
+	}
+
+	errno = 0;
+	ll = strtoll(numstr, &ep, 10);
+	if (numstr == ep || *ep != '\0') {
+		errno = EINVAL;
+		*errstrp = "invalid";
+		return 0;
+	}
+	if ((ll == LLONG_MIN && errno == ERANGE) || ll < minval) {
+		errno = ERANGE;
+		*errstrp = "too small";
+		return 0;
+	}
+	if ((ll == LLONG_MAX && errno == ERANGE) || ll > maxval) {
+		errno = ERANGE;
+		*errstrp = "too large";
+		return 0;
+	}
+
+	return ll;
+}
+
+static inline void
+freezero(void *ptr, size_t size)
+{
+	if (ptr == NULL)
+		return;
+	explicit_bzero(ptr, size);
+	free(ptr);
+}
+
+static inline void *
+recallocarray(void *ptr, size_t oldnmemb, size_t newnmemb, size_t size)
+{
+	size_t oldsize, newsize;
+	void *newptr;
+
+	if (ptr == NULL)
+		return calloc(newnmemb, size);
+
+	if (size != 0 && (newnmemb > SIZE_MAX / size ||
+	    oldnmemb > SIZE_MAX / size)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	newsize = newnmemb * size;
+	oldsize = oldnmemb * size;
+
+	/* Like OpenBSD, never leave the old contents behind in free memory */
+	if ((newptr = malloc(newsize)) == NULL)
+		return NULL;
+	if (newsize > oldsize) {
+		memcpy(newptr, ptr, oldsize);
+		memset((char *)newptr + oldsize, 0, newsize - oldsize);
+	} else
+		memcpy(newptr, ptr, newsize);
+	explicit_bzero(ptr, oldsize);
+	free(ptr);
+
+	return newptr;
+}
+
+static inline int
+getpeereid(int s, uid_t *euid, gid_t *egid)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return -1;
+	*euid = cred.uid;
+	*egid = cred.gid;
+
+	return 0;
+}
+
+static inline int
+pledge(const char *promises, const char *execpromises)
+{
+	return 0;
+}
+
+static inline int
+unveil(const char *path, const char *permissions)
+{
+	return 0;
+}
+
+#endif /* COMPAT_LINUX_H */
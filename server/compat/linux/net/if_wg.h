@@ -0,0 +1,97 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * The OpenBSD wg(4) ioctl interface, for Linux builds. Linux has no such
+ * ioctls; the structures and request numbers only travel between the
+ * server and its mock and userspace backends.
+ */
+
+#ifndef COMPAT_NET_IF_WG_H
+#define COMPAT_NET_IF_WG_H
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <net/if.h>
+#include <netinet/in.h>
+
+#include <stdint.h>
+#include <time.h>
+
+#define IFDESCRSIZE  64
+#define WG_KEY_LEN   32
+
+struct wg_aip_io {
+	sa_family_t a_af;
+	int a_cidr;
+	union wg_aip_addr {
+		struct in_addr addr_ipv4;
+		struct in6_addr addr_ipv6;
+	} a_addr;
+#define a_ipv4 a_addr.addr_ipv4
+#define a_ipv6 a_addr.addr_ipv6
+};
+
+#define WG_PEER_HAS_PUBLIC       (1 << 0)
+#define WG_PEER_HAS_PSK          (1 << 1)
+#define WG_PEER_HAS_PKA          (1 << 2)
+#define WG_PEER_HAS_ENDPOINT     (1 << 3)
+#define WG_PEER_REPLACE_AIPS     (1 << 4)
+#define WG_PEER_REMOVE           (1 << 5)
+#define WG_PEER_UPDATE           (1 << 6)
+#define WG_PEER_SET_DESCRIPTION  (1 << 7)
+
+#define p_sa p_endpoint.sa_sa
+#define p_sin p_endpoint.sa_sin
+#define p_sin6 p_endpoint.sa_sin6
+
+struct wg_peer_io {
+	int p_flags;
+	int p_protocol_version;
+	uint8_t p_public[WG_KEY_LEN];
+	uint8_t p_psk[WG_KEY_LEN];
+	uint16_t p_pka;
+	union wg_peer_endpoint {
+		struct sockaddr sa_sa;
+		struct sockaddr_in sa_sin;
+		struct sockaddr_in6 sa_sin6;
+	} p_endpoint;
+	uint64_t p_txbytes;
+	uint64_t p_rxbytes;
+	struct timespec p_last_handshake;
+	char p_description[IFDESCRSIZE];
+	size_t p_aips_count;
+	struct wg_aip_io p_aips[];
+};
+
+#define WG_INTERFACE_HAS_PUBLIC    (1 << 0)
+#define WG_INTERFACE_HAS_PRIVATE   (1 << 1)
+#define WG_INTERFACE_HAS_PORT      (1 << 2)
+#define WG_INTERFACE_HAS_RTABLE    (1 << 3)
+#define WG_INTERFACE_REPLACE_PEERS (1 << 4)
+
+struct wg_interface_io {
+	uint8_t i_flags;
+	in_port_t i_port;
+	int i_rtable;
+	uint8_t i_public[WG_KEY_LEN];
+	uint8_t i_private[WG_KEY_LEN];
+	size_t i_peers_count;
+	struct wg_peer_io i_peers[];
+};
+
+struct wg_data_io {
+	char wgd_name[IFNAMSIZ];
+	size_t wgd_size;
+	struct wg_interface_io *wgd_interface;
+};
+
+#define SIOCSWG _IOWR('i', 210, struct wg_data_io)
+#define SIOCGWG _IOWR('i', 211, struct wg_data_io)
+
+#endif /* COMPAT_NET_IF_WG_H */
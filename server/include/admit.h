@@ -0,0 +1,63 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/* Bounds on the hashing limit, in requests per turn */
+#define FW_ADMIT_MIN     1
+#define FW_ADMIT_MAX     64
+
+/* High priority work is shed past this many times the target delay */
+#define FW_ADMIT_HIGH    5
+
+/* Longest Retry-After handed out, in seconds */
+#define FW_ADMIT_RETRY   60
+
+/* Request classes, most urgent first */
+enum fw_prio {
+	FW_PRIO_HIGH,     /* Sessions, errors: cheap, never held back  */
+	FW_PRIO_MEDIUM,   /* Login: hashing that completes a client    */
+	FW_PRIO_LOW,      /* Signup: hashing that starts one           */
+};
+
+/*
+ * Admission control for one event loop turn at a time. Requests queue
+ * behind everything served before them in the turn, so the turn's
+ * length is the queueing delay of the last one. Requests that hash a
+ * password are admitted while the turn stays within the target counting
+ * their expected service time, and up to an adaptive per-turn limit:
+ * turns that run over the target cut it in proportion, turns that held
+ * work back at the limit raise it by one. At least one is admitted per
+ * turn.
+ */
+typedef struct fw_admit {
+	uint64_t start;         /* Turn start, ns                     */
+	uint64_t target;        /* Queueing delay target, ns          */
+	uint64_t service;       /* Hashing service time, EWMA ns      */
+	double limit;           /* Hashing requests per turn          */
+	unsigned int taken;     /* Admitted this turn                 */
+	unsigned int held;      /* Refused this turn                  */
+	int capped;             /* Refused for the limit this turn    */
+} fw_admit_t;
+
+/*
+ * Function prototypes
+ */
+
+void fw_admit_begin(fw_admit_t *, uint64_t, uint64_t);
+void fw_admit_done(fw_admit_t *, enum fw_prio, uint64_t);
+void fw_admit_end(fw_admit_t *, uint64_t);
+void fw_admit_init(fw_admit_t *);
+uint32_t fw_admit_retry(const fw_admit_t *, size_t);
+int fw_admit_take(fw_admit_t *, enum fw_prio, uint64_t);
+
+#endif /* ADMIT_H */
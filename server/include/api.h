@@ -0,0 +1,35 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef API_H
+#define API_H
+
+#include <poll.h>
+
+#include "common.h"
+#include "fwvpnd.h"
+
+/* HTTP API limits */
+#define FW_API_CONNS     256    /* Open client connections          */
+#define FW_API_BUF       8192   /* Request (and response) size cap  */
+#define FW_API_TIMEOUT   10     /* Idle seconds before closing      */
+#define FW_API_SESSION   86400  /* Session lifetime in seconds      */
+
+/* pollfd slots fw_api_pollfds() may fill */
+#define FW_API_POLLFDS   (1 + FW_API_CONNS)
+
+/*
+ * Function prototypes
+ */
+
+size_t fw_api_backlog(fw_ctx_t *);
+fw_err_t fw_api_cache_size(fw_ctx_t *, size_t);
+void fw_api_close(fw_ctx_t *);
+fw_err_t fw_api_open(fw_ctx_t *);
+size_t fw_api_pollfds(fw_ctx_t *, struct pollfd *);
+void fw_api_serve(fw_ctx_t *, const struct pollfd *, size_t);
+
+#endif /* API_H */
@@ -0,0 +1,78 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef BACKUP_H
+#define BACKUP_H
+
+#include <sys/types.h>
+
+#include <limits.h>
+#include <stdint.h>
+
+#include <sqlite3.h>
+
+#include "common.h"
+
+/* Pages copied per backup step */
+#define FW_BK_PAGES   64
+
+/* Time an event loop turn may spend on backup steps, in nanoseconds */
+#define FW_BK_BUDGET  2000000
+
+/* Shipped WAL size that triggers a checkpoint, in bytes */
+#define FW_WAL_CKPT   (4 * 1024 * 1024)
+
+/*
+ * Online copy of a database. Each step copies FW_BK_PAGES pages and holds
+ * the source's read lock only while it runs, so writes go ahead between
+ * steps; SQLite carries writes made on the source connection into the
+ * copy, while a write from another connection restarts it. The copy is
+ * built in path.tmp and renamed over path once complete.
+ */
+typedef struct fw_backup {
+	sqlite3 *dst;                 /* path.tmp, or NULL when idle */
+	sqlite3_backup *bk;           /* Backup handle               */
+	char path[PATH_MAX];          /* Final path                  */
+	char tmp[PATH_MAX];           /* Copy being written          */
+} fw_backup_t;
+
+/*
+ * WAL shipper for a standby directory. Committed frames of the primary's
+ * -wal file are appended to dir/wal.<gen>, one file per WAL generation
+ * (the log between two checkpoints, which the shipper runs itself once a
+ * generation is shipped), and dir/base.<gen>.db is an online copy that
+ * the chain wal.<gen>, wal.<gen + 1>, ... applies to.
+ */
+typedef struct fw_walship {
+	char dir[PATH_MAX];           /* Standby directory           */
+	char wal[PATH_MAX];           /* Primary's -wal file         */
+	uint64_t gen;                 /* Generation being shipped    */
+	uint64_t basegen;             /* Generation of the base      */
+	uint64_t rebase;              /* Copy a base from gen (0=no) */
+	off_t off;                    /* Bytes of it shipped         */
+	uint32_t salt[2];             /* Its header salts            */
+	int fd;                       /* dir/wal.<gen>, or -1        */
+	fw_backup_t base;             /* Base copy in progress       */
+} fw_walship_t;
+
+/*
+ * Function prototypes
+ */
+
+/* Online backup */
+void fw_bk_abort(fw_backup_t *);
+int fw_bk_running(const fw_backup_t *);
+fw_err_t fw_bk_start(fw_backup_t *, sqlite3 *, const char *);
+fw_err_t fw_bk_step(fw_backup_t *, int *);
+fw_err_t fw_bk_work(fw_backup_t *, uint64_t, int *);
+
+/* WAL shipping */
+void fw_ws_close(fw_walship_t *);
+fw_err_t fw_ws_open(fw_walship_t *, sqlite3 *, const char *, const char *);
+fw_err_t fw_ws_restore(const char *, const char *, uint64_t *);
+fw_err_t fw_ws_work(fw_walship_t *, sqlite3 *, uint64_t);
+
+#endif /* BACKUP_H */
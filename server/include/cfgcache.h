@@ -0,0 +1,78 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef CFGCACHE_H
+#define CFGCACHE_H
+
+#include <stdint.h>
+
+#include "common.h"
+#include "db.h"
+#include "wireguard.h"
+
+/* Cached users: default and most */
+#define FW_CFGCACHE_SIZE 4096
+#define FW_CFGCACHE_MAX  (1 << 20)
+
+/* ETag length (with nullbyte) */
+#define FW_ETAG_LEN      48
+
+/*
+ * Rendered client config: the header block and body of a 200 response
+ * after the status line, ready to hand to writev(2). Bodies are
+ * immutable and reference counted, so a response still being written
+ * keeps its body alive after the cache has dropped it.
+ */
+typedef struct fw_cfgbody {
+	int refs;                          /* Cache + pending responses   */
+	char public_key[WG_KEY_B64_LEN];   /* User's peer key             */
+	char etag[FW_ETAG_LEN];            /* Quoted ETag                 */
+	size_t len;                        /* Bytes in data               */
+	char data[];                       /* Headers, blank line, body   */
+} fw_cfgbody_t;
+
+/* Cache entry */
+typedef struct fw_cfgent {
+	char user[FW_DB_ID_LEN];  /* users.id, "" if free       */
+	uint64_t version;         /* vpn_configs row version    */
+	fw_cfgbody_t *body;       /* Rendered config            */
+	uint32_t next;            /* Hash chain link (id + 1)   */
+	int ref;                  /* CLOCK reference bit        */
+} fw_cfgent_t;
+
+/*
+ * Per-user rendered configs, keyed by user and validated against the
+ * user's vpn_configs row version. The server half (key and endpoint) is
+ * shared; changing it flushes every entry, as does resizing.
+ */
+typedef struct fw_cfgcache {
+	fw_cfgent_t *ents;                  /* size entries             */
+	uint32_t *buckets;                  /* id + 1, 0 = empty        */
+	size_t size;                        /* Entries allocated        */
+	uint32_t mask;                      /* Buckets - 1 (power of 2) */
+	size_t count;                       /* Entries in use           */
+	size_t hand;                        /* CLOCK hand               */
+	uint64_t epoch;                     /* Bumped on server changes */
+	char server_key[WG_KEY_B64_LEN];    /* Server public key        */
+	char server_addr[256];              /* Endpoint host            */
+	int server_port;                    /* Endpoint port            */
+} fw_cfgcache_t;
+
+/*
+ * Function prototypes
+ */
+
+void fw_cfgbody_unref(fw_cfgbody_t *);
+
+void fw_cfgcache_free(fw_cfgcache_t *);
+fw_err_t fw_cfgcache_resize(fw_cfgcache_t *, size_t);
+fw_cfgbody_t *fw_cfgcache_get(fw_cfgcache_t *, const char *, uint64_t);
+fw_cfgbody_t *fw_cfgcache_render(fw_cfgcache_t *, const fw_db_user_t *,
+    uint64_t);
+void fw_cfgcache_set_server(fw_cfgcache_t *, const char *, const char *,
+    int);
+
+#endif /* CFGCACHE_H */
@@ -0,0 +1,60 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "db.h"
+#include "fwvpnd.h"
+
+/* Points per node on the hash ring */
+#define FW_RING_VNODES  64
+
+/* Load allowed over a node's capacity-weighted share, in percent */
+#define FW_RING_SLACK   25
+
+/* Ring point */
+typedef struct fw_rpoint {
+	uint64_t hash;        /* Position on the ring  */
+	uint32_t node;        /* Index into nodes      */
+} fw_rpoint_t;
+
+/*
+ * Consistent hash ring with bounded loads. A key goes to the first node
+ * clockwise from its hash whose load is under its bound: its share of
+ * the keys by capacity plus FW_RING_SLACK percent, and never more than
+ * its capacity. Node loads (fw_db_node_t.placed) count up as keys are
+ * picked.
+ */
+typedef struct fw_ring {
+	fw_db_node_t *nodes;  /* Nodes, not owned      */
+	size_t nnodes;        /* Node count            */
+	fw_rpoint_t *points;  /* Sorted by hash        */
+	size_t npoints;       /* Point count           */
+	size_t total;         /* Keys the bounds share */
+	size_t capsum;        /* Summed node capacity  */
+} fw_ring_t;
+
+/*
+ * Function prototypes
+ */
+
+/* Ring */
+void fw_ring_free(fw_ring_t *);
+fw_err_t fw_ring_init(fw_ring_t *, fw_db_node_t *, size_t, size_t);
+size_t fw_ring_bound(const fw_ring_t *, size_t);
+fw_err_t fw_ring_pick(fw_ring_t *, const char *, size_t *);
+
+/* Cluster membership and placement */
+fw_err_t fw_cluster_balance(fw_ctx_t *, size_t *);
+fw_err_t fw_cluster_place(fw_ctx_t *, const char *, char [FW_DB_NODE_LEN]);
+fw_err_t fw_cluster_report(fw_ctx_t *);
+
+#endif /* CLUSTER_H */
@@ -0,0 +1,23 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef CONF_H
+#define CONF_H
+
+#include "common.h"
+#include "fwvpnd.h"
+
+/* Default configuration file */
+#define FW_CONF_PATH "/etc/fwvpnd.conf"
+
+/*
+ * Function prototypes
+ */
+
+void fw_conf_free(fw_cfg_t *);
+fw_err_t fw_conf_load(const char *, fw_cfg_t *);
+
+#endif /* CONF_H */
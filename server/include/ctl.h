@@ -0,0 +1,31 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef CTL_H
+#define CTL_H
+
+#include "common.h"
+#include "fwvpnd.h"
+
+/* Longest control request line */
+#define FW_CTL_LINE_MAX 256
+
+/* Control client I/O timeout (seconds) */
+#define FW_CTL_TIMEOUT  1
+
+/* Peer listings: peers per fw_list_peers_page() call, bytes per write */
+#define FW_CTL_PAGE     64
+#define FW_CTL_CHUNK    8192
+
+/*
+ * Function prototypes
+ */
+
+void fw_ctl_accept(fw_ctx_t *, int);
+void fw_ctl_close(int, const char *);
+fw_err_t fw_ctl_open(const char *, int *);
+
+#endif /* CTL_H */
@@ -0,0 +1,105 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef DB_H
+#define DB_H
+
+#include <netinet/in.h>
+
+#include <stdint.h>
+#include <time.h>
+
+#include <sqlite3.h>
+
+#include "common.h"
+#include "fwvpnd.h"
+#include "wireguard.h"
+
+/* Hex user ID, session token and node name lengths (with nullbyte) */
+#define FW_DB_ID_LEN     33
+#define FW_DB_TOKEN_LEN  65
+#define FW_DB_NODE_LEN   64
+
+/* Milliseconds to wait for another process's write (cluster mode) */
+#define FW_DB_BUSY_MS    1000
+
+/* Schema version (PRAGMA user_version); v1 databases read 0 */
+#define FW_DB_VERSION    2
+
+/* Peer row callback: public key (WG_KEY_LEN bytes), tunnel address */
+typedef fw_err_t (*fw_db_peer_cb)(void *, const uint8_t *, struct in_addr);
+
+/* Placement row callback: user ID, node name (NULL if unplaced) */
+typedef fw_err_t (*fw_db_place_cb)(void *, const char *, const char *);
+
+/* Time to write back for a user ID or base64 public key */
+typedef struct fw_db_stamp {
+	char key[WG_KEY_B64_LEN];
+	time_t when;
+} fw_db_stamp_t;
+
+/* User and its VPN config, as text (db.c stores it binary) */
+typedef struct fw_db_user {
+	char id[FW_DB_ID_LEN];              /* users.id                */
+	char private_key[WG_KEY_B64_LEN];   /* vpn_configs.private_key */
+	char public_key[WG_KEY_B64_LEN];    /* vpn_configs.public_key  */
+	char assigned_ip[MAX_IP_LEN];       /* vpn_configs.assigned_ip */
+	char node_addr[256];                /* Node host, "" unplaced  */
+	int node_port;                      /* Node WireGuard port     */
+} fw_db_user_t;
+
+/* Cluster node */
+typedef struct fw_db_node {
+	char name[FW_DB_NODE_LEN];          /* nodes.name              */
+	char endpoint[256];                 /* Client-facing host      */
+	int port;                           /* WireGuard port          */
+	size_t capacity;                    /* Peers it can serve      */
+	size_t peers;                       /* Peers it reported       */
+	size_t placed;                      /* Users placed on it      */
+	time_t seen;                        /* Last report             */
+} fw_db_node_t;
+
+/* User placement */
+typedef struct fw_db_place {
+	char user[FW_DB_ID_LEN];            /* users.id                */
+	char node[FW_DB_NODE_LEN];          /* nodes.name              */
+} fw_db_place_t;
+
+/*
+ * Function prototypes
+ */
+
+fw_err_t fw_db_generation(sqlite3 *, uint64_t *);
+fw_err_t fw_db_init(sqlite3 *);
+fw_err_t fw_db_wal(sqlite3 *);
+fw_err_t fw_db_load_peers(sqlite3 *, const char *, fw_db_peer_cb, void *);
+fw_err_t fw_db_open(const char *, sqlite3 **);
+fw_err_t fw_db_write_stamps(sqlite3 *, const fw_db_stamp_t *, size_t,
+    const fw_db_stamp_t *, size_t);
+
+/* Server key */
+fw_err_t fw_db_get_server_key(sqlite3 *, char [WG_KEY_B64_LEN]);
+fw_err_t fw_db_set_server_key(sqlite3 *, const char *);
+
+/* Users and sessions */
+fw_err_t fw_db_add_session(sqlite3 *, const char *, const char *, time_t);
+fw_err_t fw_db_add_user(sqlite3 *, const fw_db_user_t *, const char *,
+    const char *, time_t);
+fw_err_t fw_db_del_user(sqlite3 *, const char *);
+fw_err_t fw_db_expire_sessions(sqlite3 *, time_t, size_t, size_t *);
+fw_err_t fw_db_get_login(sqlite3 *, const char *, char *, size_t,
+    fw_db_user_t *);
+fw_err_t fw_db_get_session(sqlite3 *, const char *, time_t,
+    char [FW_DB_ID_LEN], uint64_t *);
+fw_err_t fw_db_get_user(sqlite3 *, const char *, fw_db_user_t *);
+
+/* Cluster nodes */
+fw_err_t fw_db_get_nodes(sqlite3 *, time_t, fw_db_node_t **, size_t *);
+fw_err_t fw_db_load_placements(sqlite3 *, fw_db_place_cb, void *);
+fw_err_t fw_db_place_users(sqlite3 *, const fw_db_place_t *, size_t);
+fw_err_t fw_db_report_node(sqlite3 *, const fw_db_node_t *, time_t);
+
+#endif /* DB_H */
@@ -9,6 +9,7 @@
 
 #include <sys/types.h>
 
+#include <stdint.h>
 #include <time.h>
 
 #include <sqlite3.h>
@@ -21,6 +22,29 @@
 #define MAX_KEY_LEN    64   /* Private / Public key */
 #define MAX_TOKEN_LEN  512  /* JSON web token       */
 
+/* Peer activation defaults */
+#define FW_EVICT_BATCH     64   /* Peers evicted per ioctl(2)          */
+#define FW_FLUSH_INTERVAL  30   /* Seconds between DB write-backs      */
+#define FW_INSTALL_BATCH   256  /* Peers installed per ioctl(2)        */
+#define FW_HANDSHAKE_LIVE  180  /* Seconds a handshake counts as live  */
+#define FW_IDLE_TIMEOUT    600  /* Seconds before an idle peer evicts  */
+#define FW_NODE_TIMEOUT    60   /* Seconds until a silent node is down */
+#define FW_POLL_INTERVAL   10   /* Seconds between handshake polls     */
+
+/* Signup/login rate limit defaults, per client address and per account */
+#define FW_AUTH_BURST      10   /* Attempts allowed back to back       */
+#define FW_AUTH_RATE       6    /* Attempts regained per minute        */
+
+/* Load shedding default */
+#define FW_SHED_TARGET     200  /* Milliseconds of queueing allowed    */
+
+/* Background jobs (jobs.c) */
+#define FW_EXPIRE_BATCH    512  /* Sessions deleted per transaction    */
+#define FW_EXPIRE_INTERVAL 60   /* Seconds between session expiries    */
+#define FW_JOB_BUDGET      5000000 /* CPU nanoseconds per job run      */
+#define FW_JOB_JITTER      10   /* Percent of each period randomized   */
+#define FW_SHIP_INTERVAL   1    /* Seconds between WAL shipping runs   */
+
 /* Peer statuses */
 typedef enum {
 	FW_PEER_CONNECTED    = 0,
@@ -37,23 +61,74 @@ typedef enum {
 
 /* fwvpnd configuration */
 typedef struct {
-	char *db_path;      /* Path to SQLite DB        */
-	char *listen_addr;  /* server listen address    */
-	int listen_port;    /* server port              */
-	char *server_addr;  /* server address           */
-	char *vpn_subnet;   /* subnet (CIDR)            */
-	char *wg_iface;     /* WireGuard interface name */
+	char *conf_path;       /* Configuration file (optional)    */
+	char *ctl_path;        /* Control socket (optional)        */
+	char *db_path;         /* Path to SQLite DB                */
+	char *listen_addr;     /* server listen address            */
+	int listen_port;       /* server port                      */
+	char *server_addr;     /* server address                   */
+	char *vpn_subnet;      /* subnet (CIDR)                    */
+	char *wg_iface;        /* WireGuard interface name         */
+	int lazy_peers;        /* Install peers on demand          */
+	size_t max_resident;   /* Installed peer cap (0 = default) */
+	time_t idle_timeout;   /* Idle seconds before eviction     */
+	time_t poll_interval;  /* Seconds between handshake polls  */
+	time_t flush_interval; /* Seconds between DB write-backs   */
+	int handover;          /* Keep interface across restarts   */
+	int keep_iface;        /* Handover forced on by -k         */
+	char *snap_path;       /* Peer snapshot file (optional)    */
+	char *trace_path;      /* Trace dump file (-DFW_TRACE)     */
+	int api_port;          /* HTTP API port (0 = disabled)     */
+	int api_uring;         /* API socket I/O on io_uring(7)    */
+	int wg_mock;           /* Mock interface, for load tests   */
+	int wg_userspace;      /* Userspace data plane (wguser.c)  */
+	int auth_rate;         /* Auth attempts/minute (0 = dflt)  */
+	int auth_burst;        /* Auth attempt burst (0 = default) */
+	int privsep;           /* Run wg(4) ioctls in a child      */
+	char *user;            /* Drop to this user (privsep)      */
+	char *node_name;       /* Cluster node name (cluster.c)    */
+	size_t node_capacity;  /* Peers this node takes (0 = cap)  */
+	int node_coordinator;  /* Rebalance the cluster's users    */
+	time_t node_timeout;   /* Seconds before a node is down    */
+	char *backup_path;     /* Online backup file (backup.c)    */
+	time_t backup_interval; /* Seconds between backups (0=off)*/
+	char *wal_ship_path;   /* WAL standby directory (optional) */
+	int shed_target;       /* Queueing delay target (ms)       */
+	size_t config_cache;   /* Rendered configs cached          */
+	int job_workers;       /* Threads running pool jobs        */
 } fw_cfg_t;
 
 /* fwvpnd (daemon) context */
 typedef struct {
+	void *api;               /* HTTP API server          */
+	int ctl_fd;              /* Control socket           */
 	size_t peer_count;       /* Number of active peers   */
 	void *wg_handle;         /* Wireguard control handle */
+	void *peer_tab;          /* Known peer table         */
+	int peers_dirty;         /* Peer snapshot is stale   */
+	uint64_t peers_gen;      /* DB generation synced     */
+	void *wback;             /* Login/handshake times    */
+	void *backup;            /* Online backup            */
+	void *walship;           /* WAL shipper, or NULL     */
+	void *sched;             /* Background jobs          */
 	sqlite3 *db_conn;        /* Database connection      */
 	fw_cfg_t config;         /* FreewayVPN server config */
 	fw_daemonstate_t state;  /* FreewayVPN daemon state  */
 } fw_ctx_t;
 
+/*
+ * Peer listing cursor: zero it to start, optionally set the filters,
+ * then pass it to fw_list_peers_page() until no peers come back
+ */
+typedef struct {
+	uint64_t pos;          /* Opaque resume position            */
+	unsigned int states;   /* 1 << fw_peerstate_t, 0 = any      */
+	time_t max_age;        /* Handshake within seconds, 0 = any */
+} fw_cursor_t;
+
+/* Cursor position once a listing has run out of peers */
+#define FW_CURSOR_END  UINT64_MAX
+
 /* Peer information context */
 typedef struct {
 	char allowed_ips[MAX_IP_LEN];  /* Allowed IP addresses        */
@@ -67,15 +142,25 @@ typedef struct {
  */
 
 /* Peer management */
+fw_err_t fw_activate_peer(fw_ctx_t *, const char *);
 fw_err_t fw_add_peer(fw_ctx_t *, const char *, const char *);
 fw_err_t fw_get_peer(fw_ctx_t *, const char *, fw_peer_t *);
+fw_err_t fw_get_peer_by_addr(fw_ctx_t *, const char *, fw_peer_t *);
 fw_err_t fw_remove_peer(fw_ctx_t *, const char *);
 fw_err_t fw_list_peers(fw_ctx_t *, fw_peer_t **, size_t *);
+fw_err_t fw_list_peers_page(fw_ctx_t *, fw_cursor_t *, fw_peer_t *, size_t,
+    size_t *);
+fw_err_t fw_poll_peers(fw_ctx_t *);
 
 /* Server management */
 void fw_cleanup(void);
+fw_ctx_t *fw_get_ctx(void);
 fw_err_t fw_init(fw_cfg_t *);
+fw_err_t fw_reload(fw_cfg_t *);
+fw_err_t fw_run(void);
+void fw_signal(int);
 fw_err_t fw_start(void);
+fw_err_t fw_start_backup(fw_ctx_t *);
 
 /* Metrics */
 fw_err_t fw_get_server_status(fw_ctx_t *, fw_daemonstate_t *);
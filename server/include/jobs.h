@@ -0,0 +1,121 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "metrics.h"
+
+/* Timer wheel: slots of one tick each, in milliseconds */
+#define FW_SCHED_SLOTS    256
+#define FW_SCHED_TICK     100
+
+/* Worker threads running pool jobs: default and most */
+#define FW_SCHED_WORKERS  2
+#define FW_SCHED_WORKERS_MAX 16
+
+/* Most periods an overrunning job is pushed back by */
+#define FW_SCHED_BACKOFF  4
+
+/* Job flags */
+#define FW_JOB_LOOP       0x0001  /* Run on the event loop thread     */
+
+/* Job results */
+#define FW_JOB_DONE       0       /* Nothing left until the next run  */
+#define FW_JOB_MORE       1       /* Backlog left, run again at once  */
+
+/*
+ * Job body, given its CPU budget in nanoseconds. Work that may take
+ * longer stops at the budget and returns FW_JOB_MORE.
+ */
+typedef int (*fw_job_fn)(void *, uint64_t);
+
+/* Job run statistics, written only by the thread running the job */
+struct fw_jstats {
+	uint64_t runs;                    /* Runs, counting each slice   */
+	uint64_t coalesced;               /* Runs skipped while busy     */
+	uint64_t overruns;                /* Runs over the CPU budget    */
+	uint64_t cpu;                     /* CPU time, nanoseconds       */
+	uint64_t hist[FW_HIST_BUCKETS];   /* Run time, nanoseconds       */
+	uint64_t hist_sum;
+};
+
+/*
+ * Periodic job. The caller fills in the first block and keeps the job
+ * alive while it is added; the rest belongs to the scheduler.
+ */
+typedef struct fw_job {
+	const char *name;         /* Metric label                     */
+	fw_job_fn fn;             /* Body                             */
+	void *arg;                /* Its argument                     */
+	uint64_t interval;        /* Milliseconds between runs, 0=off */
+	uint64_t jitter;          /* Random +- milliseconds per run   */
+	uint64_t budget;          /* CPU nanoseconds per run, 0=any   */
+	int flags;                /* FW_JOB_* flags                   */
+
+	struct fw_job *next;      /* Wheel slot link                  */
+	struct fw_job **prevp;    /* Its back link, NULL if unarmed   */
+	struct fw_job *qnext;     /* Run queue link                   */
+	struct fw_job *all;       /* Every job added                  */
+	uint64_t due;             /* Tick it fires on                 */
+	uint64_t penalty;         /* Milliseconds owed for overruns   */
+	int busy;                 /* Queued or running                */
+	struct fw_jstats stats;
+} fw_job_t;
+
+/* Worker thread; those numbered want and up exit */
+struct fw_worker {
+	struct fw_sched *sched;   /* Its scheduler                    */
+	size_t id;                /* Number, from 0                   */
+	pthread_t thread;
+};
+
+/*
+ * Hashed timer wheel of periodic jobs. A job fires once its tick comes
+ * round and is re-armed one period (plus jitter) from then, so periods
+ * missed while the process was busy collapse into one run; a job still
+ * queued or running when it fires again skips that run. Pool jobs run
+ * on the worker threads, loop jobs (those touching state owned by the
+ * event loop) run from fw_sched_run() one slice per turn.
+ */
+typedef struct fw_sched {
+	fw_job_t *slots[FW_SCHED_SLOTS];  /* Armed jobs by due tick     */
+	uint64_t start;                   /* Clock at tick 0, in ms     */
+	uint64_t tick;                    /* Next tick to fire          */
+	fw_job_t *jobs;                   /* Every job added            */
+	fw_job_t *ready;                  /* Loop jobs to run           */
+	fw_job_t **readyp;                /* Its tail                   */
+	fw_job_t *queue;                  /* Pool jobs to run           */
+	fw_job_t **queuep;                /* Its tail                   */
+	pthread_mutex_t lock;             /* Protects queue, want, stop */
+	pthread_cond_t cond;              /* Signals the same           */
+	struct fw_worker workers[FW_SCHED_WORKERS_MAX];
+	size_t nworkers;                  /* Workers started            */
+	size_t want;                      /* Workers to keep            */
+	int stop;                         /* Workers are to exit        */
+} fw_sched_t;
+
+/*
+ * Function prototypes
+ */
+
+void fw_sched_free(fw_sched_t *);
+fw_err_t fw_sched_init(fw_sched_t *, size_t);
+fw_err_t fw_sched_workers(fw_sched_t *, size_t);
+
+void fw_sched_add(fw_sched_t *, fw_job_t *, uint64_t);
+void fw_sched_interval(fw_sched_t *, fw_job_t *, uint64_t);
+void fw_sched_kick(fw_sched_t *, fw_job_t *);
+int fw_sched_run(fw_sched_t *);
+fw_err_t fw_sched_write(const fw_sched_t *, FILE *);
+
+#endif /* JOBS_H */
@@ -0,0 +1,53 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LPM_H
+#define LPM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/* Value of a glue node (a branch point, not a stored prefix) */
+#define FW_LPM_NONE  UINT32_MAX
+
+/* Trie node; IPv4 prefixes use the first 4 key bytes */
+typedef struct fw_lpm_node {
+	uint8_t key[16];     /* Prefix, zero past plen           */
+	uint32_t child[2];   /* Node id + 1 by next bit, 0 = none */
+	uint32_t value;      /* Stored value, or FW_LPM_NONE      */
+	uint8_t plen;        /* Prefix length in bits             */
+} fw_lpm_node_t;
+
+/*
+ * Path-compressed binary (Patricia) tries over IPv4 and IPv6 prefixes.
+ * Every node is either a stored prefix or a glue node with exactly two
+ * children, so lookups, inserts and overlap checks visit at most one
+ * node per prefix bit. Nodes live in one array linked by id.
+ */
+typedef struct fw_lpm {
+	fw_lpm_node_t *nodes;  /* Node array                       */
+	size_t cap;            /* Allocated nodes                  */
+	uint32_t freelist;     /* Free node chain (id + 1)         */
+	uint32_t root[2];      /* IPv4 and IPv6 roots (id + 1)     */
+	size_t count;          /* Stored prefixes                  */
+} fw_lpm_t;
+
+/*
+ * Function prototypes
+ */
+
+void fw_lpm_free(fw_lpm_t *);
+fw_err_t fw_lpm_init(fw_lpm_t *);
+
+fw_err_t fw_lpm_delete(fw_lpm_t *, int, const void *, int);
+fw_err_t fw_lpm_insert(fw_lpm_t *, int, const void *, int, uint32_t);
+fw_err_t fw_lpm_lookup(const fw_lpm_t *, int, const void *, uint32_t *);
+fw_err_t fw_lpm_overlap(const fw_lpm_t *, int, const void *, int,
+    uint32_t *);
+
+#endif /* LPM_H */
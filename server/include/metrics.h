@@ -0,0 +1,160 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "common.h"
+
+/* Counters */
+enum fw_counter {
+	FW_C_API_ERRORS,       /* API replies with 4xx/5xx  */
+	FW_C_API_LIMITED,      /* Auth attempts refused     */
+	FW_C_API_OVERFLOW,     /* Connections turned away   */
+	FW_C_API_REQUESTS,     /* API requests served       */
+	FW_C_API_SHED,         /* Requests shed on overload */
+	FW_C_BACKUPS,          /* Online backups completed  */
+	FW_C_CFG_HITS,         /* Cached client configs     */
+	FW_C_CFG_MISSES,       /* Client configs rendered   */
+	FW_C_CLUSTER_MOVES,    /* Users placed on a node    */
+	FW_C_CTL_ERRORS,       /* Failed control requests   */
+	FW_C_CTL_REQUESTS,     /* Control requests served   */
+	FW_C_DB_ERRORS,        /* Failed SQLite calls       */
+	FW_C_DP_DROPS,         /* Data plane drops          */
+	FW_C_DP_HANDSHAKES,    /* Data plane handshakes     */
+	FW_C_DP_RX,            /* Packets to tun(4)         */
+	FW_C_DP_TX,            /* Datagrams to peers        */
+	FW_C_PEER_ACTIVATIONS, /* Peers installed on demand */
+	FW_C_PEER_EVICTIONS,   /* Peers evicted when idle   */
+	FW_C_WAL_BYTES,        /* WAL bytes shipped         */
+	FW_C_WB_FLUSHES,       /* Write-back transactions   */
+	FW_C_WB_ROWS,          /* Stamps written back       */
+	FW_C_WG_ERRORS,        /* Failed wg(4) ioctls       */
+	FW_C_MAX
+};
+
+/* Gauges */
+enum fw_gauge {
+	FW_G_ADMIT_LIMIT,      /* Logins admitted per turn  */
+	FW_G_API_CONNS,        /* Open API connections      */
+	FW_G_API_QUEUE,        /* Connections ready at once */
+	FW_G_PEERS,            /* Registered peers          */
+	FW_G_RESIDENT,         /* Installed peers           */
+	FW_G_WB_DIRTY,         /* Stamps awaiting write-back */
+	FW_G_MAX
+};
+
+/* Latency histograms */
+enum fw_hist {
+	FW_H_API,              /* API request handling      */
+	FW_H_API_QUEUE,        /* API request queueing      */
+	FW_H_BACKUP,           /* Online backup steps       */
+	FW_H_CTL,              /* Control request handling  */
+	FW_H_DB,               /* SQLite statement steps    */
+	FW_H_PWHASH,           /* Password hashing          */
+	FW_H_WB_FLUSH,         /* Write-back transactions   */
+	FW_H_WG_GET,           /* SIOCGWG ioctls            */
+	FW_H_WG_SET,           /* SIOCSWG ioctls            */
+	FW_H_MAX
+};
+
+/*
+ * Log-linear histogram: values below 4 get a bucket each, every power of
+ * two above is split into 4 linear sub-buckets (~25% resolution).
+ */
+#define FW_HIST_SUB      4
+#define FW_HIST_BUCKETS  (64 * FW_HIST_SUB - FW_HIST_SUB)
+
+/*
+ * Per-thread metric storage. Each thread only ever writes its own block,
+ * so recording is a plain relaxed load/store with no locks or atomics
+ * read-modify-write; scrapes sum the blocks of all threads.
+ */
+struct fw_mthread {
+	uint64_t counters[FW_C_MAX];
+	uint64_t hist[FW_H_MAX][FW_HIST_BUCKETS];
+	uint64_t hist_sum[FW_H_MAX];
+	struct fw_mthread *next;
+};
+
+extern __thread struct fw_mthread *fw_mtls;
+
+/*
+ * Function prototypes
+ */
+
+struct fw_mthread *fw_mthread_register(void);
+void fw_metric_set(enum fw_gauge, uint64_t);
+void fw_metrics_hist(FILE *, const char *, const char *,
+    const uint64_t [FW_HIST_BUCKETS], uint64_t);
+fw_err_t fw_metrics_write(FILE *);
+
+/* Current thread's metric block */
+static inline struct fw_mthread *
+fw_mthread(void)
+{
+	struct fw_mthread *t = fw_mtls;
+
+	return t != NULL ? t : fw_mthread_register();
+}
+
+/* Add to a counter */
+static inline void
+fw_metric_add(enum fw_counter c, uint64_t n)
+{
+	struct fw_mthread *t = fw_mthread();
+
+	__atomic_store_n(&t->counters[c], t->counters[c] + n,
+	    __ATOMIC_RELAXED);
+}
+
+/* Bump a counter */
+static inline void
+fw_metric_inc(enum fw_counter c)
+{
+	fw_metric_add(c, 1);
+}
+
+/* Histogram bucket for a value */
+static inline unsigned int
+fw_hist_bucket(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < FW_HIST_SUB)
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	return (e - 1) * FW_HIST_SUB + ((v >> (e - 2)) & (FW_HIST_SUB - 1));
+}
+
+/* Record a latency sample in nanoseconds */
+static inline void
+fw_metric_observe(enum fw_hist h, uint64_t ns)
+{
+	struct fw_mthread *t = fw_mthread();
+	unsigned int b = fw_hist_bucket(ns);
+
+	__atomic_store_n(&t->hist[h][b], t->hist[h][b] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->hist_sum[h], t->hist_sum[h] + ns,
+	    __ATOMIC_RELAXED);
+}
+
+/* Monotonic clock in nanoseconds, for timing samples */
+static inline uint64_t
+fw_metric_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#endif /* METRICS_H */
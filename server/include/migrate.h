@@ -0,0 +1,55 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef MIGRATE_H
+#define MIGRATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sqlite3.h>
+
+#include "common.h"
+
+/* Rows per migration transaction */
+#define FW_MIG_BATCH     1000
+
+/* Migration stages */
+enum fw_mig_stage {
+	FW_MIG_COPY,      /* Copying v1 tables in rowid ranges     */
+	FW_MIG_REPLAY,    /* Replaying rows changed since          */
+	FW_MIG_DONE,      /* Cut over to the current schema        */
+};
+
+/*
+ * Migration of a v1 database to the current schema while other
+ * processes keep using it. Each step is one short write transaction;
+ * rows written while the copy runs are logged by triggers and replayed,
+ * and the last step swaps the tables over. An interrupted migration
+ * resumes from the start of the copy.
+ */
+typedef struct fw_migrate {
+	sqlite3 *db;
+	enum fw_mig_stage stage;
+	size_t batch;             /* Rows per step                 */
+	size_t table;             /* Table being copied            */
+	int64_t next;             /* Its next rowid                */
+	int64_t last;             /* Its last rowid at the start   */
+	uint64_t copied;          /* Rows copied                   */
+	uint64_t replayed;        /* Changed keys replayed         */
+} fw_migrate_t;
+
+/*
+ * Function prototypes
+ */
+
+fw_err_t fw_mig_abort(fw_migrate_t *);
+fw_err_t fw_mig_run(sqlite3 *, size_t);
+fw_err_t fw_mig_start(fw_migrate_t *, sqlite3 *, size_t);
+fw_err_t fw_mig_step(fw_migrate_t *);
+fw_err_t fw_mig_version(sqlite3 *, int *);
+
+#endif /* MIGRATE_H */
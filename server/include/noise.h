@@ -0,0 +1,107 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef NOISE_H
+#define NOISE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/* Sizes */
+#define NOISE_KEY_LEN   32  /* Curve25519 and symmetric keys */
+#define NOISE_HASH_LEN  32  /* BLAKE2s-256                   */
+#define NOISE_MAC_LEN   16  /* Keyed BLAKE2s-128             */
+#define NOISE_TAG_LEN   16  /* Poly1305 tag                  */
+#define NOISE_TS_LEN    12  /* TAI64N timestamp              */
+
+/* Message types (the type byte plus three zero bytes, little-endian) */
+#define NOISE_MSG_INIT    1
+#define NOISE_MSG_RESP    2
+#define NOISE_MSG_COOKIE  3
+#define NOISE_MSG_DATA    4
+
+/* Handshake initiation, 148 bytes */
+struct noise_init {
+	uint32_t type;
+	uint32_t sender;
+	uint8_t ephemeral[NOISE_KEY_LEN];
+	uint8_t spub[NOISE_KEY_LEN + NOISE_TAG_LEN];
+	uint8_t ts[NOISE_TS_LEN + NOISE_TAG_LEN];
+	uint8_t mac1[NOISE_MAC_LEN];
+	uint8_t mac2[NOISE_MAC_LEN];
+} __attribute__((packed));
+
+/* Handshake response, 92 bytes */
+struct noise_resp {
+	uint32_t type;
+	uint32_t sender;
+	uint32_t receiver;
+	uint8_t ephemeral[NOISE_KEY_LEN];
+	uint8_t empty[NOISE_TAG_LEN];
+	uint8_t mac1[NOISE_MAC_LEN];
+	uint8_t mac2[NOISE_MAC_LEN];
+} __attribute__((packed));
+
+/* Transport data header; the sealed packet follows */
+struct noise_data {
+	uint32_t type;
+	uint32_t receiver;
+	uint64_t counter;
+} __attribute__((packed));
+
+/* Our static identity */
+typedef struct noise_local {
+	uint8_t priv[NOISE_KEY_LEN];      /* Static private key           */
+	uint8_t pub[NOISE_KEY_LEN];       /* Static public key            */
+	uint8_t hash[NOISE_HASH_LEN];     /* Initial hash as responder    */
+	uint8_t mac1[NOISE_HASH_LEN];     /* MAC1 key for messages to us  */
+} noise_local_t;
+
+/* A peer's static identity */
+typedef struct noise_remote {
+	uint8_t pub[NOISE_KEY_LEN];       /* Static public key            */
+	uint8_t psk[NOISE_KEY_LEN];       /* Preshared key, or zeros      */
+	uint8_t hash[NOISE_HASH_LEN];     /* Initial hash as initiator    */
+	uint8_t mac1[NOISE_HASH_LEN];     /* MAC1 key for messages to it  */
+} noise_remote_t;
+
+/* Handshake in progress */
+typedef struct noise_hs {
+	uint8_t ck[NOISE_HASH_LEN];       /* Chaining key                 */
+	uint8_t hash[NOISE_HASH_LEN];     /* Handshake hash               */
+	uint8_t epriv[NOISE_KEY_LEN];     /* Our ephemeral (initiator)    */
+	uint8_t eremote[NOISE_KEY_LEN];   /* Their ephemeral (responder)  */
+	uint8_t spub[NOISE_KEY_LEN];      /* Their static (responder)     */
+	uint8_t ts[NOISE_TS_LEN];         /* Their timestamp (responder)  */
+} noise_hs_t;
+
+/*
+ * Function prototypes
+ */
+
+/* Identities */
+void noise_local_init(noise_local_t *, const uint8_t [NOISE_KEY_LEN]);
+void noise_remote_init(noise_remote_t *, const uint8_t [NOISE_KEY_LEN],
+    const uint8_t [NOISE_KEY_LEN]);
+
+/* Handshake (Noise_IKpsk2) */
+fw_err_t noise_create_init(const noise_local_t *, const noise_remote_t *,
+    noise_hs_t *, struct noise_init *, uint32_t);
+fw_err_t noise_consume_init(const noise_local_t *, noise_hs_t *,
+    const struct noise_init *);
+fw_err_t noise_create_resp(const noise_local_t *, const noise_remote_t *,
+    noise_hs_t *, struct noise_resp *, uint32_t, uint32_t);
+fw_err_t noise_consume_resp(const noise_local_t *, const noise_remote_t *,
+    noise_hs_t *, const struct noise_resp *);
+void noise_derive(noise_hs_t *, int, uint8_t [NOISE_KEY_LEN],
+    uint8_t [NOISE_KEY_LEN]);
+
+/* MACs */
+int noise_check_mac1(const noise_local_t *, const void *, size_t);
+
+#endif /* NOISE_H */
@@ -0,0 +1,85 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef PEERTAB_H
+#define PEERTAB_H
+
+#include <sys/types.h>
+
+#include <netinet/in.h>
+
+#include <stdint.h>
+#include <time.h>
+
+#include "common.h"
+#include "lpm.h"
+#include "wireguard.h"
+
+/* Peer entry flags */
+#define FW_PE_USED      0x01  /* Entry holds a registered peer  */
+#define FW_PE_RESIDENT  0x02  /* Peer is installed on interface */
+#define FW_PE_REF       0x04  /* CLOCK reference bit            */
+#define FW_PE_WARM      0x08  /* Resident before last shutdown  */
+#define FW_PE_MARK      0x10  /* Seen by the running sync       */
+
+/* Known peer */
+typedef struct fw_pent {
+	uint8_t key[WG_KEY_LEN];  /* Peer public key                  */
+	struct in_addr addr;      /* Tunnel address (/32)             */
+	time_t handshake;         /* Last handshake seen on interface */
+	time_t active;            /* Last activation or handshake     */
+	uint32_t flags;           /* FW_PE_* flags                    */
+	uint32_t next;            /* Hash chain link (id + 1, 0 = end) */
+	uint32_t slot;            /* Index in resident ring           */
+} fw_pent_t;
+
+/*
+ * Table of every registered peer. Only a bounded subset of the table is
+ * resident (installed on the interface); the resident set is kept in a
+ * ring swept by a CLOCK hand to pick eviction victims. Tunnel addresses
+ * are indexed for longest-prefix match, so no two peers share one.
+ * Whoever edits an entry's handshake directly must bump gen, so the
+ * change gets published to readers (see pview.h).
+ */
+typedef struct fw_ptab {
+	fw_pent_t *ents;    /* Entries, indexed by peer id      */
+	size_t cap;         /* Allocated entries                */
+	size_t count;       /* Registered peers                 */
+	uint32_t freelist;  /* Free entry chain (id + 1)        */
+	uint32_t *buckets;  /* Hash buckets (id + 1, 0 = empty) */
+	size_t nbuckets;    /* Bucket count (power of two)      */
+	uint32_t *ring;     /* Resident peer ids                */
+	size_t rcap;        /* Resident peer cap                */
+	size_t rcount;      /* Resident peers                   */
+	size_t hand;        /* CLOCK hand                       */
+	fw_lpm_t lpm;       /* Peer ids by tunnel address       */
+	uint64_t gen;       /* Bumped on every visible change   */
+} fw_ptab_t;
+
+/*
+ * Function prototypes
+ */
+
+/* Table management */
+fw_err_t fw_ptab_init(fw_ptab_t *, size_t);
+void fw_ptab_free(fw_ptab_t *);
+fw_err_t fw_ptab_set_cap(fw_ptab_t *, size_t);
+
+/* Registration (entry pointers are invalidated by fw_ptab_add) */
+fw_err_t fw_ptab_add(fw_ptab_t *, const uint8_t [WG_KEY_LEN],
+    struct in_addr, uint32_t *);
+fw_err_t fw_ptab_del(fw_ptab_t *, const uint8_t [WG_KEY_LEN]);
+fw_pent_t *fw_ptab_find(fw_ptab_t *, const uint8_t [WG_KEY_LEN]);
+fw_pent_t *fw_ptab_owner(fw_ptab_t *, struct in_addr);
+
+/* Resident set */
+fw_err_t fw_ptab_admit(fw_ptab_t *, fw_pent_t *);
+void fw_ptab_release(fw_ptab_t *, fw_pent_t *);
+void fw_ptab_touch(fw_pent_t *, time_t);
+size_t fw_ptab_victims(fw_ptab_t *, time_t, time_t, int, uint32_t *,
+    size_t);
+
+#endif /* PEERTAB_H */
@@ -0,0 +1,70 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef PVIEW_H
+#define PVIEW_H
+
+#include <netinet/in.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "common.h"
+#include "peertab.h"
+#include "wireguard.h"
+
+/* Published peer */
+typedef struct fw_pvent {
+	uint8_t key[WG_KEY_LEN];  /* Peer public key             */
+	struct in_addr addr;      /* Tunnel address (/32)        */
+	time_t handshake;         /* Last handshake seen         */
+	uint32_t id;              /* Table id, the listing order */
+	uint32_t flags;           /* FW_PE_* flags               */
+} fw_pvent_t;
+
+/* Address index entry */
+typedef struct fw_pvaddr {
+	uint32_t addr;            /* Tunnel address, host order  */
+	uint32_t pos;             /* Position in ents            */
+} fw_pvaddr_t;
+
+/*
+ * Immutable copy of the peer table. Readers look peers up by key,
+ * address or table id without locks; the writer never changes a
+ * published view, it publishes a new one.
+ */
+typedef struct fw_pview {
+	uint64_t gen;             /* Table generation copied          */
+	uint64_t retired;         /* Epoch it was replaced in         */
+	struct fw_pview *next;    /* Retired list link                */
+	size_t count;             /* Registered peers                 */
+	size_t resident;          /* Installed peers                  */
+	uint32_t *bykey;          /* Key index (pos + 1, 0 = free)    */
+	size_t nslots;            /* Key index slots (power of two)   */
+	fw_pvaddr_t *byaddr;      /* Positions sorted by address      */
+	fw_pvent_t ents[];        /* Peers, sorted by table id        */
+} fw_pview_t;
+
+/*
+ * Function prototypes
+ */
+
+/* Readers: the view stays valid until fw_pv_leave() */
+const fw_pview_t *fw_pv_enter(void);
+void fw_pv_leave(void);
+
+const fw_pvent_t *fw_pv_find(const fw_pview_t *, const uint8_t [WG_KEY_LEN]);
+const fw_pvent_t *fw_pv_owner(const fw_pview_t *, struct in_addr);
+size_t fw_pv_seek(const fw_pview_t *, uint64_t);
+
+/* Writer (one thread at a time) */
+void fw_pv_clear(void);
+uint64_t fw_pv_gen(void);
+fw_err_t fw_pv_publish(const fw_ptab_t *);
+size_t fw_pv_reclaim(void);
+
+#endif /* PVIEW_H */
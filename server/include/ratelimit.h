@@ -0,0 +1,59 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sodium.h>
+
+#include "common.h"
+
+/* Table geometry: sets of one cache line each */
+#define FW_RL_SETS  4096  /* Sets (power of two)     */
+#define FW_RL_WAYS  4     /* Buckets per set         */
+
+/* Bucket flags */
+#define FW_RL_USED  0x01  /* Bucket holds a key      */
+#define FW_RL_REF   0x02  /* CLOCK reference bit     */
+
+/* Token bucket, 16 bytes */
+typedef struct fw_rlent {
+	uint64_t key;     /* Keyed hash of the client or account      */
+	uint32_t stamp;   /* Last refill, ms since fw_rl_new()        */
+	uint16_t tokens;  /* Tokens left, 8.8 fixed point             */
+	uint8_t flags;    /* FW_RL_* flags                            */
+	uint8_t hand;     /* CLOCK hand for the set (way 0 only)      */
+} fw_rlent_t;
+
+/* Set: the buckets a key may live in, one cache line */
+typedef struct fw_rlset {
+	fw_rlent_t ways[FW_RL_WAYS];
+} __attribute__((aligned(64))) fw_rlset_t;
+
+/*
+ * Token buckets in a fixed, set-associative table. A key hashes to one
+ * set and is only ever compared against that set's buckets, so lookups
+ * touch a single cache line; a full set evicts with its own CLOCK hand.
+ */
+typedef struct fw_ratelimit {
+	fw_rlset_t sets[FW_RL_SETS];
+	uint8_t seed[crypto_shorthash_KEYBYTES];  /* Hash key           */
+	uint64_t epoch;                           /* Time origin (ms)   */
+} fw_ratelimit_t;
+
+/*
+ * Function prototypes
+ */
+
+void fw_rl_free(fw_ratelimit_t *);
+fw_ratelimit_t *fw_rl_new(void);
+int fw_rl_take(fw_ratelimit_t *, const void *, size_t, int, int,
+    uint32_t *);
+
+#endif /* RATELIMIT_H */
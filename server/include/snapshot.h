@@ -0,0 +1,57 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+#include "common.h"
+#include "peertab.h"
+
+/* Snapshot file identification */
+#define FW_SNAP_MAGIC    0x50534e46  /* "FNSP", native byte order */
+#define FW_SNAP_VERSION  2
+
+/* Peer record flags */
+#define FW_SNAP_RESIDENT 0x0001  /* Peer was installed when written */
+
+/* Snapshot file header */
+struct fw_snap_hdr {
+	uint32_t magic;       /* FW_SNAP_MAGIC                */
+	uint16_t version;     /* FW_SNAP_VERSION              */
+	uint16_t stride;      /* sizeof(struct fw_snap_rec)   */
+	uint64_t generation;  /* vpn_configs generation       */
+	uint64_t count;       /* Peer records                 */
+	uint64_t checksum;    /* FNV-1a 64, header and records */
+};
+
+/* Packed peer record, fixed stride */
+struct fw_snap_rec {
+	uint8_t key[WG_KEY_LEN];  /* Raw public key                */
+	uint32_t addr;            /* Tunnel address, network order */
+	uint32_t flags;           /* FW_SNAP_* flags               */
+};
+
+/* Mapped snapshot */
+typedef struct fw_snap {
+	void *base;                       /* mmap(2) base        */
+	size_t len;                       /* Mapping length      */
+	const struct fw_snap_hdr *hdr;    /* File header         */
+	const struct fw_snap_rec *recs;   /* Peer records        */
+} fw_snap_t;
+
+/*
+ * Function prototypes
+ */
+
+void fw_snap_close(fw_snap_t *);
+fw_err_t fw_snap_open(fw_snap_t *, const char *);
+fw_err_t fw_snap_write(const char *, uint64_t, fw_ptab_t *);
+
+#endif /* SNAPSHOT_H */
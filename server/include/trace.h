@@ -0,0 +1,134 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "common.h"
+
+/*
+ * Hot-path tracing probes. Build with -DFW_TRACE to enable them; without
+ * it every FW_TRACE_* macro compiles to nothing. Enabled probes write
+ * fixed-size events into a per-thread ring, which fw_trace_dump() saves
+ * for tools/fwtrace to decode into a timeline.
+ */
+
+/* Probes: X(id, name) */
+#define FW_PROBES(X)					\
+	X(FW_P_B64_DECODE,  "b64_decode")		\
+	X(FW_P_B64_ENCODE,  "b64_encode")		\
+	X(FW_P_DB_EXEC,     "db_exec")			\
+	X(FW_P_DB_STEP,     "db_step")			\
+	X(FW_P_KEYGEN,      "keygen")			\
+	X(FW_P_WG_IOCTL,    "wg_ioctl")
+
+#define FW_PROBE_ENUM(id, name) id,
+enum fw_probe {
+	FW_PROBES(FW_PROBE_ENUM)
+	FW_P_MAX
+};
+#undef FW_PROBE_ENUM
+
+/* Event phases */
+#define FW_TR_BEGIN  0
+#define FW_TR_END    1
+
+/* Events per thread ring (power of two) */
+#define FW_TRACE_RING  8192
+
+/* Dump file identification */
+#define FW_TRACE_MAGIC    0x52545746  /* "FWTR", native byte order */
+#define FW_TRACE_VERSION  1
+
+/* Trace event */
+struct fw_tevent {
+	uint64_t ts;     /* CLOCK_MONOTONIC nanoseconds */
+	uint16_t probe;  /* enum fw_probe               */
+	uint8_t phase;   /* FW_TR_BEGIN or FW_TR_END    */
+	uint8_t pad;
+	uint32_t tid;    /* Ring (thread) number        */
+	uint64_t a0;     /* Probe arguments             */
+	uint64_t a1;
+};
+
+/* Dump file header, followed by rings */
+struct fw_trace_hdr {
+	uint32_t magic;    /* FW_TRACE_MAGIC            */
+	uint16_t version;  /* FW_TRACE_VERSION          */
+	uint16_t evsize;   /* sizeof(struct fw_tevent)  */
+	uint32_t nrings;   /* Rings that follow         */
+	uint32_t pad;
+};
+
+/* Ring header in a dump, followed by count events, oldest first */
+struct fw_trace_rhdr {
+	uint32_t tid;      /* Ring (thread) number      */
+	uint32_t count;    /* Events that follow        */
+};
+
+/*
+ * Function prototypes
+ */
+
+fw_err_t fw_trace_dump(const char *);
+
+#ifdef FW_TRACE
+
+/* Per-thread event ring; only its thread writes, dumps read */
+struct fw_tring {
+	uint64_t head;                        /* Events ever written */
+	uint32_t tid;                         /* Ring number         */
+	struct fw_tring *next;                /* All rings           */
+	struct fw_tevent ev[FW_TRACE_RING];
+};
+
+extern __thread struct fw_tring *fw_trtls;
+
+struct fw_tring *fw_trace_register(void);
+
+/* Record an event */
+static inline void
+fw_trace_emit(enum fw_probe probe, uint8_t phase, uint64_t a0, uint64_t a1)
+{
+	struct fw_tring *r = fw_trtls;
+	struct fw_tevent *ev;
+	struct timespec ts;
+	uint64_t head;
+
+	if (r == NULL)
+		r = fw_trace_register();
+
+	head = r->head;
+	ev = &r->ev[head & (FW_TRACE_RING - 1)];
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ev->ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	ev->probe = probe;
+	ev->phase = phase;
+	ev->tid = r->tid;
+	ev->a0 = a0;
+	ev->a1 = a1;
+
+	/* Publish after the event is written */
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#define FW_TRACE_BEGIN(p, a0) \
+	fw_trace_emit((p), FW_TR_BEGIN, (uint64_t)(a0), 0)
+#define FW_TRACE_END(p, a0, a1) \
+	fw_trace_emit((p), FW_TR_END, (uint64_t)(a0), (uint64_t)(a1))
+
+#else /* !FW_TRACE */
+
+#define FW_TRACE_BEGIN(p, a0)    do { } while (0)
+#define FW_TRACE_END(p, a0, a1)  do { } while (0)
+
+#endif /* FW_TRACE */
+
+#endif /* TRACE_H */
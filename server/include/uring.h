@@ -0,0 +1,89 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/* Completion flags */
+#define FW_UCQE_MORE      0x01  /* Multishot request is still armed  */
+#define FW_UCQE_BUF       0x02  /* Data is in provided buffer bid    */
+
+/* Request chaining */
+#define FW_URING_LINK     0x01  /* Next runs if this one completes   */
+#define FW_URING_HARD     0x02  /* Next runs whatever this one did   */
+
+/* Completion, as reaped */
+typedef struct fw_ucqe {
+	uint64_t data;                /* Request's user data         */
+	int32_t res;                  /* Result, or -errno           */
+	uint32_t flags;               /* FW_UCQE_* flags             */
+	uint16_t bid;                 /* Buffer ID with FW_UCQE_BUF  */
+} fw_ucqe_t;
+
+/*
+ * io_uring(7) instance with a sparse registered file table and one ring
+ * of provided receive buffers, driven by raw system calls. Requests are
+ * queued locally and reach the kernel in one io_uring_enter(2) per
+ * fw_uring_submit(); completions are reaped from shared memory without
+ * any system call.
+ */
+typedef struct fw_uring {
+	int fd;                       /* Ring, or -1                 */
+	void *ring;                   /* Shared SQ and CQ rings      */
+	size_t ring_len;
+	void *sqes;                   /* Submission queue entries    */
+	size_t sqes_len;
+	unsigned int *sq_head;        /* Kernel consumer             */
+	unsigned int *sq_tail;        /* Our producer                */
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_local;        /* Tail not yet published      */
+	unsigned int *cq_head;        /* Our consumer                */
+	unsigned int *cq_tail;        /* Kernel producer             */
+	unsigned int cq_mask;
+	void *cqes;                   /* Completion queue entries    */
+	void *br;                     /* Provided buffer ring        */
+	size_t br_len;
+	uint16_t br_tail;             /* Buffers handed back         */
+	uint8_t *bufs;                /* Buffer memory               */
+	unsigned int nbufs;           /* Buffers (power of two)      */
+	size_t buflen;                /* Bytes per buffer            */
+} fw_uring_t;
+
+/*
+ * Function prototypes
+ */
+
+/* Ring */
+void fw_uring_close(fw_uring_t *);
+fw_err_t fw_uring_open(fw_uring_t *, unsigned int, unsigned int,
+    unsigned int, size_t);
+int fw_uring_reap(fw_uring_t *, fw_ucqe_t *);
+fw_err_t fw_uring_submit(fw_uring_t *);
+
+/* Provided buffers */
+void *fw_uring_buf(fw_uring_t *, uint16_t);
+void fw_uring_buf_put(fw_uring_t *, uint16_t);
+
+/* Requests */
+fw_err_t fw_uring_accept(fw_uring_t *, int, uint64_t);
+fw_err_t fw_uring_cancel(fw_uring_t *, uint64_t, int, uint64_t);
+fw_err_t fw_uring_close_fd(fw_uring_t *, int, uint64_t);
+fw_err_t fw_uring_close_file(fw_uring_t *, unsigned int, uint64_t);
+fw_err_t fw_uring_install(fw_uring_t *, int *, unsigned int, uint64_t);
+fw_err_t fw_uring_recv(fw_uring_t *, unsigned int, uint64_t);
+fw_err_t fw_uring_writev(fw_uring_t *, unsigned int, const struct iovec *,
+    int, int, uint64_t);
+
+#endif /* URING_H */
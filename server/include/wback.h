@@ -0,0 +1,69 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef WBACK_H
+#define WBACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sodium.h>
+#include <sqlite3.h>
+
+#include "common.h"
+
+/* Key length: a hex user ID without nullbyte, or a raw public key */
+#define FW_WB_KEY_LEN  32
+
+/* Rows written per flush transaction */
+#define FW_WB_BATCH    256
+
+/* Stamp kinds */
+enum fw_wb_kind {
+	FW_WB_LOGIN,      /* users.last_login by user ID           */
+	FW_WB_HANDSHAKE,  /* peer_handshakes by public key         */
+	FW_WB_MAX
+};
+
+/* Dirty stamp */
+typedef struct fw_wbent {
+	uint8_t key[FW_WB_KEY_LEN];
+	time_t when;                 /* Newest time seen      */
+	uint32_t hash;               /* Home slot hash        */
+} fw_wbent_t;
+
+/* Dirty stamps of one kind, indexed by key */
+typedef struct fw_wbset {
+	fw_wbent_t *ents;   /* Dense, in no order                    */
+	uint32_t *index;    /* Linear probing: position + 1, 0 = free */
+	size_t count;       /* Entries in use                        */
+	size_t cap;         /* Entries allocated; index has 2x slots */
+} fw_wbset_t;
+
+/*
+ * Write-back buffer for volatile timestamps. Logins and handshakes only
+ * mark a stamp here (a repeat just keeps the newest time); flushes write
+ * each key once, so the DB sees one row per key per flush however busy
+ * the key was. Only dirty stamps are kept.
+ */
+typedef struct fw_wback {
+	fw_wbset_t sets[FW_WB_MAX];
+	uint8_t seed[crypto_shorthash_KEYBYTES];  /* Hash key */
+} fw_wback_t;
+
+/*
+ * Function prototypes
+ */
+
+void fw_wb_free(fw_wback_t *);
+fw_err_t fw_wb_init(fw_wback_t *);
+
+size_t fw_wb_dirty(const fw_wback_t *);
+fw_err_t fw_wb_flush(fw_wback_t *, sqlite3 *, size_t);
+fw_err_t fw_wb_mark(fw_wback_t *, enum fw_wb_kind, const void *, time_t);
+
+#endif /* WBACK_H */
@@ -21,10 +21,22 @@
 /* Maximum allowed peers */
 #define WG_PEERS_MAX 1024
 
+/* Interface backends */
+#define WG_BACKEND_KERNEL  0  /* wg(4)                    */
+#define WG_BACKEND_MOCK    1  /* In memory (see wgmock.c)  */
+#define WG_BACKEND_USER    2  /* Userspace (see wguser.c)  */
+
+/* Next peer in a SIOCGWG dump (peers are followed by their allowed IPs) */
+#define WG_PEER_NEXT(p) \
+	((struct wg_peer_io *)&(p)->p_aips[(p)->p_aips_count])
+
 /* WireGuard interface handle */
 typedef struct wg_handle {
-	char ifname[IFNAMSIZ];  /* Interface name      */
-	int sock;               /* Socket for ioctl(2) */
+	char ifname[IFNAMSIZ];  /* Interface name              */
+	int sock;               /* Socket for ioctl(2)         */
+	struct wg_mock *mock;   /* Mock interface, or NULL     */
+	struct fw_priv *priv;   /* Privileged process, or NULL */
+	struct wg_user *user;   /* Userspace data plane, or NULL */
 } wg_handle_t;
 
 /*
@@ -36,8 +48,25 @@ void wg_close_iface(wg_handle_t *);
 fw_err_t wg_create_iface(wg_handle_t *);
 fw_err_t wg_destroy_iface(wg_handle_t *);
 fw_err_t wg_get_iface(wg_handle_t *, struct wg_interface_io *);
+fw_err_t wg_open(wg_handle_t *, const char *, int);
 fw_err_t wg_open_iface(wg_handle_t *, const char *);
 fw_err_t wg_set_iface(wg_handle_t *, struct wg_interface_io *);
+int wg_ioctl(wg_handle_t *, unsigned long, void *);
+
+/* Mock interface (see wgmock.c) */
+void wg_mock_free(wg_handle_t *);
+int wg_mock_ioctl(wg_handle_t *, unsigned long, void *);
+fw_err_t wg_open_mock(wg_handle_t *, const char *);
+
+/* Privileged process (see privsep.c) */
+fw_err_t wg_open_priv(wg_handle_t *, const char *, int);
+void wg_priv_free(wg_handle_t *);
+int wg_priv_ioctl(wg_handle_t *, unsigned long, void *);
+
+/* Userspace data plane (see wguser.c) */
+fw_err_t wg_open_user(wg_handle_t *, const char *, int);
+void wg_user_free(wg_handle_t *);
+int wg_user_ioctl(wg_handle_t *, unsigned long, void *);
 
 /* Key management */
 fw_err_t wg_gen_keypair(uint8_t [WG_KEY_LEN], uint8_t [WG_KEY_LEN]);
@@ -46,11 +75,17 @@ fw_err_t wg_set_privkey(wg_handle_t *, const uint8_t [WG_KEY_LEN]);
 
 /* Peer management */
 fw_err_t wg_add_peer(wg_handle_t *, struct wg_peer_io *);
+fw_err_t wg_add_peers(wg_handle_t *, const uint8_t (*)[WG_KEY_LEN],
+    const struct in_addr *, size_t);
 fw_err_t wg_remove_peer(wg_handle_t *, const uint8_t [WG_KEY_LEN]);
 fw_err_t wg_get_peer(wg_handle_t *, const uint8_t [WG_KEY_LEN],
     struct wg_peer_io *);
+fw_err_t wg_get_peers(wg_handle_t *, struct wg_interface_io **, size_t *);
+fw_err_t wg_remove_peers(wg_handle_t *, const uint8_t (*)[WG_KEY_LEN],
+    size_t);
 
 /* Helpers */
+int wg_data_valid(const struct wg_interface_io *, size_t);
 fw_err_t wg_key_to_b64(char *, size_t, uint8_t [WG_KEY_LEN]);
 fw_err_t wg_key_from_b64(uint8_t [WG_KEY_LEN], const char *);
 
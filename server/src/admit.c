@@ -0,0 +1,113 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Admission control for the API. The event loop serves requests one at
+ * a time, so offered load past capacity only ever shows up as longer
+ * turns: every request waits for the password hashing queued ahead of
+ * it. Bounding the hashing admitted per turn keeps turns, and so the
+ * latency of everything else, near the target; the requests held back
+ * wait for a later turn or, once they have waited the target out, are
+ * shed with a cheap 503. The hashing stage stays busy throughout, so
+ * goodput holds at capacity instead of collapsing into timeouts.
+ */
+
+#include <string.h>
+
+#include "admit.h"
+#include "metrics.h"
+
+/* Limit a fresh controller starts from */
+#define ADMIT_START  8
+
+/* Largest cut per turn */
+#define ADMIT_CUT    0.5
+
+void
+fw_admit_init(fw_admit_t *a)
+{
+	memset(a, 0, sizeof(*a));
+	a->limit = ADMIT_START;
+	fw_metric_set(FW_G_ADMIT_LIMIT, ADMIT_START);
+}
+
+/* Start a turn at now, aiming for target ns of queueing delay */
+void
+fw_admit_begin(fw_admit_t *a, uint64_t now, uint64_t target)
+{
+	a->start = now;
+	a->target = target;
+	a->taken = 0;
+	a->held = 0;
+	a->capped = 0;
+}
+
+/* Admit a request of class prio at now? */
+int
+fw_admit_take(fw_admit_t *a, enum fw_prio prio, uint64_t now)
+{
+	uint64_t delay = now - a->start;
+
+	if (prio == FW_PRIO_HIGH)
+		return delay <= FW_ADMIT_HIGH * a->target;
+
+	if (a->taken == 0 ||
+	    (a->taken < a->limit && delay + a->service <= a->target)) {
+		a->taken++;
+		return 1;
+	}
+
+	a->held++;
+	if (a->taken >= a->limit)
+		a->capped = 1;
+	return 0;
+}
+
+/*
+ * Retry-After for a request shed with backlog others queued: the time
+ * the backlog takes to serve, so retries don't all land at once
+ */
+uint32_t
+fw_admit_retry(const fw_admit_t *a, size_t backlog)
+{
+	uint64_t wait = 1 + backlog * a->service / 1000000000;
+
+	return wait < FW_ADMIT_RETRY ? wait : FW_ADMIT_RETRY;
+}
+
+/* Account an admitted request's service time */
+void
+fw_admit_done(fw_admit_t *a, enum fw_prio prio, uint64_t ns)
+{
+	if (prio == FW_PRIO_HIGH)
+		return;
+
+	a->service = a->service == 0 ? ns : (a->service * 7 + ns) / 8;
+}
+
+/* End the turn at now and adapt the limit to how long it ran */
+void
+fw_admit_end(fw_admit_t *a, uint64_t now)
+{
+	uint64_t delay = now - a->start;
+	double cut;
+
+	/* Turns without signups or logins say nothing about the limit */
+	if (a->taken + a->held == 0)
+		return;
+
+	if (delay > a->target) {
+		cut = (double)a->target / delay;
+		a->limit *= cut > ADMIT_CUT ? cut : ADMIT_CUT;
+	} else if (a->capped)
+		a->limit += 1;
+
+	if (a->limit < FW_ADMIT_MIN)
+		a->limit = FW_ADMIT_MIN;
+	else if (a->limit > FW_ADMIT_MAX)
+		a->limit = FW_ADMIT_MAX;
+	fw_metric_set(FW_G_ADMIT_LIMIT, a->limit);
+}
@@ -0,0 +1,1817 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * HTTP API: a small HTTP/1.1 server on listen_addr:api_port serving the
+ * client flows. Connections are non-blocking and kept alive; requests
+ * are handled one at a time from fw_run()'s poll loop.
+ *
+ *	POST /signup   email=...&password=...   201 {"id":...}
+ *	POST /login    email=...&password=...   200 {"token":...}
+ *	GET  /config   Authorization: Bearer    200 wg-quick(8) config
+ *	GET  /status   Authorization: Bearer    200 {"state":...}
+ *
+ * Configs are rendered once per user and served from cfgcache.c with
+ * writev(2); a matching If-None-Match gets 304. Signup and login are
+ * rate limited per client address and per account (ratelimit.c) before
+ * any password hashing or database work.
+ *
+ * Under overload, each turn serves authenticated requests first and then
+ * the signups and logins held back, as admission control (admit.c)
+ * allows; the rest get a 503 with Retry-After. Connections past
+ * FW_API_CONNS get the same answer rather than waiting in the backlog.
+ *
+ * With api_uring on Linux, socket I/O goes through io_uring (uring.c)
+ * instead of readiness: one multishot accept, a multishot receive per
+ * connection into provided buffers, responses written with writev and,
+ * on Connection: close, the close linked behind the write. Connections
+ * live in the ring's registered file table. The poll loop only waits
+ * on the ring, and each turn reaps completions and submits what it
+ * queued in one io_uring_enter(2), so a keep-alive request costs well
+ * under one system call.
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sodium.h>
+
+#include "admit.h"
+#include "api.h"
+#include "cfgcache.h"
+#include "cluster.h"
+#include "db.h"
+#include "metrics.h"
+#include "peertab.h"
+#include "ratelimit.h"
+#include "uring.h"
+#include "wback.h"
+#include "wireguard.h"
+
+/* Password length bounds */
+#define API_PASSWORD_MIN  8
+#define API_PASSWORD_MAX  128
+
+/* Connections turned away per turn while every slot is taken */
+#define API_OVERFLOW      16
+
+/* Answer to requests shed under overload */
+#define API_BUSY_BODY     "{\"error\":\"overloaded\"}\n"
+
+/* io_uring sizing: queue entries, provided buffers and their size */
+#define API_RING_SQES     (2 * FW_API_CONNS)
+#define API_RING_BUFS     256
+#define API_RING_BUFLEN   2048
+
+/*
+ * Input a connection may get ahead by. Its receive is cancelled at once
+ * when it gets ahead at all; past that, only the provided buffers can
+ * hold more for it. Beyond this the client is dropped.
+ */
+#define API_RING_SPILL    (API_RING_BUFS * API_RING_BUFLEN)
+
+/* Ring requests' user data: the connection, tagged with the operation */
+#define API_OP_ACCEPT     1
+#define API_OP_RECV       2
+#define API_OP_WRITE      3
+#define API_OP_CLOSE      4
+#define API_OP_MASK       7
+#define API_UD(c, op)     ((uint64_t)(uintptr_t)(c) | (op))
+
+/* Client connection */
+struct api_conn {
+	int fd;
+	struct in_addr addr;    /* Client address               */
+	time_t active;          /* Last read or write           */
+	int close;              /* Close once out is sent       */
+	int deferred;           /* Holds a hashing request      */
+	enum fw_prio prio;      /* Its class                    */
+	uint64_t since;         /* When it arrived, or 0 (ns)   */
+	size_t inlen;           /* Bytes buffered in in         */
+	size_t outlen;          /* Response bytes in out        */
+	size_t outoff;          /* Response bytes already sent  */
+	fw_cfgbody_t *body;     /* Sent after out, or NULL      */
+	unsigned int slot;      /* Ring: registered file        */
+	int ops;                /* Ring: requests in flight     */
+	int recv;               /* Ring: receive armed          */
+	int writing;            /* Ring: write in flight        */
+	int linked;             /* Ring: close follows write    */
+	int closing;            /* Ring: close queued           */
+	int dead;               /* Ring: closed, awaiting ring  */
+	size_t wlen;            /* Ring: bytes write asked for  */
+	char *spill;            /* Ring: input past in          */
+	size_t spilllen;
+	int paused;             /* Ring: receive cancelled      */
+	struct iovec iov[2];    /* Ring: write vectors          */
+	struct api_conn *next;  /* Ring: next dead connection   */
+	char in[FW_API_BUF];
+	char out[FW_API_BUF];
+};
+
+/* API server */
+struct fw_api {
+	int fd;                               /* Listening socket     */
+	struct api_conn *conns[FW_API_CONNS];
+	size_t nconns;
+	uint32_t pool_next;                   /* Next tunnel address  */
+	uint32_t pool_last;                   /* Last tunnel address  */
+	char server_key[WG_KEY_B64_LEN];      /* Interface public key */
+	char dummy[crypto_pwhash_STRBYTES];   /* Hash of no password  */
+	fw_cfgcache_t cache;                  /* Rendered configs     */
+	fw_ratelimit_t *rl;                   /* Auth attempt buckets */
+	fw_admit_t admit;                     /* Load shedding        */
+	size_t queued;                        /* Deferred connections */
+	int uring;                            /* I/O through ring     */
+	fw_uring_t ring;
+	int accepting;                        /* Ring accept armed    */
+	unsigned int slots[FW_API_CONNS];     /* Free file slots      */
+	size_t nslots;
+	struct api_conn *dead;                /* Closing on the ring  */
+};
+
+/* Parsed request */
+struct api_req {
+	char *method;
+	char *path;
+	char *token;            /* Bearer token, or NULL        */
+	char *etag;             /* If-None-Match, or NULL       */
+	char *body;             /* Request body                 */
+	size_t bodylen;
+	char user[FW_DB_ID_LEN];  /* Session user (auth routes) */
+	uint64_t version;         /* Its vpn_configs version    */
+};
+
+/* Routes */
+static void api_config(fw_ctx_t *, struct api_conn *, struct api_req *);
+static void api_login(fw_ctx_t *, struct api_conn *, struct api_req *);
+static void api_signup(fw_ctx_t *, struct api_conn *, struct api_req *);
+static void api_status(fw_ctx_t *, struct api_conn *, struct api_req *);
+
+/* io_uring backend */
+static fw_err_t api_ring_open(struct fw_api *);
+static void api_ring_retire(struct fw_api *, struct api_conn *);
+static int api_ring_write(struct fw_api *, struct api_conn *);
+
+static const struct api_route {
+	const char *method;
+	const char *path;
+	int auth;               /* Needs a session              */
+	int limit;              /* Rate limited per client      */
+	enum fw_prio prio;      /* Admission class              */
+	void (*fn)(fw_ctx_t *, struct api_conn *, struct api_req *);
+} api_routes[] = {
+	{ "GET",  "/config", 1, 0, FW_PRIO_HIGH,   api_config },
+	{ "POST", "/login",  0, 1, FW_PRIO_MEDIUM, api_login },
+	{ "POST", "/signup", 0, 1, FW_PRIO_LOW,    api_signup },
+	{ "GET",  "/status", 1, 0, FW_PRIO_HIGH,   api_status },
+};
+
+/* Peer state names */
+static const char *api_peer_states[] = {
+	[FW_PEER_CONNECTED]    = "connected",
+	[FW_PEER_DISCONNECTED] = "disconnected",
+	[FW_PEER_ERR]          = "error",
+};
+
+/*
+ * Set up the tunnel address pool from vpn_subnet: every host address
+ * but the first (the server's), continuing after the highest one
+ * already registered.
+ */
+static fw_err_t
+api_pool_init(fw_ctx_t *ctx, struct fw_api *api)
+{
+	fw_ptab_t *pt = ctx->peer_tab;
+	char net[MAX_IP_LEN], *slash;
+	struct in_addr addr;
+	const char *errstr;
+	uint32_t first, mask, a;
+	size_t i;
+	int bits;
+
+	if (strlcpy(net, ctx->config.vpn_subnet, sizeof(net)) >= sizeof(net) ||
+	    (slash = strchr(net, '/')) == NULL)
+		goto bad;
+	*slash++ = '\0';
+	bits = strtonum(slash, 8, 30, &errstr);
+	if (errstr != NULL || inet_pton(AF_INET, net, &addr) != 1)
+		goto bad;
+
+	mask = 0xffffffffU << (32 - bits);
+	first = (ntohl(addr.s_addr) & mask) + 2;
+	api->pool_last = (ntohl(addr.s_addr) | ~mask) - 1;
+	api->pool_next = first;
+
+	for (i = 0; i < pt->cap; i++) {
+		if (!(pt->ents[i].flags & FW_PE_USED))
+			continue;
+		a = ntohl(pt->ents[i].addr.s_addr);
+		if (a >= api->pool_next && a <= api->pool_last)
+			api->pool_next = a + 1;
+	}
+
+	return FW_OK;
+
+bad:
+	warnx("vpn_subnet: expected IPv4 CIDR: %s", ctx->config.vpn_subnet);
+	errno = EINVAL;
+	return FW_ERR;
+}
+
+/* Open the API listening socket */
+fw_err_t
+fw_api_open(fw_ctx_t *ctx)
+{
+	struct sockaddr_in sin;
+	struct fw_api *api;
+	uint8_t key[WG_KEY_LEN], pw[16];
+	int on = 1;
+
+	if ((api = calloc(1, sizeof(*api))) == NULL)
+		return FW_ERR;
+	api->fd = -1;
+
+	/* Logins as unknown emails check against this, at the same cost */
+	randombytes_buf(pw, sizeof(pw));
+	if (crypto_pwhash_str(api->dummy, (char *)pw, sizeof(pw),
+	    crypto_pwhash_OPSLIMIT_INTERACTIVE,
+	    crypto_pwhash_MEMLIMIT_INTERACTIVE) != 0) {
+		errno = ENOMEM;
+		goto err;
+	}
+
+	if (api_pool_init(ctx, api) != FW_OK ||
+	    fw_cfgcache_resize(&api->cache, ctx->config.config_cache) !=
+	    FW_OK || (api->rl = fw_rl_new()) == NULL)
+		goto err;
+	fw_admit_init(&api->admit);
+
+	/* Fixed for the daemon's lifetime, see fw_setup_key() */
+	if (wg_get_pubkey(ctx->wg_handle, key) != FW_OK ||
+	    wg_key_to_b64(api->server_key, sizeof(api->server_key), key) !=
+	    FW_OK)
+		goto err;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(ctx->config.api_port);
+	if (inet_pton(AF_INET, ctx->config.listen_addr, &sin.sin_addr) != 1) {
+		warnx("listen_addr: expected IPv4 address: %s",
+		    ctx->config.listen_addr);
+		errno = EINVAL;
+		goto err;
+	}
+
+	if ((api->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	    setsockopt(api->fd, SOL_SOCKET, SO_REUSEADDR, &on,
+	    sizeof(on)) == -1 ||
+	    bind(api->fd, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+	    fcntl(api->fd, F_SETFL, O_NONBLOCK) == -1 ||
+	    listen(api->fd, 128) == -1)
+		goto err;
+
+	if (ctx->config.api_uring && api_ring_open(api) != FW_OK)
+		warn("api_uring: staying on poll(2)");
+
+	ctx->api = api;
+
+	return FW_OK;
+
+err:
+	if (api->fd != -1)
+		close(api->fd);
+	fw_cfgcache_free(&api->cache);
+	fw_rl_free(api->rl);
+	free(api);
+	return FW_ERR;
+}
+
+/* Drop connection i; the last connection takes its place */
+static void
+api_conn_close(struct fw_api *api, size_t i)
+{
+	struct api_conn *c = api->conns[i];
+
+	api->conns[i] = api->conns[--api->nconns];
+	if (api->uring) {
+		api_ring_retire(api, c);
+		return;
+	}
+
+	/* Unread input would turn the close into a reset, losing the reply */
+	(void)recv(c->fd, c->in, sizeof(c->in), MSG_DONTWAIT);
+	close(c->fd);
+	fw_cfgbody_unref(c->body);
+	free(c);
+}
+
+/* Drop connection c, wherever it is */
+static void
+api_conn_drop(struct fw_api *api, struct api_conn *c)
+{
+	size_t i;
+
+	for (i = 0; i < api->nconns; i++) {
+		if (api->conns[i] == c) {
+			api_conn_close(api, i);
+			return;
+		}
+	}
+}
+
+/* Close the API socket and every connection */
+void
+fw_api_close(fw_ctx_t *ctx)
+{
+	struct fw_api *api = ctx->api;
+	struct api_conn *c;
+
+	if (api == NULL)
+		return;
+
+	/* Closing the ring cancels its requests and closes its files */
+	if (api->uring) {
+		fw_uring_close(&api->ring);
+		api->uring = 0;
+		while (api->nconns > 0) {
+			c = api->conns[--api->nconns];
+			fw_cfgbody_unref(c->body);
+			free(c->spill);
+			free(c);
+		}
+		while ((c = api->dead) != NULL) {
+			api->dead = c->next;
+			fw_cfgbody_unref(c->body);
+			free(c->spill);
+			free(c);
+		}
+	}
+
+	while (api->nconns > 0)
+		api_conn_close(api, api->nconns - 1);
+	fw_cfgcache_free(&api->cache);
+	fw_rl_free(api->rl);
+	close(api->fd);
+	free(api);
+	ctx->api = NULL;
+}
+
+/*
+ * Fill pfds (FW_API_POLLFDS slots) with the listening socket, then one
+ * slot per connection in order; returns the slots used. On the ring,
+ * the first slot waits for completions and the others are left unused.
+ */
+size_t
+fw_api_pollfds(fw_ctx_t *ctx, struct pollfd *pfds)
+{
+	struct fw_api *api = ctx->api;
+	struct api_conn *c;
+	size_t i;
+
+	if (api == NULL)
+		return 0;
+
+	if (api->uring) {
+		pfds[0].fd = api->ring.fd;
+		pfds[0].events = POLLIN;
+		pfds[0].revents = 0;
+		for (i = 0; i < api->nconns; i++)
+			pfds[i + 1].fd = -1;
+		return api->nconns + 1;
+	}
+
+	/* Even while full: api_accept() turns the overflow away */
+	pfds[0].fd = api->fd;
+	pfds[0].events = POLLIN;
+	pfds[0].revents = 0;
+
+	for (i = 0; i < api->nconns; i++) {
+		c = api->conns[i];
+		pfds[i + 1].fd = c->fd;
+		pfds[i + 1].events = c->outlen > 0 ? POLLOUT : POLLIN;
+		pfds[i + 1].revents = 0;
+	}
+
+	return api->nconns + 1;
+}
+
+/*
+ * START response helpers
+ */
+
+static const char *
+api_status_text(int status)
+{
+	switch (status) {
+	case 200: return "OK";
+	case 201: return "Created";
+	case 304: return "Not Modified";
+	case 400: return "Bad Request";
+	case 401: return "Unauthorized";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 409: return "Conflict";
+	case 413: return "Payload Too Large";
+	case 429: return "Too Many Requests";
+	case 500: return "Internal Server Error";
+	case 503: return "Service Unavailable";
+	default:  return "Unknown";
+	}
+}
+
+/* Queue a response with extra header lines hdr */
+static void
+api_reply_hdr(struct api_conn *c, int status, const char *type,
+    const char *hdr, const char *body)
+{
+	size_t len = strlen(body);
+	int n;
+
+	if (status >= 400)
+		fw_metric_inc(FW_C_API_ERRORS);
+
+	n = snprintf(c->out, sizeof(c->out), "HTTP/1.1 %d %s\r\n"
+	    "Content-Type: %s\r\nContent-Length: %zu\r\n%s%s\r\n%s",
+	    status, api_status_text(status), type, len, hdr,
+	    c->close ? "Connection: close\r\n" : "", body);
+	if (n < 0 || (size_t)n >= sizeof(c->out)) {
+		c->close = 1;
+		n = snprintf(c->out, sizeof(c->out), "HTTP/1.1 500 %s\r\n"
+		    "Content-Length: 0\r\nConnection: close\r\n\r\n",
+		    api_status_text(500));
+	}
+
+	c->outlen = n;
+	c->outoff = 0;
+}
+
+/* Queue a response */
+static void
+api_reply(struct api_conn *c, int status, const char *type,
+    const char *body)
+{
+	api_reply_hdr(c, status, type,
+	    status == 401 ? "WWW-Authenticate: Bearer\r\n" : "", body);
+}
+
+/* Queue a JSON error response */
+static void
+api_error(struct api_conn *c, int status, const char *msg)
+{
+	char body[128];
+
+	snprintf(body, sizeof(body), "{\"error\":\"%s\"}\n", msg);
+	api_reply(c, status, "application/json", body);
+}
+
+/* Refuse a request under overload, telling the client when to retry */
+static void
+api_shed(struct api_conn *c, uint32_t wait)
+{
+	char hdr[32];
+
+	fw_metric_inc(FW_C_API_SHED);
+	snprintf(hdr, sizeof(hdr), "Retry-After: %u\r\n", wait);
+	api_reply_hdr(c, 503, "application/json", hdr, API_BUSY_BODY);
+}
+
+/*
+ * Charge an auth attempt to key's bucket; once it is empty, replies 429
+ * and returns FW_ERR
+ */
+static fw_err_t
+api_limit(fw_ctx_t *ctx, struct api_conn *c, const void *key, size_t len)
+{
+	struct fw_api *api = ctx->api;
+	char hdr[32];
+	uint32_t wait;
+
+	if (fw_rl_take(api->rl, key, len, ctx->config.auth_rate,
+	    ctx->config.auth_burst, &wait))
+		return FW_OK;
+
+	fw_metric_inc(FW_C_API_LIMITED);
+	snprintf(hdr, sizeof(hdr), "Retry-After: %u\r\n", wait);
+	api_reply_hdr(c, 429, "application/json", hdr,
+	    "{\"error\":\"too many attempts\"}\n");
+	return FW_ERR;
+}
+
+/* Charge an attempt on an account, keyed by case-folded email */
+static fw_err_t
+api_limit_account(fw_ctx_t *ctx, struct api_conn *c, const char *email)
+{
+	char key[MAX_EMAIL_LEN + 2];
+	size_t i;
+
+	key[0] = 'a';
+	for (i = 0; email[i] != '\0' && i < MAX_EMAIL_LEN; i++)
+		key[i + 1] = tolower((unsigned char)email[i]);
+
+	return api_limit(ctx, c, key, i + 1);
+}
+
+/*
+ * END response helpers
+ */
+
+/*
+ * START request parsing
+ */
+
+/* Decode a %-encoded form value in place */
+static fw_err_t
+api_urldecode(char *s)
+{
+	char *d = s, hex[3];
+
+	for (; *s != '\0'; s++) {
+		if (*s == '+')
+			*d++ = ' ';
+		else if (*s != '%')
+			*d++ = *s;
+		else if (isxdigit((unsigned char)s[1]) &&
+		    isxdigit((unsigned char)s[2])) {
+			hex[0] = s[1];
+			hex[1] = s[2];
+			hex[2] = '\0';
+			*d++ = strtol(hex, NULL, 16);
+			s += 2;
+		} else
+			return FW_ERR;
+	}
+	*d = '\0';
+
+	return FW_OK;
+}
+
+/* Find and decode form field name in body (modified in place) */
+static char *
+api_form_get(char *body, const char *name)
+{
+	size_t len = strlen(name);
+	char *p, *end;
+
+	for (p = body; p != NULL && *p != '\0'; p = end) {
+		if ((end = strchr(p, '&')) != NULL)
+			*end++ = '\0';
+		if (strncmp(p, name, len) == 0 && p[len] == '=') {
+			if (api_urldecode(p + len + 1) != FW_OK)
+				return NULL;
+			return p + len + 1;
+		}
+	}
+
+	return NULL;
+}
+
+/* Parse email and password from a signup/login form */
+static fw_err_t
+api_credentials(struct api_req *req, char *email, size_t emaillen,
+    char *password, size_t passwordlen)
+{
+	char form[FW_API_BUF], *v;
+
+	/* Lookups split the form, so work on a fresh copy each time */
+	memcpy(form, req->body, req->bodylen);
+	form[req->bodylen] = '\0';
+	if ((v = api_form_get(form, "email")) == NULL ||
+	    strchr(v, '@') == NULL || strlcpy(email, v, emaillen) >= emaillen)
+		return FW_ERR;
+
+	memcpy(form, req->body, req->bodylen);
+	form[req->bodylen] = '\0';
+	if ((v = api_form_get(form, "password")) == NULL ||
+	    strlen(v) < API_PASSWORD_MIN ||
+	    strlcpy(password, v, passwordlen) >= passwordlen)
+		return FW_ERR;
+
+	return FW_OK;
+}
+
+/* Case-insensitive header match; returns the value or NULL */
+static char *
+api_header(char *line, const char *name)
+{
+	size_t len = strlen(name);
+
+	if (strncasecmp(line, name, len) != 0 || line[len] != ':')
+		return NULL;
+
+	line += len + 1;
+	return line + strspn(line, " \t");
+}
+
+/*
+ * Content-Length of a complete header block, without modifying it.
+ * Returns -1 if the header is present but not a valid length.
+ */
+static ssize_t
+api_content_length(const char *hdr, const char *end)
+{
+	const char *line, *errstr;
+	char num[16];
+	size_t len;
+
+	for (line = strstr(hdr, "\r\n"); line != NULL && line < end;
+	    line = strstr(line, "\r\n")) {
+		line += 2;
+		if (strncasecmp(line, "Content-Length:", 15) != 0)
+			continue;
+		line += 15;
+		line += strspn(line, " \t");
+		len = strcspn(line, "\r");
+		if (len >= sizeof(num))
+			return -1;
+		memcpy(num, line, len);
+		num[len] = '\0';
+		len = strtonum(num, 0, INT_MAX, &errstr);
+		if (errstr != NULL)
+			return -1;
+		return len;
+	}
+
+	return 0;
+}
+
+/*
+ * Whether c->in holds a whole request, or one that api_parse() will
+ * reject without waiting for more input.
+ */
+static int
+api_complete(struct api_conn *c)
+{
+	char *end;
+	size_t hdrlen;
+	ssize_t bodylen;
+
+	c->in[c->inlen] = '\0';
+	if ((end = strstr(c->in, "\r\n\r\n")) == NULL)
+		return c->inlen >= sizeof(c->in) - 1;
+	hdrlen = end + 4 - c->in;
+	if ((bodylen = api_content_length(c->in, end)) == -1 ||
+	    hdrlen + bodylen > sizeof(c->in) - 1)
+		return 1;
+
+	return c->inlen >= hdrlen + bodylen;
+}
+
+/*
+ * Parse the request at the start of c->in. Returns the request length,
+ * 0 if it is still incomplete or -1 (with a response queued) if it is
+ * malformed.
+ */
+static ssize_t
+api_parse(struct api_conn *c, struct api_req *req)
+{
+	char *end, *line, *next, *v, *version;
+	size_t hdrlen;
+	ssize_t bodylen;
+
+	c->in[c->inlen] = '\0';
+	if ((end = strstr(c->in, "\r\n\r\n")) == NULL) {
+		if (c->inlen >= sizeof(c->in) - 1) {
+			c->close = 1;
+			api_error(c, 413, "request too large");
+			return -1;
+		}
+		return 0;
+	}
+	hdrlen = end + 4 - c->in;
+
+	if ((bodylen = api_content_length(c->in, end)) == -1) {
+		c->close = 1;
+		api_error(c, 400, "bad content length");
+		return -1;
+	}
+	if (hdrlen + bodylen > sizeof(c->in) - 1) {
+		c->close = 1;
+		api_error(c, 413, "request too large");
+		return -1;
+	}
+	if (c->inlen < hdrlen + bodylen)
+		return 0;
+
+	/* Complete; split the header block in place */
+	memset(req, 0, sizeof(*req));
+	*end = '\0';
+
+	line = c->in;
+	if ((next = strstr(line, "\r\n")) != NULL) {
+		*next = '\0';
+		next += 2;
+	}
+	req->method = strsep(&line, " ");
+	req->path = strsep(&line, " ");
+	version = line;
+	if (req->path == NULL || version == NULL ||
+	    strncmp(version, "HTTP/1.", 7) != 0) {
+		c->close = 1;
+		api_error(c, 400, "bad request line");
+		return -1;
+	}
+	if (strcmp(version, "HTTP/1.0") == 0)
+		c->close = 1;
+
+	for (line = next; line != NULL; line = next) {
+		if ((next = strstr(line, "\r\n")) != NULL) {
+			*next = '\0';
+			next += 2;
+		}
+
+		if ((v = api_header(line, "Authorization")) != NULL) {
+			if (strncasecmp(v, "Bearer ", 7) == 0)
+				req->token = v + 7;
+		} else if ((v = api_header(line, "If-None-Match")) != NULL) {
+			req->etag = v;
+		} else if ((v = api_header(line, "Connection")) != NULL) {
+			if (strcasecmp(v, "close") == 0)
+				c->close = 1;
+			else if (strcasecmp(v, "keep-alive") == 0)
+				c->close = 0;
+		}
+	}
+
+	/* The body is not NUL-terminated; a pipelined request may follow */
+	req->body = c->in + hdrlen;
+	req->bodylen = bodylen;
+
+	return hdrlen + bodylen;
+}
+
+/*
+ * END request parsing
+ */
+
+/*
+ * START routes
+ */
+
+/*
+ * Install the peer if it isn't. Clustered, users placed on other nodes
+ * aren't in our table; their own node activates them.
+ */
+static void
+api_activate(fw_ctx_t *ctx, const char *route, const char *pubkey)
+{
+	if (fw_activate_peer(ctx, pubkey) == FW_OK)
+		return;
+	if (ctx->config.node_name != NULL && errno == ENOENT)
+		return;
+	warn("%s: fw_activate_peer %s", route, pubkey);
+}
+
+/* POST /signup: create a user, its keys and tunnel address */
+static void
+api_signup(fw_ctx_t *ctx, struct api_conn *c, struct api_req *req)
+{
+	struct fw_api *api = ctx->api;
+	char email[MAX_EMAIL_LEN + 1], password[API_PASSWORD_MAX + 1];
+	char hash[crypto_pwhash_STRBYTES], body[128];
+	char node[FW_DB_NODE_LEN];
+	uint8_t id[(FW_DB_ID_LEN - 1) / 2];
+	uint8_t privkey[WG_KEY_LEN], pubkey[WG_KEY_LEN];
+	fw_db_user_t user;
+	struct in_addr addr;
+	uint64_t start;
+	time_t now;
+	fw_err_t ret;
+
+	if (api_credentials(req, email, sizeof(email), password,
+	    sizeof(password)) != FW_OK) {
+		api_error(c, 400, "bad email or password");
+		return;
+	}
+	if (api_limit_account(ctx, c, email) != FW_OK) {
+		sodium_memzero(password, sizeof(password));
+		return;
+	}
+
+	start = fw_metric_now();
+	ret = crypto_pwhash_str(hash, password, strlen(password),
+	    crypto_pwhash_OPSLIMIT_INTERACTIVE,
+	    crypto_pwhash_MEMLIMIT_INTERACTIVE);
+	fw_metric_observe(FW_H_PWHASH, fw_metric_now() - start);
+	sodium_memzero(password, sizeof(password));
+	if (ret != 0) {
+		api_error(c, 503, "out of memory");
+		return;
+	}
+
+	memset(&user, 0, sizeof(user));
+	randombytes_buf(id, sizeof(id));
+	sodium_bin2hex(user.id, sizeof(user.id), id, sizeof(id));
+	if (wg_gen_keypair(privkey, pubkey) != FW_OK ||
+	    wg_key_to_b64(user.private_key, sizeof(user.private_key),
+	    privkey) != FW_OK ||
+	    wg_key_to_b64(user.public_key, sizeof(user.public_key),
+	    pubkey) != FW_OK) {
+		sodium_memzero(privkey, sizeof(privkey));
+		api_error(c, 500, "key generation failed");
+		return;
+	}
+	sodium_memzero(privkey, sizeof(privkey));
+
+	/* Skip addresses taken behind our back (rows not in the table) */
+	now = time(NULL);
+	do {
+		if (api->pool_next > api->pool_last) {
+			api_error(c, 503, "address pool exhausted");
+			return;
+		}
+		addr.s_addr = htonl(api->pool_next++);
+		inet_ntop(AF_INET, &addr, user.assigned_ip,
+		    sizeof(user.assigned_ip));
+		ret = fw_db_add_user(ctx->db_conn, &user, email, hash, now);
+	} while (ret != FW_OK && errno == EADDRINUSE);
+
+	if (ret != FW_OK) {
+		if (errno == EEXIST)
+			api_error(c, 409, "email already registered");
+		else
+			api_error(c, 500, "database error");
+		return;
+	}
+
+	/* Clustered: the owning node picks the peer up on its next poll */
+	if (ctx->config.node_name != NULL) {
+		if (fw_cluster_place(ctx, user.id, node) != FW_OK) {
+			warn("signup: fw_cluster_place %s", user.id);
+			fw_db_del_user(ctx->db_conn, user.id);
+			api_error(c, 503, "no node has room");
+			return;
+		}
+		if (strcmp(node, ctx->config.node_name) != 0)
+			goto done;
+	}
+
+	if (fw_add_peer(ctx, user.public_key, user.assigned_ip) != FW_OK) {
+		warn("signup: fw_add_peer %s", user.public_key);
+		fw_db_del_user(ctx->db_conn, user.id);
+		api_error(c, 503, "can't provision peer");
+		return;
+	}
+
+done:
+	snprintf(body, sizeof(body), "{\"id\":\"%s\"}\n", user.id);
+	api_reply(c, 201, "application/json", body);
+}
+
+/* POST /login: check password and open a session */
+static void
+api_login(fw_ctx_t *ctx, struct api_conn *c, struct api_req *req)
+{
+	struct fw_api *api = ctx->api;
+	char email[MAX_EMAIL_LEN + 1], password[API_PASSWORD_MAX + 1];
+	char hash[crypto_pwhash_STRBYTES], token[FW_DB_TOKEN_LEN];
+	char body[160];
+	uint8_t raw[(FW_DB_TOKEN_LEN - 1) / 2];
+	fw_db_user_t user;
+	uint64_t start;
+	time_t now;
+	fw_err_t ret;
+	int bad;
+
+	if (api_credentials(req, email, sizeof(email), password,
+	    sizeof(password)) != FW_OK) {
+		api_error(c, 400, "bad email or password");
+		return;
+	}
+	if (api_limit_account(ctx, c, email) != FW_OK) {
+		sodium_memzero(password, sizeof(password));
+		return;
+	}
+
+	/*
+	 * An unknown email is checked against the dummy hash, so the reply
+	 * takes as long and doesn't tell whether the account exists
+	 */
+	ret = fw_db_get_login(ctx->db_conn, email, hash, sizeof(hash), &user);
+	start = fw_metric_now();
+	bad = crypto_pwhash_str_verify(ret == FW_OK ? hash : api->dummy,
+	    password, strlen(password)) != 0 || ret != FW_OK;
+	fw_metric_observe(FW_H_PWHASH, fw_metric_now() - start);
+	if (bad) {
+		sodium_memzero(password, sizeof(password));
+		if (ret == FW_DB_ERR)
+			api_error(c, 500, "database error");
+		else
+			api_error(c, 401, "invalid credentials");
+		return;
+	}
+	sodium_memzero(password, sizeof(password));
+
+	randombytes_buf(raw, sizeof(raw));
+	sodium_bin2hex(token, sizeof(token), raw, sizeof(raw));
+	now = time(NULL);
+	if (fw_db_add_session(ctx->db_conn, token, user.id,
+	    now + FW_API_SESSION) != FW_OK) {
+		api_error(c, 500, "database error");
+		return;
+	}
+	if (fw_wb_mark(ctx->wback, FW_WB_LOGIN, user.id, now) != FW_OK)
+		warn("login: fw_wb_mark");
+
+	/* The client is about to connect; make sure its peer is there */
+	api_activate(ctx, "login", user.public_key);
+
+	snprintf(body, sizeof(body), "{\"token\":\"%s\",\"expires\":%lld}\n",
+	    token, (long long)(now + FW_API_SESSION));
+	api_reply(c, 200, "application/json", body);
+}
+
+/*
+ * The session user's rendered config, from the cache or the database;
+ * replies with an error and returns NULL if there is none
+ */
+static fw_cfgbody_t *
+api_user_config(fw_ctx_t *ctx, struct api_conn *c, struct api_req *req)
+{
+	struct fw_api *api = ctx->api;
+	fw_cfgbody_t *body;
+	fw_db_user_t user;
+	fw_err_t ret;
+
+	/* A reload may have moved the endpoint */
+	fw_cfgcache_set_server(&api->cache, api->server_key,
+	    ctx->config.server_addr, ctx->config.listen_port);
+
+	if ((body = fw_cfgcache_get(&api->cache, req->user, req->version)) !=
+	    NULL)
+		return body;
+
+	if ((ret = fw_db_get_user(ctx->db_conn, req->user, &user)) != FW_OK) {
+		if (ret == FW_DB_ERR)
+			api_error(c, 500, "database error");
+		else
+			api_error(c, 401, "invalid session");
+		return NULL;
+	}
+
+	body = fw_cfgcache_render(&api->cache, &user, req->version);
+	explicit_bzero(user.private_key, sizeof(user.private_key));
+	if (body == NULL)
+		api_error(c, 503, "out of memory");
+
+	return body;
+}
+
+/* GET /config: the client's wg-quick(8) configuration */
+static void
+api_config(fw_ctx_t *ctx, struct api_conn *c, struct api_req *req)
+{
+	fw_cfgbody_t *body;
+	int n;
+
+	if ((body = api_user_config(ctx, c, req)) == NULL)
+		return;
+
+	api_activate(ctx, "config", body->public_key);
+
+	if (req->etag != NULL && strcmp(req->etag, body->etag) == 0) {
+		n = snprintf(c->out, sizeof(c->out), "HTTP/1.1 304 %s\r\n"
+		    "ETag: %s\r\n%s\r\n", api_status_text(304), body->etag,
+		    c->close ? "Connection: close\r\n" : "");
+		c->outlen = n;
+		c->outoff = 0;
+		return;
+	}
+
+	/* Status line here, the prebuilt headers and body go by reference */
+	n = snprintf(c->out, sizeof(c->out), "HTTP/1.1 200 %s\r\n%s",
+	    api_status_text(200), c->close ? "Connection: close\r\n" : "");
+	c->outlen = n;
+	c->outoff = 0;
+	c->body = body;
+	body->refs++;
+}
+
+/* GET /status: the client's tunnel state */
+static void
+api_status(fw_ctx_t *ctx, struct api_conn *c, struct api_req *req)
+{
+	struct fw_api *api = ctx->api;
+	fw_cfgbody_t *cfg;
+	fw_db_user_t user;
+	fw_peer_t peer;
+	char body[160], key[WG_KEY_B64_LEN];
+	fw_err_t ret;
+
+	/* Only the peer key is needed: take a cached config's, else the row's */
+	if ((cfg = fw_cfgcache_get(&api->cache, req->user, req->version)) !=
+	    NULL)
+		strlcpy(key, cfg->public_key, sizeof(key));
+	else if ((ret = fw_db_get_user(ctx->db_conn, req->user, &user)) ==
+	    FW_OK) {
+		strlcpy(key, user.public_key, sizeof(key));
+		explicit_bzero(user.private_key, sizeof(user.private_key));
+	} else {
+		if (ret == FW_DB_ERR)
+			api_error(c, 500, "database error");
+		else
+			api_error(c, 401, "invalid session");
+		return;
+	}
+
+	if (fw_get_peer(ctx, key, &peer) != FW_OK) {
+		api_error(c, 404, "peer not found");
+		return;
+	}
+
+	snprintf(body, sizeof(body), "{\"address\":\"%s\",\"state\":\"%s\","
+	    "\"last_handshake\":%lld}\n", peer.allowed_ips,
+	    api_peer_states[peer.state], (long long)peer.last_handshake);
+	api_reply(c, 200, "application/json", body);
+}
+
+/*
+ * END routes
+ */
+
+/*
+ * Class of the next buffered request, from its request line alone;
+ * requests that won't route or parse are cheap, so high
+ */
+static enum fw_prio
+api_prio(const struct api_conn *c)
+{
+	const struct api_route *r;
+	size_t i, mlen, plen;
+
+	for (i = 0; i < sizeof(api_routes) / sizeof(api_routes[0]); i++) {
+		r = &api_routes[i];
+		mlen = strlen(r->method);
+		plen = strlen(r->path);
+		if (c->inlen > mlen + plen + 1 &&
+		    memcmp(c->in, r->method, mlen) == 0 &&
+		    c->in[mlen] == ' ' &&
+		    memcmp(c->in + mlen + 1, r->path, plen) == 0 &&
+		    c->in[mlen + 1 + plen] == ' ')
+			return r->prio;
+	}
+
+	return FW_PRIO_HIGH;
+}
+
+/* Route a parsed request */
+static void
+api_dispatch(fw_ctx_t *ctx, struct api_conn *c, struct api_req *req)
+{
+	const struct api_route *r = NULL;
+	uint8_t key[1 + sizeof(struct in_addr)];
+	size_t i;
+	int found = 0;
+
+	for (i = 0; i < sizeof(api_routes) / sizeof(api_routes[0]); i++) {
+		if (strcmp(req->path, api_routes[i].path) != 0)
+			continue;
+		found = 1;
+		if (strcmp(req->method, api_routes[i].method) == 0) {
+			r = &api_routes[i];
+			break;
+		}
+	}
+
+	if (r == NULL) {
+		if (found)
+			api_error(c, 405, "method not allowed");
+		else
+			api_error(c, 404, "not found");
+		return;
+	}
+
+	/* Per-client limit first; it is cheaper than anything below */
+	if (r->limit) {
+		key[0] = 'i';
+		memcpy(key + 1, &c->addr, sizeof(c->addr));
+		if (api_limit(ctx, c, key, sizeof(key)) != FW_OK)
+			return;
+	}
+
+	if (r->auth) {
+		if (req->token == NULL ||
+		    strlen(req->token) != FW_DB_TOKEN_LEN - 1) {
+			api_error(c, 401, "missing session");
+			return;
+		}
+		switch (fw_db_get_session(ctx->db_conn, req->token,
+		    time(NULL), req->user, &req->version)) {
+		case FW_OK:
+			break;
+		case FW_DB_ERR:
+			api_error(c, 500, "database error");
+			return;
+		default:
+			api_error(c, 401, "invalid session");
+			return;
+		}
+	}
+
+	r->fn(ctx, c, req);
+}
+
+/*
+ * Handle buffered requests until one is incomplete or output is queued.
+ * A request that hashes a password waits (leaving c deferred) for the
+ * second pass of the turn, hash, and then for admission, unless it has
+ * waited longer than the target: then it is shed.
+ */
+static void
+api_process(fw_ctx_t *ctx, struct api_conn *c, int hash)
+{
+	struct fw_api *api = ctx->api;
+	struct api_req req;
+	enum fw_prio prio;
+	uint64_t start, since, ns;
+	ssize_t len;
+	int admit;
+
+	while (c->outlen == 0 && !c->close && c->inlen > 0) {
+		/* Only a whole request competes for an admission slot */
+		if (!api_complete(c))
+			return;
+
+		start = fw_metric_now();
+		since = api->admit.start;
+		if ((prio = api_prio(c)) != FW_PRIO_HIGH) {
+			if (c->since == 0)
+				c->since = start;
+			since = c->since;
+			c->prio = prio;
+			if (!hash) {
+				c->deferred = 1;
+				return;
+			}
+		}
+
+		admit = fw_admit_take(&api->admit, prio, start);
+		if (!admit && prio != FW_PRIO_HIGH &&
+		    start - since <= api->admit.target) {
+			c->deferred = 1;
+			return;
+		}
+
+		if ((len = api_parse(c, &req)) == 0)
+			return;
+		c->since = 0;
+
+		fw_metric_inc(FW_C_API_REQUESTS);
+		fw_metric_observe(FW_H_API_QUEUE, start - since);
+		if (len > 0 && admit)
+			api_dispatch(ctx, c, &req);
+		else if (len > 0)
+			api_shed(c, fw_admit_retry(&api->admit, api->queued));
+		ns = fw_metric_now() - start;
+		fw_metric_observe(FW_H_API, ns);
+		if (admit)
+			fw_admit_done(&api->admit, prio, ns);
+		if (len < 0)
+			return;
+
+		/* Keep any pipelined request that followed */
+		memmove(c->in, c->in + len, c->inlen - len);
+		c->inlen -= len;
+	}
+}
+
+/* Send queued output; returns -1 if the connection should close */
+static int
+api_flush(struct fw_api *api, struct api_conn *c)
+{
+	struct iovec iov[2];
+	size_t total, off;
+	ssize_t n;
+	int iovcnt;
+
+	if (api->uring)
+		return api_ring_write(api, c);
+
+	total = c->outlen + (c->body != NULL ? c->body->len : 0);
+	while (c->outoff < total) {
+		iovcnt = 0;
+		off = 0;
+		if (c->outoff < c->outlen) {
+			iov[iovcnt].iov_base = c->out + c->outoff;
+			iov[iovcnt++].iov_len = c->outlen - c->outoff;
+		} else
+			off = c->outoff - c->outlen;
+		if (c->body != NULL) {
+			iov[iovcnt].iov_base = c->body->data + off;
+			iov[iovcnt++].iov_len = c->body->len - off;
+		}
+
+		n = writev(c->fd, iov, iovcnt);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		c->outoff += n;
+	}
+
+	fw_cfgbody_unref(c->body);
+	c->body = NULL;
+	c->outlen = c->outoff = 0;
+	return c->close ? -1 : 0;
+}
+
+/*
+ * Serve buffered requests, those that hash a password too if hash, and
+ * try to answer straight away; returns -1 if the connection should close
+ */
+static int
+api_conn_serve(fw_ctx_t *ctx, struct api_conn *c, int hash)
+{
+	for (;;) {
+		api_process(ctx, c, hash);
+		if (c->outlen == 0)
+			return 0;
+		if (api_flush(ctx->api, c) == -1)
+			return -1;
+		if (c->outlen > 0 || c->inlen == 0)
+			return 0;
+	}
+}
+
+/*
+ * Read and serve a connection, leaving password hashing for later in
+ * the turn; returns -1 if it should close
+ */
+static int
+api_conn_io(fw_ctx_t *ctx, struct api_conn *c, short revents)
+{
+	ssize_t n;
+
+	if (revents & POLLOUT) {
+		if (api_flush(ctx->api, c) == -1)
+			return -1;
+		if (c->outlen > 0)
+			return 0;
+	} else if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		n = read(c->fd, c->in + c->inlen, sizeof(c->in) - 1 - c->inlen);
+		if (n == 0 || (n == -1 && errno != EAGAIN &&
+		    errno != EWOULDBLOCK && errno != EINTR))
+			return -1;
+		if (n > 0)
+			c->inlen += n;
+	} else
+		return 0;
+
+	c->active = time(NULL);
+
+	return api_conn_serve(ctx, c, 0);
+}
+
+/*
+ * Turn away a connection we have no slot for: a 503 now beats a client
+ * timing out in the backlog. What it sent is read first, so closing
+ * doesn't reset the connection under the reply.
+ */
+static void
+api_refuse(int fd)
+{
+	static const char resp[] = "HTTP/1.1 503 Service Unavailable\r\n"
+	    "Content-Type: application/json\r\nContent-Length: 23\r\n"
+	    "Retry-After: 1\r\nConnection: close\r\n\r\n" API_BUSY_BODY;
+	char buf[FW_API_BUF];
+
+	fw_metric_inc(FW_C_API_OVERFLOW);
+	(void)recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+	(void)send(fd, resp, sizeof(resp) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(fd);
+}
+
+/* Accept new connections, turning away up to API_OVERFLOW once full */
+static void
+api_accept(struct fw_api *api)
+{
+	struct sockaddr_in sin;
+	struct api_conn *c;
+	socklen_t len;
+	int fd, refused = 0;
+
+	while (api->nconns < FW_API_CONNS || refused < API_OVERFLOW) {
+		len = sizeof(sin);
+		if ((fd = accept(api->fd, (struct sockaddr *)&sin,
+		    &len)) == -1) {
+			if (errno != EWOULDBLOCK && errno != EAGAIN &&
+			    errno != EINTR && errno != ECONNABORTED)
+				warn("api accept");
+			return;
+		}
+		if (api->nconns == FW_API_CONNS) {
+			api_refuse(fd);
+			refused++;
+			continue;
+		}
+
+		if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+		    (c = malloc(sizeof(*c))) == NULL) {
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->addr = sin.sin_addr;
+		c->active = time(NULL);
+		c->close = 0;
+		c->deferred = 0;
+		c->since = 0;
+		c->inlen = c->outlen = c->outoff = 0;
+		c->body = NULL;
+		api->conns[api->nconns++] = c;
+	}
+}
+
+/*
+ * START io_uring backend
+ */
+
+/* Set up the ring with every file slot free and the accept armed */
+static fw_err_t
+api_ring_open(struct fw_api *api)
+{
+	size_t i;
+
+	if (fw_uring_open(&api->ring, API_RING_SQES, FW_API_CONNS,
+	    API_RING_BUFS, API_RING_BUFLEN) != FW_OK)
+		return FW_ERR;
+	if (fw_uring_accept(&api->ring, api->fd,
+	    API_UD(NULL, API_OP_ACCEPT)) != FW_OK ||
+	    fw_uring_submit(&api->ring) != FW_OK) {
+		fw_uring_close(&api->ring);
+		return FW_ERR;
+	}
+
+	for (i = 0; i < FW_API_CONNS; i++)
+		api->slots[i] = FW_API_CONNS - 1 - i;
+	api->nslots = FW_API_CONNS;
+	api->accepting = 1;
+	api->uring = 1;
+
+	return FW_OK;
+}
+
+/* Arm c's multishot receive */
+static void
+api_ring_arm(struct fw_api *api, struct api_conn *c)
+{
+	if (fw_uring_recv(&api->ring, c->slot,
+	    API_UD(c, API_OP_RECV)) != FW_OK) {
+		warn("api ring recv");
+		return;
+	}
+	c->ops++;
+	c->recv = 1;
+	c->paused = 0;
+}
+
+/*
+ * Queue c's close: cancel its receive, which holds the socket open, then
+ * close its slot whether or not there was one to cancel
+ */
+static void
+api_ring_close(struct fw_api *api, struct api_conn *c)
+{
+	if (c->recv)
+		(void)fw_uring_cancel(&api->ring, API_UD(c, API_OP_RECV),
+		    FW_URING_HARD, 0);
+	if (fw_uring_close_file(&api->ring, c->slot,
+	    API_UD(c, API_OP_CLOSE)) != FW_OK) {
+		warn("api ring close");
+		return;
+	}
+	c->ops++;
+	c->closing = 1;
+}
+
+/* Free dead connection c once the ring is done with it */
+static void
+api_ring_put(struct fw_api *api, struct api_conn *c)
+{
+	struct api_conn **p;
+
+	if (!c->dead || c->ops > 0)
+		return;
+
+	for (p = &api->dead; *p != c; p = &(*p)->next)
+		;
+	*p = c->next;
+	fw_cfgbody_unref(c->body);
+	free(c->spill);
+	free(c);
+}
+
+/* Close c, already off the connection list, and free it when it can be */
+static void
+api_ring_retire(struct fw_api *api, struct api_conn *c)
+{
+	c->dead = 1;
+	c->next = api->dead;
+	api->dead = c;
+	if (!c->closing)
+		api_ring_close(api, c);
+	api_ring_put(api, c);
+}
+
+/*
+ * Queue the rest of c's response; the last one on the connection takes
+ * the close with it. Returns -1 if the connection should close.
+ */
+static int
+api_ring_write(struct fw_api *api, struct api_conn *c)
+{
+	size_t total, off = 0;
+	int iovcnt = 0, link;
+
+	if (c->writing || c->closing)
+		return 0;
+
+	total = c->outlen + (c->body != NULL ? c->body->len : 0);
+	if (c->outoff < c->outlen) {
+		c->iov[iovcnt].iov_base = c->out + c->outoff;
+		c->iov[iovcnt++].iov_len = c->outlen - c->outoff;
+	} else
+		off = c->outoff - c->outlen;
+	if (c->body != NULL) {
+		c->iov[iovcnt].iov_base = c->body->data + off;
+		c->iov[iovcnt++].iov_len = c->body->len - off;
+	}
+	c->wlen = total - c->outoff;
+
+	link = c->close ? FW_URING_LINK : 0;
+	if (fw_uring_writev(&api->ring, c->slot, c->iov, iovcnt, link,
+	    API_UD(c, API_OP_WRITE)) != FW_OK) {
+		warn("api ring write");
+		return -1;
+	}
+	c->ops++;
+	c->writing = 1;
+	if (link) {
+		c->linked = 1;
+		api_ring_close(api, c);
+	}
+
+	return 0;
+}
+
+/* A connection accepted as descriptor fd (or -errno) */
+static void
+api_ring_accept(struct fw_api *api, const fw_ucqe_t *cqe)
+{
+	struct sockaddr_in sin;
+	struct api_conn *c;
+	socklen_t len = sizeof(sin);
+	int fd = cqe->res;
+
+	if (!(cqe->flags & FW_UCQE_MORE))
+		api->accepting = 0;
+	if (fd < 0) {
+		errno = -fd;
+		if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+			warn("api accept");
+		return;
+	}
+
+	/* Slots of connections still closing aren't free yet */
+	if (api->nconns == FW_API_CONNS || api->nslots == 0) {
+		api_refuse(fd);
+		return;
+	}
+
+	if (getpeername(fd, (struct sockaddr *)&sin, &len) == -1 ||
+	    (c = calloc(1, sizeof(*c))) == NULL) {
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	c->addr = sin.sin_addr;
+	c->active = time(NULL);
+	c->slot = api->slots[--api->nslots];
+
+	/* Issued in order: into the table, descriptor closed, receive */
+	if (fw_uring_install(&api->ring, &c->fd, c->slot, 0) != FW_OK) {
+		warn("api ring install");
+		api->slots[api->nslots++] = c->slot;
+		close(fd);
+		free(c);
+		return;
+	}
+	(void)fw_uring_close_fd(&api->ring, fd, 0);
+	api_ring_arm(api, c);
+	api->conns[api->nconns++] = c;
+}
+
+/*
+ * Buffer len bytes received on c; returns -1 if the connection should
+ * close. Receives don't wait for responses: what doesn't fit in c->in
+ * is spilled and the receive cancelled, so TCP pushes back on a client
+ * that pipelines ahead of us, as it does with poll(2).
+ */
+static int
+api_ring_input(struct fw_api *api, struct api_conn *c, const char *buf,
+    size_t len)
+{
+	size_t n = 0;
+	char *p;
+
+	if (c->spilllen == 0) {
+		n = sizeof(c->in) - 1 - c->inlen;
+		if (n > len)
+			n = len;
+		memcpy(c->in + c->inlen, buf, n);
+		c->inlen += n;
+	}
+	c->active = time(NULL);
+	if (n == len)
+		return 0;
+
+	if (c->spilllen + len - n > API_RING_SPILL ||
+	    (p = realloc(c->spill, c->spilllen + len - n)) == NULL)
+		return -1;
+	memcpy(p + c->spilllen, buf + n, len - n);
+	c->spill = p;
+	c->spilllen += len - n;
+	if (c->recv && !c->paused &&
+	    fw_uring_cancel(&api->ring, API_UD(c, API_OP_RECV), 0, 0) ==
+	    FW_OK && fw_uring_submit(&api->ring) == FW_OK)
+		c->paused = 1;
+
+	return 0;
+}
+
+/*
+ * Serve c's buffered requests, taking in spilled input as they make
+ * room, and receive again once it is all in; returns -1 if the
+ * connection should close
+ */
+static int
+api_ring_serve(fw_ctx_t *ctx, struct api_conn *c)
+{
+	size_t n;
+
+	for (;;) {
+		n = sizeof(c->in) - 1 - c->inlen;
+		if (n > c->spilllen)
+			n = c->spilllen;
+		if (n > 0) {
+			memcpy(c->in + c->inlen, c->spill, n);
+			c->inlen += n;
+			memmove(c->spill, c->spill + n, c->spilllen - n);
+			c->spilllen -= n;
+		}
+
+		if (api_conn_serve(ctx, c, 0) == -1)
+			return -1;
+		if (c->outlen > 0 || c->deferred || c->spilllen == 0)
+			break;
+	}
+
+	if (c->spilllen == 0 && !c->recv && !c->closing)
+		api_ring_arm(ctx->api, c);
+
+	return 0;
+}
+
+/* Data (or end of stream, or -errno) received on c */
+static void
+api_ring_recvd(fw_ctx_t *ctx, struct api_conn *c, const fw_ucqe_t *cqe)
+{
+	struct fw_api *api = ctx->api;
+	int ret = 0;
+
+	if (!(cqe->flags & FW_UCQE_MORE)) {
+		c->ops--;
+		c->recv = 0;
+	}
+	if (cqe->flags & FW_UCQE_BUF) {
+		if (cqe->res > 0 && !c->dead)
+			ret = api_ring_input(api, c,
+			    fw_uring_buf(&api->ring, cqe->bid), cqe->res);
+		fw_uring_buf_put(&api->ring, cqe->bid);
+	}
+
+	if (c->dead) {
+		api_ring_put(api, c);
+		return;
+	}
+
+	/* Out of buffers, they are all back by now; cancelled, paused */
+	if (ret == -1 || cqe->res == 0 || (cqe->res < 0 &&
+	    cqe->res != -ENOBUFS && cqe->res != -ECANCELED) ||
+	    (cqe->res > 0 && api_ring_serve(ctx, c) == -1)) {
+		api_conn_drop(api, c);
+		return;
+	}
+	if (!c->recv && !c->closing && c->spilllen == 0)
+		api_ring_arm(api, c);
+}
+
+/* Write of c's response done (or -errno) */
+static void
+api_ring_wrote(fw_ctx_t *ctx, struct api_conn *c, const fw_ucqe_t *cqe)
+{
+	struct fw_api *api = ctx->api;
+
+	c->ops--;
+	c->writing = 0;
+
+	/* Short or failed, it cancelled the close linked behind it */
+	if (c->linked && (cqe->res < 0 || (size_t)cqe->res < c->wlen))
+		c->closing = 0;
+	c->linked = 0;
+
+	if (c->dead) {
+		if (!c->closing)
+			api_ring_close(api, c);
+		api_ring_put(api, c);
+		return;
+	}
+	if (cqe->res < 0) {
+		api_conn_drop(api, c);
+		return;
+	}
+
+	c->outoff += cqe->res;
+	c->active = time(NULL);
+	if ((size_t)cqe->res < c->wlen) {
+		if (api_ring_write(api, c) == -1)
+			api_conn_drop(api, c);
+		return;
+	}
+
+	fw_cfgbody_unref(c->body);
+	c->body = NULL;
+	c->outlen = c->outoff = 0;
+	if (c->close || api_ring_serve(ctx, c) == -1)
+		api_conn_drop(api, c);
+}
+
+/* Close of c's slot done; a cancelled one is queued again */
+static void
+api_ring_closed(struct fw_api *api, struct api_conn *c, const fw_ucqe_t *cqe)
+{
+	c->ops--;
+	if (cqe->res != -ECANCELED)
+		api->slots[api->nslots++] = c->slot;
+	api_ring_put(api, c);
+}
+
+/* Handle every completion, then close idle connections */
+static void
+api_ring_reap(fw_ctx_t *ctx)
+{
+	struct fw_api *api = ctx->api;
+	struct api_conn *c;
+	fw_ucqe_t cqe;
+	time_t now;
+	size_t i;
+
+	while (fw_uring_reap(&api->ring, &cqe)) {
+		c = (struct api_conn *)(uintptr_t)(cqe.data &
+		    ~(uint64_t)API_OP_MASK);
+		switch (cqe.data & API_OP_MASK) {
+		case API_OP_ACCEPT:
+			api_ring_accept(api, &cqe);
+			break;
+		case API_OP_RECV:
+			api_ring_recvd(ctx, c, &cqe);
+			break;
+		case API_OP_WRITE:
+			api_ring_wrote(ctx, c, &cqe);
+			break;
+		case API_OP_CLOSE:
+			api_ring_closed(api, c, &cqe);
+			break;
+		}
+	}
+
+	now = time(NULL);
+	for (i = api->nconns; i > 0; i--)
+		if (now - api->conns[i - 1]->active >= FW_API_TIMEOUT)
+			api_conn_close(api, i - 1);
+}
+
+/* Re-arm the accept if it ended and submit the turn's requests */
+static void
+api_ring_submit(struct fw_api *api)
+{
+	if (!api->accepting && fw_uring_accept(&api->ring, api->fd,
+	    API_UD(NULL, API_OP_ACCEPT)) == FW_OK)
+		api->accepting = 1;
+	if (fw_uring_submit(&api->ring) != FW_OK)
+		warn("api ring submit");
+}
+
+/*
+ * END io_uring backend
+ */
+
+/*
+ * Order held back connections by class, then by when their request
+ * arrived: logins, which finish a client's flow, go before signups
+ */
+static int
+api_held_cmp(const void *a, const void *b)
+{
+	const struct api_conn *x = *(struct api_conn * const *)a;
+	const struct api_conn *y = *(struct api_conn * const *)b;
+
+	if (x->prio != y->prio)
+		return x->prio < y->prio ? -1 : 1;
+	return x->since < y->since ? -1 : x->since > y->since;
+}
+
+/*
+ * Serve the pollfds filled by fw_api_pollfds(): every connection's
+ * cheap requests, then password hashing as admission allows
+ */
+void
+fw_api_serve(fw_ctx_t *ctx, const struct pollfd *pfds, size_t npfds)
+{
+	struct fw_api *api = ctx->api;
+	struct api_conn *held[FW_API_CONNS];
+	time_t now;
+	size_t i, n;
+
+	if (api == NULL || npfds == 0)
+		return;
+
+	fw_admit_begin(&api->admit, fw_metric_now(),
+	    (uint64_t)ctx->config.shed_target * 1000000);
+
+	if (api->uring)
+		api_ring_reap(ctx);
+
+	/* Backwards, as closing moves the last connection into the slot */
+	now = time(NULL);
+	for (i = npfds - 1; i > 0 && !api->uring; i--) {
+		if (i > api->nconns)
+			continue;
+		if (api_conn_io(ctx, api->conns[i - 1], pfds[i].revents) ==
+		    -1 || now - api->conns[i - 1]->active >= FW_API_TIMEOUT)
+			api_conn_close(api, i - 1);
+	}
+
+	/* Then the logins and signups held back */
+	for (i = n = 0; i < api->nconns; i++)
+		if (api->conns[i]->deferred)
+			held[n++] = api->conns[i];
+	qsort(held, n, sizeof(*held), api_held_cmp);
+	api->queued = n;
+	for (i = 0; i < n; i++) {
+		held[i]->deferred = 0;
+		if (api_conn_serve(ctx, held[i], 1) == -1)
+			api_conn_drop(api, held[i]);
+	}
+	fw_admit_end(&api->admit, fw_metric_now());
+
+	if (api->uring)
+		api_ring_submit(api);
+	else if (pfds[0].revents & POLLIN)
+		api_accept(api);
+
+	for (i = n = 0; i < api->nconns; i++)
+		n += api->conns[i]->deferred;
+	api->queued = n;
+	fw_metric_set(FW_G_API_CONNS, api->nconns);
+	fw_metric_set(FW_G_API_QUEUE, n);
+}
+
+/* Signups and logins waiting for admission */
+size_t
+fw_api_backlog(fw_ctx_t *ctx)
+{
+	struct fw_api *api = ctx->api;
+
+	return api != NULL ? api->queued : 0;
+}
+
+/*
+ * Resize the rendered config cache (config_cache). Responses still
+ * being written hold their own body references.
+ */
+fw_err_t
+fw_api_cache_size(fw_ctx_t *ctx, size_t size)
+{
+	struct fw_api *api = ctx->api;
+
+	return fw_cfgcache_resize(&api->cache, size);
+}
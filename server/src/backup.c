@@ -0,0 +1,589 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Online backup and WAL shipping. Both run in bounded slices from the
+ * event loop (fw_bk_work(), fw_ws_work()), so a copy of any size delays a
+ * foreground request by at most one slice: FW_BK_BUDGET plus one step of
+ * FW_BK_PAGES pages (fwvpnd_backup_step_seconds has the step times).
+ *
+ * Shipping assumes fwvpnd is the database's only writer: it turns off
+ * automatic checkpoints and checkpoints itself only once every committed
+ * frame is shipped. If another writer restarts the log first, the frames
+ * it folded in are lost to the standby, so the shipper starts over with a
+ * new base copy.
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "db.h"
+#include "metrics.h"
+
+/* Page cache of a copy being written, as a pragma value */
+#define BK_CACHE   "16"
+
+/* WAL file and frame header sizes */
+#define WAL_HDR    32
+#define WAL_FRAME  24
+
+/* Standby file kinds */
+enum ws_kind {
+	WS_OTHER,
+	WS_WAL,    /* wal.<gen>     */
+	WS_BASE,   /* base.<gen>.db */
+};
+
+/* Big-endian 32-bit field */
+static uint32_t
+be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Drop a running backup and its partial copy */
+void
+fw_bk_abort(fw_backup_t *b)
+{
+	if (b->bk != NULL)
+		sqlite3_backup_finish(b->bk);
+	if (b->dst != NULL) {
+		sqlite3_close(b->dst);
+		unlink(b->tmp);
+	}
+	b->bk = NULL;
+	b->dst = NULL;
+}
+
+int
+fw_bk_running(const fw_backup_t *b)
+{
+	return b->dst != NULL;
+}
+
+/* Start copying src to path */
+fw_err_t
+fw_bk_start(fw_backup_t *b, sqlite3 *src, const char *path)
+{
+	int fd, n;
+
+	if (fw_bk_running(b)) {
+		errno = EBUSY;
+		return FW_ERR;
+	}
+
+	n = snprintf(b->tmp, sizeof(b->tmp), "%s.tmp", path);
+	if (n < 0 || (size_t)n >= sizeof(b->tmp) ||
+	    strlcpy(b->path, path, sizeof(b->path)) >= sizeof(b->path)) {
+		errno = ENAMETOOLONG;
+		return FW_ERR;
+	}
+
+	/* Replace what a copy that never finished left; keys stay private */
+	if ((unlink(b->tmp) == -1 && errno != ENOENT) ||
+	    (fd = open(b->tmp, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1)
+		return FW_ERR;
+	close(fd);
+
+	/*
+	 * The copy is scratch until renamed: no journal, and pages go out as
+	 * they are copied, synced by each step, so that the last step
+	 * doesn't flush the whole copy at once
+	 */
+	if (sqlite3_open(b->tmp, &b->dst) != SQLITE_OK ||
+	    sqlite3_exec(b->dst, "PRAGMA journal_mode = OFF; "
+	    "PRAGMA synchronous = OFF; PRAGMA cache_size = " BK_CACHE,
+	    NULL, NULL, NULL) != SQLITE_OK) {
+		warnx("%s: %s", b->tmp, sqlite3_errmsg(b->dst));
+		fw_bk_abort(b);
+		return FW_DB_ERR;
+	}
+	if ((b->bk = sqlite3_backup_init(b->dst, "main", src, "main")) ==
+	    NULL) {
+		warnx("backup: %s", sqlite3_errmsg(b->dst));
+		fw_bk_abort(b);
+		return FW_DB_ERR;
+	}
+
+	return FW_OK;
+}
+
+/*
+ * Copy the next FW_BK_PAGES pages; *done is set once the copy is in
+ * place. Fails with EAGAIN while the source is locked (the backup stays
+ * up), anything else drops it.
+ */
+fw_err_t
+fw_bk_step(fw_backup_t *b, int *done)
+{
+	sqlite3_file *f;
+	uint64_t start;
+	int rc;
+
+	*done = 0;
+	start = fw_metric_now();
+	rc = sqlite3_backup_step(b->bk, FW_BK_PAGES);
+	if ((rc == SQLITE_OK || rc == SQLITE_DONE) &&
+	    sqlite3_file_control(b->dst, "main", SQLITE_FCNTL_FILE_POINTER,
+	    &f) == SQLITE_OK && f->pMethods != NULL)
+		f->pMethods->xSync(f, SQLITE_SYNC_NORMAL);
+	fw_metric_observe(FW_H_BACKUP, fw_metric_now() - start);
+
+	switch (rc) {
+	case SQLITE_OK:
+		return FW_OK;
+	case SQLITE_BUSY:
+	case SQLITE_LOCKED:
+		errno = EAGAIN;
+		return FW_ERR;
+	case SQLITE_DONE:
+		break;
+	default:
+		warnx("backup %s: %s", b->path, sqlite3_errstr(rc));
+		fw_bk_abort(b);
+		return FW_DB_ERR;
+	}
+
+	sqlite3_backup_finish(b->bk);
+	b->bk = NULL;
+	rc = sqlite3_close(b->dst);
+	b->dst = NULL;
+	if (rc != SQLITE_OK || rename(b->tmp, b->path) == -1) {
+		warn("backup %s", b->path);
+		unlink(b->tmp);
+		return FW_ERR;
+	}
+	fw_metric_inc(FW_C_BACKUPS);
+	*done = 1;
+
+	return FW_OK;
+}
+
+/* Step a running backup for up to budget nanoseconds */
+fw_err_t
+fw_bk_work(fw_backup_t *b, uint64_t budget, int *done)
+{
+	uint64_t start = fw_metric_now();
+
+	*done = 0;
+	while (fw_bk_running(b)) {
+		if (fw_bk_step(b, done) != FW_OK)
+			return errno == EAGAIN ? FW_OK : FW_ERR;
+		if (fw_metric_now() - start >= budget)
+			break;
+	}
+
+	return FW_OK;
+}
+
+/* Kind and generation of a standby file name */
+static enum ws_kind
+ws_kind(const char *name, uint64_t *gen)
+{
+	unsigned long long g;
+	int n = 0;
+
+	if (sscanf(name, "wal.%llu%n", &g, &n) == 1 && n > 0 &&
+	    name[n] == '\0') {
+		*gen = g;
+		return WS_WAL;
+	}
+	n = 0;
+	if (sscanf(name, "base.%llu.db%n", &g, &n) == 1 && n > 0 &&
+	    name[n] == '\0') {
+		*gen = g;
+		return WS_BASE;
+	}
+
+	return WS_OTHER;
+}
+
+/* Newest generation in dir, and the newest with a base (0 for none) */
+static fw_err_t
+ws_scan(const char *dir, uint64_t *last, uint64_t *base)
+{
+	struct dirent *de;
+	uint64_t gen;
+	DIR *d;
+
+	*last = *base = 0;
+	if ((d = opendir(dir)) == NULL)
+		return FW_ERR;
+	while ((de = readdir(d)) != NULL) {
+		switch (ws_kind(de->d_name, &gen)) {
+		case WS_BASE:
+			if (gen > *base)
+				*base = gen;
+			/* FALLTHROUGH */
+		case WS_WAL:
+			if (gen > *last)
+				*last = gen;
+			break;
+		case WS_OTHER:
+			break;
+		}
+	}
+	closedir(d);
+
+	return FW_OK;
+}
+
+/* Path of a standby file */
+static fw_err_t
+ws_path(char *buf, size_t len, const char *dir, enum ws_kind kind,
+    uint64_t gen)
+{
+	int n;
+
+	n = snprintf(buf, len, kind == WS_BASE ? "%s/base.%llu.db" :
+	    "%s/wal.%llu", dir, (unsigned long long)gen);
+	if (n < 0 || (size_t)n >= len) {
+		errno = ENAMETOOLONG;
+		return FW_ERR;
+	}
+
+	return FW_OK;
+}
+
+/* Remove what the newest base made useless */
+static void
+ws_prune(fw_walship_t *ws)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	enum ws_kind kind;
+	uint64_t gen;
+	DIR *d;
+
+	if ((d = opendir(ws->dir)) == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		kind = ws_kind(de->d_name, &gen);
+		if (kind != WS_OTHER && gen < ws->basegen &&
+		    ws_path(path, sizeof(path), ws->dir, kind, gen) == FW_OK &&
+		    unlink(path) == -1)
+			warn("wal: %s", path);
+	}
+	closedir(d);
+}
+
+/* Close the shipped generation; the next write starts a new one */
+static void
+ws_next(fw_walship_t *ws)
+{
+	if (ws->fd != -1)
+		close(ws->fd);
+	ws->fd = -1;
+	ws->gen++;
+	ws->off = 0;
+	memset(ws->salt, 0, sizeof(ws->salt));
+}
+
+/* Copy bytes [from, to) of fd to the open standby file */
+static fw_err_t
+ws_copy(fw_walship_t *ws, int fd, off_t from, off_t to)
+{
+	uint8_t buf[65536];
+	ssize_t n;
+
+	while (from < to) {
+		n = to - from < (off_t)sizeof(buf) ? to - from : sizeof(buf);
+		if ((n = pread(fd, buf, n, from)) <= 0 ||
+		    write(ws->fd, buf, n) != n) {
+			if (n == 0)
+				errno = EIO;
+			return FW_ERR;
+		}
+		from += n;
+	}
+
+	return fsync(ws->fd) == -1 ? FW_ERR : FW_OK;
+}
+
+/* Append the log's newly committed frames to the standby */
+static fw_err_t
+ws_ship(fw_walship_t *ws)
+{
+	uint8_t hdr[WAL_HDR], fh[WAL_FRAME];
+	char path[PATH_MAX];
+	uint32_t salt[2];
+	struct stat st;
+	off_t pos, end, framesz;
+	fw_err_t ret = FW_OK;
+	int fd;
+
+	if ((fd = open(ws->wal, O_RDONLY)) == -1)
+		return errno == ENOENT ? FW_OK : FW_ERR;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return FW_ERR;
+	}
+	if (st.st_size < WAL_HDR || pread(fd, hdr, WAL_HDR, 0) != WAL_HDR)
+		goto done;
+
+	salt[0] = be32(&hdr[16]);
+	salt[1] = be32(&hdr[20]);
+	framesz = WAL_FRAME + (be32(&hdr[8]) == 1 ? 65536 : be32(&hdr[8]));
+
+	/* Restarted behind our back: the standby chain ends here */
+	if (ws->off > 0 && memcmp(salt, ws->salt, sizeof(salt)) != 0) {
+		warnx("wal: log restarted before it was shipped");
+		ws_next(ws);
+		ws->rebase = ws->gen;
+	}
+
+	/* Only up to the last commit; later frames may still be rewritten */
+	end = ws->off > 0 ? ws->off : WAL_HDR;
+	for (pos = end; pos + framesz <= st.st_size; pos += framesz) {
+		if (pread(fd, fh, WAL_FRAME, pos) != WAL_FRAME ||
+		    be32(&fh[8]) != salt[0] || be32(&fh[12]) != salt[1])
+			break;
+		if (be32(&fh[4]) != 0)
+			end = pos + framesz;
+	}
+	if (end == (ws->off > 0 ? ws->off : WAL_HDR))
+		goto done;
+
+	if (ws->fd == -1) {
+		if ((ret = ws_path(path, sizeof(path), ws->dir, WS_WAL,
+		    ws->gen)) != FW_OK)
+			goto done;
+		if ((ws->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) ==
+		    -1) {
+			ret = FW_ERR;
+			goto done;
+		}
+	}
+	if ((ret = ws_copy(ws, fd, ws->off, end)) != FW_OK) {
+		/* Rewrite the generation from the start next time */
+		close(ws->fd);
+		ws->fd = -1;
+		ws->off = 0;
+		goto done;
+	}
+	fw_metric_add(FW_C_WAL_BYTES, end - ws->off);
+	ws->off = end;
+	memcpy(ws->salt, salt, sizeof(salt));
+
+done:
+	close(fd);
+	return ret;
+}
+
+/* Fold the shipped log into the database and start a new generation */
+static fw_err_t
+ws_checkpoint(fw_walship_t *ws, sqlite3 *db)
+{
+	int rc;
+
+	rc = sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_TRUNCATE,
+	    NULL, NULL);
+	if (rc == SQLITE_BUSY)
+		return FW_OK;
+	if (rc != SQLITE_OK) {
+		warnx("wal: checkpoint: %s", sqlite3_errmsg(db));
+		return FW_DB_ERR;
+	}
+	ws_next(ws);
+
+	return FW_OK;
+}
+
+void
+fw_ws_close(fw_walship_t *ws)
+{
+	fw_bk_abort(&ws->base);
+	if (ws->fd != -1)
+		close(ws->fd);
+	ws->fd = -1;
+}
+
+/*
+ * Ship db_path's log to dir. The chain restarts at a new generation with
+ * a new base copy, as the log may hold frames nobody shipped.
+ */
+fw_err_t
+fw_ws_open(fw_walship_t *ws, sqlite3 *db, const char *db_path,
+    const char *dir)
+{
+	uint64_t last, base;
+	int n;
+
+	memset(ws, 0, sizeof(*ws));
+	ws->fd = -1;
+
+	n = snprintf(ws->wal, sizeof(ws->wal), "%s-wal", db_path);
+	if (n < 0 || (size_t)n >= sizeof(ws->wal) ||
+	    strlcpy(ws->dir, dir, sizeof(ws->dir)) >= sizeof(ws->dir)) {
+		errno = ENAMETOOLONG;
+		return FW_ERR;
+	}
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+		return FW_ERR;
+	if (ws_scan(dir, &last, &base) != FW_OK)
+		return FW_ERR;
+
+	/* We checkpoint ourselves, once a generation is shipped */
+	if (fw_db_wal(db) != FW_OK)
+		return FW_DB_ERR;
+	sqlite3_wal_autocheckpoint(db, 0);
+	if (sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_TRUNCATE,
+	    NULL, NULL) != SQLITE_OK)
+		warnx("wal: checkpoint: %s", sqlite3_errmsg(db));
+
+	ws->gen = last + 1;
+	ws->rebase = ws->gen;
+
+	return FW_OK;
+}
+
+/*
+ * Ship new frames and step the base copy, for up to budget nanoseconds
+ * of copying; checkpoints once FW_WAL_CKPT bytes of log are shipped
+ */
+fw_err_t
+fw_ws_work(fw_walship_t *ws, sqlite3 *db, uint64_t budget)
+{
+	char path[PATH_MAX];
+	int done;
+
+	if (ws->rebase != 0 && ws->gen >= ws->rebase &&
+	    !fw_bk_running(&ws->base)) {
+		if (ws_path(path, sizeof(path), ws->dir, WS_BASE,
+		    ws->gen) != FW_OK ||
+		    fw_bk_start(&ws->base, db, path) != FW_OK) {
+			warn("wal: base copy");
+			ws->rebase = ws->gen + 1;
+		} else {
+			ws->basegen = ws->gen;
+			ws->rebase = 0;
+		}
+	}
+
+	if (fw_bk_running(&ws->base)) {
+		if (fw_bk_work(&ws->base, budget, &done) != FW_OK) {
+			warnx("wal: base copy failed, retrying next generation");
+			ws->rebase = ws->gen + 1;
+		} else if (done)
+			ws_prune(ws);
+	}
+
+	if (ws_ship(ws) != FW_OK) {
+		warn("wal: shipping %s", ws->wal);
+		return FW_ERR;
+	}
+
+	/* A running base copy may still need the log as it is */
+	if (ws->off >= FW_WAL_CKPT && !fw_bk_running(&ws->base))
+		return ws_checkpoint(ws, db);
+
+	return FW_OK;
+}
+
+/* Copy file from to a new file to */
+static fw_err_t
+ws_copy_file(const char *from, const char *to, int flags)
+{
+	uint8_t buf[65536];
+	ssize_t n;
+	int in, out;
+
+	if ((in = open(from, O_RDONLY)) == -1)
+		return FW_ERR;
+	if ((out = open(to, O_WRONLY | O_CREAT | flags, 0600)) == -1) {
+		close(in);
+		return FW_ERR;
+	}
+	while ((n = read(in, buf, sizeof(buf))) > 0)
+		if (write(out, buf, n) != n) {
+			n = -1;
+			break;
+		}
+	if (n == 0 && fsync(out) == -1)
+		n = -1;
+	close(in);
+	close(out);
+
+	return n == 0 ? FW_OK : FW_ERR;
+}
+
+/*
+ * Failover: rebuild db_path (which must not exist) from the newest base
+ * in dir and the generations after it. *applied gets the number of
+ * generations replayed; SQLite's WAL recovery drops a torn tail.
+ */
+fw_err_t
+fw_ws_restore(const char *dir, const char *db_path, uint64_t *applied)
+{
+	char path[PATH_MAX], wal[PATH_MAX];
+	uint64_t last, gen;
+	sqlite3 *db;
+	int n, rc;
+
+	*applied = 0;
+	if (ws_scan(dir, &last, &gen) != FW_OK)
+		return FW_ERR;
+	if (gen == 0) {
+		errno = ENOENT;
+		return FW_ERR;
+	}
+
+	n = snprintf(wal, sizeof(wal), "%s-wal", db_path);
+	if (n < 0 || (size_t)n >= sizeof(wal) ||
+	    ws_path(path, sizeof(path), dir, WS_BASE, gen) != FW_OK) {
+		errno = ENAMETOOLONG;
+		return FW_ERR;
+	}
+	if (ws_copy_file(path, db_path, O_EXCL) != FW_OK)
+		return FW_ERR;
+
+	/* The copy has to be in WAL mode for SQLite to read a log */
+	if (sqlite3_open(db_path, &db) != SQLITE_OK ||
+	    sqlite3_exec(db, "PRAGMA journal_mode = WAL", NULL, NULL, NULL) !=
+	    SQLITE_OK) {
+		warnx("%s: %s", db_path, sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return FW_DB_ERR;
+	}
+	sqlite3_close(db);
+
+	for (; gen <= last; gen++) {
+		if (ws_path(path, sizeof(path), dir, WS_WAL, gen) != FW_OK)
+			return FW_ERR;
+		if (access(path, F_OK) == -1)
+			break;
+		if (ws_copy_file(path, wal, O_TRUNC) != FW_OK)
+			return FW_ERR;
+
+		/* A read first: until then the pager doesn't know it's WAL */
+		rc = sqlite3_open(db_path, &db);
+		if (rc == SQLITE_OK)
+			rc = sqlite3_exec(db, "SELECT count(*) FROM sqlite_master",
+			    NULL, NULL, NULL);
+		if (rc == SQLITE_OK)
+			rc = sqlite3_wal_checkpoint_v2(db, NULL,
+			    SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+		if (rc != SQLITE_OK) {
+			warnx("%s: %s", path, sqlite3_errmsg(db));
+			sqlite3_close(db);
+			return FW_DB_ERR;
+		}
+		sqlite3_close(db);
+		(*applied)++;
+	}
+
+	return FW_OK;
+}
@@ -0,0 +1,256 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cfgcache.h"
+#include "metrics.h"
+
+/* Client config template: private key, address, server key, endpoint */
+#define CFG_TEMPLATE							\
+	"[Interface]\nPrivateKey = %s\nAddress = %s/32\n\n"		\
+	"[Peer]\nPublicKey = %s\nEndpoint = %s:%d\n"			\
+	"AllowedIPs = 0.0.0.0/0\n"
+
+/* Response headers after the status line: length, ETag, body */
+#define CFG_HEADERS							\
+	"Content-Type: text/plain\r\nContent-Length: %zu\r\n"		\
+	"ETag: %s\r\nCache-Control: private, no-cache\r\n\r\n%s"
+
+/* FNV-1a over the user ID */
+static uint32_t
+cache_hash(const fw_cfgcache_t *c, const char *user)
+{
+	uint32_t h = 2166136261U;
+
+	for (; *user != '\0'; user++)
+		h = (h ^ (unsigned char)*user) * 16777619U;
+
+	return h & c->mask;
+}
+
+/* Drop a body reference; the last one wipes the private key */
+void
+fw_cfgbody_unref(fw_cfgbody_t *body)
+{
+	if (body == NULL || --body->refs > 0)
+		return;
+
+	explicit_bzero(body->data, body->len);
+	free(body);
+}
+
+/* Unlink and release entry id */
+static void
+cache_drop(fw_cfgcache_t *c, uint32_t id)
+{
+	fw_cfgent_t *e = &c->ents[id];
+	uint32_t *link;
+
+	link = &c->buckets[cache_hash(c, e->user)];
+	while (*link != id + 1)
+		link = &c->ents[*link - 1].next;
+	*link = e->next;
+
+	fw_cfgbody_unref(e->body);
+	memset(e, 0, sizeof(*e));
+	c->count--;
+}
+
+/* Drop every entry */
+static void
+cache_flush(fw_cfgcache_t *c)
+{
+	uint32_t i;
+
+	for (i = 0; i < c->size && c->count > 0; i++) {
+		if (c->ents[i].user[0] != '\0')
+			cache_drop(c, i);
+	}
+}
+
+/* Drop every entry and release the tables */
+void
+fw_cfgcache_free(fw_cfgcache_t *c)
+{
+	cache_flush(c);
+	free(c->ents);
+	free(c->buckets);
+	c->ents = NULL;
+	c->buckets = NULL;
+	c->size = 0;
+	c->mask = 0;
+}
+
+/*
+ * Hold size entries, flushing the cache. On a zeroed cache this sets it
+ * up; on failure the cache is left as it was.
+ */
+fw_err_t
+fw_cfgcache_resize(fw_cfgcache_t *c, size_t size)
+{
+	fw_cfgent_t *ents;
+	uint32_t *buckets;
+	size_t nb;
+
+	if (size == 0 || size > FW_CFGCACHE_MAX) {
+		errno = EINVAL;
+		return FW_ERR;
+	}
+
+	for (nb = 1; nb < size; nb <<= 1)
+		;
+	if ((ents = calloc(size, sizeof(*ents))) == NULL)
+		return FW_ERR;
+	if ((buckets = calloc(nb, sizeof(*buckets))) == NULL) {
+		free(ents);
+		return FW_ERR;
+	}
+
+	fw_cfgcache_free(c);
+	c->ents = ents;
+	c->buckets = buckets;
+	c->size = size;
+	c->mask = nb - 1;
+	c->hand = 0;
+
+	return FW_OK;
+}
+
+/*
+ * Set the server half of every config, flushing the cache if it
+ * changed. Cheap to call per request when nothing changed.
+ */
+void
+fw_cfgcache_set_server(fw_cfgcache_t *c, const char *key, const char *addr,
+    int port)
+{
+	if (port == c->server_port && strcmp(key, c->server_key) == 0 &&
+	    strcmp(addr, c->server_addr) == 0)
+		return;
+
+	cache_flush(c);
+	strlcpy(c->server_key, key, sizeof(c->server_key));
+	strlcpy(c->server_addr, addr, sizeof(c->server_addr));
+	c->server_port = port;
+	c->epoch++;
+}
+
+/*
+ * Look up a user's config rendered from row version. The body belongs
+ * to the cache; take a reference to keep it past the next cache call.
+ */
+fw_cfgbody_t *
+fw_cfgcache_get(fw_cfgcache_t *c, const char *user, uint64_t version)
+{
+	fw_cfgent_t *e;
+	uint32_t id;
+
+	for (id = c->buckets[cache_hash(c, user)]; id != 0; id = e->next) {
+		e = &c->ents[id - 1];
+		if (strcmp(e->user, user) != 0)
+			continue;
+
+		/* The row changed since we rendered it */
+		if (e->version != version) {
+			cache_drop(c, id - 1);
+			break;
+		}
+
+		e->ref = 1;
+		fw_metric_inc(FW_C_CFG_HITS);
+		return e->body;
+	}
+
+	fw_metric_inc(FW_C_CFG_MISSES);
+	return NULL;
+}
+
+/* Pick a free slot, evicting the CLOCK victim if the cache is full */
+static uint32_t
+cache_slot(fw_cfgcache_t *c)
+{
+	fw_cfgent_t *e;
+	uint32_t id;
+
+	for (;;) {
+		id = c->hand++ % c->size;
+		e = &c->ents[id];
+		if (e->user[0] == '\0')
+			return id;
+		if (e->ref) {
+			e->ref = 0;
+			continue;
+		}
+		cache_drop(c, id);
+		return id;
+	}
+}
+
+/* Render and cache user's config at row version */
+fw_cfgbody_t *
+fw_cfgcache_render(fw_cfgcache_t *c, const fw_db_user_t *user,
+    uint64_t version)
+{
+	fw_cfgbody_t *body;
+	fw_cfgent_t *e;
+	const char *addr = c->server_addr;
+	char text[512];
+	uint32_t id, b;
+	int tlen, len, port = c->server_port;
+
+	/* Clustered users connect to the node they're placed on */
+	if (user->node_addr[0] != '\0') {
+		addr = user->node_addr;
+		port = user->node_port;
+	}
+
+	tlen = snprintf(text, sizeof(text), CFG_TEMPLATE, user->private_key,
+	    user->assigned_ip, c->server_key, addr, port);
+	if (tlen < 0 || (size_t)tlen >= sizeof(text))
+		return NULL;
+
+	len = snprintf(NULL, 0, CFG_HEADERS, (size_t)tlen, "\"\"", text) +
+	    FW_ETAG_LEN;
+	if ((body = malloc(sizeof(*body) + len + 1)) == NULL) {
+		explicit_bzero(text, sizeof(text));
+		return NULL;
+	}
+
+	body->refs = 1;
+	strlcpy(body->public_key, user->public_key, sizeof(body->public_key));
+	snprintf(body->etag, sizeof(body->etag), "\"%llx-%llx\"",
+	    (unsigned long long)version, (unsigned long long)c->epoch);
+	body->len = snprintf(body->data, len + 1, CFG_HEADERS, (size_t)tlen,
+	    body->etag, text);
+	explicit_bzero(text, sizeof(text));
+
+	/* Replace any stale entry for the user */
+	for (id = c->buckets[cache_hash(c, user->id)]; id != 0;
+	    id = c->ents[id - 1].next) {
+		if (strcmp(c->ents[id - 1].user, user->id) == 0) {
+			cache_drop(c, id - 1);
+			break;
+		}
+	}
+
+	id = cache_slot(c);
+	e = &c->ents[id];
+	strlcpy(e->user, user->id, sizeof(e->user));
+	e->version = version;
+	e->body = body;
+	e->ref = 1;
+
+	b = cache_hash(c, e->user);
+	e->next = c->buckets[b];
+	c->buckets[b] = id + 1;
+	c->count++;
+
+	return body;
+}
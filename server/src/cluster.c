@@ -0,0 +1,325 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Cluster mode: several fwvpnd nodes share one database, each serving
+ * the users placed on it (the placements table). Every node reports its
+ * endpoint, capacity and peer count on each poll; nodes that stop
+ * reporting for node_timeout seconds are down. Signups are placed right
+ * away by whichever node takes them, and the coordinator node moves
+ * users off down or overloaded nodes. Placement is consistent hashing
+ * with bounded loads, so each move is one the bounds force: users on a
+ * healthy node within its bound are never touched.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sodium.h>
+
+#include "cluster.h"
+#include "metrics.h"
+#include "peertab.h"
+
+/* Fixed hash key: every node must build the same ring */
+static const uint8_t ring_key[crypto_shorthash_KEYBYTES];
+
+/* Hash a string onto the ring */
+static uint64_t
+ring_hash(const char *s)
+{
+	uint8_t h[crypto_shorthash_BYTES];
+	uint64_t v;
+
+	crypto_shorthash(h, (const uint8_t *)s, strlen(s), ring_key);
+	memcpy(&v, h, sizeof(v));
+
+	return v;
+}
+
+/* Order ring points */
+static int
+ring_cmp(const void *a, const void *b)
+{
+	const fw_rpoint_t *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return x->node < y->node ? -1 : x->node > y->node;
+}
+
+void
+fw_ring_free(fw_ring_t *ring)
+{
+	free(ring->points);
+	memset(ring, 0, sizeof(*ring));
+}
+
+/* Build the ring over nodes, with bounds sharing total keys */
+fw_err_t
+fw_ring_init(fw_ring_t *ring, fw_db_node_t *nodes, size_t nnodes,
+    size_t total)
+{
+	char name[FW_DB_NODE_LEN + 16];
+	size_t i, v;
+
+	memset(ring, 0, sizeof(*ring));
+	if (nnodes > 0 && (ring->points = calloc(nnodes * FW_RING_VNODES,
+	    sizeof(*ring->points))) == NULL)
+		return FW_ERR;
+
+	ring->nodes = nodes;
+	ring->nnodes = nnodes;
+	ring->total = total;
+	for (i = 0; i < nnodes; i++) {
+		ring->capsum += nodes[i].capacity;
+		for (v = 0; v < FW_RING_VNODES; v++) {
+			snprintf(name, sizeof(name), "%s#%zu", nodes[i].name, v);
+			ring->points[ring->npoints].hash = ring_hash(name);
+			ring->points[ring->npoints++].node = i;
+		}
+	}
+	qsort(ring->points, ring->npoints, sizeof(*ring->points), ring_cmp);
+
+	return FW_OK;
+}
+
+/* Most keys node i may hold */
+size_t
+fw_ring_bound(const fw_ring_t *ring, size_t i)
+{
+	size_t cap = ring->nodes[i].capacity;
+	double share;
+
+	if (cap == 0)
+		return 0;
+
+	share = (double)ring->total * cap / ring->capsum *
+	    (100 + FW_RING_SLACK) / 100;
+	if (share < 1)
+		return 1;
+	if (share >= cap)
+		return cap;
+
+	return (size_t)share + (share > (size_t)share);
+}
+
+/*
+ * Pick a node for key and count it there; fails with ENOSPC if every
+ * node is at its bound
+ */
+fw_err_t
+fw_ring_pick(fw_ring_t *ring, const char *key, size_t *node)
+{
+	const fw_rpoint_t *p;
+	uint64_t h = ring_hash(key);
+	size_t lo, hi, mid, k;
+
+	for (lo = 0, hi = ring->npoints; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (ring->points[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (k = 0; k < ring->npoints; k++) {
+		p = &ring->points[(lo + k) % ring->npoints];
+		if (ring->nodes[p->node].placed < fw_ring_bound(ring, p->node)) {
+			ring->nodes[p->node].placed++;
+			*node = p->node;
+			return FW_OK;
+		}
+	}
+
+	errno = ENOSPC;
+	return FW_ERR;
+}
+
+/* Report this node's endpoint, capacity and peer count */
+fw_err_t
+fw_cluster_report(fw_ctx_t *ctx)
+{
+	fw_db_node_t self;
+
+	memset(&self, 0, sizeof(self));
+	if (strlcpy(self.name, ctx->config.node_name, sizeof(self.name)) >=
+	    sizeof(self.name) ||
+	    strlcpy(self.endpoint, ctx->config.server_addr,
+	    sizeof(self.endpoint)) >= sizeof(self.endpoint)) {
+		errno = ENAMETOOLONG;
+		return FW_ERR;
+	}
+	self.port = ctx->config.listen_port;
+	self.capacity = ctx->config.node_capacity;
+	self.peers = ((fw_ptab_t *)ctx->peer_tab)->count;
+
+	return fw_db_report_node(ctx->db_conn, &self, time(NULL));
+}
+
+/*
+ * Place a new user and record it; node gets the chosen node's name. With
+ * no node up (not even this one, yet), the user stays here.
+ */
+fw_err_t
+fw_cluster_place(fw_ctx_t *ctx, const char *user, char node[FW_DB_NODE_LEN])
+{
+	fw_db_place_t p;
+	fw_db_node_t *nodes;
+	fw_ring_t ring;
+	size_t n, i, total = 1;
+	fw_err_t ret;
+
+	if ((ret = fw_db_get_nodes(ctx->db_conn,
+	    time(NULL) - ctx->config.node_timeout, &nodes, &n)) != FW_OK)
+		return ret;
+
+	strlcpy(p.user, user, sizeof(p.user));
+	strlcpy(p.node, ctx->config.node_name, sizeof(p.node));
+	if (n > 0) {
+		for (i = 0; i < n; i++)
+			total += nodes[i].placed;
+		if (fw_ring_init(&ring, nodes, n, total) != FW_OK) {
+			free(nodes);
+			return FW_ERR;
+		}
+		ret = fw_ring_pick(&ring, user, &i);
+		fw_ring_free(&ring);
+		if (ret == FW_OK)
+			strlcpy(p.node, nodes[i].name, sizeof(p.node));
+	}
+	free(nodes);
+
+	if (ret != FW_OK)
+		return ret;
+	if ((ret = fw_db_place_users(ctx->db_conn, &p, 1)) != FW_OK)
+		return ret;
+	strlcpy(node, p.node, FW_DB_NODE_LEN);
+
+	return FW_OK;
+}
+
+/* Users being balanced, and the live nodes they can go to */
+struct cluster_users {
+	fw_db_node_t *nodes;
+	size_t nnodes;
+	fw_db_place_t *ents;    /* Users; node is "" if it must move */
+	size_t count;
+	size_t cap;
+};
+
+/* Order nodes by name */
+static int
+node_cmp(const void *a, const void *b)
+{
+	return strcmp(((const fw_db_node_t *)a)->name,
+	    ((const fw_db_node_t *)b)->name);
+}
+
+/* Collect one user, counting it against its node if that node is up */
+static fw_err_t
+cluster_user(void *arg, const char *user, const char *node)
+{
+	struct cluster_users *cu = arg;
+	fw_db_place_t *e;
+	fw_db_node_t key, *n = NULL;
+
+	if (cu->count == cu->cap) {
+		cu->cap = cu->cap ? cu->cap * 2 : 1024;
+		if ((e = reallocarray(cu->ents, cu->cap, sizeof(*e))) == NULL)
+			return FW_ERR;
+		cu->ents = e;
+	}
+	e = &cu->ents[cu->count++];
+	strlcpy(e->user, user, sizeof(e->user));
+	e->node[0] = '\0';
+
+	if (node != NULL && strlcpy(key.name, node, sizeof(key.name)) <
+	    sizeof(key.name))
+		n = bsearch(&key, cu->nodes, cu->nnodes, sizeof(key), node_cmp);
+	if (n != NULL) {
+		strlcpy(e->node, n->name, sizeof(e->node));
+		n->placed++;
+	}
+
+	return FW_OK;
+}
+
+/*
+ * Coordinator: move users off down nodes, place unplaced users, and trim
+ * nodes over their bound (after a node joins or shrinks). Nothing else
+ * moves. *moved gets the number of users placed anew.
+ */
+fw_err_t
+fw_cluster_balance(fw_ctx_t *ctx, size_t *moved)
+{
+	struct cluster_users cu;
+	fw_db_place_t *moves = NULL;
+	fw_ring_t ring;
+	size_t i, j, bound, nmoves = 0;
+	fw_err_t ret;
+
+	*moved = 0;
+	memset(&cu, 0, sizeof(cu));
+	if ((ret = fw_db_get_nodes(ctx->db_conn,
+	    time(NULL) - ctx->config.node_timeout, &cu.nodes, &cu.nnodes)) !=
+	    FW_OK)
+		return ret;
+	if (cu.nnodes == 0)
+		goto done;
+
+	/* Recount loads from the placements themselves */
+	for (i = 0; i < cu.nnodes; i++)
+		cu.nodes[i].placed = 0;
+	if ((ret = fw_db_load_placements(ctx->db_conn, cluster_user, &cu)) !=
+	    FW_OK)
+		goto done;
+
+	if ((ret = fw_ring_init(&ring, cu.nodes, cu.nnodes, cu.count)) !=
+	    FW_OK)
+		goto done;
+
+	/* Over its bound: release the newest users down to it */
+	for (i = 0; i < cu.nnodes; i++) {
+		bound = fw_ring_bound(&ring, i);
+		for (j = cu.count; j > 0 && cu.nodes[i].placed > bound; j--) {
+			if (strcmp(cu.ents[j - 1].node, cu.nodes[i].name) != 0)
+				continue;
+			cu.ents[j - 1].node[0] = '\0';
+			cu.nodes[i].placed--;
+		}
+	}
+
+	/* Place everyone left without a node, in place in the array */
+	moves = cu.ents;
+	for (i = 0; i < cu.count; i++) {
+		if (cu.ents[i].node[0] != '\0')
+			continue;
+		if (fw_ring_pick(&ring, cu.ents[i].user, &j) != FW_OK) {
+			warnx("cluster: no room for %zu users",
+			    cu.count - i);
+			break;
+		}
+		moves[nmoves] = cu.ents[i];
+		strlcpy(moves[nmoves++].node, cu.nodes[j].name,
+		    sizeof(moves->node));
+	}
+	fw_ring_free(&ring);
+
+	if (nmoves > 0 &&
+	    (ret = fw_db_place_users(ctx->db_conn, moves, nmoves)) == FW_OK) {
+		fw_metric_add(FW_C_CLUSTER_MOVES, nmoves);
+		*moved = nmoves;
+	}
+
+done:
+	free(cu.ents);
+	free(cu.nodes);
+	return ret;
+}
@@ -0,0 +1,257 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * fwvpnd.conf(5) is a list of "keyword value" lines; blank lines and
+ * text after '#' are ignored. Keywords are the fw_cfg_t field names:
+ *
+ *	api_port      8080
+ *	db_path       /var/fwvpn/db/vpn.db
+ *	listen_port   51820
+ *	lazy_peers    yes
+ *	max_resident  512
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "conf.h"
+
+/* Default configuration */
+static const fw_cfg_t conf_defaults = {
+	.ctl_path    = "/var/run/fwvpnd.sock",
+	.db_path     = "/var/fwvpn/db/vpn.db",
+	.listen_addr = "127.0.0.1",
+	.listen_port = 8080,
+	.server_addr = "10.0.0.1",
+	.trace_path  = "/var/run/fwvpnd.trace",
+	.vpn_subnet  = "10.0.0.0/24",
+	.wg_iface    = "wg0",
+};
+
+/* Keyword value types */
+enum conf_type {
+	CONF_BOOL,
+	CONF_INT,
+	CONF_SIZE,
+	CONF_STR,
+	CONF_TIME,
+};
+
+/* Configuration keywords, named after their fw_cfg_t field */
+#define KW(field, type, max) { #field, type, offsetof(fw_cfg_t, field), max }
+static const struct conf_kw {
+	const char *name;     /* Keyword                 */
+	enum conf_type type;  /* Value type              */
+	size_t off;           /* Offset into fw_cfg_t    */
+	long long max;        /* Upper bound for numbers */
+} conf_kws[] = {
+	KW(api_port,         CONF_INT,  65535),
+	KW(api_uring,        CONF_BOOL, 0),
+	KW(auth_burst,       CONF_INT,  255),
+	KW(auth_rate,        CONF_INT,  60000),
+	KW(backup_interval,  CONF_TIME, 2592000),
+	KW(backup_path,      CONF_STR,  0),
+	KW(config_cache,     CONF_SIZE, 1048576),
+	KW(ctl_path,         CONF_STR,  0),
+	KW(db_path,          CONF_STR,  0),
+	KW(flush_interval,   CONF_TIME, 3600),
+	KW(handover,         CONF_BOOL, 0),
+	KW(idle_timeout,     CONF_TIME, INT_MAX),
+	KW(job_workers,      CONF_INT,  16),
+	KW(lazy_peers,       CONF_BOOL, 0),
+	KW(listen_addr,      CONF_STR,  0),
+	KW(listen_port,      CONF_INT,  65535),
+	KW(max_resident,     CONF_SIZE, INT_MAX),
+	KW(node_capacity,    CONF_SIZE, INT_MAX),
+	KW(node_coordinator, CONF_BOOL, 0),
+	KW(node_name,        CONF_STR,  0),
+	KW(node_timeout,     CONF_TIME, 86400),
+	KW(poll_interval,    CONF_TIME, 3600),
+	KW(privsep,          CONF_BOOL, 0),
+	KW(server_addr,      CONF_STR,  0),
+	KW(shed_target,      CONF_INT,  10000),
+	KW(snap_path,        CONF_STR,  0),
+	KW(trace_path,       CONF_STR,  0),
+	KW(user,             CONF_STR,  0),
+	KW(vpn_subnet,       CONF_STR,  0),
+	KW(wal_ship_path,    CONF_STR,  0),
+	KW(wg_iface,         CONF_STR,  0),
+	KW(wg_mock,          CONF_BOOL, 0),
+	KW(wg_userspace,     CONF_BOOL, 0),
+};
+#undef KW
+
+#define NKWS (sizeof(conf_kws) / sizeof(conf_kws[0]))
+
+/* String field of cfg for keyword */
+#define CONF_STRP(cfg, kw) ((char **)((char *)(cfg) + (kw)->off))
+
+/* Store value for keyword */
+static fw_err_t
+conf_set(fw_cfg_t *cfg, const struct conf_kw *kw, const char *val)
+{
+	void *field = (char *)cfg + kw->off;
+	const char *errstr;
+	long long num;
+	char *str;
+
+	switch (kw->type) {
+	case CONF_BOOL:
+		if (strcmp(val, "yes") == 0)
+			*(int *)field = 1;
+		else if (strcmp(val, "no") == 0)
+			*(int *)field = 0;
+		else {
+			warnx("%s: expected yes or no", kw->name);
+			return FW_ERR;
+		}
+		break;
+	case CONF_INT:
+	case CONF_SIZE:
+	case CONF_TIME:
+		num = strtonum(val, 0, kw->max, &errstr);
+		if (errstr != NULL) {
+			warnx("%s: value is %s: %s", kw->name, errstr, val);
+			return FW_ERR;
+		}
+		if (kw->type == CONF_INT)
+			*(int *)field = num;
+		else if (kw->type == CONF_SIZE)
+			*(size_t *)field = num;
+		else
+			*(time_t *)field = num;
+		break;
+	case CONF_STR:
+		if ((str = strdup(val)) == NULL)
+			return FW_ERR;
+		free(*CONF_STRP(cfg, kw));
+		*CONF_STRP(cfg, kw) = str;
+		break;
+	}
+
+	return FW_OK;
+}
+
+/* Parse configuration file into cfg */
+static fw_err_t
+conf_parse(FILE *fp, const char *path, fw_cfg_t *cfg)
+{
+	char *line = NULL, *key, *val, *end;
+	size_t linesize = 0, i;
+	fw_err_t ret = FW_OK;
+	int lineno = 0;
+
+	while (getline(&line, &linesize, fp) != -1) {
+		lineno++;
+		line[strcspn(line, "#\n")] = '\0';
+
+		key = line + strspn(line, " \t");
+		if (*key == '\0')
+			continue;
+
+		val = key + strcspn(key, " \t");
+		if (*val != '\0')
+			*val++ = '\0';
+		val += strspn(val, " \t");
+		for (end = val + strlen(val); end > val &&
+		    isspace((unsigned char)end[-1]); end--)
+			end[-1] = '\0';
+
+		for (i = 0; i < NKWS; i++)
+			if (strcmp(key, conf_kws[i].name) == 0)
+				break;
+
+		if (i == NKWS) {
+			warnx("%s:%d: unknown keyword %s", path, lineno, key);
+			ret = FW_ERR;
+		} else if (*val == '\0') {
+			warnx("%s:%d: %s: missing value", path, lineno, key);
+			ret = FW_ERR;
+		} else if (conf_set(cfg, &conf_kws[i], val) != FW_OK) {
+			warnx("%s:%d: bad value", path, lineno);
+			ret = FW_ERR;
+		}
+	}
+	free(line);
+
+	if (ferror(fp)) {
+		warn("%s", path);
+		ret = FW_ERR;
+	}
+
+	return ret;
+}
+
+/*
+ * Load configuration: the compiled-in defaults, overridden by the file
+ * at path (if any). Strings in cfg are allocated; see fw_conf_free().
+ */
+fw_err_t
+fw_conf_load(const char *path, fw_cfg_t *cfg)
+{
+	const char *src;
+	FILE *fp;
+	size_t i;
+
+	/* Own a copy of every default string */
+	memcpy(cfg, &conf_defaults, sizeof(*cfg));
+	for (i = 0; i < NKWS; i++) {
+		if (conf_kws[i].type == CONF_STR)
+			*CONF_STRP(cfg, &conf_kws[i]) = NULL;
+	}
+	for (i = 0; i < NKWS; i++) {
+		if (conf_kws[i].type != CONF_STR)
+			continue;
+		src = *CONF_STRP(&conf_defaults, &conf_kws[i]);
+		if (src != NULL &&
+		    (*CONF_STRP(cfg, &conf_kws[i]) = strdup(src)) == NULL)
+			goto err;
+	}
+
+	if (path == NULL)
+		return FW_OK;
+
+	if ((cfg->conf_path = strdup(path)) == NULL)
+		goto err;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		warn("%s", path);
+		goto err;
+	}
+
+	if (conf_parse(fp, path, cfg) != FW_OK) {
+		fclose(fp);
+		goto err;
+	}
+	fclose(fp);
+
+	return FW_OK;
+
+err:
+	fw_conf_free(cfg);
+	return FW_ERR;
+}
+
+/* Free strings allocated by fw_conf_load() */
+void
+fw_conf_free(fw_cfg_t *cfg)
+{
+	size_t i;
+
+	for (i = 0; i < NKWS; i++) {
+		if (conf_kws[i].type == CONF_STR)
+			free(*CONF_STRP(cfg, &conf_kws[i]));
+	}
+	free(cfg->conf_path);
+	memset(cfg, 0, sizeof(*cfg));
+}
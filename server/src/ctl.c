@@ -0,0 +1,393 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Control socket: a UNIX stream socket taking one request line per
+ * connection and answering in plain text:
+ *
+ *	backup    start an online backup to backup_path
+ *	metrics   Prometheus text exposition
+ *	nodes     cluster nodes as NDJSON
+ *	owner     peer holding a tunnel address, as JSON
+ *	peers     peers as NDJSON (see ctl_peers())
+ *	status    daemon state and peer counts
+ */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctl.h"
+#include "db.h"
+#include "jobs.h"
+#include "metrics.h"
+#include "wback.h"
+
+/* Control commands */
+static fw_err_t ctl_backup(fw_ctx_t *, FILE *, char *);
+static fw_err_t ctl_metrics(fw_ctx_t *, FILE *, char *);
+static fw_err_t ctl_nodes(fw_ctx_t *, FILE *, char *);
+static fw_err_t ctl_owner(fw_ctx_t *, FILE *, char *);
+static fw_err_t ctl_peers(fw_ctx_t *, FILE *, char *);
+static fw_err_t ctl_status(fw_ctx_t *, FILE *, char *);
+
+static const struct ctl_cmd {
+	const char *name;
+	fw_err_t (*fn)(fw_ctx_t *, FILE *, char *);
+} ctl_cmds[] = {
+	{ "backup",  ctl_backup },
+	{ "metrics", ctl_metrics },
+	{ "nodes",   ctl_nodes },
+	{ "owner",   ctl_owner },
+	{ "peers",   ctl_peers },
+	{ "status",  ctl_status },
+};
+
+/* Daemon state names */
+static const char *ctl_states[] = {
+	[FW_STATE_ERROR]   = "error",
+	[FW_STATE_RUNNING] = "running",
+	[FW_STATE_STOPPED] = "stopped",
+};
+
+/* Peer state names */
+static const char *ctl_peer_states[] = {
+	[FW_PEER_CONNECTED]    = "connected",
+	[FW_PEER_DISCONNECTED] = "disconnected",
+	[FW_PEER_ERR]          = "error",
+};
+
+/* Open control socket at path */
+fw_err_t
+fw_ctl_open(const char *path, int *fdp)
+{
+	struct sockaddr_un sun;
+	mode_t omask;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return FW_ERR;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return FW_ERR;
+
+	/* Replace a socket left behind by a previous fwvpnd */
+	if (unlink(path) == -1 && errno != ENOENT) {
+		close(fd);
+		return FW_ERR;
+	}
+
+	omask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		umask(omask);
+		close(fd);
+		return FW_ERR;
+	}
+	umask(omask);
+
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 || listen(fd, 16) == -1) {
+		close(fd);
+		unlink(path);
+		return FW_ERR;
+	}
+
+	*fdp = fd;
+
+	return FW_OK;
+}
+
+/* Close control socket */
+void
+fw_ctl_close(int fd, const char *path)
+{
+	if (fd == -1)
+		return;
+
+	close(fd);
+	unlink(path);
+}
+
+/* backup: start an online backup; fwvpnd_backups_total counts it done */
+static fw_err_t
+ctl_backup(fw_ctx_t *ctx, FILE *fp, char *args)
+{
+	if (fw_start_backup(ctx) != FW_OK)
+		return FW_ERR;
+
+	fprintf(fp, "backup started\n");
+
+	return FW_OK;
+}
+
+/* metrics: Prometheus text exposition */
+static fw_err_t
+ctl_metrics(fw_ctx_t *ctx, FILE *fp, char *args)
+{
+	size_t peers, resident;
+
+	if (fw_get_server_stats(ctx, &peers, &resident) == FW_OK) {
+		fw_metric_set(FW_G_PEERS, peers);
+		fw_metric_set(FW_G_RESIDENT, resident);
+	}
+	fw_metric_set(FW_G_WB_DIRTY, fw_wb_dirty(ctx->wback));
+
+	if (fw_metrics_write(fp) != FW_OK)
+		return FW_ERR;
+
+	return ctx->sched != NULL ? fw_sched_write(ctx->sched, fp) : FW_OK;
+}
+
+/* nodes: every cluster node, its load and whether it is up */
+static fw_err_t
+ctl_nodes(fw_ctx_t *ctx, FILE *fp, char *args)
+{
+	fw_db_node_t *nodes;
+	time_t since;
+	size_t n, i;
+
+	if (ctx->config.node_name == NULL) {
+		errno = ENOTSUP;
+		return FW_ERR;
+	}
+	if (fw_db_get_nodes(ctx->db_conn, 0, &nodes, &n) != FW_OK)
+		return FW_ERR;
+
+	since = time(NULL) - ctx->config.node_timeout;
+	for (i = 0; i < n; i++)
+		fprintf(fp, "{\"name\":\"%s\",\"endpoint\":\"%s:%d\","
+		    "\"capacity\":%zu,\"peers\":%zu,\"placed\":%zu,"
+		    "\"seen\":%lld,\"up\":%s}\n", nodes[i].name,
+		    nodes[i].endpoint, nodes[i].port, nodes[i].capacity,
+		    nodes[i].peers, nodes[i].placed, (long long)nodes[i].seen,
+		    nodes[i].seen >= since ? "true" : "false");
+	free(nodes);
+
+	return FW_OK;
+}
+
+/* owner ADDR: the peer whose tunnel address covers ADDR */
+static fw_err_t
+ctl_owner(fw_ctx_t *ctx, FILE *fp, char *args)
+{
+	fw_peer_t peer;
+
+	if (fw_get_peer_by_addr(ctx, args, &peer) != FW_OK)
+		return FW_ERR;
+
+	fprintf(fp, "{\"pubkey\":\"%s\",\"address\":\"%s\",\"state\":\"%s\","
+	    "\"last_handshake\":%lld}\n", peer.pubkey, peer.allowed_ips,
+	    ctl_peer_states[peer.state], (long long)peer.last_handshake);
+
+	return FW_OK;
+}
+
+/*
+ * peers [state=S] [age=SECONDS] [limit=N] [cursor=C] [format=json]
+ *
+ * Stream matching peers one NDJSON object per line, or as one JSON
+ * object with format=json. With limit, a listing that stopped early ends
+ * with the cursor to resume from ({"cursor":"..."} or a "cursor" member).
+ * Peers go out a page at a time through a fixed-size stdio buffer, so
+ * memory use doesn't grow with the peer count.
+ */
+static fw_err_t
+ctl_peers(fw_ctx_t *ctx, FILE *fp, char *args)
+{
+	static char chunk[FW_CTL_CHUNK];
+	fw_peer_t page[FW_CTL_PAGE];
+	const char *errstr;
+	char *arg, *val;
+	fw_cursor_t cur;
+	size_t i, n, want, sent = 0, limit = 0;
+	int json = 0, s;
+
+	memset(&cur, 0, sizeof(cur));
+	while ((arg = strsep(&args, " ")) != NULL) {
+		if (*arg == '\0')
+			continue;
+		if ((val = strchr(arg, '=')) == NULL)
+			return FW_ERR;
+		*val++ = '\0';
+		errstr = NULL;
+
+		if (strcmp(arg, "state") == 0) {
+			for (s = 0; s <= FW_PEER_ERR; s++) {
+				if (strcmp(val, ctl_peer_states[s]) == 0)
+					break;
+			}
+			if (s > FW_PEER_ERR)
+				return FW_ERR;
+			cur.states |= 1U << s;
+		} else if (strcmp(arg, "age") == 0)
+			cur.max_age = strtonum(val, 1, INT_MAX, &errstr);
+		else if (strcmp(arg, "limit") == 0)
+			limit = strtonum(val, 1, INT_MAX, &errstr);
+		else if (strcmp(arg, "cursor") == 0)
+			cur.pos = strtonum(val, 0, LLONG_MAX, &errstr);
+		else if (strcmp(arg, "format") == 0 &&
+		    (strcmp(val, "json") == 0 || strcmp(val, "ndjson") == 0))
+			json = strcmp(val, "json") == 0;
+		else
+			return FW_ERR;
+		if (errstr != NULL)
+			return FW_ERR;
+	}
+
+	setvbuf(fp, chunk, _IOFBF, sizeof(chunk));
+	if (json)
+		fputs("{\"peers\":[", fp);
+
+	do {
+		want = FW_CTL_PAGE;
+		if (limit > 0 && limit - sent < want)
+			want = limit - sent;
+		if (fw_list_peers_page(ctx, &cur, page, want, &n) != FW_OK)
+			return FW_ERR;
+
+		for (i = 0; i < n; i++, sent++) {
+			fprintf(fp, "%s{\"pubkey\":\"%s\",\"address\":\"%s\","
+			    "\"state\":\"%s\",\"last_handshake\":%lld}%s",
+			    json && sent > 0 ? "," : "", page[i].pubkey,
+			    page[i].allowed_ips, ctl_peer_states[page[i].state],
+			    (long long)page[i].last_handshake, json ? "" : "\n");
+		}
+
+		/* The client went away or stopped reading */
+		if (ferror(fp))
+			return FW_ERR;
+	} while (n > 0 && (limit == 0 || sent < limit));
+
+	/* Stopped at the limit: hand out the resume point */
+	if (limit > 0 && sent == limit && cur.pos != FW_CURSOR_END) {
+		if (json)
+			fprintf(fp, "],\"cursor\":\"%llu\"}\n",
+			    (unsigned long long)cur.pos);
+		else
+			fprintf(fp, "{\"cursor\":\"%llu\"}\n",
+			    (unsigned long long)cur.pos);
+	} else if (json)
+		fputs("]}\n", fp);
+
+	return FW_OK;
+}
+
+/* status: daemon state and peer counts */
+static fw_err_t
+ctl_status(fw_ctx_t *ctx, FILE *fp, char *args)
+{
+	fw_daemonstate_t state;
+	size_t peers, resident;
+
+	if (fw_get_server_status(ctx, &state) != FW_OK ||
+	    fw_get_server_stats(ctx, &peers, &resident) != FW_OK)
+		return FW_ERR;
+
+	fprintf(fp, "state %s\npeers %zu\nresident %zu\n", ctl_states[state],
+	    peers, resident);
+
+	return FW_OK;
+}
+
+/* Read one request line */
+static fw_err_t
+ctl_readline(int fd, char *buf, size_t len)
+{
+	size_t off = 0;
+	ssize_t n;
+	char *nl;
+
+	while (off < len - 1) {
+		if ((n = read(fd, buf + off, len - 1 - off)) <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			return FW_ERR;
+		}
+		off += n;
+		buf[off] = '\0';
+		if ((nl = strchr(buf, '\n')) != NULL) {
+			*nl = '\0';
+			if (nl > buf && nl[-1] == '\r')
+				nl[-1] = '\0';
+			return FW_OK;
+		}
+	}
+
+	return FW_ERR;
+}
+
+/* Accept and serve one control client */
+void
+fw_ctl_accept(fw_ctx_t *ctx, int lfd)
+{
+	char line[FW_CTL_LINE_MAX], *args;
+	const struct ctl_cmd *cmd = NULL;
+	struct timeval tv;
+	uint64_t start;
+	FILE *fp;
+	size_t i;
+	int fd;
+
+	if ((fd = accept(lfd, NULL, NULL)) == -1) {
+		if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR &&
+		    errno != ECONNABORTED)
+			warn("control accept");
+		return;
+	}
+
+	start = fw_metric_now();
+	fw_metric_inc(FW_C_CTL_REQUESTS);
+
+	/* Don't let a stuck client stall the daemon */
+	tv.tv_sec = FW_CTL_TIMEOUT;
+	tv.tv_usec = 0;
+	if (fcntl(fd, F_SETFL, 0) == -1 ||
+	    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1 ||
+	    ctl_readline(fd, line, sizeof(line)) != FW_OK ||
+	    (fp = fdopen(fd, "w")) == NULL) {
+		fw_metric_inc(FW_C_CTL_ERRORS);
+		close(fd);
+		return;
+	}
+
+	args = line + strcspn(line, " ");
+	if (*args != '\0')
+		*args++ = '\0';
+
+	for (i = 0; i < sizeof(ctl_cmds) / sizeof(ctl_cmds[0]); i++) {
+		if (strcmp(line, ctl_cmds[i].name) == 0) {
+			cmd = &ctl_cmds[i];
+			break;
+		}
+	}
+
+	if (cmd == NULL) {
+		fprintf(fp, "error unknown command\n");
+		fw_metric_inc(FW_C_CTL_ERRORS);
+	} else if (cmd->fn(ctx, fp, args) != FW_OK) {
+		fprintf(fp, "error %s\n", cmd->name);
+		fw_metric_inc(FW_C_CTL_ERRORS);
+	}
+
+	fclose(fp);
+	fw_metric_observe(FW_H_CTL, fw_metric_now() - start);
+}
@@ -0,0 +1,1077 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sodium.h>
+#include <sqlite3.h>
+
+#include "base64.h"
+#include "db.h"
+#include "metrics.h"
+#include "migrate.h"
+#include "trace.h"
+
+/* Stored sizes of a user ID and a session token */
+#define DB_ID_BYTES     ((FW_DB_ID_LEN - 1) / 2)
+#define DB_TOKEN_BYTES  ((FW_DB_TOKEN_LEN - 1) / 2)
+
+/*
+ * Database schema, version FW_DB_VERSION. Users are keyed by an integer
+ * rowid (uid) that every other table refers to; the external hex ID,
+ * session tokens and keys are stored as raw BLOBs and tunnel addresses
+ * as host order integers, so indexes hold 4 to 32 byte keys rather than
+ * their text encodings. The text forms in db.h are converted here. A
+ * private key determines its public key, so only the latter is unique.
+ * v1 databases are migrated in place on open (see migrate.c).
+ */
+static const char *init_sql =
+    "PRAGMA foreign_keys = ON;"
+    "CREATE TABLE IF NOT EXISTS users ("
+    "	uid INTEGER PRIMARY KEY,"
+    "	id BLOB NOT NULL UNIQUE CHECK (length(id) = 16),"
+    "	email TEXT UNIQUE,"
+    "	password TEXT NOT NULL,"
+    "	created_at INTEGER,"
+    "	last_login INTEGER"
+    ");"
+    "CREATE TABLE IF NOT EXISTS vpn_configs ("
+    "	uid INTEGER PRIMARY KEY REFERENCES users (uid),"
+    "	assigned_ip INTEGER UNIQUE,"
+    "	created_at INTEGER,"
+    "	private_key BLOB CHECK (length(private_key) = 32),"
+    "	public_key BLOB UNIQUE CHECK (length(public_key) = 32)"
+    ");"
+    /* Clustered on the token: a session check reads one b-tree */
+    "CREATE TABLE IF NOT EXISTS sessions ("
+    "	token BLOB PRIMARY KEY CHECK (length(token) = 32),"
+    "	uid INTEGER NOT NULL REFERENCES users (uid),"
+    "	expires_at INTEGER"
+    ") WITHOUT ROWID;"
+    "CREATE INDEX IF NOT EXISTS sessions_by_uid ON sessions (uid);"
+    "CREATE INDEX IF NOT EXISTS sessions_by_expiry ON sessions (expires_at);"
+    /* Last handshake per peer, written back in batches (wback.c) */
+    "CREATE TABLE IF NOT EXISTS peer_handshakes ("
+    "	public_key BLOB PRIMARY KEY,"
+    "	last_handshake INTEGER NOT NULL"
+    ") WITHOUT ROWID;"
+    /* The interface private key, so it survives interface re-creation */
+    "CREATE TABLE IF NOT EXISTS server_keys ("
+    "	id INTEGER PRIMARY KEY CHECK (id = 1),"
+    "	private_key BLOB NOT NULL CHECK (length(private_key) = 32)"
+    ");"
+    /* Bumped on every vpn_configs change, see fw_db_generation() */
+    "CREATE TABLE IF NOT EXISTS fw_meta ("
+    "	key TEXT PRIMARY KEY,"
+    "	value INTEGER NOT NULL"
+    ");"
+    "INSERT OR IGNORE INTO fw_meta (key, value) VALUES ('generation', 0);"
+    "CREATE TRIGGER IF NOT EXISTS vpn_configs_ins "
+    "AFTER INSERT ON vpn_configs BEGIN"
+    "	UPDATE fw_meta SET value = value + 1 WHERE key = 'generation';"
+    "END;"
+    "CREATE TRIGGER IF NOT EXISTS vpn_configs_upd "
+    "AFTER UPDATE ON vpn_configs BEGIN"
+    "	UPDATE fw_meta SET value = value + 1 WHERE key = 'generation';"
+    "END;"
+    "CREATE TRIGGER IF NOT EXISTS vpn_configs_del "
+    "AFTER DELETE ON vpn_configs BEGIN"
+    "	UPDATE fw_meta SET value = value + 1 WHERE key = 'generation';"
+    "END;"
+    /* Per-user row versions, validating cached configs (cfgcache.c) */
+    "CREATE TABLE IF NOT EXISTS vpn_config_versions ("
+    "	uid INTEGER PRIMARY KEY,"
+    "	version INTEGER NOT NULL"
+    ");"
+    "INSERT OR IGNORE INTO fw_meta (key, value) VALUES ('config_version', 0);"
+    "CREATE TRIGGER IF NOT EXISTS vpn_configs_ver_ins "
+    "AFTER INSERT ON vpn_configs BEGIN"
+    "	UPDATE fw_meta SET value = value + 1 WHERE key = 'config_version';"
+    "	INSERT OR REPLACE INTO vpn_config_versions (uid, version)"
+    "	    SELECT NEW.uid, value FROM fw_meta"
+    "	    WHERE key = 'config_version';"
+    "END;"
+    "CREATE TRIGGER IF NOT EXISTS vpn_configs_ver_upd "
+    "AFTER UPDATE ON vpn_configs BEGIN"
+    "	UPDATE fw_meta SET value = value + 1 WHERE key = 'config_version';"
+    "	DELETE FROM vpn_config_versions WHERE uid = OLD.uid;"
+    "	INSERT OR REPLACE INTO vpn_config_versions (uid, version)"
+    "	    SELECT NEW.uid, value FROM fw_meta"
+    "	    WHERE key = 'config_version';"
+    "END;"
+    "CREATE TRIGGER IF NOT EXISTS vpn_configs_ver_del "
+    "AFTER DELETE ON vpn_configs BEGIN"
+    "	DELETE FROM vpn_config_versions WHERE uid = OLD.uid;"
+    "END;"
+    /* Cluster nodes sharing this DB, each reporting on every poll */
+    "CREATE TABLE IF NOT EXISTS nodes ("
+    "	name TEXT PRIMARY KEY,"
+    "	endpoint TEXT NOT NULL,"
+    "	port INTEGER NOT NULL,"
+    "	capacity INTEGER NOT NULL,"
+    "	peers INTEGER NOT NULL,"
+    "	seen INTEGER NOT NULL"
+    ");"
+    /*
+     * The node serving each user. A move changes which peers a node
+     * loads and the endpoint in the user's config, so it counts as a
+     * vpn_configs change for both the generation and the row version.
+     * The node index carries the uid, so it covers a node's peer load.
+     */
+    "CREATE TABLE IF NOT EXISTS placements ("
+    "	uid INTEGER PRIMARY KEY REFERENCES users (uid),"
+    "	node TEXT NOT NULL"
+    ");"
+    "CREATE INDEX IF NOT EXISTS placements_by_node ON placements (node);"
+    "CREATE TRIGGER IF NOT EXISTS placements_ins "
+    "AFTER INSERT ON placements BEGIN"
+    "	UPDATE fw_meta SET value = value + 1"
+    "	    WHERE key IN ('generation', 'config_version');"
+    "	DELETE FROM vpn_config_versions WHERE uid = NEW.uid;"
+    "	INSERT OR REPLACE INTO vpn_config_versions (uid, version)"
+    "	    SELECT NEW.uid, value FROM fw_meta"
+    "	    WHERE key = 'config_version';"
+    "END;"
+    "CREATE TRIGGER IF NOT EXISTS placements_upd "
+    "AFTER UPDATE ON placements BEGIN"
+    "	UPDATE fw_meta SET value = value + 1"
+    "	    WHERE key IN ('generation', 'config_version');"
+    "	DELETE FROM vpn_config_versions WHERE uid = NEW.uid;"
+    "	INSERT OR REPLACE INTO vpn_config_versions (uid, version)"
+    "	    SELECT NEW.uid, value FROM fw_meta"
+    "	    WHERE key = 'config_version';"
+    "END;"
+    "CREATE TRIGGER IF NOT EXISTS placements_del "
+    "AFTER DELETE ON placements BEGIN"
+    "	UPDATE fw_meta SET value = value + 1 WHERE key = 'generation';"
+    "END;"
+    /* A node that moved invalidates its users' cached configs */
+    "CREATE TRIGGER IF NOT EXISTS nodes_moved "
+    "AFTER UPDATE OF endpoint, port ON nodes "
+    "WHEN OLD.endpoint IS NOT NEW.endpoint OR OLD.port IS NOT NEW.port "
+    "BEGIN"
+    "	UPDATE fw_meta SET value = value + 1 WHERE key = 'config_version';"
+    "	UPDATE vpn_config_versions SET version ="
+    "	    (SELECT value FROM fw_meta WHERE key = 'config_version')"
+    "	    WHERE uid IN"
+    "	    (SELECT uid FROM placements WHERE node = NEW.name);"
+    "END;"
+    "PRAGMA user_version = 2;";
+
+/* Step a statement, timing it */
+static int
+db_step(sqlite3_stmt *stmt)
+{
+	uint64_t start;
+	int rc;
+
+	FW_TRACE_BEGIN(FW_P_DB_STEP, (uintptr_t)stmt);
+	start = fw_metric_now();
+	rc = sqlite3_step(stmt);
+	fw_metric_observe(FW_H_DB, fw_metric_now() - start);
+	FW_TRACE_END(FW_P_DB_STEP, (uintptr_t)stmt, rc);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+		fw_metric_inc(FW_C_DB_ERRORS);
+
+	return rc;
+}
+
+/* Create the schema, or whatever of it is missing */
+fw_err_t
+fw_db_init(sqlite3 *db)
+{
+	char *err = NULL;
+	int rc;
+
+	FW_TRACE_BEGIN(FW_P_DB_EXEC, 0);
+	rc = sqlite3_exec(db, init_sql, NULL, NULL, &err);
+	FW_TRACE_END(FW_P_DB_EXEC, 0, rc);
+	if (rc != SQLITE_OK) {
+		warnx("SQLite error: %s", err);
+		sqlite3_free(err);
+		return FW_DB_ERR;
+	}
+
+	return FW_OK;
+}
+
+/* Open SQLite database, migrating and initializing its schema */
+fw_err_t
+fw_db_open(const char *db_path, sqlite3 **dbp)
+{
+	int version;
+
+	/* Open database connection */
+	if (sqlite3_open(db_path, dbp) != SQLITE_OK) {
+		warnx("can't open database: %s", sqlite3_errmsg(*dbp));
+		goto err;
+	}
+
+	/* Cluster nodes share the file; wait out each other's writes */
+	sqlite3_busy_timeout(*dbp, FW_DB_BUSY_MS);
+
+	/* Bring a v1 database (or a half-migrated one) up to date first */
+	if (fw_mig_version(*dbp, &version) != FW_OK)
+		goto err;
+	if (version > FW_DB_VERSION) {
+		warnx("%s: schema version %d is newer than %d", db_path,
+		    version, FW_DB_VERSION);
+		goto err;
+	}
+	if (version < FW_DB_VERSION && version != 0) {
+		warnx("%s: migrating schema to version %d", db_path,
+		    FW_DB_VERSION);
+		if (fw_mig_run(*dbp, FW_MIG_BATCH) != FW_OK)
+			goto err;
+	}
+
+	/* Initialize schema */
+	if (fw_db_init(*dbp) != FW_OK)
+		goto err;
+
+	return FW_OK;
+
+err:
+	sqlite3_close(*dbp);
+	*dbp = NULL;
+	return FW_DB_ERR;
+}
+
+/* Switch to write-ahead logging, for WAL shipping (backup.c) */
+fw_err_t
+fw_db_wal(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	int rc, wal = 0;
+
+	if (sqlite3_prepare_v2(db, "PRAGMA journal_mode = WAL", -1, &stmt,
+	    NULL) != SQLITE_OK) {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		return FW_DB_ERR;
+	}
+	if ((rc = db_step(stmt)) == SQLITE_ROW)
+		wal = sqlite3_stricmp((const char *)sqlite3_column_text(stmt, 0),
+		    "wal") == 0;
+	sqlite3_finalize(stmt);
+
+	if (!wal) {
+		warnx("can't switch database to WAL mode");
+		return FW_DB_ERR;
+	}
+
+	return FW_OK;
+}
+
+/* Get vpn_configs generation */
+fw_err_t
+fw_db_generation(sqlite3 *db, uint64_t *generation)
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	if (sqlite3_prepare_v2(db,
+	    "SELECT value FROM fw_meta WHERE key = 'generation'",
+	    -1, &stmt, NULL) != SQLITE_OK) {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		return FW_DB_ERR;
+	}
+
+	if ((rc = db_step(stmt)) == SQLITE_ROW)
+		*generation = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	if (rc != SQLITE_ROW) {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		return FW_DB_ERR;
+	}
+
+	return FW_OK;
+}
+
+/*
+ * Call cb for every provisioned peer in vpn_configs, or with a node
+ * name, only for the peers placed on that node. Rows come out in the
+ * binary form the peer table wants, with no decoding on the way.
+ */
+fw_err_t
+fw_db_load_peers(sqlite3 *db, const char *node, fw_db_peer_cb cb, void *arg)
+{
+	sqlite3_stmt *stmt;
+	const uint8_t *pubkey;
+	struct in_addr addr;
+	fw_err_t ret = FW_OK;
+	int rc;
+
+	if (sqlite3_prepare_v2(db, node == NULL ?
+	    "SELECT public_key, assigned_ip FROM vpn_configs "
+	    "WHERE public_key IS NOT NULL AND assigned_ip IS NOT NULL" :
+	    "SELECT c.public_key, c.assigned_ip FROM placements p "
+	    "JOIN vpn_configs c ON c.uid = p.uid WHERE p.node = ? "
+	    "AND c.public_key IS NOT NULL AND c.assigned_ip IS NOT NULL",
+	    -1, &stmt, NULL) != SQLITE_OK) {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		return FW_DB_ERR;
+	}
+	if (node != NULL)
+		sqlite3_bind_text(stmt, 1, node, -1, SQLITE_STATIC);
+
+	while ((rc = db_step(stmt)) == SQLITE_ROW) {
+		pubkey = sqlite3_column_blob(stmt, 0);
+		if (sqlite3_column_bytes(stmt, 0) != WG_KEY_LEN) {
+			warnx("skipping peer with a malformed key");
+			continue;
+		}
+		addr.s_addr = htonl(sqlite3_column_int64(stmt, 1));
+		if ((ret = cb(arg, pubkey, addr)) != FW_OK)
+			break;
+	}
+
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		ret = FW_DB_ERR;
+	}
+
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
+
+/* Prepare a statement, warning on failure */
+static fw_err_t
+db_prepare(sqlite3 *db, const char *sql, sqlite3_stmt **stmt)
+{
+	if (sqlite3_prepare_v2(db, sql, -1, stmt, NULL) != SQLITE_OK) {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		fw_metric_inc(FW_C_DB_ERRORS);
+		return FW_DB_ERR;
+	}
+
+	return FW_OK;
+}
+
+/* Run a statement without results (transaction control) */
+static fw_err_t
+db_exec(sqlite3 *db, const char *sql)
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	if (db_prepare(db, sql, &stmt) != FW_OK)
+		return FW_DB_ERR;
+	rc = db_step(stmt);
+	sqlite3_finalize(stmt);
+
+	if (rc != SQLITE_DONE) {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		return FW_DB_ERR;
+	}
+
+	return FW_OK;
+}
+
+/* Copy a text column into buf, failing if it is NULL or too long */
+static fw_err_t
+db_column_str(sqlite3_stmt *stmt, int col, char *buf, size_t len)
+{
+	const char *s = (const char *)sqlite3_column_text(stmt, col);
+
+	if (s == NULL || strlcpy(buf, s, len) >= len)
+		return FW_DB_ERR;
+
+	return FW_OK;
+}
+
+/* Bind hex as a BLOB of exactly len bytes; EINVAL if it isn't one */
+static fw_err_t
+db_bind_hex(sqlite3_stmt *stmt, int col, const char *hex, size_t len)
+{
+	uint8_t buf[DB_TOKEN_BYTES];
+	size_t n;
+
+	if (len > sizeof(buf) || sodium_hex2bin(buf, len, hex, strlen(hex),
+	    NULL, &n, NULL) != 0 || n != len) {
+		errno = EINVAL;
+		return FW_ERR;
+	}
+	sqlite3_bind_blob(stmt, col, buf, len, SQLITE_TRANSIENT);
+
+	return FW_OK;
+}
+
+/* Copy a BLOB column into buf as hex */
+static fw_err_t
+db_column_hex(sqlite3_stmt *stmt, int col, char *buf, size_t len)
+{
+	const uint8_t *b = sqlite3_column_blob(stmt, col);
+	size_t n = sqlite3_column_bytes(stmt, col);
+
+	if (b == NULL || n * 2 + 1 > len)
+		return FW_DB_ERR;
+	sodium_bin2hex(buf, len, b, n);
+
+	return FW_OK;
+}
+
+/* Bind a base64 key as its WG_KEY_LEN bytes; EINVAL if it isn't one */
+static fw_err_t
+db_bind_key(sqlite3_stmt *stmt, int col, const char *b64)
+{
+	uint8_t key[WG_KEY_LEN];
+
+	if (b64_pton(b64, key, sizeof(key)) != WG_KEY_LEN) {
+		errno = EINVAL;
+		return FW_ERR;
+	}
+	sqlite3_bind_blob(stmt, col, key, sizeof(key), SQLITE_TRANSIENT);
+
+	return FW_OK;
+}
+
+/* Copy a key column into buf as base64 */
+static fw_err_t
+db_column_key(sqlite3_stmt *stmt, int col, char buf[WG_KEY_B64_LEN])
+{
+	const uint8_t *key = sqlite3_column_blob(stmt, col);
+
+	if (key == NULL || sqlite3_column_bytes(stmt, col) != WG_KEY_LEN ||
+	    b64_ntop((u_char *)key, WG_KEY_LEN, buf, WG_KEY_B64_LEN) == -1)
+		return FW_DB_ERR;
+
+	return FW_OK;
+}
+
+/* Bind a dotted IPv4 address as a host order integer */
+static fw_err_t
+db_bind_ip(sqlite3_stmt *stmt, int col, const char *ip)
+{
+	struct in_addr addr;
+
+	if (inet_pton(AF_INET, ip, &addr) != 1) {
+		errno = EINVAL;
+		return FW_ERR;
+	}
+	sqlite3_bind_int64(stmt, col, ntohl(addr.s_addr));
+
+	return FW_OK;
+}
+
+/* Copy an address column into buf, dotted */
+static fw_err_t
+db_column_ip(sqlite3_stmt *stmt, int col, char *buf, size_t len)
+{
+	struct in_addr addr;
+
+	if (sqlite3_column_type(stmt, col) != SQLITE_INTEGER)
+		return FW_DB_ERR;
+	addr.s_addr = htonl(sqlite3_column_int64(stmt, col));
+	if (inet_ntop(AF_INET, &addr, buf, len) == NULL)
+		return FW_DB_ERR;
+
+	return FW_OK;
+}
+
+/* Get interface private key (base64); ENOENT if none was stored */
+fw_err_t
+fw_db_get_server_key(sqlite3 *db, char key[WG_KEY_B64_LEN])
+{
+	sqlite3_stmt *stmt;
+	fw_err_t ret;
+	int rc;
+
+	if (db_prepare(db, "SELECT private_key FROM server_keys WHERE id = 1",
+	    &stmt) != FW_OK)
+		return FW_DB_ERR;
+
+	if ((rc = db_step(stmt)) == SQLITE_ROW)
+		ret = db_column_key(stmt, 0, key);
+	else if (rc == SQLITE_DONE) {
+		errno = ENOENT;
+		ret = FW_ERR;
+	} else {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		ret = FW_DB_ERR;
+	}
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
+
+/* Store interface private key (base64) */
+fw_err_t
+fw_db_set_server_key(sqlite3 *db, const char *key)
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	if (db_prepare(db,
+	    "INSERT OR REPLACE INTO server_keys (id, private_key) VALUES (1, ?)",
+	    &stmt) != FW_OK)
+		return FW_DB_ERR;
+
+	if (db_bind_key(stmt, 1, key) != FW_OK) {
+		warnx("malformed server key");
+		sqlite3_finalize(stmt);
+		return FW_DB_ERR;
+	}
+	rc = db_step(stmt);
+	sqlite3_finalize(stmt);
+
+	if (rc != SQLITE_DONE) {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		return FW_DB_ERR;
+	}
+
+	return FW_OK;
+}
+
+/*
+ * Create a user and its VPN config. Fails with EEXIST if the email is
+ * taken and EADDRINUSE if the config clashes with another user's.
+ */
+fw_err_t
+fw_db_add_user(sqlite3 *db, const fw_db_user_t *user, const char *email,
+    const char *hash, time_t now)
+{
+	sqlite3_stmt *stmt;
+	sqlite3_int64 uid;
+	int rc;
+
+	if (db_exec(db, "BEGIN") != FW_OK)
+		return FW_DB_ERR;
+
+	if (db_prepare(db,
+	    "INSERT INTO users (created_at, id, email, password) "
+	    "VALUES (?, ?, ?, ?)", &stmt) != FW_OK)
+		goto err;
+	sqlite3_bind_int64(stmt, 1, now);
+	sqlite3_bind_text(stmt, 3, email, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 4, hash, -1, SQLITE_STATIC);
+	if (db_bind_hex(stmt, 2, user->id, DB_ID_BYTES) != FW_OK) {
+		sqlite3_finalize(stmt);
+		goto err;
+	}
+	rc = db_step(stmt);
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_DONE) {
+		errno = rc == SQLITE_CONSTRAINT ? EEXIST : EIO;
+		goto err;
+	}
+	uid = sqlite3_last_insert_rowid(db);
+
+	if (db_prepare(db,
+	    "INSERT INTO vpn_configs "
+	    "(uid, assigned_ip, created_at, private_key, public_key) "
+	    "VALUES (?, ?, ?, ?, ?)", &stmt) != FW_OK)
+		goto err;
+	sqlite3_bind_int64(stmt, 1, uid);
+	sqlite3_bind_int64(stmt, 3, now);
+	if (db_bind_ip(stmt, 2, user->assigned_ip) != FW_OK ||
+	    db_bind_key(stmt, 4, user->private_key) != FW_OK ||
+	    db_bind_key(stmt, 5, user->public_key) != FW_OK) {
+		sqlite3_finalize(stmt);
+		goto err;
+	}
+	rc = db_step(stmt);
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_DONE) {
+		errno = rc == SQLITE_CONSTRAINT ? EADDRINUSE : EIO;
+		goto err;
+	}
+
+	if (db_exec(db, "COMMIT") != FW_OK)
+		goto err;
+
+	return FW_OK;
+
+err:
+	rc = errno;
+	db_exec(db, "ROLLBACK");
+	errno = rc;
+	return FW_DB_ERR;
+}
+
+/* Delete a user with its VPN config and sessions */
+fw_err_t
+fw_db_del_user(sqlite3 *db, const char *id)
+{
+	static const char *sql[] = {
+		"DELETE FROM placements WHERE uid = "
+		    "(SELECT uid FROM users WHERE id = ?)",
+		"DELETE FROM sessions WHERE uid = "
+		    "(SELECT uid FROM users WHERE id = ?)",
+		"DELETE FROM vpn_configs WHERE uid = "
+		    "(SELECT uid FROM users WHERE id = ?)",
+		"DELETE FROM users WHERE id = ?",
+	};
+	sqlite3_stmt *stmt;
+	size_t i;
+	int rc;
+
+	if (db_exec(db, "BEGIN") != FW_OK)
+		return FW_DB_ERR;
+
+	for (i = 0; i < sizeof(sql) / sizeof(sql[0]); i++) {
+		if (db_prepare(db, sql[i], &stmt) != FW_OK)
+			goto err;
+		if (db_bind_hex(stmt, 1, id, DB_ID_BYTES) != FW_OK) {
+			sqlite3_finalize(stmt);
+			goto err;
+		}
+		rc = db_step(stmt);
+		sqlite3_finalize(stmt);
+		if (rc != SQLITE_DONE) {
+			warnx("SQLite error: %s", sqlite3_errmsg(db));
+			goto err;
+		}
+	}
+
+	if (db_exec(db, "COMMIT") != FW_OK)
+		goto err;
+
+	return FW_OK;
+
+err:
+	db_exec(db, "ROLLBACK");
+	return FW_DB_ERR;
+}
+
+/* Fill user from columns id, private_key, public_key, assigned_ip */
+static fw_err_t
+db_user_row(sqlite3_stmt *stmt, int col, fw_db_user_t *user)
+{
+	if (db_column_hex(stmt, col, user->id, sizeof(user->id)) != FW_OK ||
+	    db_column_key(stmt, col + 1, user->private_key) != FW_OK ||
+	    db_column_key(stmt, col + 2, user->public_key) != FW_OK ||
+	    db_column_ip(stmt, col + 3, user->assigned_ip,
+	    sizeof(user->assigned_ip)) != FW_OK)
+		return FW_DB_ERR;
+
+	return FW_OK;
+}
+
+/* Get a user's password hash and config by email; ENOENT if unknown */
+fw_err_t
+fw_db_get_login(sqlite3 *db, const char *email, char *hash, size_t hashlen,
+    fw_db_user_t *user)
+{
+	sqlite3_stmt *stmt;
+	fw_err_t ret;
+	int rc;
+
+	if (db_prepare(db,
+	    "SELECT u.password, u.id, c.private_key, c.public_key, "
+	    "c.assigned_ip FROM users u JOIN vpn_configs c "
+	    "ON c.uid = u.uid WHERE u.email = ?", &stmt) != FW_OK)
+		return FW_DB_ERR;
+
+	sqlite3_bind_text(stmt, 1, email, -1, SQLITE_STATIC);
+	if ((rc = db_step(stmt)) == SQLITE_ROW) {
+		ret = db_column_str(stmt, 0, hash, hashlen);
+		if (ret == FW_OK)
+			ret = db_user_row(stmt, 1, user);
+	} else if (rc == SQLITE_DONE) {
+		errno = ENOENT;
+		ret = FW_ERR;
+	} else {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		ret = FW_DB_ERR;
+	}
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
+
+/*
+ * Create a session. The login time is written back later (see
+ * fw_wb_mark()), not here.
+ */
+fw_err_t
+fw_db_add_session(sqlite3 *db, const char *token, const char *id,
+    time_t expires)
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	if (db_prepare(db,
+	    "INSERT INTO sessions (token, expires_at, uid) "
+	    "SELECT ?, ?, uid FROM users WHERE id = ?", &stmt) != FW_OK)
+		return FW_DB_ERR;
+	sqlite3_bind_int64(stmt, 2, expires);
+	if (db_bind_hex(stmt, 1, token, DB_TOKEN_BYTES) != FW_OK ||
+	    db_bind_hex(stmt, 3, id, DB_ID_BYTES) != FW_OK) {
+		warnx("malformed session token or user ID");
+		sqlite3_finalize(stmt);
+		return FW_DB_ERR;
+	}
+	rc = db_step(stmt);
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_DONE) {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		return FW_DB_ERR;
+	}
+	if (sqlite3_changes(db) == 0) {
+		warnx("no user %s for session", id);
+		return FW_DB_ERR;
+	}
+
+	return FW_OK;
+}
+
+/*
+ * Write back login and handshake times in one transaction: stage them in
+ * a temporary table, then apply each kind with one statement. Times only
+ * move forward.
+ */
+fw_err_t
+fw_db_write_stamps(sqlite3 *db, const fw_db_stamp_t *logins, size_t nlogins,
+    const fw_db_stamp_t *hs, size_t nhs)
+{
+	sqlite3_stmt *stmt;
+	const fw_db_stamp_t *st;
+	size_t i;
+	fw_err_t ret;
+	int rc = SQLITE_DONE;
+
+	if (db_exec(db, "BEGIN") != FW_OK)
+		return FW_DB_ERR;
+
+	if (db_exec(db, "CREATE TEMP TABLE IF NOT EXISTS wb_stamps ("
+	    "kind INTEGER, key BLOB, at INTEGER, PRIMARY KEY (kind, key))") !=
+	    FW_OK ||
+	    db_prepare(db, "INSERT OR REPLACE INTO temp.wb_stamps "
+	    "(kind, key, at) VALUES (?, ?, ?)", &stmt) != FW_OK)
+		goto err;
+	for (i = 0; i < nlogins + nhs && rc == SQLITE_DONE; i++) {
+		st = i < nlogins ? &logins[i] : &hs[i - nlogins];
+		ret = i < nlogins ? db_bind_hex(stmt, 2, st->key, DB_ID_BYTES) :
+		    db_bind_key(stmt, 2, st->key);
+		if (ret != FW_OK) {
+			/* Nothing to write it to; don't fail the batch */
+			warnx("skipping malformed stamp key %s", st->key);
+			continue;
+		}
+		sqlite3_bind_int(stmt, 1, i >= nlogins);
+		sqlite3_bind_int64(stmt, 3, st->when);
+		rc = db_step(stmt);
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_DONE)
+		goto err;
+
+	if (db_exec(db,
+	    "UPDATE users SET last_login = s.at FROM temp.wb_stamps AS s "
+	    "WHERE s.kind = 0 AND users.id = s.key AND "
+	    "(users.last_login IS NULL OR users.last_login < s.at)") != FW_OK ||
+	    db_exec(db,
+	    "INSERT INTO peer_handshakes (public_key, last_handshake) "
+	    "SELECT key, at FROM temp.wb_stamps WHERE kind = 1 "
+	    "ON CONFLICT (public_key) DO UPDATE SET last_handshake = "
+	    "max(last_handshake, excluded.last_handshake)") != FW_OK ||
+	    db_exec(db, "DELETE FROM temp.wb_stamps") != FW_OK ||
+	    db_exec(db, "COMMIT") != FW_OK)
+		goto err;
+
+	return FW_OK;
+
+err:
+	warnx("SQLite error: %s", sqlite3_errmsg(db));
+	db_exec(db, "ROLLBACK");
+	return FW_DB_ERR;
+}
+
+/*
+ * Get the user behind a live session and the version of its VPN config
+ * row (0 if it predates versioning); ENOENT if unknown or expired
+ */
+fw_err_t
+fw_db_get_session(sqlite3 *db, const char *token, time_t now,
+    char id[FW_DB_ID_LEN], uint64_t *version)
+{
+	sqlite3_stmt *stmt;
+	fw_err_t ret;
+	int rc;
+
+	if (db_prepare(db,
+	    "SELECT u.id, COALESCE(v.version, 0) FROM sessions s "
+	    "JOIN users u ON u.uid = s.uid "
+	    "LEFT JOIN vpn_config_versions v ON v.uid = s.uid "
+	    "WHERE s.token = ? AND s.expires_at > ?", &stmt) != FW_OK)
+		return FW_DB_ERR;
+
+	/* Not a token we could have handed out */
+	if (db_bind_hex(stmt, 1, token, DB_TOKEN_BYTES) != FW_OK) {
+		sqlite3_finalize(stmt);
+		errno = ENOENT;
+		return FW_ERR;
+	}
+	sqlite3_bind_int64(stmt, 2, now);
+	if ((rc = db_step(stmt)) == SQLITE_ROW) {
+		ret = db_column_hex(stmt, 0, id, FW_DB_ID_LEN);
+		*version = sqlite3_column_int64(stmt, 1);
+	} else if (rc == SQLITE_DONE) {
+		errno = ENOENT;
+		ret = FW_ERR;
+	} else {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		ret = FW_DB_ERR;
+	}
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
+
+/*
+ * Delete up to limit sessions expired by now; *count is how many went.
+ * Small batches keep the write lock short for the other writers.
+ */
+fw_err_t
+fw_db_expire_sessions(sqlite3 *db, time_t now, size_t limit, size_t *count)
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	if (db_prepare(db,
+	    "DELETE FROM sessions WHERE token IN "
+	    "(SELECT token FROM sessions WHERE expires_at <= ? LIMIT ?)",
+	    &stmt) != FW_OK)
+		return FW_DB_ERR;
+	sqlite3_bind_int64(stmt, 1, now);
+	sqlite3_bind_int64(stmt, 2, limit);
+	rc = db_step(stmt);
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_DONE) {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		return FW_DB_ERR;
+	}
+	*count = sqlite3_changes(db);
+
+	return FW_OK;
+}
+
+/* Get a user's VPN config by ID; ENOENT if unknown */
+fw_err_t
+fw_db_get_user(sqlite3 *db, const char *id, fw_db_user_t *user)
+{
+	sqlite3_stmt *stmt;
+	fw_err_t ret;
+	int rc;
+
+	if (db_prepare(db,
+	    "SELECT u.id, c.private_key, c.public_key, c.assigned_ip, "
+	    "n.endpoint, n.port FROM users u JOIN vpn_configs c "
+	    "ON c.uid = u.uid LEFT JOIN placements p ON p.uid = u.uid "
+	    "LEFT JOIN nodes n ON n.name = p.node WHERE u.id = ?",
+	    &stmt) != FW_OK)
+		return FW_DB_ERR;
+
+	if (db_bind_hex(stmt, 1, id, DB_ID_BYTES) != FW_OK) {
+		sqlite3_finalize(stmt);
+		errno = ENOENT;
+		return FW_ERR;
+	}
+	if ((rc = db_step(stmt)) == SQLITE_ROW) {
+		ret = db_user_row(stmt, 0, user);
+
+		/* Placed on a cluster node: its endpoint, not ours */
+		user->node_addr[0] = '\0';
+		user->node_port = 0;
+		if (ret == FW_OK && sqlite3_column_type(stmt, 4) != SQLITE_NULL &&
+		    db_column_str(stmt, 4, user->node_addr,
+		    sizeof(user->node_addr)) == FW_OK)
+			user->node_port = sqlite3_column_int(stmt, 5);
+	} else if (rc == SQLITE_DONE) {
+		errno = ENOENT;
+		ret = FW_ERR;
+	} else {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		ret = FW_DB_ERR;
+	}
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
+
+/*
+ * START cluster nodes
+ */
+
+/* Record a node's endpoint, capacity and peer count as of now */
+fw_err_t
+fw_db_report_node(sqlite3 *db, const fw_db_node_t *node, time_t now)
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	if (db_prepare(db,
+	    "INSERT INTO nodes (name, endpoint, port, capacity, peers, seen) "
+	    "VALUES (?, ?, ?, ?, ?, ?) ON CONFLICT (name) DO UPDATE SET "
+	    "endpoint = excluded.endpoint, port = excluded.port, "
+	    "capacity = excluded.capacity, peers = excluded.peers, "
+	    "seen = excluded.seen", &stmt) != FW_OK)
+		return FW_DB_ERR;
+	sqlite3_bind_text(stmt, 1, node->name, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, node->endpoint, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 3, node->port);
+	sqlite3_bind_int64(stmt, 4, node->capacity);
+	sqlite3_bind_int64(stmt, 5, node->peers);
+	sqlite3_bind_int64(stmt, 6, now);
+	rc = db_step(stmt);
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_DONE) {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		return FW_DB_ERR;
+	}
+
+	return FW_OK;
+}
+
+/*
+ * Get the nodes that reported at or after since, by name, each with the
+ * number of users placed on it; the array must be freed by the caller
+ */
+fw_err_t
+fw_db_get_nodes(sqlite3 *db, time_t since, fw_db_node_t **nodes,
+    size_t *count)
+{
+	sqlite3_stmt *stmt;
+	fw_db_node_t *n, *tmp;
+	size_t cap = 0;
+	fw_err_t ret = FW_OK;
+	int rc;
+
+	*nodes = NULL;
+	*count = 0;
+	if (db_prepare(db,
+	    "SELECT n.name, n.endpoint, n.port, n.capacity, n.peers, n.seen, "
+	    "(SELECT count(*) FROM placements p WHERE p.node = n.name) "
+	    "FROM nodes n WHERE n.seen >= ? ORDER BY n.name", &stmt) != FW_OK)
+		return FW_DB_ERR;
+	sqlite3_bind_int64(stmt, 1, since);
+
+	while ((rc = db_step(stmt)) == SQLITE_ROW) {
+		if (*count == cap) {
+			cap = cap ? cap * 2 : 8;
+			if ((tmp = reallocarray(*nodes, cap, sizeof(*tmp))) ==
+			    NULL) {
+				ret = FW_ERR;
+				break;
+			}
+			*nodes = tmp;
+		}
+		n = &(*nodes)[*count];
+		if (db_column_str(stmt, 0, n->name, sizeof(n->name)) != FW_OK ||
+		    db_column_str(stmt, 1, n->endpoint, sizeof(n->endpoint)) !=
+		    FW_OK)
+			continue;
+		n->port = sqlite3_column_int(stmt, 2);
+		n->capacity = sqlite3_column_int64(stmt, 3);
+		n->peers = sqlite3_column_int64(stmt, 4);
+		n->seen = sqlite3_column_int64(stmt, 5);
+		n->placed = sqlite3_column_int64(stmt, 6);
+		(*count)++;
+	}
+	if (ret == FW_OK && rc != SQLITE_DONE) {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		ret = FW_DB_ERR;
+	}
+	sqlite3_finalize(stmt);
+
+	if (ret != FW_OK) {
+		free(*nodes);
+		*nodes = NULL;
+		*count = 0;
+	}
+
+	return ret;
+}
+
+/* Call cb for every user with a VPN config and its node (NULL if none) */
+fw_err_t
+fw_db_load_placements(sqlite3 *db, fw_db_place_cb cb, void *arg)
+{
+	sqlite3_stmt *stmt;
+	char id[FW_DB_ID_LEN];
+	fw_err_t ret = FW_OK;
+	int rc;
+
+	if (db_prepare(db,
+	    "SELECT u.id, p.node FROM vpn_configs c "
+	    "JOIN users u ON u.uid = c.uid "
+	    "LEFT JOIN placements p ON p.uid = c.uid", &stmt) != FW_OK)
+		return FW_DB_ERR;
+
+	while ((rc = db_step(stmt)) == SQLITE_ROW) {
+		if (db_column_hex(stmt, 0, id, sizeof(id)) != FW_OK)
+			continue;
+		if ((ret = cb(arg, id,
+		    (const char *)sqlite3_column_text(stmt, 1))) != FW_OK)
+			break;
+	}
+	if (ret == FW_OK && rc != SQLITE_DONE) {
+		warnx("SQLite error: %s", sqlite3_errmsg(db));
+		ret = FW_DB_ERR;
+	}
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
+
+/* Place users on nodes in one transaction; unchanged rows stay quiet */
+fw_err_t
+fw_db_place_users(sqlite3 *db, const fw_db_place_t *moves, size_t count)
+{
+	sqlite3_stmt *stmt = NULL;
+	size_t i;
+
+	if (db_exec(db, "BEGIN IMMEDIATE") != FW_OK)
+		return FW_DB_ERR;
+
+	if (db_prepare(db,
+	    "INSERT INTO placements (uid, node) "
+	    "SELECT uid, ?2 FROM users WHERE id = ?1 "
+	    "ON CONFLICT (uid) DO UPDATE SET node = excluded.node "
+	    "WHERE node IS NOT excluded.node", &stmt) != FW_OK)
+		goto err;
+
+	for (i = 0; i < count; i++) {
+		if (db_bind_hex(stmt, 1, moves[i].user, DB_ID_BYTES) != FW_OK) {
+			warnx("malformed user ID %s", moves[i].user);
+			goto err;
+		}
+		sqlite3_bind_text(stmt, 2, moves[i].node, -1, SQLITE_STATIC);
+		if (db_step(stmt) != SQLITE_DONE) {
+			warnx("SQLite error: %s", sqlite3_errmsg(db));
+			goto err;
+		}
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+
+	if (db_exec(db, "COMMIT") != FW_OK)
+		goto err;
+
+	return FW_OK;
+
+err:
+	sqlite3_finalize(stmt);
+	db_exec(db, "ROLLBACK");
+	return FW_DB_ERR;
+}
+
+/*
+ * END cluster nodes
+ */
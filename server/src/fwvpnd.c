@@ -7,52 +7,188 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include <arpa/inet.h>
+
 #include <err.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "api.h"
+#include "backup.h"
+#include "cfgcache.h"
+#include "cluster.h"
+#include "conf.h"
+#include "ctl.h"
+#include "db.h"
 #include "fwvpnd.h"
+#include "jobs.h"
+#include "metrics.h"
+#include "peertab.h"
+#include "pview.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "wback.h"
 #include "wireguard.h"
 
 /* Global fwvpnd (daemon) context */
 static fw_ctx_t *g_fw_ctx = NULL;
 
+/* The one thread that changes the peer table */
+static pthread_t g_fw_writer;
+
+/* Background jobs, run by the context's scheduler */
+static struct {
+	fw_job_t backup;     /* Start and copy online backups     */
+	fw_job_t cluster;    /* Report in, rebalance, sync slice  */
+	fw_job_t expire;     /* Delete expired sessions           */
+	fw_job_t flush;      /* Write back logins and handshakes  */
+	fw_job_t poll;       /* Poll handshakes, evict idle peers */
+	fw_job_t snapshot;   /* Rewrite a stale peer snapshot     */
+	fw_job_t walship;    /* Ship the WAL to the standby       */
+} g_fw_jobs;
+
+/* Signals pending for fw_run() */
+static volatile sig_atomic_t g_fw_reload = 0;
+static volatile sig_atomic_t g_fw_stop = 0;
+static volatile sig_atomic_t g_fw_trace = 0;
+
+static fw_err_t fw_adopt_iface(fw_ctx_t *);
+static fw_err_t fw_evict_peers(fw_ctx_t *, const uint32_t *, size_t);
+static fw_err_t fw_install_peers(fw_ctx_t *);
+static fw_err_t fw_load_peer(void *, const uint8_t *, struct in_addr);
+static fw_err_t fw_load_peers(fw_ctx_t *);
+static int fw_is_writer(void);
+static void fw_save_peers(fw_ctx_t *);
+static fw_err_t fw_setup_key(fw_ctx_t *, int);
+static void fw_publish_peers(fw_ctx_t *);
+static void fw_cluster_poll(fw_ctx_t *);
+static fw_err_t fw_begin_backup(fw_ctx_t *);
+static fw_err_t fw_start_jobs(fw_ctx_t *);
+static void fw_jobs_interval(fw_ctx_t *);
+
+/*
+ * Fill in defaults for unset peer activation, rate limit and shedding,
+ * and apply command-line overrides
+ */
+static void
+fw_cfg_defaults(fw_cfg_t *cfg)
+{
+	if (cfg->keep_iface)
+		cfg->handover = 1;
+	if (cfg->max_resident == 0 || cfg->max_resident > WG_PEERS_MAX)
+		cfg->max_resident = WG_PEERS_MAX;
+	if (cfg->idle_timeout <= 0)
+		cfg->idle_timeout = FW_IDLE_TIMEOUT;
+	if (cfg->poll_interval <= 0)
+		cfg->poll_interval = FW_POLL_INTERVAL;
+	if (cfg->flush_interval <= 0)
+		cfg->flush_interval = FW_FLUSH_INTERVAL;
+	if (cfg->auth_rate <= 0)
+		cfg->auth_rate = FW_AUTH_RATE;
+	if (cfg->auth_burst <= 0)
+		cfg->auth_burst = FW_AUTH_BURST;
+	if (cfg->shed_target <= 0)
+		cfg->shed_target = FW_SHED_TARGET;
+	if (cfg->node_capacity == 0)
+		cfg->node_capacity = cfg->max_resident;
+	if (cfg->node_timeout <= 0)
+		cfg->node_timeout = FW_NODE_TIMEOUT;
+	if (cfg->config_cache == 0)
+		cfg->config_cache = FW_CFGCACHE_SIZE;
+	if (cfg->job_workers <= 0)
+		cfg->job_workers = FW_SCHED_WORKERS;
+}
+
 /* Initialize fwvpnd */
 fw_err_t
 fw_init(fw_cfg_t *g_fw_cfg)
 {
 	wg_handle_t *wg;
+	int backend;
 
 	if (g_fw_cfg == NULL)
 		return FW_ERR;
 
     /* Initialize global fwvpnd context */
-	g_fw_ctx = calloc(1, sizeof(fw_ctx_t));
+	if ((g_fw_ctx = calloc(1, sizeof(fw_ctx_t))) == NULL)
+		return FW_ERR;
 	memcpy(&g_fw_ctx->config, g_fw_cfg, sizeof(fw_cfg_t));
+	g_fw_ctx->ctl_fd = -1;
 
-    /* Initialize DB connection */
-	if (sqlite3_open(g_fw_cfg->db_path, &g_fw_ctx->db_conn) != SQLITE_OK) {
+    /*
+     * Open wg(4) (mock or userspace) interface handle. With privsep this
+     * forks the privileged process, so do it before anything else is open.
+     */
+	backend = g_fw_cfg->wg_mock ? WG_BACKEND_MOCK :
+	    g_fw_cfg->wg_userspace ? WG_BACKEND_USER : WG_BACKEND_KERNEL;
+	if ((wg = calloc(1, sizeof(wg_handle_t))) == NULL) {
 		free(g_fw_ctx);
 		g_fw_ctx = NULL;
-		return FW_DB_ERR;
+		return FW_ERR;
 	}
-
-    /* Open wg(4) interface handle */
-	wg = calloc(1, sizeof(wg_handle_t));
-	if (wg_open_iface(wg, g_fw_cfg->wg_iface) != FW_OK) {
-		sqlite3_close(g_fw_ctx->db_conn);
+	if ((g_fw_cfg->privsep ? wg_open_priv(wg, g_fw_cfg->wg_iface,
+	    backend) : wg_open(wg, g_fw_cfg->wg_iface, backend)) != FW_OK) {
 		free(wg);
+		free(g_fw_ctx);
+		g_fw_ctx = NULL;
 		return FW_WG_ERR;
 	}
 
+    /* Initialize DB connection and schema */
+	if (fw_db_open(g_fw_cfg->db_path, &g_fw_ctx->db_conn) != FW_OK) {
+		wg_close_iface(wg);
+		free(wg);
+		free(g_fw_ctx);
+		g_fw_ctx = NULL;
+		return FW_DB_ERR;
+	}
+
     /* Store wg(4) handle in context */
 	g_fw_ctx->wg_handle = wg;
+
+    /* Apply peer activation defaults */
+	fw_cfg_defaults(&g_fw_ctx->config);
+
+    /* Initialize known peer table */
+	g_fw_ctx->peer_tab = calloc(1, sizeof(fw_ptab_t));
+	if (g_fw_ctx->peer_tab == NULL || fw_ptab_init(g_fw_ctx->peer_tab,
+	    g_fw_ctx->config.max_resident) != FW_OK) {
+		wg_close_iface(wg);
+		sqlite3_close(g_fw_ctx->db_conn);
+		free(g_fw_ctx->peer_tab);
+		free(wg);
+		free(g_fw_ctx);
+		g_fw_ctx = NULL;
+		return FW_ERR;
+	}
+
+    /* Initialize login/handshake write-back and online backups */
+	g_fw_ctx->wback = calloc(1, sizeof(fw_wback_t));
+	g_fw_ctx->backup = calloc(1, sizeof(fw_backup_t));
+	if (g_fw_ctx->wback == NULL || g_fw_ctx->backup == NULL ||
+	    fw_wb_init(g_fw_ctx->wback) != FW_OK) {
+		wg_close_iface(wg);
+		sqlite3_close(g_fw_ctx->db_conn);
+		fw_ptab_free(g_fw_ctx->peer_tab);
+		free(g_fw_ctx->peer_tab);
+		free(g_fw_ctx->wback);
+		free(g_fw_ctx->backup);
+		free(wg);
+		free(g_fw_ctx);
+		g_fw_ctx = NULL;
+		return FW_ERR;
+	}
+
     /* Initialize context state */
 	g_fw_ctx->state = FW_STATE_STOPPED;
 	g_fw_ctx->peer_count = 0;
+	g_fw_writer = pthread_self();
 
 	return FW_OK;
 }
@@ -64,12 +200,57 @@ fw_cleanup(void)
 	if (g_fw_ctx == NULL)
 		return;
 
+    /* Let a running pool job finish before anything goes away */
+	if (g_fw_ctx->sched != NULL) {
+		fw_sched_free(g_fw_ctx->sched);
+		free(g_fw_ctx->sched);
+		g_fw_ctx->sched = NULL;
+	}
+
+    /* Record the resident set for a warm start */
+	if (g_fw_ctx->state == FW_STATE_RUNNING)
+		fw_save_peers(g_fw_ctx);
+
+	fw_api_close(g_fw_ctx);
+	fw_ctl_close(g_fw_ctx->ctl_fd, g_fw_ctx->config.ctl_path);
+
 	if (g_fw_ctx->wg_handle != NULL) {
-		wg_destroy_iface(g_fw_ctx->wg_handle);
+	    /* In handover mode the interface outlives us */
+		if (!g_fw_ctx->config.handover)
+			wg_destroy_iface(g_fw_ctx->wg_handle);
 		wg_close_iface(g_fw_ctx->wg_handle);
 		free(g_fw_ctx->wg_handle);
 	}
 
+	fw_pv_clear();
+	if (g_fw_ctx->peer_tab != NULL) {
+		fw_ptab_free(g_fw_ctx->peer_tab);
+		free(g_fw_ctx->peer_tab);
+	}
+
+	if (g_fw_ctx->wback != NULL) {
+	    /* Write back everything still pending, however long it takes */
+		while (g_fw_ctx->db_conn != NULL &&
+		    fw_wb_dirty(g_fw_ctx->wback) > 0 &&
+		    fw_wb_flush(g_fw_ctx->wback, g_fw_ctx->db_conn,
+		    FW_WB_BATCH) == FW_OK)
+			;
+		fw_wb_free(g_fw_ctx->wback);
+		free(g_fw_ctx->wback);
+	}
+
+	if (g_fw_ctx->backup != NULL) {
+		fw_bk_abort(g_fw_ctx->backup);
+		free(g_fw_ctx->backup);
+	}
+	if (g_fw_ctx->walship != NULL) {
+	    /* Ship the last write-backs before the log is folded in */
+		if (g_fw_ctx->db_conn != NULL)
+			fw_ws_work(g_fw_ctx->walship, g_fw_ctx->db_conn, 0);
+		fw_ws_close(g_fw_ctx->walship);
+		free(g_fw_ctx->walship);
+	}
+
 	if (g_fw_ctx->db_conn != NULL)
 		sqlite3_close(g_fw_ctx->db_conn);
 
@@ -77,12 +258,474 @@ fw_cleanup(void)
 	g_fw_ctx = NULL;
 }
 
+/* Get fwvpnd context */
+fw_ctx_t *
+fw_get_ctx(void)
+{
+	return g_fw_ctx;
+}
+
+/* Note a signal for fw_run(); safe to call from a signal handler */
+void
+fw_signal(int sig)
+{
+	switch (sig) {
+	case SIGHUP:
+		g_fw_reload = 1;
+		break;
+	case SIGINT:
+	case SIGTERM:
+		g_fw_stop = 1;
+		break;
+	case SIGUSR1:
+		g_fw_trace = 1;
+		break;
+	}
+}
+
+/* Warn about a changed setting that only applies after a restart */
+static void
+fw_reload_keep(const char *name, const char *cur, const char *new)
+{
+	if (cur == new || (cur != NULL && new != NULL && strcmp(cur, new) == 0))
+		return;
+	warnx("reload: %s change requires a restart", name);
+}
+
+/*
+ * Apply a reloaded configuration, touching only what changed. Settings
+ * that would tear down the interface or DB connection are kept until
+ * restart. Established tunnels are left alone; only a smaller resident
+ * cap evicts peers.
+ */
+fw_err_t
+fw_reload(fw_cfg_t *cfg)
+{
+	struct wg_interface_io iface;
+	fw_cfg_t *cur, new;
+	fw_ptab_t *pt;
+	uint32_t ids[FW_EVICT_BATCH];
+	fw_err_t ret = FW_OK;
+	size_t n;
+
+	if (g_fw_ctx == NULL || cfg == NULL)
+		return FW_ERR;
+
+	cur = &g_fw_ctx->config;
+	pt = g_fw_ctx->peer_tab;
+	memcpy(&new, cfg, sizeof(new));
+	fw_cfg_defaults(&new);
+
+    /* Restart-only settings */
+	fw_reload_keep("ctl_path", cur->ctl_path, new.ctl_path);
+	fw_reload_keep("backup_path", cur->backup_path, new.backup_path);
+	fw_reload_keep("db_path", cur->db_path, new.db_path);
+	fw_reload_keep("listen_addr", cur->listen_addr, new.listen_addr);
+	fw_reload_keep("node_name", cur->node_name, new.node_name);
+	fw_reload_keep("server_addr", cur->server_addr, new.server_addr);
+	fw_reload_keep("snap_path", cur->snap_path, new.snap_path);
+	fw_reload_keep("trace_path", cur->trace_path, new.trace_path);
+	fw_reload_keep("user", cur->user, new.user);
+	fw_reload_keep("vpn_subnet", cur->vpn_subnet, new.vpn_subnet);
+	fw_reload_keep("wal_ship_path", cur->wal_ship_path, new.wal_ship_path);
+	fw_reload_keep("wg_iface", cur->wg_iface, new.wg_iface);
+	if (new.handover != cur->handover)
+		warnx("reload: handover change requires a restart");
+	if (new.api_port != cur->api_port)
+		warnx("reload: api_port change requires a restart");
+	if (new.api_uring != cur->api_uring)
+		warnx("reload: api_uring change requires a restart");
+	if (new.wg_mock != cur->wg_mock)
+		warnx("reload: wg_mock change requires a restart");
+	if (new.wg_userspace != cur->wg_userspace)
+		warnx("reload: wg_userspace change requires a restart");
+	if (new.privsep != cur->privsep)
+		warnx("reload: privsep change requires a restart");
+
+	cur->idle_timeout = new.idle_timeout;
+	cur->poll_interval = new.poll_interval;
+	cur->flush_interval = new.flush_interval;
+	cur->auth_rate = new.auth_rate;
+	cur->auth_burst = new.auth_burst;
+	cur->shed_target = new.shed_target;
+	cur->node_capacity = new.node_capacity;
+	cur->node_coordinator = new.node_coordinator;
+	cur->node_timeout = new.node_timeout;
+	cur->backup_interval = new.backup_interval;
+	if (g_fw_ctx->sched != NULL)
+		fw_jobs_interval(g_fw_ctx);
+
+	if (new.job_workers != cur->job_workers) {
+		if (g_fw_ctx->sched == NULL ||
+		    fw_sched_workers(g_fw_ctx->sched, new.job_workers) == FW_OK)
+			cur->job_workers = new.job_workers;
+		else {
+			warn("reload: job_workers");
+			ret = FW_ERR;
+		}
+	}
+
+    /* Resizing flushes the rendered configs; they render again on use */
+	if (new.config_cache != cur->config_cache) {
+		if (g_fw_ctx->api == NULL ||
+		    fw_api_cache_size(g_fw_ctx, new.config_cache) == FW_OK)
+			cur->config_cache = new.config_cache;
+		else {
+			warn("reload: config_cache");
+			ret = FW_ERR;
+		}
+	}
+
+    /* Before fw_start() the new port just replaces the one it will set */
+	if (new.listen_port != cur->listen_port &&
+	    g_fw_ctx->state != FW_STATE_RUNNING)
+		cur->listen_port = new.listen_port;
+	else if (new.listen_port != cur->listen_port) {
+		memset(&iface, 0, sizeof(iface));
+		iface.i_flags = WG_INTERFACE_HAS_PORT;
+		iface.i_port = new.listen_port;
+		if (wg_set_iface(g_fw_ctx->wg_handle, &iface) == FW_OK)
+			cur->listen_port = new.listen_port;
+		else {
+			warn("reload: listen_port");
+			ret = FW_WG_ERR;
+		}
+	}
+
+    /* Shrinking the resident cap evicts CLOCK victims down to it */
+	while (pt->rcount > new.max_resident) {
+		n = pt->rcount - new.max_resident;
+		n = fw_ptab_victims(pt, 0, 0, 1, ids,
+		    n < FW_EVICT_BATCH ? n : FW_EVICT_BATCH);
+		if (fw_evict_peers(g_fw_ctx, ids, n) != FW_OK)
+			ret = FW_WG_ERR;
+	}
+	if (fw_ptab_set_cap(pt, new.max_resident) == FW_OK)
+		cur->max_resident = new.max_resident;
+	else
+		ret = FW_ERR;
+
+    /* Leaving lazy mode installs every registered peer */
+	if (new.lazy_peers != cur->lazy_peers) {
+		cur->lazy_peers = new.lazy_peers;
+		if (!cur->lazy_peers && g_fw_ctx->state == FW_STATE_RUNNING &&
+		    fw_install_peers(g_fw_ctx) != FW_OK)
+			ret = FW_WG_ERR;
+	}
+
+	return ret;
+}
+
+/* Reload the configuration file after SIGHUP */
+static void
+fw_reload_conf(void)
+{
+	fw_cfg_t cfg;
+
+	if (fw_conf_load(g_fw_ctx->config.conf_path, &cfg) != FW_OK) {
+		warnx("reload: keeping current configuration");
+		return;
+	}
+
+    /* Command-line overrides outlive the file they override */
+	cfg.keep_iface = g_fw_ctx->config.keep_iface;
+
+	if (fw_reload(&cfg) != FW_OK)
+		warnx("reload: configuration partially applied");
+	fw_conf_free(&cfg);
+}
+
+/*
+ * Run fwvpnd until stopped by SIGINT or SIGTERM: serve the control
+ * socket and HTTP API between the background jobs' turns (handshake
+ * polls, write-backs, backups; see fw_start_jobs()).
+ */
+fw_err_t
+fw_run(void)
+{
+	struct pollfd pfds[1 + FW_API_POLLFDS];
+	size_t napi;
+	int timeout;
+
+	if (g_fw_ctx == NULL || g_fw_ctx->state != FW_STATE_RUNNING)
+		return FW_ERR;
+
+	pfds[0].fd = g_fw_ctx->ctl_fd;
+	pfds[0].events = POLLIN;
+
+	while (!g_fw_stop) {
+	    /* Changes made while serving the last turn go out as one batch */
+		fw_publish_peers(g_fw_ctx);
+
+		if (g_fw_reload) {
+			g_fw_reload = 0;
+			fw_reload_conf();
+		}
+
+		if (g_fw_trace) {
+			g_fw_trace = 0;
+			if (g_fw_ctx->config.trace_path != NULL &&
+			    fw_trace_dump(g_fw_ctx->config.trace_path) != FW_OK)
+				warn("%s", g_fw_ctx->config.trace_path);
+		}
+
+	    /*
+	     * One slice of each due loop job, then sleep until the next
+	     * is due; signals wake us early. A job with a backlog or
+	     * requests held back by admission control only yield to
+	     * pending requests.
+	     */
+		timeout = fw_sched_run(g_fw_ctx->sched);
+		napi = fw_api_pollfds(g_fw_ctx, &pfds[1]);
+		if (fw_api_backlog(g_fw_ctx) > 0)
+			timeout = 0;
+		if (napi > 1 && (timeout < 0 || timeout > FW_API_TIMEOUT * 1000))
+			timeout = FW_API_TIMEOUT * 1000;
+		pfds[0].revents = 0;
+		if (poll(pfds, 1 + napi, timeout) == -1) {
+			if (errno != EINTR)
+				warn("poll");
+			continue;
+		}
+
+		if (pfds[0].revents & POLLIN)
+			fw_ctl_accept(g_fw_ctx, pfds[0].fd);
+		fw_api_serve(g_fw_ctx, &pfds[1], napi);
+	}
+
+	return FW_OK;
+}
+
+/* Job: record handshakes and evict idle peers */
+static int
+fw_job_poll(void *arg, uint64_t budget)
+{
+	if (fw_poll_peers(arg) != FW_OK)
+		warn("fw_poll_peers");
+
+	return FW_JOB_DONE;
+}
+
+/* Job: cluster report, rebalancing and sync */
+static int
+fw_job_cluster(void *arg, uint64_t budget)
+{
+	fw_cluster_poll(arg);
+
+	return FW_JOB_DONE;
+}
+
+/* Job: rewrite the peer snapshot once the table changed */
+static int
+fw_job_snapshot(void *arg, uint64_t budget)
+{
+	fw_ctx_t *ctx = arg;
+
+	if (ctx->peers_dirty)
+		fw_save_peers(ctx);
+
+	return FW_JOB_DONE;
+}
+
+/* Job: write back one batch of stamps a slice until none are left */
+static int
+fw_job_flush(void *arg, uint64_t budget)
+{
+	fw_ctx_t *ctx = arg;
+
+	if (fw_wb_flush(ctx->wback, ctx->db_conn, FW_WB_BATCH) != FW_OK) {
+		warnx("write-back failed, retrying later");
+		return FW_JOB_DONE;
+	}
+
+	return fw_wb_dirty(ctx->wback) > 0 ? FW_JOB_MORE : FW_JOB_DONE;
+}
+
+/* Job: start a backup unless one is running, then copy a slice of it */
+static int
+fw_job_backup(void *arg, uint64_t budget)
+{
+	fw_ctx_t *ctx = arg;
+	int done;
+
+	if (!fw_bk_running(ctx->backup) && fw_begin_backup(ctx) != FW_OK) {
+		warn("backup %s", ctx->config.backup_path);
+		return FW_JOB_DONE;
+	}
+
+	if (fw_bk_work(ctx->backup, budget, &done) != FW_OK) {
+		warnx("backup %s failed", ctx->config.backup_path);
+		return FW_JOB_DONE;
+	}
+
+	return done ? FW_JOB_DONE : FW_JOB_MORE;
+}
+
+/* Job: ship new WAL frames, a slice of any base copy at a time */
+static int
+fw_job_walship(void *arg, uint64_t budget)
+{
+	fw_ctx_t *ctx = arg;
+	fw_walship_t *ws = ctx->walship;
+
+	fw_ws_work(ws, ctx->db_conn, budget);
+
+	return fw_bk_running(&ws->base) ? FW_JOB_MORE : FW_JOB_DONE;
+}
+
+/*
+ * Job: delete expired sessions in batches until the budget is spent.
+ * It runs on the loop, on the one connection that writes (and ships).
+ */
+static int
+fw_job_expire(void *arg, uint64_t budget)
+{
+	fw_ctx_t *ctx = arg;
+	uint64_t start;
+	size_t n;
+
+	start = fw_metric_now();
+	do {
+		if (fw_db_expire_sessions(ctx->db_conn, time(NULL),
+		    FW_EXPIRE_BATCH, &n) != FW_OK)
+			return FW_JOB_DONE;
+	} while (n == FW_EXPIRE_BATCH && fw_metric_now() - start < budget);
+
+	return n == FW_EXPIRE_BATCH ? FW_JOB_MORE : FW_JOB_DONE;
+}
+
+/* Set up a job to run every interval seconds, give or take the jitter */
+static void
+fw_job_init(fw_job_t *j, const char *name, fw_job_fn fn, void *arg,
+    time_t interval, uint64_t budget, int flags)
+{
+	memset(j, 0, sizeof(*j));
+	j->name = name;
+	j->fn = fn;
+	j->arg = arg;
+	j->interval = interval * 1000;
+	j->jitter = j->interval * FW_JOB_JITTER / 100;
+	j->budget = budget;
+	j->flags = flags;
+}
+
+/* Apply changed job intervals from the configuration */
+static void
+fw_jobs_interval(fw_ctx_t *ctx)
+{
+	struct {
+		fw_job_t *job;
+		time_t interval;
+	} set[] = {
+		{ &g_fw_jobs.backup, ctx->config.backup_interval },
+		{ &g_fw_jobs.cluster, ctx->config.poll_interval },
+		{ &g_fw_jobs.flush, ctx->config.flush_interval },
+		{ &g_fw_jobs.poll, ctx->config.poll_interval },
+		{ &g_fw_jobs.snapshot, ctx->config.poll_interval },
+	};
+	uint64_t ms;
+	size_t i;
+
+	for (i = 0; i < sizeof(set) / sizeof(set[0]); i++) {
+		ms = (uint64_t)set[i].interval * 1000;
+		if (set[i].job->fn == NULL || set[i].job->interval == ms)
+			continue;
+		set[i].job->jitter = ms * FW_JOB_JITTER / 100;
+		fw_sched_interval(ctx->sched, set[i].job, ms);
+	}
+}
+
+/*
+ * Start the scheduler and add the background jobs. Jobs that touch the
+ * peer table, the write-back buffer or the main DB connection run on
+ * the event loop thread, between requests; the rest run on workers.
+ */
+static fw_err_t
+fw_start_jobs(fw_ctx_t *ctx)
+{
+	fw_cfg_t *cfg = &ctx->config;
+	fw_sched_t *s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		return FW_ERR;
+	if (fw_sched_init(s, cfg->job_workers) != FW_OK) {
+		free(s);
+		return FW_ERR;
+	}
+	ctx->sched = s;
+
+	fw_job_init(&g_fw_jobs.poll, "poll", fw_job_poll, ctx,
+	    cfg->poll_interval, FW_JOB_BUDGET, FW_JOB_LOOP);
+	fw_sched_add(s, &g_fw_jobs.poll, 0);
+
+	if (cfg->node_name != NULL) {
+		fw_job_init(&g_fw_jobs.cluster, "cluster", fw_job_cluster, ctx,
+		    cfg->poll_interval, FW_JOB_BUDGET, FW_JOB_LOOP);
+		fw_sched_add(s, &g_fw_jobs.cluster, 0);
+	}
+
+	fw_job_init(&g_fw_jobs.snapshot, "snapshot", fw_job_snapshot, ctx,
+	    cfg->poll_interval, FW_JOB_BUDGET, FW_JOB_LOOP);
+	fw_sched_add(s, &g_fw_jobs.snapshot, g_fw_jobs.snapshot.interval);
+
+	fw_job_init(&g_fw_jobs.flush, "flush", fw_job_flush, ctx,
+	    cfg->flush_interval, FW_JOB_BUDGET, FW_JOB_LOOP);
+	fw_sched_add(s, &g_fw_jobs.flush, g_fw_jobs.flush.interval);
+
+    /* Added even when off: a control request can start a backup */
+	fw_job_init(&g_fw_jobs.backup, "backup", fw_job_backup, ctx,
+	    cfg->backup_interval, FW_BK_BUDGET, FW_JOB_LOOP);
+	fw_sched_add(s, &g_fw_jobs.backup, g_fw_jobs.backup.interval);
+
+	if (ctx->walship != NULL) {
+		fw_job_init(&g_fw_jobs.walship, "walship", fw_job_walship, ctx,
+		    FW_SHIP_INTERVAL, FW_BK_BUDGET, FW_JOB_LOOP);
+		fw_sched_add(s, &g_fw_jobs.walship, 0);
+	}
+
+	fw_job_init(&g_fw_jobs.expire, "expire", fw_job_expire, ctx,
+	    FW_EXPIRE_INTERVAL, FW_JOB_BUDGET, FW_JOB_LOOP);
+	fw_sched_add(s, &g_fw_jobs.expire, g_fw_jobs.expire.interval);
+
+	return FW_OK;
+}
+
+/* Start an online backup to backup_path */
+static fw_err_t
+fw_begin_backup(fw_ctx_t *ctx)
+{
+	if (ctx->config.backup_path == NULL) {
+		errno = EINVAL;
+		return FW_ERR;
+	}
+
+	return fw_bk_start(ctx->backup, ctx->db_conn, ctx->config.backup_path);
+}
+
+/* Start an online backup to backup_path, copied by the backup job */
+fw_err_t
+fw_start_backup(fw_ctx_t *ctx)
+{
+	if (ctx == NULL) {
+		errno = EINVAL;
+		return FW_ERR;
+	}
+
+	if (fw_begin_backup(ctx) != FW_OK)
+		return FW_ERR;
+	if (ctx->sched != NULL)
+		fw_sched_kick(ctx->sched, &g_fw_jobs.backup);
+
+	return FW_OK;
+}
+
 /* Start fwvpnd */
 fw_err_t
 fw_start(void)
 {
 	struct wg_interface_io iface;
 	fw_err_t ret;
+	int adopt;
 
 	if (g_fw_ctx == NULL)
 		return FW_ERR;
@@ -90,23 +733,1002 @@ fw_start(void)
 	if (g_fw_ctx->state == FW_STATE_RUNNING)
 		return FW_OK;
 
-	if ((ret = wg_create_iface(g_fw_ctx->wg_handle)) != FW_OK)
+    /* Load existing peers from snapshot or DB */
+	if ((ret = fw_load_peers(g_fw_ctx)) != FW_OK)
 		return ret;
 
-    /* Configure wg(4) interface */
+    /* In handover mode, adopt a live interface rather than recreate it */
 	memset(&iface, 0, sizeof(iface));
-	iface.i_flags = WG_INTERFACE_HAS_PORT;
-	iface.i_port = g_fw_ctx->config.listen_port;
+	adopt = g_fw_ctx->config.handover &&
+	    wg_get_iface(g_fw_ctx->wg_handle, &iface) == FW_OK;
+
+	if (!adopt && (ret = wg_create_iface(g_fw_ctx->wg_handle)) != FW_OK)
+		return ret;
+
+    /* Configure wg(4) interface, leaving an adopted one alone if we can */
+	if (!adopt || iface.i_port != g_fw_ctx->config.listen_port) {
+		memset(&iface, 0, sizeof(iface));
+		iface.i_flags = WG_INTERFACE_HAS_PORT;
+		iface.i_port = g_fw_ctx->config.listen_port;
+
+		if ((ret = wg_set_iface(g_fw_ctx->wg_handle, &iface)) != FW_OK) {
+			if (!adopt)
+				wg_destroy_iface(g_fw_ctx->wg_handle);
+			return ret;
+		}
+	}
+
+	if ((ret = fw_setup_key(g_fw_ctx, adopt)) != FW_OK) {
+		if (!adopt)
+			wg_destroy_iface(g_fw_ctx->wg_handle);
+		return ret;
+	}
+
+	if (adopt && (ret = fw_adopt_iface(g_fw_ctx)) != FW_OK)
+		return ret;
 
-	if ((ret = wg_set_iface(g_fw_ctx->wg_handle, &iface)) != FW_OK) {
-		wg_destroy_iface(g_fw_ctx->wg_handle);
+	if ((ret = fw_install_peers(g_fw_ctx)) != FW_OK)
 		return ret;
+
+    /* Ship the WAL to a standby directory */
+	if (g_fw_ctx->config.wal_ship_path != NULL) {
+		if ((g_fw_ctx->walship = calloc(1, sizeof(fw_walship_t))) ==
+		    NULL)
+			return FW_ERR;
+		if (fw_ws_open(g_fw_ctx->walship, g_fw_ctx->db_conn,
+		    g_fw_ctx->config.db_path, g_fw_ctx->config.wal_ship_path) !=
+		    FW_OK) {
+			warn("%s", g_fw_ctx->config.wal_ship_path);
+			return FW_ERR;
+		}
+	}
+
+    /* Set up control socket */
+	if (g_fw_ctx->config.ctl_path != NULL &&
+	    fw_ctl_open(g_fw_ctx->config.ctl_path, &g_fw_ctx->ctl_fd) != FW_OK) {
+		warn("%s", g_fw_ctx->config.ctl_path);
+		return FW_ERR;
 	}
 
-    /* XXX: Set up IPC socket */
-    /* XXX: Load existing peers from DB */
+    /* Set up HTTP API */
+	if (g_fw_ctx->config.api_port != 0 && fw_api_open(g_fw_ctx) != FW_OK) {
+		warn("api %s:%d", g_fw_ctx->config.listen_addr,
+		    g_fw_ctx->config.api_port);
+		return FW_ERR;
+	}
+
+	if (fw_start_jobs(g_fw_ctx) != FW_OK) {
+		warn("background jobs");
+		return FW_ERR;
+	}
 
 	g_fw_ctx->state = FW_STATE_RUNNING;
 
 	return FW_OK;
 }
+
+/*
+ * Give the interface its private key from the DB, generating and storing
+ * one on first start so client configs stay valid across restarts. An
+ * adopted interface keeps the key it already has.
+ */
+static fw_err_t
+fw_setup_key(fw_ctx_t *ctx, int adopt)
+{
+	char b64[WG_KEY_B64_LEN];
+	uint8_t privkey[WG_KEY_LEN], pubkey[WG_KEY_LEN];
+	fw_err_t ret;
+
+	if (adopt && wg_get_pubkey(ctx->wg_handle, pubkey) == FW_OK)
+		return FW_OK;
+
+	if ((ret = fw_db_get_server_key(ctx->db_conn, b64)) == FW_OK) {
+		if (wg_key_from_b64(privkey, b64) != FW_OK) {
+			warnx("server_keys: bad private key");
+			return FW_ERR;
+		}
+	} else if (ret == FW_ERR && errno == ENOENT) {
+		if (wg_gen_keypair(privkey, pubkey) != FW_OK ||
+		    wg_key_to_b64(b64, sizeof(b64), privkey) != FW_OK ||
+		    fw_db_set_server_key(ctx->db_conn, b64) != FW_OK) {
+			explicit_bzero(privkey, sizeof(privkey));
+			explicit_bzero(b64, sizeof(b64));
+			return FW_ERR;
+		}
+	} else
+		return ret;
+
+	ret = wg_set_privkey(ctx->wg_handle, privkey);
+	explicit_bzero(privkey, sizeof(privkey));
+	explicit_bzero(b64, sizeof(b64));
+
+	return ret;
+}
+
+/* Get fwvpnd running state */
+fw_err_t
+fw_get_server_status(fw_ctx_t *ctx, fw_daemonstate_t *state)
+{
+	if (ctx == NULL || state == NULL)
+		return FW_ERR;
+
+	*state = ctx->state;
+
+	return FW_OK;
+}
+
+/* Get registered and installed (resident) peer counts */
+fw_err_t
+fw_get_server_stats(fw_ctx_t *ctx, size_t *peers, size_t *resident)
+{
+	fw_ptab_t *pt;
+	const fw_pview_t *v;
+
+	if (ctx == NULL || peers == NULL || resident == NULL)
+		return FW_ERR;
+
+	if (fw_is_writer()) {
+		pt = ctx->peer_tab;
+		*peers = pt->count;
+		*resident = pt->rcount;
+		return FW_OK;
+	}
+
+	v = fw_pv_enter();
+	*peers = v != NULL ? v->count : 0;
+	*resident = v != NULL ? v->resident : 0;
+	fw_pv_leave();
+
+	return FW_OK;
+}
+
+/*
+ * START peer management functions
+ */
+
+/*
+ * Publish the peer table if it changed since the last view, and free
+ * views that readers have since let go of. Failure leaves readers on the
+ * old view until the next try.
+ */
+static void
+fw_publish_peers(fw_ctx_t *ctx)
+{
+	fw_ptab_t *pt = ctx->peer_tab;
+
+	if (fw_pv_gen() != pt->gen) {
+		if (fw_pv_publish(pt) != FW_OK)
+			warn("can't publish peer view");
+	} else
+		fw_pv_reclaim();
+}
+
+/*
+ * Whether we are the writer thread. The writer reads its own writes
+ * straight from the peer table; other threads read the view fw_run()
+ * published last.
+ */
+static int
+fw_is_writer(void)
+{
+	return pthread_equal(pthread_self(), g_fw_writer);
+}
+
+/* Copy a table entry into the published form, or NULL */
+static const fw_pvent_t *
+fw_peer_ent(const fw_ptab_t *pt, const fw_pent_t *pe, fw_pvent_t *ent)
+{
+	if (pe == NULL)
+		return NULL;
+
+	memcpy(ent->key, pe->key, WG_KEY_LEN);
+	ent->addr = pe->addr;
+	ent->handshake = pe->handshake;
+	ent->id = pe - pt->ents;
+	ent->flags = pe->flags;
+
+	return ent;
+}
+
+/* Install peer on interface with its tunnel address as allowed IP */
+static fw_err_t
+fw_install_peer(fw_ctx_t *ctx, fw_pent_t *pe)
+{
+	return wg_add_peers(ctx->wg_handle, &pe->key, &pe->addr, 1);
+}
+
+/* Install a batch of registered peers in one ioctl(2) and admit them */
+static fw_err_t
+fw_install_batch(fw_ctx_t *ctx, const uint32_t *ids, size_t count)
+{
+	fw_ptab_t *pt = ctx->peer_tab;
+	uint8_t keys[FW_INSTALL_BATCH][WG_KEY_LEN];
+	struct in_addr addrs[FW_INSTALL_BATCH];
+	fw_pent_t *pe;
+	time_t now;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		memcpy(keys[i], pt->ents[ids[i]].key, WG_KEY_LEN);
+		addrs[i] = pt->ents[ids[i]].addr;
+	}
+	if (wg_add_peers(ctx->wg_handle, keys, addrs, count) != FW_OK)
+		return FW_WG_ERR;
+
+	now = time(NULL);
+	for (i = 0; i < count; i++) {
+		pe = &pt->ents[ids[i]];
+		fw_ptab_admit(pt, pe);
+		fw_ptab_touch(pe, now);
+	}
+
+	return FW_OK;
+}
+
+/* Remove victims picked by the CLOCK sweep from the interface */
+static fw_err_t
+fw_evict_peers(fw_ctx_t *ctx, const uint32_t *ids, size_t count)
+{
+	fw_ptab_t *pt = ctx->peer_tab;
+	uint8_t keys[FW_EVICT_BATCH][WG_KEY_LEN];
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		memcpy(keys[i], pt->ents[ids[i]].key, WG_KEY_LEN);
+
+	ctx->peer_count = pt->rcount;
+	fw_metric_add(FW_C_PEER_EVICTIONS, count);
+
+    /* Peers left behind on failure are reconciled by the next poll */
+	return wg_remove_peers(ctx->wg_handle, keys, count);
+}
+
+/* Make room for one more resident peer */
+static fw_err_t
+fw_reserve_slot(fw_ctx_t *ctx)
+{
+	fw_ptab_t *pt = ctx->peer_tab;
+	uint32_t ids[FW_EVICT_BATCH];
+	size_t n;
+
+	if (pt->rcount < pt->rcap)
+		return FW_OK;
+
+	if (!ctx->config.lazy_peers) {
+		errno = ENOSPC;
+		return FW_ERR;
+	}
+
+    /* Prefer a batch of idle peers, else take the CLOCK victim */
+	n = fw_ptab_victims(pt, time(NULL), ctx->config.idle_timeout, 0, ids,
+	    FW_EVICT_BATCH);
+	if (n == 0)
+		n = fw_ptab_victims(pt, 0, 0, 1, ids, 1);
+
+	return fw_evict_peers(ctx, ids, n);
+}
+
+/*
+ * Ensure a registered peer is installed, called when its user
+ * authenticates or fetches a config. Only does work in lazy mode or if
+ * the peer was evicted; otherwise it just records activity.
+ */
+fw_err_t
+fw_activate_peer(fw_ctx_t *ctx, const char *pubkey)
+{
+	uint8_t key[WG_KEY_LEN];
+	fw_pent_t *pe;
+	fw_err_t ret;
+
+	if (ctx == NULL || pubkey == NULL)
+		return FW_ERR;
+
+	if (wg_key_from_b64(key, pubkey) != FW_OK)
+		return FW_ERR;
+
+	if ((pe = fw_ptab_find(ctx->peer_tab, key)) == NULL) {
+		errno = ENOENT;
+		return FW_ERR;
+	}
+
+	if (!(pe->flags & FW_PE_RESIDENT)) {
+		if ((ret = fw_reserve_slot(ctx)) != FW_OK)
+			return ret;
+		if ((ret = fw_install_peer(ctx, pe)) != FW_OK)
+			return ret;
+		fw_metric_inc(FW_C_PEER_ACTIVATIONS);
+		fw_ptab_admit(ctx->peer_tab, pe);
+		ctx->peer_count = ((fw_ptab_t *)ctx->peer_tab)->rcount;
+	}
+
+	fw_ptab_touch(pe, time(NULL));
+
+	return FW_OK;
+}
+
+/* Parse peer key and tunnel address */
+static fw_err_t
+fw_parse_peer(const char *pubkey, const char *allowed_ips,
+    uint8_t key[WG_KEY_LEN], struct in_addr *addr)
+{
+	char ip[MAX_IP_LEN];
+
+	if (wg_key_from_b64(key, pubkey) != FW_OK)
+		return FW_ERR;
+
+    /* Only a single /32 tunnel address is supported */
+	strlcpy(ip, allowed_ips, sizeof(ip));
+	ip[strcspn(ip, "/")] = '\0';
+	if (inet_pton(AF_INET, ip, addr) != 1) {
+		errno = EINVAL;
+		return FW_ERR;
+	}
+
+	return FW_OK;
+}
+
+/* Register a peer row from the DB without installing it */
+static fw_err_t
+fw_load_peer(void *arg, const uint8_t *key, struct in_addr addr)
+{
+	fw_ctx_t *ctx = arg;
+	char b64[WG_KEY_B64_LEN];
+
+	if (fw_ptab_add(ctx->peer_tab, key, addr, NULL) != FW_OK &&
+	    wg_key_to_b64(b64, sizeof(b64), (uint8_t *)key) == FW_OK)
+		warnx("skipping peer %s", b64);
+
+	return FW_OK;
+}
+
+/*
+ * Install every registered peer that is not yet resident. In lazy mode
+ * only peers that were resident before the last shutdown are installed.
+ */
+static fw_err_t
+fw_install_peers(fw_ctx_t *ctx)
+{
+	fw_ptab_t *pt = ctx->peer_tab;
+	fw_pent_t *pe;
+	uint32_t ids[FW_INSTALL_BATCH], want;
+	size_t i, n;
+
+	want = ctx->config.lazy_peers ? FW_PE_WARM : FW_PE_USED;
+	n = 0;
+	for (i = 0; i < pt->cap; i++) {
+		pe = &pt->ents[i];
+		if (!(pe->flags & want) || (pe->flags & FW_PE_RESIDENT))
+			continue;
+
+		if (pt->rcount + n >= pt->rcap) {
+			warnx("resident peer cap reached, %zu peers not installed",
+			    pt->count - pt->rcount - n);
+			break;
+		}
+
+		ids[n++] = i;
+		if (n == FW_INSTALL_BATCH) {
+			if (fw_install_batch(ctx, ids, n) != FW_OK)
+				return FW_WG_ERR;
+			n = 0;
+		}
+	}
+	if (n > 0 && fw_install_batch(ctx, ids, n) != FW_OK)
+		return FW_WG_ERR;
+	ctx->peer_count = pt->rcount;
+
+	for (i = 0; i < pt->cap; i++)
+		pt->ents[i].flags &= ~FW_PE_WARM;
+
+	return FW_OK;
+}
+
+/*
+ * Build the peer table from the snapshot when it matches the DB
+ * generation, else from vpn_configs (and then write a fresh snapshot).
+ */
+static fw_err_t
+fw_load_peers(fw_ctx_t *ctx)
+{
+	const struct fw_snap_rec *r;
+	struct in_addr addr;
+	fw_snap_t snap;
+	fw_pent_t *pe;
+	uint64_t count, gen, i;
+	uint32_t id;
+	fw_err_t ret;
+
+	if (ctx->config.snap_path == NULL)
+		return fw_db_load_peers(ctx->db_conn, ctx->config.node_name,
+		    fw_load_peer, ctx);
+
+	if ((ret = fw_db_generation(ctx->db_conn, &gen)) != FW_OK)
+		return ret;
+
+	if (fw_snap_open(&snap, ctx->config.snap_path) != FW_OK) {
+		if (errno != ENOENT)
+			warn("%s: ignoring snapshot", ctx->config.snap_path);
+	} else if (snap.hdr->generation != gen) {
+		fw_snap_close(&snap);
+	} else {
+		count = snap.hdr->count;
+		for (i = 0; i < count; i++) {
+			r = &snap.recs[i];
+			addr.s_addr = r->addr;
+			if (fw_ptab_add(ctx->peer_tab, r->key, addr, &id) !=
+			    FW_OK)
+				break;
+			pe = &((fw_ptab_t *)ctx->peer_tab)->ents[id];
+			if (r->flags & FW_SNAP_RESIDENT)
+				pe->flags |= FW_PE_WARM;
+		}
+		fw_snap_close(&snap);
+		if (i == count)
+			return FW_OK;
+
+	    /* Start over from the DB with an empty table */
+		warn("%s: ignoring snapshot", ctx->config.snap_path);
+		fw_ptab_free(ctx->peer_tab);
+		if (fw_ptab_init(ctx->peer_tab, ctx->config.max_resident) !=
+		    FW_OK)
+			return FW_ERR;
+	}
+
+	if ((ret = fw_db_load_peers(ctx->db_conn, ctx->config.node_name,
+	    fw_load_peer, ctx)) != FW_OK)
+		return ret;
+	ctx->peers_dirty = 1;
+
+	return FW_OK;
+}
+
+/* Write the peer snapshot, tagged with the current DB generation */
+static void
+fw_save_peers(fw_ctx_t *ctx)
+{
+	uint64_t gen;
+
+	if (ctx->config.snap_path == NULL)
+		return;
+
+	if (fw_db_generation(ctx->db_conn, &gen) != FW_OK)
+		return;
+
+	if (fw_snap_write(ctx->config.snap_path, gen, ctx->peer_tab) !=
+	    FW_OK) {
+		warn("%s: can't write snapshot", ctx->config.snap_path);
+		return;
+	}
+
+	ctx->peers_dirty = 0;
+}
+
+/*
+ * Reconcile a live interface left behind by a previous fwvpnd against
+ * the peer table. Known peers are adopted as resident with their
+ * sessions intact; unknown peers (or those over the cap) are removed.
+ */
+static fw_err_t
+fw_adopt_iface(fw_ctx_t *ctx)
+{
+	struct wg_interface_io *iface;
+	struct wg_peer_io *p;
+	fw_ptab_t *pt = ctx->peer_tab;
+	fw_pent_t *pe;
+	uint8_t stale[FW_EVICT_BATCH][WG_KEY_LEN];
+	uint8_t moved[FW_INSTALL_BATCH][WG_KEY_LEN];
+	struct in_addr addrs[FW_INSTALL_BATCH];
+	fw_err_t ret = FW_OK;
+	time_t now;
+	size_t i, m, n;
+
+	if (wg_get_peers(ctx->wg_handle, &iface, NULL) != FW_OK)
+		return FW_WG_ERR;
+
+	now = time(NULL);
+	m = n = 0;
+	p = &iface->i_peers[0];
+	for (i = 0; i < iface->i_peers_count; i++, p = WG_PEER_NEXT(p)) {
+		pe = fw_ptab_find(pt, p->p_public);
+		if (pe != NULL && fw_ptab_admit(pt, pe) == FW_OK) {
+		    /* Adopted peers get a full idle period of grace */
+			pe->handshake = p->p_last_handshake.tv_sec;
+			pt->gen++;
+			fw_ptab_touch(pe, now);
+
+		    /* Fix up allowed IPs if the DB moved the peer */
+			if (p->p_aips_count == 1 &&
+			    p->p_aips[0].a_af == AF_INET &&
+			    p->p_aips[0].a_cidr == 32 &&
+			    p->p_aips[0].a_ipv4.s_addr == pe->addr.s_addr)
+				continue;
+			memcpy(moved[m], pe->key, WG_KEY_LEN);
+			addrs[m++] = pe->addr;
+			if (m == FW_INSTALL_BATCH) {
+				if (wg_add_peers(ctx->wg_handle, moved, addrs,
+				    m) != FW_OK)
+					ret = FW_WG_ERR;
+				m = 0;
+			}
+			continue;
+		}
+
+		memcpy(stale[n++], p->p_public, WG_KEY_LEN);
+		if (n == FW_EVICT_BATCH) {
+			if (wg_remove_peers(ctx->wg_handle, stale, n) != FW_OK)
+				ret = FW_WG_ERR;
+			n = 0;
+		}
+	}
+	free(iface);
+
+	if (n > 0 && wg_remove_peers(ctx->wg_handle, stale, n) != FW_OK)
+		ret = FW_WG_ERR;
+	if (m > 0 && wg_add_peers(ctx->wg_handle, moved, addrs, m) != FW_OK)
+		ret = FW_WG_ERR;
+	ctx->peer_count = pt->rcount;
+
+	return ret;
+}
+
+/* Register peer; installed now unless running in lazy mode */
+fw_err_t
+fw_add_peer(fw_ctx_t *ctx, const char *pubkey, const char *allowed_ips)
+{
+	uint8_t key[WG_KEY_LEN];
+	struct in_addr addr;
+
+	if (ctx == NULL || pubkey == NULL || allowed_ips == NULL)
+		return FW_ERR;
+
+	if (fw_parse_peer(pubkey, allowed_ips, key, &addr) != FW_OK)
+		return FW_ERR;
+
+	if (fw_ptab_add(ctx->peer_tab, key, addr, NULL) != FW_OK)
+		return FW_ERR;
+
+	ctx->peers_dirty = 1;
+	if (ctx->config.lazy_peers)
+		return FW_OK;
+
+	if (fw_activate_peer(ctx, pubkey) != FW_OK) {
+		fw_ptab_del(ctx->peer_tab, key);
+		return FW_ERR;
+	}
+
+	return FW_OK;
+}
+
+/* Fill peer information from a published entry */
+static void
+fw_fill_peer(const fw_pvent_t *pe, fw_peer_t *peer, time_t now)
+{
+	memset(peer, 0, sizeof(*peer));
+	inet_ntop(AF_INET, &pe->addr, peer->allowed_ips,
+	    sizeof(peer->allowed_ips));
+	wg_key_to_b64(peer->pubkey, sizeof(peer->pubkey), (uint8_t *)pe->key);
+	peer->last_handshake = pe->handshake;
+
+	if ((pe->flags & FW_PE_RESIDENT) &&
+	    now - pe->handshake < FW_HANDSHAKE_LIVE)
+		peer->state = FW_PEER_CONNECTED;
+	else
+		peer->state = FW_PEER_DISCONNECTED;
+}
+
+/* Get peer information */
+fw_err_t
+fw_get_peer(fw_ctx_t *ctx, const char *pubkey, fw_peer_t *peer)
+{
+	uint8_t key[WG_KEY_LEN];
+	const fw_pvent_t *pe;
+	fw_pvent_t ent;
+	fw_err_t ret = FW_OK;
+	int writer;
+
+	if (ctx == NULL || pubkey == NULL || peer == NULL)
+		return FW_ERR;
+
+	if (wg_key_from_b64(key, pubkey) != FW_OK)
+		return FW_ERR;
+
+	if ((writer = fw_is_writer()))
+		pe = fw_peer_ent(ctx->peer_tab,
+		    fw_ptab_find(ctx->peer_tab, key), &ent);
+	else
+		pe = fw_pv_find(fw_pv_enter(), key);
+	if (pe != NULL)
+		fw_fill_peer(pe, peer, time(NULL));
+	else {
+		errno = ENOENT;
+		ret = FW_ERR;
+	}
+	if (!writer)
+		fw_pv_leave();
+
+	return ret;
+}
+
+/* Get information on the peer whose tunnel address covers addr */
+fw_err_t
+fw_get_peer_by_addr(fw_ctx_t *ctx, const char *addr, fw_peer_t *peer)
+{
+	const fw_pvent_t *pe;
+	fw_pvent_t ent;
+	struct in_addr in;
+	fw_err_t ret = FW_OK;
+	int writer;
+
+	if (ctx == NULL || addr == NULL || peer == NULL)
+		return FW_ERR;
+
+	if (inet_pton(AF_INET, addr, &in) != 1) {
+		errno = EINVAL;
+		return FW_ERR;
+	}
+
+	if ((writer = fw_is_writer()))
+		pe = fw_peer_ent(ctx->peer_tab,
+		    fw_ptab_owner(ctx->peer_tab, in), &ent);
+	else
+		pe = fw_pv_owner(fw_pv_enter(), in);
+	if (pe != NULL)
+		fw_fill_peer(pe, peer, time(NULL));
+	else {
+		errno = ENOENT;
+		ret = FW_ERR;
+	}
+	if (!writer)
+		fw_pv_leave();
+
+	return ret;
+}
+
+/* Unregister peer and remove it from the interface */
+fw_err_t
+fw_remove_peer(fw_ctx_t *ctx, const char *pubkey)
+{
+	uint8_t key[WG_KEY_LEN];
+	fw_pent_t *pe;
+
+	if (ctx == NULL || pubkey == NULL)
+		return FW_ERR;
+
+	if (wg_key_from_b64(key, pubkey) != FW_OK)
+		return FW_ERR;
+
+	if ((pe = fw_ptab_find(ctx->peer_tab, key)) == NULL) {
+		errno = ENOENT;
+		return FW_ERR;
+	}
+
+	if ((pe->flags & FW_PE_RESIDENT) &&
+	    wg_remove_peer(ctx->wg_handle, key) != FW_OK)
+		return FW_ERR;
+
+	fw_ptab_del(ctx->peer_tab, key);
+	ctx->peer_count = ((fw_ptab_t *)ctx->peer_tab)->rcount;
+	ctx->peers_dirty = 1;
+
+	return FW_OK;
+}
+
+/*
+ * List every registered peer; the array must be freed by the caller.
+ * fw_list_peers_page() lists in O(page) memory.
+ */
+fw_err_t
+fw_list_peers(fw_ctx_t *ctx, fw_peer_t **peers, size_t *count)
+{
+	fw_ptab_t *pt;
+	const fw_pview_t *v;
+	fw_pvent_t ent;
+	fw_err_t ret = FW_OK;
+	time_t now;
+	size_t i, n;
+
+	if (ctx == NULL || peers == NULL || count == NULL)
+		return FW_ERR;
+
+	*peers = NULL;
+	*count = 0;
+	if (fw_is_writer()) {
+		pt = ctx->peer_tab;
+		if (pt->count == 0)
+			return FW_OK;
+		if ((*peers = calloc(pt->count, sizeof(fw_peer_t))) == NULL)
+			return FW_ERR;
+
+		now = time(NULL);
+		for (i = n = 0; i < pt->cap && n < pt->count; i++) {
+			if (pt->ents[i].flags & FW_PE_USED)
+				fw_fill_peer(fw_peer_ent(pt, &pt->ents[i], &ent),
+				    &(*peers)[n++], now);
+		}
+		*count = n;
+		return FW_OK;
+	}
+
+	v = fw_pv_enter();
+	if (v == NULL || v->count == 0)
+		goto done;
+
+	if ((*peers = calloc(v->count, sizeof(fw_peer_t))) == NULL) {
+		ret = FW_ERR;
+		goto done;
+	}
+
+	now = time(NULL);
+	for (i = 0; i < v->count; i++)
+		fw_fill_peer(&v->ents[i], &(*peers)[i], now);
+	*count = v->count;
+
+done:
+	fw_pv_leave();
+	return ret;
+}
+
+/*
+ * Fill peers with up to max registered peers matching cur's filters,
+ * resuming after the last call; *count is 0 once the listing is done,
+ * and cur->pos is FW_CURSOR_END once nothing is left. Positions are
+ * table ids and each page reads the latest view, so peers added or
+ * removed meanwhile may or may not show up, but no peer is listed twice.
+ */
+fw_err_t
+fw_list_peers_page(fw_ctx_t *ctx, fw_cursor_t *cur, fw_peer_t *peers,
+    size_t max, size_t *count)
+{
+	fw_ptab_t *pt;
+	const fw_pview_t *v = NULL;
+	const fw_pvent_t *pe;
+	fw_pvent_t ent;
+	time_t now;
+	size_t end, i, n = 0;
+	int writer;
+
+	if (ctx == NULL || cur == NULL || peers == NULL || count == NULL)
+		return FW_ERR;
+
+    /* The writer walks table ids itself, others the view's positions */
+	pt = ctx->peer_tab;
+	if ((writer = fw_is_writer())) {
+		i = cur->pos < pt->cap ? cur->pos : pt->cap;
+		end = pt->cap;
+	} else {
+		v = fw_pv_enter();
+		i = fw_pv_seek(v, cur->pos);
+		end = v != NULL ? v->count : 0;
+	}
+	now = time(NULL);
+	for (; i < end && n < max; i++) {
+		if (!writer)
+			pe = &v->ents[i];
+		else if (pt->ents[i].flags & FW_PE_USED)
+			pe = fw_peer_ent(pt, &pt->ents[i], &ent);
+		else
+			continue;
+		cur->pos = pe->id + 1;
+		if (cur->max_age > 0 && now - pe->handshake > cur->max_age)
+			continue;
+		fw_fill_peer(pe, &peers[n], now);
+		if (cur->states == 0 || (cur->states & (1U << peers[n].state)))
+			n++;
+	}
+	if (i == end)
+		cur->pos = FW_CURSOR_END;
+	if (!writer)
+		fw_pv_leave();
+	*count = n;
+
+	return FW_OK;
+}
+
+/*
+ * Handshake poller: record handshake recency from the interface and, in
+ * lazy mode, evict peers idle past the configured timeout in batches.
+ */
+fw_err_t
+fw_poll_peers(fw_ctx_t *ctx)
+{
+	struct wg_interface_io *iface;
+	struct wg_peer_io *p;
+	fw_ptab_t *pt;
+	fw_pent_t *pe;
+	uint32_t ids[FW_EVICT_BATCH];
+	time_t now;
+	size_t i, n;
+
+	if (ctx == NULL)
+		return FW_ERR;
+
+	pt = ctx->peer_tab;
+	if (wg_get_peers(ctx->wg_handle, &iface, NULL) != FW_OK)
+		return FW_ERR;
+
+	p = &iface->i_peers[0];
+	for (i = 0; i < iface->i_peers_count; i++, p = WG_PEER_NEXT(p)) {
+		if ((pe = fw_ptab_find(pt, p->p_public)) == NULL)
+			continue;
+
+	    /* An evicted peer whose removal failed is still installed */
+		if (!(pe->flags & FW_PE_RESIDENT) &&
+		    fw_ptab_admit(pt, pe) != FW_OK)
+			continue;
+
+		if (p->p_last_handshake.tv_sec > pe->handshake) {
+			pe->handshake = p->p_last_handshake.tv_sec;
+			pt->gen++;
+			fw_ptab_touch(pe, pe->handshake);
+			fw_wb_mark(ctx->wback, FW_WB_HANDSHAKE, pe->key,
+			    pe->handshake);
+		}
+	}
+	free(iface);
+
+	ctx->peer_count = pt->rcount;
+	if (!ctx->config.lazy_peers)
+		return FW_OK;
+
+	now = time(NULL);
+	while ((n = fw_ptab_victims(pt, now, ctx->config.idle_timeout, 0, ids,
+	    FW_EVICT_BATCH)) > 0) {
+		if (fw_evict_peers(ctx, ids, n) != FW_OK)
+			return FW_WG_ERR;
+		if (n < FW_EVICT_BATCH)
+			break;
+	}
+
+	return FW_OK;
+}
+
+/* Cluster sync state */
+struct fw_sync {
+	fw_ctx_t *ctx;
+	size_t failed;      /* Rows to retry on the next sync */
+};
+
+/* Uninstall and unregister a peer */
+static fw_err_t
+fw_drop_peer(fw_ctx_t *ctx, fw_pent_t *pe)
+{
+	if ((pe->flags & FW_PE_RESIDENT) &&
+	    wg_remove_peer(ctx->wg_handle, pe->key) != FW_OK)
+		return FW_WG_ERR;
+
+	return fw_ptab_del(ctx->peer_tab, pe->key);
+}
+
+/*
+ * Uninstall a batch of resident peers in one ioctl(2) and unregister
+ * them; returns how many are left to retry
+ */
+static size_t
+fw_drop_peers(fw_ctx_t *ctx, const uint32_t *ids, size_t count)
+{
+	fw_ptab_t *pt = ctx->peer_tab;
+	uint8_t keys[FW_EVICT_BATCH][WG_KEY_LEN];
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		memcpy(keys[i], pt->ents[ids[i]].key, WG_KEY_LEN);
+	if (wg_remove_peers(ctx->wg_handle, keys, count) != FW_OK)
+		return count;
+
+	for (i = 0; i < count; i++)
+		fw_ptab_del(pt, keys[i]);
+
+	return 0;
+}
+
+/* Keep or register one peer of this node's slice, marking it seen */
+static fw_err_t
+fw_sync_peer(void *arg, const uint8_t *key, struct in_addr addr)
+{
+	struct fw_sync *sync = arg;
+	fw_ptab_t *pt = sync->ctx->peer_tab;
+	fw_pent_t *pe;
+	uint32_t id;
+
+	if ((pe = fw_ptab_find(pt, key)) != NULL) {
+		if (pe->addr.s_addr == addr.s_addr) {
+			pe->flags |= FW_PE_MARK;
+			return FW_OK;
+		}
+		if (fw_drop_peer(sync->ctx, pe) != FW_OK) {
+			sync->failed++;
+			return FW_OK;
+		}
+	}
+
+    /* The address may still be held by a peer this sync drops */
+	if (fw_ptab_add(pt, key, addr, &id) != FW_OK) {
+		sync->failed++;
+		return FW_OK;
+	}
+	pt->ents[id].flags |= FW_PE_MARK;
+
+	return FW_OK;
+}
+
+/*
+ * Cluster mode: once the DB changed, bring the table in line with the
+ * peers placed on this node, registering arrivals and dropping peers
+ * that moved away. Outside lazy mode arrivals are installed right away.
+ */
+static fw_err_t
+fw_sync_peers(fw_ctx_t *ctx)
+{
+	struct fw_sync sync = { ctx, 0 };
+	fw_ptab_t *pt = ctx->peer_tab;
+	fw_pent_t *pe;
+	uint32_t ids[FW_EVICT_BATCH];
+	uint64_t gen;
+	fw_err_t ret;
+	size_t i, n;
+
+	if ((ret = fw_db_generation(ctx->db_conn, &gen)) != FW_OK)
+		return ret;
+	if (gen == ctx->peers_gen)
+		return FW_OK;
+
+	for (i = 0; i < pt->cap; i++)
+		pt->ents[i].flags &= ~FW_PE_MARK;
+	if ((ret = fw_db_load_peers(ctx->db_conn, ctx->config.node_name,
+	    fw_sync_peer, &sync)) != FW_OK)
+		return ret;
+
+    /* Peers that moved away leave the interface in batches */
+	n = 0;
+	for (i = 0; i < pt->cap; i++) {
+		pe = &pt->ents[i];
+		if ((pe->flags & (FW_PE_USED | FW_PE_MARK)) != FW_PE_USED)
+			continue;
+		if (!(pe->flags & FW_PE_RESIDENT)) {
+			fw_ptab_del(pt, pe->key);
+			continue;
+		}
+		ids[n++] = i;
+		if (n == FW_EVICT_BATCH) {
+			sync.failed += fw_drop_peers(ctx, ids, n);
+			n = 0;
+		}
+	}
+	if (n > 0)
+		sync.failed += fw_drop_peers(ctx, ids, n);
+	ctx->peer_count = pt->rcount;
+	ctx->peers_dirty = 1;
+
+	if (!ctx->config.lazy_peers && fw_install_peers(ctx) != FW_OK)
+		ret = FW_WG_ERR;
+
+    /* Anything left over is retried on the next poll */
+	if (ret == FW_OK && sync.failed == 0)
+		ctx->peers_gen = gen;
+
+	return ret;
+}
+
+/* Cluster mode: report in, rebalance if coordinating, sync our slice */
+static void
+fw_cluster_poll(fw_ctx_t *ctx)
+{
+	size_t moved;
+
+	if (fw_cluster_report(ctx) != FW_OK)
+		warnx("cluster: can't report node %s", ctx->config.node_name);
+
+	if (ctx->config.node_coordinator) {
+		if (fw_cluster_balance(ctx, &moved) != FW_OK)
+			warnx("cluster: rebalancing failed");
+		else if (moved > 0)
+			warnx("cluster: placed %zu users", moved);
+	}
+
+	if (fw_sync_peers(ctx) != FW_OK)
+		warnx("cluster: can't sync peers, retrying");
+}
+
+/*
+ * END peer management functions
+ */
@@ -0,0 +1,480 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * jobs.c - Periodic background jobs on a hashed timer wheel.
+ *
+ * Only the event loop thread touches the wheel: it fires due jobs from
+ * fw_sched_run(), runs loop jobs there and hands pool jobs to the
+ * workers through a queue. A job is never queued twice, so one stuck
+ * job holds up its own runs, not everyone else's.
+ *
+ * Each run is timed in CPU and wall clock time. A run over its CPU
+ * budget pushes the job's next run back in proportion, up to
+ * FW_SCHED_BACKOFF periods, which keeps its share of the CPU near
+ * budget / interval whatever the load.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <sodium.h>
+
+#include "jobs.h"
+#include "metrics.h"
+
+/* Label buffer for one job */
+#define SCHED_LABEL  80
+
+/* Monotonic clock in milliseconds */
+static uint64_t
+sched_clock(void)
+{
+	return fw_metric_now() / 1000000;
+}
+
+/* Tick containing the current time */
+static uint64_t
+sched_now(const fw_sched_t *s)
+{
+	return (sched_clock() - s->start) / FW_SCHED_TICK;
+}
+
+/* CPU time of the calling thread in nanoseconds */
+static uint64_t
+sched_cpu(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Bump a statistic; only the thread running the job writes it */
+static void
+sched_stat(uint64_t *v, uint64_t n)
+{
+	__atomic_store_n(v, *v + n, __ATOMIC_RELAXED);
+}
+
+/* Take a job off the wheel */
+static void
+sched_disarm(fw_job_t *j)
+{
+	if (j->prevp == NULL)
+		return;
+
+	if (j->next != NULL)
+		j->next->prevp = j->prevp;
+	*j->prevp = j->next;
+	j->next = NULL;
+	j->prevp = NULL;
+}
+
+/* Put a job on the wheel to fire on tick due, or the next if that passed */
+static void
+sched_arm(fw_sched_t *s, fw_job_t *j, uint64_t due)
+{
+	fw_job_t **slot;
+
+	sched_disarm(j);
+	if (due < s->tick)
+		due = s->tick;
+
+	j->due = due;
+	slot = &s->slots[due % FW_SCHED_SLOTS];
+	if ((j->next = *slot) != NULL)
+		j->next->prevp = &j->next;
+	j->prevp = slot;
+	*slot = j;
+}
+
+/*
+ * Arm a job one period from tick now: the interval, give or take the
+ * jitter, plus whatever it owes for overrunning its budget
+ */
+static void
+sched_rearm(fw_sched_t *s, fw_job_t *j, uint64_t now)
+{
+	uint64_t ms;
+
+	if (j->interval == 0) {
+		sched_disarm(j);
+		return;
+	}
+
+	ms = j->interval + __atomic_exchange_n(&j->penalty, 0,
+	    __ATOMIC_RELAXED);
+	if (j->jitter > 0 && j->jitter < UINT32_MAX / 2) {
+		ms += randombytes_uniform(2 * j->jitter + 1);
+		ms = ms > j->jitter ? ms - j->jitter : 0;
+	}
+
+	if (ms < FW_SCHED_TICK)
+		ms = FW_SCHED_TICK;
+
+	sched_arm(s, j, now + (ms + FW_SCHED_TICK - 1) / FW_SCHED_TICK);
+}
+
+/*
+ * Run a job once and account for it. Over budget, the next run is
+ * pushed back by the interval times the fraction it went over.
+ */
+static int
+sched_exec(fw_job_t *j)
+{
+	uint64_t t0, c0, cpu, wall;
+	double over;
+	int ret;
+
+	t0 = fw_metric_now();
+	c0 = sched_cpu();
+	ret = j->fn(j->arg, j->budget);
+	cpu = sched_cpu() - c0;
+	wall = fw_metric_now() - t0;
+
+	sched_stat(&j->stats.runs, 1);
+	sched_stat(&j->stats.cpu, cpu);
+	sched_stat(&j->stats.hist[fw_hist_bucket(wall)], 1);
+	sched_stat(&j->stats.hist_sum, wall);
+
+	if (j->budget > 0 && cpu > j->budget) {
+		sched_stat(&j->stats.overruns, 1);
+		over = (double)(cpu - j->budget) / j->budget;
+		if (over > FW_SCHED_BACKOFF)
+			over = FW_SCHED_BACKOFF;
+		__atomic_store_n(&j->penalty, (uint64_t)(j->interval * over),
+		    __ATOMIC_RELAXED);
+	}
+
+	return ret;
+}
+
+/* Worker thread: run pool jobs until told to stop or no longer wanted */
+static void *
+sched_worker(void *arg)
+{
+	struct fw_worker *w = arg;
+	fw_sched_t *s = w->sched;
+	fw_job_t *j;
+	int more;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while (!s->stop && w->id < s->want && s->queue == NULL)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->stop)
+			break;
+		if (w->id >= s->want) {
+			/* A run queued meanwhile may have woken us, not a keeper */
+			if (s->queue != NULL)
+				pthread_cond_signal(&s->cond);
+			break;
+		}
+
+		j = s->queue;
+		if ((s->queue = j->qnext) == NULL)
+			s->queuep = &s->queue;
+		pthread_mutex_unlock(&s->lock);
+
+		more = sched_exec(j);
+
+		pthread_mutex_lock(&s->lock);
+		if (more == FW_JOB_MORE) {
+			/* To the back, behind the jobs that waited on it */
+			j->qnext = NULL;
+			*s->queuep = j;
+			s->queuep = &j->qnext;
+		} else
+			__atomic_store_n(&j->busy, 0, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+/* Fire a job: re-arm it and queue a run unless one is outstanding */
+static void
+sched_fire(fw_sched_t *s, fw_job_t *j, uint64_t now)
+{
+	sched_rearm(s, j, now);
+
+	if (__atomic_load_n(&j->busy, __ATOMIC_ACQUIRE)) {
+		sched_stat(&j->stats.coalesced, 1);
+		return;
+	}
+	__atomic_store_n(&j->busy, 1, __ATOMIC_RELAXED);
+	j->qnext = NULL;
+
+	if (j->flags & FW_JOB_LOOP) {
+		*s->readyp = j;
+		s->readyp = &j->qnext;
+		return;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	*s->queuep = j;
+	s->queuep = &j->qnext;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Start the workers of an empty scheduler */
+fw_err_t
+fw_sched_init(fw_sched_t *s, size_t workers)
+{
+	memset(s, 0, sizeof(*s));
+	s->start = sched_clock();
+	s->readyp = &s->ready;
+	s->queuep = &s->queue;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+
+	if (fw_sched_workers(s, workers) != FW_OK) {
+		fw_sched_free(s);
+		return FW_ERR;
+	}
+
+	return FW_OK;
+}
+
+/*
+ * Run pool jobs on n workers (at most FW_SCHED_WORKERS_MAX). Workers
+ * dropped finish their current run first; on failure to start more,
+ * those that did start are kept.
+ */
+fw_err_t
+fw_sched_workers(fw_sched_t *s, size_t n)
+{
+	struct fw_worker *w;
+	sigset_t all, old;
+	int error = 0;
+
+	if (n > FW_SCHED_WORKERS_MAX)
+		n = FW_SCHED_WORKERS_MAX;
+
+	pthread_mutex_lock(&s->lock);
+	s->want = n;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	for (; s->nworkers > n; s->nworkers--)
+		pthread_join(s->workers[s->nworkers - 1].thread, NULL);
+
+	/* Signals are for the event loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (; s->nworkers < n; s->nworkers++) {
+		w = &s->workers[s->nworkers];
+		w->sched = s;
+		w->id = s->nworkers;
+		if ((error = pthread_create(&w->thread, NULL, sched_worker,
+		    w)) != 0)
+			break;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (error != 0) {
+		pthread_mutex_lock(&s->lock);
+		s->want = s->nworkers;
+		pthread_mutex_unlock(&s->lock);
+		errno = error;
+		return FW_ERR;
+	}
+
+	return FW_OK;
+}
+
+/* Stop the workers once their current run is done; queued runs drop */
+void
+fw_sched_free(fw_sched_t *s)
+{
+	size_t i;
+
+	pthread_mutex_lock(&s->lock);
+	s->stop = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	for (i = 0; i < s->nworkers; i++)
+		pthread_join(s->workers[i].thread, NULL);
+	s->nworkers = 0;
+
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+}
+
+/* Add a job, first run in delay milliseconds */
+void
+fw_sched_add(fw_sched_t *s, fw_job_t *j, uint64_t delay)
+{
+	fw_job_t **jp;
+
+	j->next = j->qnext = NULL;
+	j->prevp = NULL;
+	j->busy = 0;
+	j->penalty = 0;
+	memset(&j->stats, 0, sizeof(j->stats));
+
+	for (jp = &s->jobs; *jp != NULL; jp = &(*jp)->all)
+		;
+	j->all = NULL;
+	*jp = j;
+
+	if (j->interval > 0)
+		sched_arm(s, j, sched_now(s) +
+		    (delay + FW_SCHED_TICK - 1) / FW_SCHED_TICK);
+}
+
+/*
+ * Change a job's interval. An armed job keeps its next run; a job that
+ * was off runs one new interval from now.
+ */
+void
+fw_sched_interval(fw_sched_t *s, fw_job_t *j, uint64_t interval)
+{
+	int armed = j->prevp != NULL;
+
+	j->interval = interval;
+	if (interval == 0)
+		sched_disarm(j);
+	else if (!armed)
+		sched_rearm(s, j, sched_now(s));
+}
+
+/*
+ * Fire a job now, restarting its period; a loop job runs on the next
+ * fw_sched_run()
+ */
+void
+fw_sched_kick(fw_sched_t *s, fw_job_t *j)
+{
+	sched_fire(s, j, sched_now(s));
+}
+
+/*
+ * Event loop turn: fire the jobs now due, then give each loop job one
+ * run. Returns the milliseconds until the next job is due, 0 if a loop
+ * job has a backlog, or -1 if nothing is armed.
+ */
+int
+fw_sched_run(fw_sched_t *s)
+{
+	fw_job_t *j, *run, *best = NULL;
+	uint64_t now, n, i, ms;
+
+	/* A late turn looks at each slot once */
+	now = sched_now(s);
+	if (now >= s->tick) {
+		n = now - s->tick + 1;
+		if (n > FW_SCHED_SLOTS)
+			n = FW_SCHED_SLOTS;
+		for (i = 0; i < n; i++) {
+			j = s->slots[(s->tick + i) % FW_SCHED_SLOTS];
+			while (j != NULL) {
+				run = j;
+				j = j->next;
+				if (run->due <= now)
+					sched_fire(s, run, now);
+			}
+		}
+		s->tick = now + 1;
+	}
+
+	run = s->ready;
+	s->ready = NULL;
+	s->readyp = &s->ready;
+	while ((j = run) != NULL) {
+		run = j->qnext;
+		j->qnext = NULL;
+		if (sched_exec(j) == FW_JOB_MORE) {
+			*s->readyp = j;
+			s->readyp = &j->qnext;
+		} else
+			__atomic_store_n(&j->busy, 0, __ATOMIC_RELAXED);
+	}
+	if (s->ready != NULL)
+		return 0;
+
+	/* The first job found due in the first revolution is the next */
+	for (i = 0; i < FW_SCHED_SLOTS; i++) {
+		if (best != NULL && best->due <= s->tick + i)
+			break;
+		for (j = s->slots[(s->tick + i) % FW_SCHED_SLOTS]; j != NULL;
+		    j = j->next)
+			if (best == NULL || j->due < best->due)
+				best = j;
+	}
+	if (best == NULL)
+		return -1;
+
+	ms = best->due * FW_SCHED_TICK + s->start;
+	now = sched_clock();
+	return ms > now ? ms - now : 0;
+}
+
+/* Write per-job metrics in Prometheus text exposition format */
+fw_err_t
+fw_sched_write(const fw_sched_t *s, FILE *fp)
+{
+	static const struct {
+		const char *name;
+		const char *help;
+		size_t off;
+		int seconds;
+	} desc[] = {
+		{ "fwvpnd_job_coalesced_total",
+		    "Background job runs skipped while the last was busy",
+		    offsetof(struct fw_jstats, coalesced), 0 },
+		{ "fwvpnd_job_cpu_seconds_total",
+		    "CPU time spent in background jobs",
+		    offsetof(struct fw_jstats, cpu), 1 },
+		{ "fwvpnd_job_overruns_total",
+		    "Background job runs over their CPU budget",
+		    offsetof(struct fw_jstats, overruns), 0 },
+		{ "fwvpnd_job_runs_total",
+		    "Background job runs",
+		    offsetof(struct fw_jstats, runs), 0 },
+	};
+	char label[SCHED_LABEL];
+	uint64_t buckets[FW_HIST_BUCKETS], sum, v;
+	const fw_job_t *j;
+	size_t i, b;
+
+	for (i = 0; i < sizeof(desc) / sizeof(desc[0]); i++) {
+		fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n", desc[i].name,
+		    desc[i].help, desc[i].name);
+		for (j = s->jobs; j != NULL; j = j->all) {
+			v = __atomic_load_n((const uint64_t *)
+			    ((const char *)&j->stats + desc[i].off),
+			    __ATOMIC_RELAXED);
+			if (desc[i].seconds)
+				fprintf(fp, "%s{job=\"%s\"} %.9f\n",
+				    desc[i].name, j->name, v / 1e9);
+			else
+				fprintf(fp, "%s{job=\"%s\"} %llu\n",
+				    desc[i].name, j->name,
+				    (unsigned long long)v);
+		}
+	}
+
+	fprintf(fp, "# HELP fwvpnd_job_run_seconds Background job run time\n"
+	    "# TYPE fwvpnd_job_run_seconds histogram\n");
+	for (j = s->jobs; j != NULL; j = j->all) {
+		for (b = 0; b < FW_HIST_BUCKETS; b++)
+			buckets[b] = __atomic_load_n(&j->stats.hist[b],
+			    __ATOMIC_RELAXED);
+		sum = __atomic_load_n(&j->stats.hist_sum, __ATOMIC_RELAXED);
+		snprintf(label, sizeof(label), "job=\"%s\"", j->name);
+		fw_metrics_hist(fp, "fwvpnd_job_run_seconds", label, buckets,
+		    sum);
+	}
+
+	return ferror(fp) ? FW_ERR : FW_OK;
+}
@@ -0,0 +1,363 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Longest-prefix match over tunnel prefixes. A node stores the full
+ * (masked) prefix it stands for, so a walk compares whole bytes instead
+ * of testing one bit per level, and branches on the bit just past the
+ * node's prefix. Glue nodes are removed as soon as they would have fewer
+ * than two children, which keeps the trie at most 2n - 1 nodes.
+ */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lpm.h"
+
+/* Initial node count */
+#define LPM_INIT_CAP 64
+
+/* Bit i of key, most significant first */
+#define LPM_BIT(key, i) (((key)[(i) >> 3] >> (7 - ((i) & 7))) & 1)
+
+/* Prefix bits for af, or -1 if unsupported */
+static int
+lpm_bits(int af)
+{
+	switch (af) {
+	case AF_INET:
+		return 32;
+	case AF_INET6:
+		return 128;
+	default:
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+}
+
+/* Leading bits a and b share, up to max */
+static int
+lpm_common(const uint8_t *a, const uint8_t *b, int max)
+{
+	int i, n;
+	uint8_t x;
+
+	for (i = 0, n = 0; n < max; i++, n += 8) {
+		if ((x = a[i] ^ b[i]) != 0) {
+			n += __builtin_clz(x) - 24;
+			break;
+		}
+	}
+
+	return n < max ? n : max;
+}
+
+/* Copy the first plen bits of src into a zeroed 16-byte key */
+static void
+lpm_mask(uint8_t key[16], const uint8_t *src, int plen)
+{
+	int full = plen >> 3;
+
+	memset(key, 0, 16);
+	memcpy(key, src, full);
+	if (plen & 7)
+		key[full] = src[full] & (0xff << (8 - (plen & 7)));
+}
+
+/* Make sure n nodes can be taken without growing */
+static fw_err_t
+lpm_reserve(fw_lpm_t *lpm, int n)
+{
+	fw_lpm_node_t *nodes;
+	uint32_t id;
+	size_t cap, i;
+
+	for (id = lpm->freelist; id != 0 && n > 0; n--)
+		id = lpm->nodes[id - 1].child[0];
+	if (n == 0)
+		return FW_OK;
+
+	cap = lpm->cap ? lpm->cap * 2 : LPM_INIT_CAP;
+	if (cap > UINT32_MAX - 1) {
+		errno = ENOMEM;
+		return FW_ERR;
+	}
+
+	nodes = recallocarray(lpm->nodes, lpm->cap, cap, sizeof(*nodes));
+	if (nodes == NULL)
+		return FW_ERR;
+	lpm->nodes = nodes;
+
+	for (i = cap; i > lpm->cap; i--) {
+		nodes[i - 1].child[0] = lpm->freelist;
+		lpm->freelist = i;
+	}
+	lpm->cap = cap;
+
+	return FW_OK;
+}
+
+/* Take a reserved node; returns its id + 1 */
+static uint32_t
+lpm_node(fw_lpm_t *lpm, const uint8_t key[16], int plen, uint32_t value)
+{
+	fw_lpm_node_t *n;
+	uint32_t id;
+
+	id = lpm->freelist;
+	n = &lpm->nodes[id - 1];
+	lpm->freelist = n->child[0];
+
+	memcpy(n->key, key, sizeof(n->key));
+	n->child[0] = n->child[1] = 0;
+	n->value = value;
+	n->plen = plen;
+
+	return id;
+}
+
+/* Return node id + 1 to the free list */
+static void
+lpm_release(fw_lpm_t *lpm, uint32_t id)
+{
+	fw_lpm_node_t *n = &lpm->nodes[id - 1];
+
+	memset(n, 0, sizeof(*n));
+	n->child[0] = lpm->freelist;
+	lpm->freelist = id;
+}
+
+/* Initialize an empty index */
+fw_err_t
+fw_lpm_init(fw_lpm_t *lpm)
+{
+	memset(lpm, 0, sizeof(*lpm));
+	return lpm_reserve(lpm, 1);
+}
+
+/* Free index */
+void
+fw_lpm_free(fw_lpm_t *lpm)
+{
+	free(lpm->nodes);
+	memset(lpm, 0, sizeof(*lpm));
+}
+
+/* Store addr/plen -> value; fails with EEXIST if the prefix is stored */
+fw_err_t
+fw_lpm_insert(fw_lpm_t *lpm, int af, const void *addr, int plen,
+    uint32_t value)
+{
+	fw_lpm_node_t *n;
+	uint8_t key[16];
+	uint32_t *link, id, glue;
+	int bits, c;
+
+	if ((bits = lpm_bits(af)) < 0)
+		return FW_ERR;
+	if (plen < 0 || plen > bits || value == FW_LPM_NONE) {
+		errno = EINVAL;
+		return FW_ERR;
+	}
+
+	/* A split takes at most two nodes; take them before walking */
+	if (lpm_reserve(lpm, 2) != FW_OK)
+		return FW_ERR;
+
+	lpm_mask(key, addr, plen);
+	link = &lpm->root[af == AF_INET6];
+
+	while (*link != 0) {
+		n = &lpm->nodes[*link - 1];
+		c = lpm_common(n->key, key, MIN(n->plen, plen));
+
+		if (c == n->plen) {
+			if (c < plen) {
+				link = &n->child[LPM_BIT(key, c)];
+				continue;
+			}
+
+			/* Same prefix: fill in a glue node */
+			if (n->value != FW_LPM_NONE) {
+				errno = EEXIST;
+				return FW_ERR;
+			}
+			n->value = value;
+			lpm->count++;
+			return FW_OK;
+		}
+
+		/* The new prefix contains n: put it above n */
+		if (c == plen) {
+			id = lpm_node(lpm, key, plen, value);
+			lpm->nodes[id - 1].child[LPM_BIT(n->key, c)] = *link;
+			*link = id;
+			lpm->count++;
+			return FW_OK;
+		}
+
+		/* The prefixes part at bit c: join them under a glue node */
+		id = lpm_node(lpm, key, plen, value);
+		glue = lpm_node(lpm, key, c, FW_LPM_NONE);
+		lpm->nodes[glue - 1].child[LPM_BIT(key, c)] = id;
+		lpm->nodes[glue - 1].child[!LPM_BIT(key, c)] = *link;
+		*link = glue;
+		lpm->count++;
+		return FW_OK;
+	}
+
+	*link = lpm_node(lpm, key, plen, value);
+	lpm->count++;
+
+	return FW_OK;
+}
+
+/* Remove addr/plen; fails with ENOENT if the prefix isn't stored */
+fw_err_t
+fw_lpm_delete(fw_lpm_t *lpm, int af, const void *addr, int plen)
+{
+	fw_lpm_node_t *n, *p;
+	uint8_t key[16];
+	uint32_t *link, *plink, id;
+	int bits;
+
+	if ((bits = lpm_bits(af)) < 0)
+		return FW_ERR;
+	if (plen < 0 || plen > bits) {
+		errno = EINVAL;
+		return FW_ERR;
+	}
+
+	lpm_mask(key, addr, plen);
+	plink = NULL;
+	link = &lpm->root[af == AF_INET6];
+
+	while (*link != 0) {
+		n = &lpm->nodes[*link - 1];
+		if (n->plen > plen || lpm_common(n->key, key, n->plen) < n->plen)
+			break;
+		if (n->plen == plen)
+			break;
+		plink = link;
+		link = &n->child[LPM_BIT(key, n->plen)];
+	}
+
+	if (*link == 0 || (n = &lpm->nodes[*link - 1])->plen != plen ||
+	    n->value == FW_LPM_NONE ||
+	    lpm_common(n->key, key, plen) < plen) {
+		errno = ENOENT;
+		return FW_ERR;
+	}
+
+	n->value = FW_LPM_NONE;
+	lpm->count--;
+
+	/* Still a branch point: keep it as glue */
+	if (n->child[0] != 0 && n->child[1] != 0)
+		return FW_OK;
+
+	/* Splice out the node, then its parent if that leaves it one child */
+	id = *link;
+	*link = n->child[0] | n->child[1];
+	lpm_release(lpm, id);
+
+	if (*link != 0 || plink == NULL)
+		return FW_OK;
+
+	p = &lpm->nodes[*plink - 1];
+	if (p->value != FW_LPM_NONE)
+		return FW_OK;
+
+	id = *plink;
+	*plink = p->child[0] | p->child[1];
+	lpm_release(lpm, id);
+
+	return FW_OK;
+}
+
+/* Find the longest stored prefix containing addr */
+fw_err_t
+fw_lpm_lookup(const fw_lpm_t *lpm, int af, const void *addr,
+    uint32_t *valuep)
+{
+	const fw_lpm_node_t *n;
+	uint32_t id, best;
+	int bits;
+
+	if ((bits = lpm_bits(af)) < 0)
+		return FW_ERR;
+
+	best = FW_LPM_NONE;
+	for (id = lpm->root[af == AF_INET6]; id != 0;
+	    id = n->child[LPM_BIT((const uint8_t *)addr, n->plen)]) {
+		n = &lpm->nodes[id - 1];
+		if (lpm_common(n->key, addr, n->plen) < n->plen)
+			break;
+		if (n->value != FW_LPM_NONE)
+			best = n->value;
+		if (n->plen == bits)
+			break;
+	}
+
+	if (best == FW_LPM_NONE) {
+		errno = ENOENT;
+		return FW_ERR;
+	}
+
+	*valuep = best;
+	return FW_OK;
+}
+
+/*
+ * Check addr/plen against the stored prefixes. If one contains it, or
+ * lies inside it, store that prefix's value and return FW_OK; otherwise
+ * fail with ENOENT.
+ */
+fw_err_t
+fw_lpm_overlap(const fw_lpm_t *lpm, int af, const void *addr, int plen,
+    uint32_t *valuep)
+{
+	const fw_lpm_node_t *n;
+	uint8_t key[16];
+	uint32_t id;
+	int bits;
+
+	if ((bits = lpm_bits(af)) < 0)
+		return FW_ERR;
+	if (plen < 0 || plen > bits) {
+		errno = EINVAL;
+		return FW_ERR;
+	}
+
+	lpm_mask(key, addr, plen);
+	for (id = lpm->root[af == AF_INET6]; id != 0;
+	    id = n->child[LPM_BIT(key, n->plen)]) {
+		n = &lpm->nodes[id - 1];
+		if (lpm_common(n->key, key, MIN(n->plen, plen)) <
+		    MIN(n->plen, plen))
+			break;
+
+		if (n->plen < plen) {
+			if (n->value == FW_LPM_NONE)
+				continue;
+			*valuep = n->value;
+			return FW_OK;
+		}
+
+		/* n lies inside the query; glue always leads to a prefix */
+		while (n->value == FW_LPM_NONE)
+			n = &lpm->nodes[n->child[0] - 1];
+		*valuep = n->value;
+		return FW_OK;
+	}
+
+	errno = ENOENT;
+	return FW_ERR;
+}
@@ -5,41 +5,67 @@
  */
 
 #include <err.h>
+#include <grp.h>
+#include <pwd.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "backup.h"
+#include "conf.h"
 #include "fwvpnd.h"
 
-/* Global fwvpnd (daemon) context */
-static fw_ctx_t g_fw_ctx;
-/* Default configuration */
-static fw_cfg_t g_fw_cfg = {
-	.db_path     = "/var/fwvpn/db/vpn.db",
-	.listen_addr = "127.0.0.1",
-	.listen_port = 8080,
-	.server_addr = "10.0.0.1",
-	.vpn_subnet  = "10.0.0.0/24",
-	.wg_if       = "wg0",
-};
+/* Loaded configuration */
+static fw_cfg_t g_fw_cfg;
+
+/* Become user, once only the privileged process needs root */
+static void
+drop_privs(const char *user)
+{
+	struct passwd *pw;
+
+	if ((pw = getpwnam(user)) == NULL)
+		errx(1, "unknown user %s", user);
+	if (setgroups(1, &pw->pw_gid) == -1 ||
+	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) == -1 ||
+	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid) == -1)
+		err(1, "can't drop privileges to %s", user);
+}
 
 static void
 usage(int exitcode)
 {
-	fprintf(exitcode > 0 ? stderr : stdout, "usage: fwvpnd [-h]\n");
+	fprintf(exitcode > 0 ? stderr : stdout,
+	    "usage: fwvpnd [-hk] [-f file] [-r standby]\n");
 	exit(exitcode);
 }
 
 int
 main(int argc, char *argv[])
 {
-	int ch;
+	struct sigaction sa;
+	const char *conf_path = NULL, *standby = NULL;
+	uint64_t gens;
+	int ch, handover = 0;
 
 	/* Parse argv */
-	while ((ch = getopt(argc, argv, "h")) != -1) {
+	while ((ch = getopt(argc, argv, "f:hkr:")) != -1) {
 		switch (ch) {
+		case 'f':
+			conf_path = optarg;
+			break;
 		case 'h':
 			usage(0);
+		case 'k':
+			/* Keep interface up for the next fwvpnd */
+			handover = 1;
+			break;
+		case 'r':
+			/* Rebuild db_path from a WAL standby, then exit */
+			standby = optarg;
+			break;
 		default:
 			usage(1);
 		}
@@ -48,20 +74,70 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	/* OpenBSD pledge(2) */
-	if (pledge("stdio dns inet rpath wpath", NULL) == -1)
-		err(1, "pledge");
+	/* Fall back to the default configuration file if there is one */
+	if (conf_path == NULL && access(FW_CONF_PATH, F_OK) == 0)
+		conf_path = FW_CONF_PATH;
+
+	if (fw_conf_load(conf_path, &g_fw_cfg) != FW_OK)
+		errx(1, "fw_conf_load: failed to load configuration");
+	if (handover)
+		g_fw_cfg.keep_iface = 1;
+
+	if (standby != NULL) {
+		if (fw_ws_restore(standby, g_fw_cfg.db_path, &gens) != FW_OK)
+			err(1, "can't restore %s from %s", g_fw_cfg.db_path,
+			    standby);
+		printf("%s: restored, %llu WAL generations applied\n",
+		    g_fw_cfg.db_path, (unsigned long long)gens);
+		fw_conf_free(&g_fw_cfg);
+		return 0;
+	}
+
+	/*
+	 * SIGHUP reloads the configuration, SIGUSR1 dumps trace rings and
+	 * SIGINT/SIGTERM stop fwvpnd
+	 */
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = fw_signal;
+	if (sigaction(SIGHUP, &sa, NULL) == -1 ||
+	    sigaction(SIGINT, &sa, NULL) == -1 ||
+	    sigaction(SIGTERM, &sa, NULL) == -1 ||
+	    sigaction(SIGUSR1, &sa, NULL) == -1)
+		err(1, "sigaction");
 
-	/* Initialize server */
+	/* Write errors on closed API clients and a dead privileged process */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Initialize server; with privsep this forks the privileged process */
 	if (fw_init(&g_fw_cfg) != FW_OK)
 		err(1, "fw_init: failed to initialize server");
 
+	/*
+	 * OpenBSD pledge(2), after the fork so it binds only this process.
+	 * Keep "getpw id" until privileges are dropped below.
+	 */
+	if (pledge("stdio dns inet unix rpath wpath cpath flock getpw id",
+	    NULL) == -1)
+		err(1, "pledge");
+
 	/* Start server */
 	if (fw_start() != FW_OK)
 		err(1, "fw_start: failed to start server");
 
+	/* Sockets are bound; serve clients without root */
+	if (g_fw_cfg.privsep && g_fw_cfg.user != NULL)
+		drop_privs(g_fw_cfg.user);
+	if (pledge("stdio dns inet unix rpath wpath cpath flock", NULL) == -1)
+		err(1, "pledge");
+
+	/* Poll peers until stopped */
+	if (fw_run() != FW_OK)
+		warn("fw_run");
+
 	/* Cleanup on exit */
 	fw_cleanup();
+	fw_conf_free(&g_fw_cfg);
 
 	return 0;
 }
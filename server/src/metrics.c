@@ -0,0 +1,222 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+
+/* Exported histogram range, in buckets: upper bounds 1us .. ~34s */
+#define HIST_FIRST  35
+#define HIST_LAST   139
+
+/* Current thread's metric block */
+__thread struct fw_mthread *fw_mtls = NULL;
+
+/* Every thread's metric block; blocks are never freed */
+static struct fw_mthread *g_mthreads = NULL;
+
+/* Gauges, set by whoever owns the value */
+static uint64_t g_gauges[FW_G_MAX];
+
+/* Prometheus names and help text */
+static const struct {
+	const char *name;
+	const char *help;
+} counter_desc[FW_C_MAX] = {
+	[FW_C_API_ERRORS] = { "fwvpnd_api_errors_total",
+	    "API requests answered with an error" },
+	[FW_C_API_LIMITED] = { "fwvpnd_api_rate_limited_total",
+	    "Signup and login attempts refused by the rate limiter" },
+	[FW_C_API_OVERFLOW] = { "fwvpnd_api_overflow_total",
+	    "API connections refused while every slot was taken" },
+	[FW_C_API_REQUESTS] = { "fwvpnd_api_requests_total",
+	    "API requests served" },
+	[FW_C_API_SHED] = { "fwvpnd_api_shed_total",
+	    "API requests refused by admission control" },
+	[FW_C_BACKUPS] = { "fwvpnd_backups_total",
+	    "Online database backups completed" },
+	[FW_C_CFG_HITS] = { "fwvpnd_config_cache_hits_total",
+	    "Client configs served from the cache" },
+	[FW_C_CFG_MISSES] = { "fwvpnd_config_cache_misses_total",
+	    "Client configs rendered" },
+	[FW_C_CLUSTER_MOVES] = { "fwvpnd_cluster_moves_total",
+	    "Users placed or moved by the cluster coordinator" },
+	[FW_C_CTL_ERRORS] = { "fwvpnd_ctl_errors_total",
+	    "Control requests that failed" },
+	[FW_C_CTL_REQUESTS] = { "fwvpnd_ctl_requests_total",
+	    "Control requests served" },
+	[FW_C_DB_ERRORS] = { "fwvpnd_db_errors_total",
+	    "SQLite calls that failed" },
+	[FW_C_DP_DROPS] = { "fwvpnd_dataplane_drops_total",
+	    "Packets the userspace data plane dropped" },
+	[FW_C_DP_HANDSHAKES] = { "fwvpnd_dataplane_handshakes_total",
+	    "Handshakes completed by the userspace data plane" },
+	[FW_C_DP_RX] = { "fwvpnd_dataplane_rx_packets_total",
+	    "Packets decrypted and written to the tunnel device" },
+	[FW_C_DP_TX] = { "fwvpnd_dataplane_tx_packets_total",
+	    "Encrypted datagrams sent to peers" },
+	[FW_C_PEER_ACTIVATIONS] = { "fwvpnd_peer_activations_total",
+	    "Peers installed on the interface" },
+	[FW_C_PEER_EVICTIONS] = { "fwvpnd_peer_evictions_total",
+	    "Peers evicted from the interface" },
+	[FW_C_WAL_BYTES] = { "fwvpnd_wal_shipped_bytes_total",
+	    "WAL bytes shipped to the standby directory" },
+	[FW_C_WB_FLUSHES] = { "fwvpnd_writeback_flushes_total",
+	    "Write-back transactions committed" },
+	[FW_C_WB_ROWS] = { "fwvpnd_writeback_rows_total",
+	    "Login and handshake times written back" },
+	[FW_C_WG_ERRORS] = { "fwvpnd_wg_errors_total",
+	    "wg(4) ioctls that failed" },
+}, gauge_desc[FW_G_MAX] = {
+	[FW_G_ADMIT_LIMIT] = { "fwvpnd_admit_limit",
+	    "Signups and logins admitted per event loop turn" },
+	[FW_G_API_CONNS] = { "fwvpnd_api_connections",
+	    "Open API connections" },
+	[FW_G_API_QUEUE] = { "fwvpnd_api_queue_depth",
+	    "API connections with input in the last event loop turn" },
+	[FW_G_PEERS] = { "fwvpnd_peers",
+	    "Registered peers" },
+	[FW_G_RESIDENT] = { "fwvpnd_peers_resident",
+	    "Peers installed on the interface" },
+	[FW_G_WB_DIRTY] = { "fwvpnd_writeback_pending",
+	    "Login and handshake times waiting to be written back" },
+}, hist_desc[FW_H_MAX] = {
+	[FW_H_API] = { "fwvpnd_api_request_seconds",
+	    "API request latency" },
+	[FW_H_API_QUEUE] = { "fwvpnd_api_queue_seconds",
+	    "Time API requests waited behind others in their turn" },
+	[FW_H_BACKUP] = { "fwvpnd_backup_step_seconds",
+	    "Online backup step latency" },
+	[FW_H_CTL] = { "fwvpnd_ctl_request_seconds",
+	    "Control request latency" },
+	[FW_H_DB] = { "fwvpnd_db_step_seconds",
+	    "SQLite statement step latency" },
+	[FW_H_PWHASH] = { "fwvpnd_password_hash_seconds",
+	    "Password hashing and verification latency" },
+	[FW_H_WB_FLUSH] = { "fwvpnd_writeback_flush_seconds",
+	    "Write-back transaction latency" },
+	[FW_H_WG_GET] = { "fwvpnd_wg_get_seconds",
+	    "SIOCGWG ioctl latency" },
+	[FW_H_WG_SET] = { "fwvpnd_wg_set_seconds",
+	    "SIOCSWG ioctl latency" },
+};
+
+/* Allocate and publish the calling thread's metric block */
+struct fw_mthread *
+fw_mthread_register(void)
+{
+	struct fw_mthread *t;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		err(1, "fw_mthread_register");
+
+	t->next = __atomic_load_n(&g_mthreads, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&g_mthreads, &t->next, t, 1,
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	fw_mtls = t;
+
+	return t;
+}
+
+/* Set a gauge */
+void
+fw_metric_set(enum fw_gauge g, uint64_t v)
+{
+	__atomic_store_n(&g_gauges[g], v, __ATOMIC_RELAXED);
+}
+
+/* Exclusive upper bound of a histogram bucket, in nanoseconds */
+static uint64_t
+hist_bound(unsigned int b)
+{
+	unsigned int e;
+
+	if (b < FW_HIST_SUB)
+		return b + 1;
+
+	e = b / FW_HIST_SUB + 1;
+	return (uint64_t)(FW_HIST_SUB + 1 + b % FW_HIST_SUB) << (e - 2);
+}
+
+/*
+ * Write the series of one histogram in nanoseconds; labels are extra
+ * Prometheus label pairs, or ""
+ */
+void
+fw_metrics_hist(FILE *fp, const char *name, const char *labels,
+    const uint64_t buckets[FW_HIST_BUCKETS], uint64_t sum)
+{
+	const char *sep = *labels != '\0' ? "," : "";
+	uint64_t cum;
+	unsigned int b;
+
+	/* Fixed bucket set, so every scrape has the same series */
+	for (b = 0, cum = 0; b < FW_HIST_BUCKETS; b++) {
+		cum += buckets[b];
+		if (b >= HIST_FIRST && b <= HIST_LAST)
+			fprintf(fp, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name,
+			    labels, sep, hist_bound(b) / 1e9,
+			    (unsigned long long)cum);
+	}
+	fprintf(fp, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+	    (unsigned long long)cum);
+	if (*labels != '\0')
+		fprintf(fp, "%s_sum{%s} %.9f\n%s_count{%s} %llu\n", name,
+		    labels, sum / 1e9, name, labels, (unsigned long long)cum);
+	else
+		fprintf(fp, "%s_sum %.9f\n%s_count %llu\n", name, sum / 1e9,
+		    name, (unsigned long long)cum);
+}
+
+/* Sum a value over every thread */
+#define MTHREAD_SUM(sum, field) do {					\
+	struct fw_mthread *t_;						\
+	(sum) = 0;							\
+	for (t_ = __atomic_load_n(&g_mthreads, __ATOMIC_ACQUIRE);	\
+	    t_ != NULL; t_ = t_->next)					\
+		(sum) += __atomic_load_n(&t_->field, __ATOMIC_RELAXED);	\
+} while (0)
+
+/* Write every metric in Prometheus text exposition format */
+fw_err_t
+fw_metrics_write(FILE *fp)
+{
+	uint64_t buckets[FW_HIST_BUCKETS];
+	uint64_t v, sum;
+	unsigned int i, b;
+
+	for (i = 0; i < FW_C_MAX; i++) {
+		MTHREAD_SUM(v, counters[i]);
+		fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+		    counter_desc[i].name, counter_desc[i].help,
+		    counter_desc[i].name, counter_desc[i].name,
+		    (unsigned long long)v);
+	}
+
+	for (i = 0; i < FW_G_MAX; i++) {
+		v = __atomic_load_n(&g_gauges[i], __ATOMIC_RELAXED);
+		fprintf(fp, "# HELP %s %s\n# TYPE %s gauge\n%s %llu\n",
+		    gauge_desc[i].name, gauge_desc[i].help,
+		    gauge_desc[i].name, gauge_desc[i].name,
+		    (unsigned long long)v);
+	}
+
+	for (i = 0; i < FW_H_MAX; i++) {
+		for (b = 0; b < FW_HIST_BUCKETS; b++)
+			MTHREAD_SUM(buckets[b], hist[i][b]);
+		MTHREAD_SUM(sum, hist_sum[i]);
+
+		fprintf(fp, "# HELP %s %s\n# TYPE %s histogram\n",
+		    hist_desc[i].name, hist_desc[i].help, hist_desc[i].name);
+		fw_metrics_hist(fp, hist_desc[i].name, "", buckets, sum);
+	}
+
+	return ferror(fp) ? FW_ERR : FW_OK;
+}
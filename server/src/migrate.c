@@ -0,0 +1,701 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Online migration from the v1 schema (TEXT keys everywhere) to the
+ * current one (see db.c). The new tables are built beside the old ones
+ * as <name>_v2 while older fwvpnd processes keep reading and writing
+ * the old ones:
+ *
+ *  1. One transaction creates the v2 tables, a change log and triggers
+ *     on every v1 table that log the user ID or public key a write
+ *     touched. The triggers are plain SQL, so older processes run them.
+ *  2. Each v1 table is copied in rowid ranges of one batch per
+ *     transaction, converting text to BLOBs and integers with functions
+ *     registered on this connection only. A user's uid is its v1 rowid.
+ *  3. Logged keys are replayed a batch at a time: every v2 row of the
+ *     user (or handshake of the key) is dropped and copied again.
+ *  4. Once the log is down to one batch, a last transaction replays it,
+ *     checks the row counts, drops the v1 tables, renames the v2 ones
+ *     into place and completes the schema.
+ *
+ * No transaction holds the write lock for longer than one batch, except
+ * the last one, which also drops the old tables. Older processes fail
+ * their queries from then on and must be upgraded.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sodium.h>
+
+#include "base64.h"
+#include "db.h"
+#include "migrate.h"
+
+/* Longest BLOB fw_unhex() decodes: a session token */
+#define MIG_HEX_MAX  32
+
+/* Logged key kinds */
+#define MIG_USER     0   /* v1 users.id            */
+#define MIG_KEY      1   /* Base64 public key      */
+
+/* v1 tables, each copied into <name>_v2 */
+static const struct mig_table {
+	const char *name;
+	const char *alias;      /* Of name in from                   */
+	const char *key;        /* Logged key column                 */
+	int kind;               /* Its MIG_* kind                    */
+	const char *into;       /* v2 table and columns              */
+	const char *select;     /* v2 row from from                  */
+	const char *from;       /* v1 rows, with uid as u.rowid      */
+	const char *where;      /* v1 rows that have a v2 form       */
+} mig_tables[] = {
+	{ "users", "u", "id", MIG_USER,
+	    "users_v2 (uid, id, email, password, created_at, last_login)",
+	    "u.rowid, fw_unhex(u.id), u.email, u.password, u.created_at, "
+	    "u.last_login",
+	    "users u", "1" },
+	{ "vpn_configs", "c", "user_id", MIG_USER,
+	    "vpn_configs_v2 "
+	    "(uid, assigned_ip, created_at, private_key, public_key)",
+	    "u.rowid, fw_inet(c.assigned_ip), c.created_at, "
+	    "fw_unb64(c.private_key), fw_unb64(c.public_key)",
+	    "vpn_configs c JOIN users u ON u.id = c.user_id", "1" },
+	{ "vpn_config_versions", "v", "user_id", MIG_USER,
+	    "vpn_config_versions_v2 (uid, version)",
+	    "u.rowid, v.version",
+	    "vpn_config_versions v JOIN users u ON u.id = v.user_id", "1" },
+	{ "placements", "p", "user_id", MIG_USER,
+	    "placements_v2 (uid, node)",
+	    "u.rowid, p.node",
+	    "placements p JOIN users u ON u.id = p.user_id", "1" },
+	{ "sessions", "s", "user_id", MIG_USER,
+	    "sessions_v2 (token, uid, expires_at)",
+	    "fw_unhex(s.token), u.rowid, s.expires_at",
+	    "sessions s JOIN users u ON u.id = s.user_id",
+	    "length(fw_unhex(s.token)) = 32" },
+	{ "peer_handshakes", "h", "public_key", MIG_KEY,
+	    "peer_handshakes_v2 (public_key, last_handshake)",
+	    "fw_unb64(h.public_key), h.last_handshake",
+	    "peer_handshakes h", "fw_unb64(h.public_key) IS NOT NULL" },
+};
+
+#define MIG_TABLES  (sizeof(mig_tables) / sizeof(mig_tables[0]))
+
+/*
+ * v1 tables added after the first release, so a database from then lacks
+ * them. Created empty before the copy so every table above exists.
+ */
+static const char *mig_v1_sql =
+    "CREATE TABLE IF NOT EXISTS peer_handshakes ("
+    "	public_key TEXT PRIMARY KEY,"
+    "	last_handshake INTEGER NOT NULL"
+    ");"
+    "CREATE TABLE IF NOT EXISTS server_keys ("
+    "	id INTEGER PRIMARY KEY CHECK (id = 1),"
+    "	private_key TEXT NOT NULL"
+    ");"
+    "CREATE TABLE IF NOT EXISTS vpn_config_versions ("
+    "	user_id TEXT PRIMARY KEY,"
+    "	version INTEGER NOT NULL"
+    ");"
+    "CREATE TABLE IF NOT EXISTS placements ("
+    "	user_id TEXT PRIMARY KEY,"
+    "	node TEXT NOT NULL,"
+    "	FOREIGN KEY(user_id) REFERENCES users(id)"
+    ");";
+
+/* The current schema's tables, under their _v2 names */
+static const char *mig_create_sql =
+    "CREATE TABLE IF NOT EXISTS users_v2 ("
+    "	uid INTEGER PRIMARY KEY,"
+    "	id BLOB NOT NULL UNIQUE CHECK (length(id) = 16),"
+    "	email TEXT UNIQUE,"
+    "	password TEXT NOT NULL,"
+    "	created_at INTEGER,"
+    "	last_login INTEGER"
+    ");"
+    "CREATE TABLE IF NOT EXISTS vpn_configs_v2 ("
+    "	uid INTEGER PRIMARY KEY REFERENCES users_v2 (uid),"
+    "	assigned_ip INTEGER UNIQUE,"
+    "	created_at INTEGER,"
+    "	private_key BLOB CHECK (length(private_key) = 32),"
+    "	public_key BLOB UNIQUE CHECK (length(public_key) = 32)"
+    ");"
+    "CREATE TABLE IF NOT EXISTS sessions_v2 ("
+    "	token BLOB PRIMARY KEY CHECK (length(token) = 32),"
+    "	uid INTEGER NOT NULL REFERENCES users_v2 (uid),"
+    "	expires_at INTEGER"
+    ") WITHOUT ROWID;"
+    "CREATE INDEX IF NOT EXISTS sessions_by_uid ON sessions_v2 (uid);"
+    "CREATE TABLE IF NOT EXISTS peer_handshakes_v2 ("
+    "	public_key BLOB PRIMARY KEY,"
+    "	last_handshake INTEGER NOT NULL"
+    ") WITHOUT ROWID;"
+    "CREATE TABLE IF NOT EXISTS vpn_config_versions_v2 ("
+    "	uid INTEGER PRIMARY KEY,"
+    "	version INTEGER NOT NULL"
+    ");"
+    "CREATE TABLE IF NOT EXISTS placements_v2 ("
+    "	uid INTEGER PRIMARY KEY REFERENCES users_v2 (uid),"
+    "	node TEXT NOT NULL"
+    ");"
+    "CREATE INDEX IF NOT EXISTS placements_by_node ON placements_v2 (node);"
+    "CREATE TABLE IF NOT EXISTS fw_mig_log ("
+    "	kind INTEGER NOT NULL,"
+    "	key TEXT NOT NULL,"
+    "	PRIMARY KEY (kind, key)"
+    ") WITHOUT ROWID;";
+
+/* Per-connection scratch for replays */
+static const char *mig_temp_sql =
+    "CREATE TEMP TABLE IF NOT EXISTS mig_keys ("
+    "	kind INTEGER, key TEXT, PRIMARY KEY (kind, key));"
+    "CREATE TEMP TABLE IF NOT EXISTS mig_uids (uid INTEGER PRIMARY KEY);";
+
+/* Drop the v2 rows of the users and keys in temp.mig_keys */
+static const char *mig_drop_sql =
+    "INSERT OR IGNORE INTO temp.mig_uids"
+    "	SELECT uid FROM users_v2 WHERE id IN"
+    "	(SELECT fw_unhex(key) FROM temp.mig_keys WHERE kind = 0)"
+    "	UNION ALL SELECT rowid FROM users WHERE id IN"
+    "	(SELECT key FROM temp.mig_keys WHERE kind = 0);"
+    "DELETE FROM sessions_v2 WHERE uid IN (SELECT uid FROM temp.mig_uids);"
+    "DELETE FROM placements_v2 WHERE uid IN (SELECT uid FROM temp.mig_uids);"
+    "DELETE FROM vpn_config_versions_v2"
+    "	WHERE uid IN (SELECT uid FROM temp.mig_uids);"
+    "DELETE FROM vpn_configs_v2 WHERE uid IN (SELECT uid FROM temp.mig_uids);"
+    "DELETE FROM users_v2 WHERE uid IN (SELECT uid FROM temp.mig_uids);"
+    "DELETE FROM peer_handshakes_v2 WHERE public_key IN"
+    "	(SELECT fw_unb64(key) FROM temp.mig_keys WHERE kind = 1);";
+
+/*
+ * Rows a user replaced by another with the same email took with it; the
+ * replay leaves them nothing to hang off
+ */
+static const char *mig_orphans_sql =
+    "DELETE FROM sessions_v2 WHERE uid NOT IN (SELECT uid FROM users_v2);"
+    "DELETE FROM placements_v2 WHERE uid NOT IN (SELECT uid FROM users_v2);"
+    "DELETE FROM vpn_config_versions_v2"
+    "	WHERE uid NOT IN (SELECT uid FROM users_v2);"
+    "DELETE FROM vpn_configs_v2 WHERE uid NOT IN (SELECT uid FROM users_v2);";
+
+/* Swap the tables over; the schema is completed by fw_db_init() */
+static const char *mig_swap_sql =
+    "CREATE TABLE server_keys_v2 ("
+    "	id INTEGER PRIMARY KEY CHECK (id = 1),"
+    "	private_key BLOB NOT NULL CHECK (length(private_key) = 32)"
+    ");"
+    "INSERT INTO server_keys_v2 (id, private_key)"
+    "	SELECT id, fw_unb64(private_key) FROM server_keys"
+    "	WHERE fw_unb64(private_key) IS NOT NULL;"
+    /* Refers to placements.user_id, and would fail the renames */
+    "DROP TRIGGER IF EXISTS nodes_moved;"
+    "DROP TABLE sessions;"
+    "DROP TABLE placements;"
+    "DROP TABLE vpn_config_versions;"
+    "DROP TABLE vpn_configs;"
+    "DROP TABLE peer_handshakes;"
+    "DROP TABLE server_keys;"
+    "DROP TABLE users;"
+    "DROP TABLE fw_mig_log;"
+    "ALTER TABLE users_v2 RENAME TO users;"
+    "ALTER TABLE vpn_configs_v2 RENAME TO vpn_configs;"
+    "ALTER TABLE sessions_v2 RENAME TO sessions;"
+    "ALTER TABLE peer_handshakes_v2 RENAME TO peer_handshakes;"
+    "ALTER TABLE server_keys_v2 RENAME TO server_keys;"
+    "ALTER TABLE vpn_config_versions_v2 RENAME TO vpn_config_versions;"
+    "ALTER TABLE placements_v2 RENAME TO placements;";
+
+/* Undo fw_mig_start(); the log triggers are dropped separately */
+static const char *mig_abort_sql =
+    "DROP TABLE IF EXISTS sessions_v2;"
+    "DROP TABLE IF EXISTS placements_v2;"
+    "DROP TABLE IF EXISTS vpn_config_versions_v2;"
+    "DROP TABLE IF EXISTS vpn_configs_v2;"
+    "DROP TABLE IF EXISTS peer_handshakes_v2;"
+    "DROP TABLE IF EXISTS users_v2;"
+    "DROP TABLE IF EXISTS fw_mig_log;";
+
+/* Run sql, warning on failure */
+static fw_err_t
+mig_exec(sqlite3 *db, const char *sql)
+{
+	char *err = NULL;
+
+	if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+		warnx("migration: %s", err);
+		sqlite3_free(err);
+		return FW_DB_ERR;
+	}
+
+	return FW_OK;
+}
+
+/* Run a query for one integer; missing or NULL reads as dflt */
+static fw_err_t
+mig_int(sqlite3 *db, const char *sql, int64_t arg, int64_t dflt,
+    int64_t *val)
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		warnx("migration: %s", sqlite3_errmsg(db));
+		return FW_DB_ERR;
+	}
+	if (sqlite3_bind_parameter_count(stmt) > 0)
+		sqlite3_bind_int64(stmt, 1, arg);
+
+	*val = dflt;
+	if ((rc = sqlite3_step(stmt)) == SQLITE_ROW &&
+	    sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+		*val = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		warnx("migration: %s", sqlite3_errmsg(db));
+		return FW_DB_ERR;
+	}
+
+	return FW_OK;
+}
+
+/* fw_unhex(text): its bytes, NULL unless well-formed */
+static void
+mig_unhex(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	const char *hex = (const char *)sqlite3_value_text(argv[0]);
+	uint8_t buf[MIG_HEX_MAX];
+	size_t n;
+
+	if (hex == NULL || sodium_hex2bin(buf, sizeof(buf), hex, strlen(hex),
+	    NULL, &n, NULL) != 0)
+		sqlite3_result_null(ctx);
+	else
+		sqlite3_result_blob(ctx, buf, n, SQLITE_TRANSIENT);
+}
+
+/* fw_unb64(text): the key it encodes, NULL unless WG_KEY_LEN bytes */
+static void
+mig_unb64(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	const char *b64 = (const char *)sqlite3_value_text(argv[0]);
+	uint8_t key[WG_KEY_LEN];
+
+	if (b64 == NULL || b64_pton(b64, key, sizeof(key)) != WG_KEY_LEN)
+		sqlite3_result_null(ctx);
+	else
+		sqlite3_result_blob(ctx, key, sizeof(key), SQLITE_TRANSIENT);
+}
+
+/* fw_inet(text): a dotted address (or /32 prefix) in host order */
+static void
+mig_inet(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	const char *s = (const char *)sqlite3_value_text(argv[0]);
+	struct in_addr addr;
+	char ip[MAX_IP_LEN];
+
+	if (s == NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	strlcpy(ip, s, sizeof(ip));
+	ip[strcspn(ip, "/")] = '\0';
+	if (inet_pton(AF_INET, ip, &addr) != 1)
+		sqlite3_result_null(ctx);
+	else
+		sqlite3_result_int64(ctx, ntohl(addr.s_addr));
+}
+
+/* Create or drop the change log triggers on every v1 table */
+static fw_err_t
+mig_triggers(sqlite3 *db, int create)
+{
+	const struct mig_table *t;
+	char sql[1024];
+	size_t i;
+
+	for (i = 0; i < MIG_TABLES; i++) {
+		t = &mig_tables[i];
+		if (create)
+			snprintf(sql, sizeof(sql),
+			    "CREATE TRIGGER IF NOT EXISTS fw_mig_%s_ins "
+			    "AFTER INSERT ON %s BEGIN "
+			    "INSERT OR IGNORE INTO fw_mig_log (kind, key) "
+			    "SELECT %d, NEW.%s WHERE NEW.%s IS NOT NULL; END;"
+			    "CREATE TRIGGER IF NOT EXISTS fw_mig_%s_upd "
+			    "AFTER UPDATE ON %s BEGIN "
+			    "INSERT OR IGNORE INTO fw_mig_log (kind, key) "
+			    "SELECT %d, OLD.%s WHERE OLD.%s IS NOT NULL; "
+			    "INSERT OR IGNORE INTO fw_mig_log (kind, key) "
+			    "SELECT %d, NEW.%s WHERE NEW.%s IS NOT NULL; END;"
+			    "CREATE TRIGGER IF NOT EXISTS fw_mig_%s_del "
+			    "AFTER DELETE ON %s BEGIN "
+			    "INSERT OR IGNORE INTO fw_mig_log (kind, key) "
+			    "SELECT %d, OLD.%s WHERE OLD.%s IS NOT NULL; END;",
+			    t->name, t->name, t->kind, t->key, t->key,
+			    t->name, t->name, t->kind, t->key, t->key,
+			    t->kind, t->key, t->key,
+			    t->name, t->name, t->kind, t->key, t->key);
+		else
+			snprintf(sql, sizeof(sql),
+			    "DROP TRIGGER IF EXISTS fw_mig_%s_ins;"
+			    "DROP TRIGGER IF EXISTS fw_mig_%s_upd;"
+			    "DROP TRIGGER IF EXISTS fw_mig_%s_del;",
+			    t->name, t->name, t->name);
+		if (mig_exec(db, sql) != FW_OK)
+			return FW_DB_ERR;
+	}
+
+	return FW_OK;
+}
+
+/* Start copying table i */
+static fw_err_t
+mig_table(fw_migrate_t *m, size_t i)
+{
+	char sql[128];
+
+	m->table = i;
+	if (i == MIG_TABLES) {
+		m->stage = FW_MIG_REPLAY;
+		return FW_OK;
+	}
+
+	snprintf(sql, sizeof(sql), "SELECT min(rowid) FROM %s",
+	    mig_tables[i].name);
+	if (mig_int(m->db, sql, 0, 1, &m->next) != FW_OK)
+		return FW_DB_ERR;
+	snprintf(sql, sizeof(sql), "SELECT max(rowid) FROM %s",
+	    mig_tables[i].name);
+	return mig_int(m->db, sql, 0, 0, &m->last);
+}
+
+/* Copy the v1 rows of table t matching cond, binding lo and hi */
+static fw_err_t
+mig_copy(fw_migrate_t *m, const struct mig_table *t, const char *cond,
+    int64_t lo, int64_t hi)
+{
+	sqlite3_stmt *stmt;
+	char sql[1024];
+	int rc;
+
+	snprintf(sql, sizeof(sql),
+	    "INSERT OR REPLACE INTO %s SELECT %s FROM %s WHERE %s AND %s",
+	    t->into, t->select, t->from, t->where, cond);
+	if (sqlite3_prepare_v2(m->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		warnx("migration: %s", sqlite3_errmsg(m->db));
+		return FW_DB_ERR;
+	}
+	if (sqlite3_bind_parameter_count(stmt) == 2) {
+		sqlite3_bind_int64(stmt, 1, lo);
+		sqlite3_bind_int64(stmt, 2, hi);
+	}
+	rc = sqlite3_step(stmt);
+	if (rc == SQLITE_DONE)
+		m->copied += sqlite3_changes(m->db);
+	sqlite3_finalize(stmt);
+
+	if (rc != SQLITE_DONE) {
+		warnx("migration: %s: %s", t->name, sqlite3_errmsg(m->db));
+		return FW_DB_ERR;
+	}
+
+	return FW_OK;
+}
+
+/* Copy the next batch of the current table */
+static fw_err_t
+mig_copy_step(fw_migrate_t *m)
+{
+	const struct mig_table *t = &mig_tables[m->table];
+	char sql[128], cond[64];
+	int64_t hi;
+
+	if (m->next > m->last)
+		return mig_table(m, m->table + 1);
+
+	/* The batch'th rowid from next on, or the end */
+	snprintf(sql, sizeof(sql), "SELECT rowid FROM %s WHERE rowid >= ? "
+	    "ORDER BY rowid LIMIT 1 OFFSET %zu", t->name, m->batch - 1);
+	if (mig_exec(m->db, "BEGIN IMMEDIATE") != FW_OK)
+		return FW_DB_ERR;
+	if (mig_int(m->db, sql, m->next, m->last, &hi) != FW_OK)
+		goto err;
+	if (hi > m->last)
+		hi = m->last;
+
+	snprintf(cond, sizeof(cond), "%s.rowid BETWEEN ?1 AND ?2", t->alias);
+	if (mig_copy(m, t, cond, m->next, hi) != FW_OK ||
+	    mig_exec(m->db, "COMMIT") != FW_OK)
+		goto err;
+	m->next = hi + 1;
+
+	return FW_OK;
+
+err:
+	sqlite3_exec(m->db, "ROLLBACK", NULL, NULL, NULL);
+	return FW_DB_ERR;
+}
+
+/* Replay up to max logged keys (all if negative), inside a transaction */
+static fw_err_t
+mig_replay(fw_migrate_t *m, int64_t max)
+{
+	const struct mig_table *t;
+	char sql[128], cond[128];
+	size_t i;
+
+	snprintf(sql, sizeof(sql), "INSERT INTO temp.mig_keys "
+	    "SELECT kind, key FROM fw_mig_log LIMIT %lld", (long long)max);
+	if (mig_exec(m->db, sql) != FW_OK)
+		return FW_DB_ERR;
+	m->replayed += sqlite3_changes(m->db);
+
+	if (mig_exec(m->db, "DELETE FROM fw_mig_log WHERE (kind, key) IN "
+	    "(SELECT kind, key FROM temp.mig_keys)") != FW_OK ||
+	    mig_exec(m->db, mig_drop_sql) != FW_OK)
+		return FW_DB_ERR;
+
+	for (i = 0; i < MIG_TABLES; i++) {
+		t = &mig_tables[i];
+		snprintf(cond, sizeof(cond), "%s.%s IN (SELECT key FROM "
+		    "temp.mig_keys WHERE kind = %d)", t->alias, t->key, t->kind);
+		if (mig_copy(m, t, cond, 0, 0) != FW_OK)
+			return FW_DB_ERR;
+	}
+
+	return mig_exec(m->db,
+	    "DELETE FROM temp.mig_keys; DELETE FROM temp.mig_uids");
+}
+
+/* Every v1 row with a v2 form must have made it across */
+static fw_err_t
+mig_verify(fw_migrate_t *m)
+{
+	const struct mig_table *t;
+	int64_t v1, v2;
+	char sql[512];
+	size_t i;
+
+	for (i = 0; i < MIG_TABLES; i++) {
+		t = &mig_tables[i];
+		snprintf(sql, sizeof(sql), "SELECT count(*) FROM %s WHERE %s",
+		    t->from, t->where);
+		if (mig_int(m->db, sql, 0, 0, &v1) != FW_OK)
+			return FW_DB_ERR;
+		snprintf(sql, sizeof(sql), "SELECT count(*) FROM %s_v2",
+		    t->name);
+		if (mig_int(m->db, sql, 0, 0, &v2) != FW_OK)
+			return FW_DB_ERR;
+		if (v1 != v2) {
+			warnx("migration: %s has %lld rows, copied %lld",
+			    t->name, (long long)v1, (long long)v2);
+			return FW_DB_ERR;
+		}
+	}
+
+	return FW_OK;
+}
+
+/* Replay the rest of the log and swap the tables over */
+static fw_err_t
+mig_cutover(fw_migrate_t *m)
+{
+	int64_t bad;
+
+	if (mig_exec(m->db, "BEGIN IMMEDIATE") != FW_OK)
+		return FW_DB_ERR;
+
+	if (mig_replay(m, -1) != FW_OK ||
+	    mig_exec(m->db, mig_orphans_sql) != FW_OK ||
+	    mig_verify(m) != FW_OK ||
+	    mig_exec(m->db, mig_swap_sql) != FW_OK ||
+	    fw_db_init(m->db) != FW_OK ||
+	    mig_int(m->db, "SELECT count(*) FROM pragma_foreign_key_check",
+	    0, 0, &bad) != FW_OK)
+		goto err;
+	if (bad != 0) {
+		warnx("migration: %lld foreign key violations", (long long)bad);
+		goto err;
+	}
+	if (mig_exec(m->db, "COMMIT") != FW_OK)
+		goto err;
+
+	m->stage = FW_MIG_DONE;
+	mig_exec(m->db, "DROP TABLE IF EXISTS temp.mig_keys;"
+	    "DROP TABLE IF EXISTS temp.mig_uids;"
+	    "PRAGMA foreign_keys = ON");
+
+	return FW_OK;
+
+err:
+	sqlite3_exec(m->db, "ROLLBACK", NULL, NULL, NULL);
+	return FW_DB_ERR;
+}
+
+/*
+ * Schema version of db: its user_version, but 1 for a v1 database (which
+ * never set one) and 0 for an empty one
+ */
+fw_err_t
+fw_mig_version(sqlite3 *db, int *version)
+{
+	int64_t v, tables;
+
+	if (mig_int(db, "PRAGMA user_version", 0, 0, &v) != FW_OK ||
+	    mig_int(db, "SELECT count(*) FROM sqlite_master "
+	    "WHERE type = 'table' AND name = 'users'", 0, 0, &tables) != FW_OK)
+		return FW_DB_ERR;
+
+	*version = v == 0 && tables > 0 ? 1 : v;
+
+	return FW_OK;
+}
+
+/*
+ * Start (or resume) migrating db in transactions of batch rows. Fails
+ * with EALREADY if there is nothing to migrate.
+ */
+fw_err_t
+fw_mig_start(fw_migrate_t *m, sqlite3 *db, size_t batch)
+{
+	int version;
+
+	memset(m, 0, sizeof(*m));
+	m->db = db;
+	m->batch = batch > 0 ? batch : FW_MIG_BATCH;
+
+	if (fw_mig_version(db, &version) != FW_OK)
+		return FW_DB_ERR;
+	if (version != 1) {
+		errno = EALREADY;
+		return FW_ERR;
+	}
+
+	if (sqlite3_create_function(db, "fw_unhex", 1,
+	    SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, mig_unhex, NULL, NULL) !=
+	    SQLITE_OK ||
+	    sqlite3_create_function(db, "fw_unb64", 1,
+	    SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, mig_unb64, NULL, NULL) !=
+	    SQLITE_OK ||
+	    sqlite3_create_function(db, "fw_inet", 1,
+	    SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, mig_inet, NULL, NULL) !=
+	    SQLITE_OK) {
+		warnx("migration: %s", sqlite3_errmsg(db));
+		return FW_DB_ERR;
+	}
+
+	/* Rows land before their users do; fw_mig_step() checks at the end */
+	if (mig_exec(db, "PRAGMA foreign_keys = OFF") != FW_OK)
+		return FW_DB_ERR;
+	if (mig_exec(db, mig_temp_sql) != FW_OK ||
+	    mig_exec(db, "BEGIN IMMEDIATE") != FW_OK)
+		goto err;
+	if (mig_exec(db, mig_v1_sql) != FW_OK ||
+	    mig_exec(db, mig_create_sql) != FW_OK ||
+	    mig_triggers(db, 1) != FW_OK ||
+	    mig_exec(db, "COMMIT") != FW_OK) {
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		goto err;
+	}
+
+	return mig_table(m, 0);
+
+err:
+	mig_exec(db, "DROP TABLE IF EXISTS temp.mig_keys;"
+	    "DROP TABLE IF EXISTS temp.mig_uids;"
+	    "PRAGMA foreign_keys = ON");
+	return FW_DB_ERR;
+}
+
+/*
+ * Run one transaction of the migration: a batch of the copy or of the
+ * replay, or the cutover once the replay has caught up
+ */
+fw_err_t
+fw_mig_step(fw_migrate_t *m)
+{
+	int64_t logged;
+
+	switch (m->stage) {
+	case FW_MIG_COPY:
+		return mig_copy_step(m);
+	case FW_MIG_REPLAY:
+		if (mig_int(m->db, "SELECT count(*) FROM fw_mig_log", 0, 0,
+		    &logged) != FW_OK)
+			return FW_DB_ERR;
+		if (logged <= (int64_t)m->batch)
+			return mig_cutover(m);
+		if (mig_exec(m->db, "BEGIN IMMEDIATE") != FW_OK)
+			return FW_DB_ERR;
+		if (mig_replay(m, m->batch) != FW_OK ||
+		    mig_exec(m->db, "COMMIT") != FW_OK) {
+			sqlite3_exec(m->db, "ROLLBACK", NULL, NULL, NULL);
+			return FW_DB_ERR;
+		}
+		return FW_OK;
+	case FW_MIG_DONE:
+		break;
+	}
+
+	return FW_OK;
+}
+
+/* Drop everything a migration added, leaving the v1 tables as they were */
+fw_err_t
+fw_mig_abort(fw_migrate_t *m)
+{
+	fw_err_t ret = FW_DB_ERR;
+
+	if (m->stage == FW_MIG_DONE)
+		return FW_OK;
+
+	if (mig_exec(m->db, "BEGIN IMMEDIATE") != FW_OK)
+		return FW_DB_ERR;
+	if (mig_triggers(m->db, 0) != FW_OK ||
+	    mig_exec(m->db, mig_abort_sql) != FW_OK ||
+	    mig_exec(m->db, "COMMIT") != FW_OK)
+		sqlite3_exec(m->db, "ROLLBACK", NULL, NULL, NULL);
+	else
+		ret = FW_OK;
+
+	mig_exec(m->db, "DROP TABLE IF EXISTS temp.mig_keys;"
+	    "DROP TABLE IF EXISTS temp.mig_uids;"
+	    "PRAGMA foreign_keys = ON");
+
+	return ret;
+}
+
+/* Migrate db to the current schema in one go, batch rows at a time */
+fw_err_t
+fw_mig_run(sqlite3 *db, size_t batch)
+{
+	fw_migrate_t m;
+	fw_err_t ret;
+
+	if ((ret = fw_mig_start(&m, db, batch)) != FW_OK)
+		return ret == FW_ERR && errno == EALREADY ? FW_OK : FW_DB_ERR;
+
+	while (m.stage != FW_MIG_DONE)
+		if (fw_mig_step(&m) != FW_OK) {
+			fw_mig_abort(&m);
+			return FW_DB_ERR;
+		}
+
+	return FW_OK;
+}
@@ -0,0 +1,524 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * WireGuard's Noise_IKpsk2 handshake, for the userspace data plane.
+ * libsodium supplies X25519 and ChaCha20-Poly1305; BLAKE2s (RFC 7693),
+ * which it lacks, is implemented here. Functions fail without saying
+ * why: a handshake that doesn't check out is dropped, never answered.
+ */
+
+#include <endian.h>
+#include <string.h>
+#include <time.h>
+
+#include <sodium.h>
+
+#include "noise.h"
+
+/* Protocol constants */
+#define NOISE_CONSTRUCTION  "Noise_IKpsk2_25519_ChaChaPoly_BLAKE2s"
+#define NOISE_IDENTIFIER    "WireGuard v1 zx2c4 Jason@zx2c4.com"
+#define NOISE_LABEL_MAC1    "mac1----"
+
+/* BLAKE2s block size */
+#define B2S_BLOCK 64
+
+/* BLAKE2s state */
+struct b2s {
+	uint32_t h[8];
+	uint32_t t[2];
+	uint8_t buf[B2S_BLOCK];
+	size_t len;
+	size_t outlen;
+};
+
+static const uint32_t b2s_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint8_t b2s_sigma[10][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+	{ 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+	{ 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+	{ 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+	{ 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+	{ 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+	{ 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+	{ 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+	{ 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define B2S_G(a, b, c, d, x, y) do {					\
+	a += b + x; d = ROTR32(d ^ a, 16);				\
+	c += d;     b = ROTR32(b ^ c, 12);				\
+	a += b + y; d = ROTR32(d ^ a, 8);				\
+	c += d;     b = ROTR32(b ^ c, 7);				\
+} while (0)
+
+/* Compress the buffered block; last marks the final one */
+static void
+b2s_compress(struct b2s *s, int last)
+{
+	const uint8_t *sg;
+	uint32_t m[16], v[16];
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		memcpy(&m[i], s->buf + 4 * i, 4);
+		m[i] = le32toh(m[i]);
+	}
+	for (i = 0; i < 8; i++) {
+		v[i] = s->h[i];
+		v[i + 8] = b2s_iv[i];
+	}
+	v[12] ^= s->t[0];
+	v[13] ^= s->t[1];
+	if (last)
+		v[14] = ~v[14];
+
+	for (i = 0; i < 10; i++) {
+		sg = b2s_sigma[i];
+		B2S_G(v[0], v[4], v[8], v[12], m[sg[0]], m[sg[1]]);
+		B2S_G(v[1], v[5], v[9], v[13], m[sg[2]], m[sg[3]]);
+		B2S_G(v[2], v[6], v[10], v[14], m[sg[4]], m[sg[5]]);
+		B2S_G(v[3], v[7], v[11], v[15], m[sg[6]], m[sg[7]]);
+		B2S_G(v[0], v[5], v[10], v[15], m[sg[8]], m[sg[9]]);
+		B2S_G(v[1], v[6], v[11], v[12], m[sg[10]], m[sg[11]]);
+		B2S_G(v[2], v[7], v[8], v[13], m[sg[12]], m[sg[13]]);
+		B2S_G(v[3], v[4], v[9], v[14], m[sg[14]], m[sg[15]]);
+	}
+
+	for (i = 0; i < 8; i++)
+		s->h[i] ^= v[i] ^ v[i + 8];
+}
+
+/* Count n more input bytes */
+static void
+b2s_count(struct b2s *s, size_t n)
+{
+	s->t[0] += n;
+	if (s->t[0] < n)
+		s->t[1]++;
+}
+
+static void
+b2s_update(struct b2s *s, const void *in, size_t len)
+{
+	const uint8_t *p = in;
+	size_t n;
+
+	while (len > 0) {
+		/* Only compress a full block once more input follows it */
+		if (s->len == B2S_BLOCK) {
+			b2s_count(s, B2S_BLOCK);
+			b2s_compress(s, 0);
+			s->len = 0;
+		}
+		n = B2S_BLOCK - s->len;
+		if (n > len)
+			n = len;
+		memcpy(s->buf + s->len, p, n);
+		s->len += n;
+		p += n;
+		len -= n;
+	}
+}
+
+/* Start a hash of outlen bytes, keyed if keylen > 0 */
+static void
+b2s_init(struct b2s *s, size_t outlen, const void *key, size_t keylen)
+{
+	memset(s, 0, sizeof(*s));
+	memcpy(s->h, b2s_iv, sizeof(s->h));
+	s->h[0] ^= 0x01010000 ^ (keylen << 8) ^ outlen;
+	s->outlen = outlen;
+
+	if (keylen > 0) {
+		memcpy(s->buf, key, keylen);
+		s->len = B2S_BLOCK;
+	}
+}
+
+static void
+b2s_final(struct b2s *s, uint8_t *out)
+{
+	uint8_t h[32];
+	int i;
+
+	b2s_count(s, s->len);
+	memset(s->buf + s->len, 0, B2S_BLOCK - s->len);
+	b2s_compress(s, 1);
+
+	for (i = 0; i < 8; i++)
+		s->h[i] = htole32(s->h[i]);
+	memcpy(h, s->h, sizeof(h));
+	memcpy(out, h, s->outlen);
+
+	explicit_bzero(h, sizeof(h));
+	explicit_bzero(s, sizeof(*s));
+}
+
+/* HASH(a || b) */
+static void
+noise_hash(uint8_t out[NOISE_HASH_LEN], const void *a, size_t alen,
+    const void *b, size_t blen)
+{
+	struct b2s s;
+
+	b2s_init(&s, NOISE_HASH_LEN, NULL, 0);
+	b2s_update(&s, a, alen);
+	b2s_update(&s, b, blen);
+	b2s_final(&s, out);
+}
+
+/* MAC(key, in): keyed BLAKE2s-128 */
+static void
+noise_mac(uint8_t out[NOISE_MAC_LEN], const uint8_t key[NOISE_KEY_LEN],
+    const void *in, size_t len)
+{
+	struct b2s s;
+
+	b2s_init(&s, NOISE_MAC_LEN, key, NOISE_KEY_LEN);
+	b2s_update(&s, in, len);
+	b2s_final(&s, out);
+}
+
+/* HMAC-BLAKE2s(key, a || b) */
+static void
+noise_hmac(uint8_t out[NOISE_HASH_LEN], const uint8_t key[NOISE_HASH_LEN],
+    const void *a, size_t alen, const void *b, size_t blen)
+{
+	uint8_t pad[B2S_BLOCK], inner[NOISE_HASH_LEN];
+	struct b2s s;
+	int i;
+
+	memset(pad, 0, sizeof(pad));
+	memcpy(pad, key, NOISE_HASH_LEN);
+	for (i = 0; i < B2S_BLOCK; i++)
+		pad[i] ^= 0x36;
+	b2s_init(&s, NOISE_HASH_LEN, NULL, 0);
+	b2s_update(&s, pad, sizeof(pad));
+	b2s_update(&s, a, alen);
+	b2s_update(&s, b, blen);
+	b2s_final(&s, inner);
+
+	for (i = 0; i < B2S_BLOCK; i++)
+		pad[i] ^= 0x36 ^ 0x5c;
+	b2s_init(&s, NOISE_HASH_LEN, NULL, 0);
+	b2s_update(&s, pad, sizeof(pad));
+	b2s_update(&s, inner, sizeof(inner));
+	b2s_final(&s, out);
+
+	explicit_bzero(pad, sizeof(pad));
+	explicit_bzero(inner, sizeof(inner));
+}
+
+/*
+ * KDF(ck, in): replace the chaining key and derive up to two more keys
+ * (t1, t2 may be NULL)
+ */
+static void
+noise_kdf(uint8_t ck[NOISE_HASH_LEN], uint8_t *t1, uint8_t *t2,
+    const void *in, size_t len)
+{
+	uint8_t prk[NOISE_HASH_LEN], out[NOISE_HASH_LEN];
+	uint8_t one = 1, two = 2, three = 3;
+
+	noise_hmac(prk, ck, in, len, NULL, 0);
+	noise_hmac(out, prk, &one, 1, NULL, 0);
+	if (t1 != NULL) {
+		noise_hmac(t1, prk, out, sizeof(out), &two, 1);
+		if (t2 != NULL)
+			noise_hmac(t2, prk, t1, NOISE_HASH_LEN, &three, 1);
+	}
+	memcpy(ck, out, NOISE_HASH_LEN);
+
+	explicit_bzero(prk, sizeof(prk));
+	explicit_bzero(out, sizeof(out));
+}
+
+/* Mix DH(priv, pub) into the chaining key, deriving key k if not NULL */
+static fw_err_t
+noise_mix_dh(noise_hs_t *hs, uint8_t *k, const uint8_t priv[NOISE_KEY_LEN],
+    const uint8_t pub[NOISE_KEY_LEN])
+{
+	uint8_t dh[NOISE_KEY_LEN];
+
+	/* Fails on low-order points, which would give a known secret */
+	if (crypto_scalarmult(dh, priv, pub) != 0)
+		return FW_ERR;
+	noise_kdf(hs->ck, k, NULL, dh, sizeof(dh));
+	explicit_bzero(dh, sizeof(dh));
+
+	return FW_OK;
+}
+
+/* Encrypt len bytes of in under k with the hash as data, then mix out */
+static void
+noise_seal(noise_hs_t *hs, uint8_t *out, const uint8_t k[NOISE_KEY_LEN],
+    const void *in, size_t len)
+{
+	uint8_t nonce[crypto_aead_chacha20poly1305_ietf_NPUBBYTES] = { 0 };
+
+	crypto_aead_chacha20poly1305_ietf_encrypt(out, NULL, in, len,
+	    hs->hash, NOISE_HASH_LEN, NULL, nonce, k);
+	noise_hash(hs->hash, hs->hash, NOISE_HASH_LEN, out,
+	    len + NOISE_TAG_LEN);
+}
+
+/* Decrypt len sealed bytes of in, then mix in */
+static fw_err_t
+noise_open(noise_hs_t *hs, uint8_t *out, const uint8_t k[NOISE_KEY_LEN],
+    const uint8_t *in, size_t len)
+{
+	uint8_t nonce[crypto_aead_chacha20poly1305_ietf_NPUBBYTES] = { 0 };
+
+	/* libsodium wants somewhere to put even an empty plaintext */
+	if (out == NULL)
+		out = nonce;
+	if (crypto_aead_chacha20poly1305_ietf_decrypt(out, NULL, NULL, in,
+	    len, hs->hash, NOISE_HASH_LEN, nonce, k) != 0)
+		return FW_ERR;
+	noise_hash(hs->hash, hs->hash, NOISE_HASH_LEN, in, len);
+
+	return FW_OK;
+}
+
+/* Mix an ephemeral public key into the chaining key and hash */
+static void
+noise_mix_ephemeral(noise_hs_t *hs, const uint8_t pub[NOISE_KEY_LEN])
+{
+	noise_kdf(hs->ck, NULL, NULL, pub, NOISE_KEY_LEN);
+	noise_hash(hs->hash, hs->hash, NOISE_HASH_LEN, pub, NOISE_KEY_LEN);
+}
+
+/* Start a handshake: Ci = HASH(CONSTRUCTION), Hi = initial hash */
+static void
+noise_hs_start(noise_hs_t *hs, const uint8_t hash[NOISE_HASH_LEN])
+{
+	memset(hs, 0, sizeof(*hs));
+	noise_hash(hs->ck, NOISE_CONSTRUCTION, sizeof(NOISE_CONSTRUCTION) - 1,
+	    NULL, 0);
+	memcpy(hs->hash, hash, NOISE_HASH_LEN);
+}
+
+/* HASH(HASH(HASH(CONSTRUCTION) || IDENTIFIER) || responder key) */
+static void
+noise_initial_hash(uint8_t out[NOISE_HASH_LEN],
+    const uint8_t pub[NOISE_KEY_LEN])
+{
+	uint8_t ck[NOISE_HASH_LEN];
+
+	noise_hash(ck, NOISE_CONSTRUCTION, sizeof(NOISE_CONSTRUCTION) - 1,
+	    NULL, 0);
+	noise_hash(out, ck, sizeof(ck), NOISE_IDENTIFIER,
+	    sizeof(NOISE_IDENTIFIER) - 1);
+	noise_hash(out, out, NOISE_HASH_LEN, pub, NOISE_KEY_LEN);
+}
+
+/* Set up our identity from the interface private key */
+void
+noise_local_init(noise_local_t *l, const uint8_t priv[NOISE_KEY_LEN])
+{
+	memcpy(l->priv, priv, NOISE_KEY_LEN);
+	crypto_scalarmult_base(l->pub, l->priv);
+	noise_initial_hash(l->hash, l->pub);
+	noise_hash(l->mac1, NOISE_LABEL_MAC1, sizeof(NOISE_LABEL_MAC1) - 1,
+	    l->pub, NOISE_KEY_LEN);
+}
+
+/* Set up a peer's identity; psk may be NULL */
+void
+noise_remote_init(noise_remote_t *r, const uint8_t pub[NOISE_KEY_LEN],
+    const uint8_t psk[NOISE_KEY_LEN])
+{
+	memcpy(r->pub, pub, NOISE_KEY_LEN);
+	if (psk != NULL)
+		memcpy(r->psk, psk, NOISE_KEY_LEN);
+	else
+		memset(r->psk, 0, NOISE_KEY_LEN);
+	noise_initial_hash(r->hash, r->pub);
+	noise_hash(r->mac1, NOISE_LABEL_MAC1, sizeof(NOISE_LABEL_MAC1) - 1,
+	    r->pub, NOISE_KEY_LEN);
+}
+
+/* TAI64N of the current time */
+static void
+noise_tai64n(uint8_t ts[NOISE_TS_LEN])
+{
+	struct timespec now;
+	uint64_t sec;
+	uint32_t nsec;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	sec = htobe64(0x400000000000000aULL + now.tv_sec);
+	nsec = htobe32(now.tv_nsec);
+	memcpy(ts, &sec, sizeof(sec));
+	memcpy(ts + sizeof(sec), &nsec, sizeof(nsec));
+}
+
+/* Check MAC1 on a handshake message of len bytes addressed to us */
+int
+noise_check_mac1(const noise_local_t *l, const void *msg, size_t len)
+{
+	uint8_t mac[NOISE_MAC_LEN];
+	const uint8_t *p = msg;
+
+	noise_mac(mac, l->mac1, p, len - 2 * NOISE_MAC_LEN);
+
+	return sodium_memcmp(mac, p + len - 2 * NOISE_MAC_LEN, sizeof(mac)) ==
+	    0;
+}
+
+/* Build a handshake initiation to r with our index sender */
+fw_err_t
+noise_create_init(const noise_local_t *l, const noise_remote_t *r,
+    noise_hs_t *hs, struct noise_init *m, uint32_t sender)
+{
+	uint8_t k[NOISE_KEY_LEN], ts[NOISE_TS_LEN];
+	fw_err_t ret = FW_ERR;
+
+	noise_hs_start(hs, r->hash);
+	memset(m, 0, sizeof(*m));
+	m->type = htole32(NOISE_MSG_INIT);
+	m->sender = htole32(sender);
+
+	randombytes_buf(hs->epriv, sizeof(hs->epriv));
+	crypto_scalarmult_base(m->ephemeral, hs->epriv);
+	noise_mix_ephemeral(hs, m->ephemeral);
+
+	if (noise_mix_dh(hs, k, hs->epriv, r->pub) != FW_OK)
+		goto out;
+	noise_seal(hs, m->spub, k, l->pub, NOISE_KEY_LEN);
+
+	if (noise_mix_dh(hs, k, l->priv, r->pub) != FW_OK)
+		goto out;
+	noise_tai64n(ts);
+	noise_seal(hs, m->ts, k, ts, sizeof(ts));
+
+	noise_mac(m->mac1, r->mac1, m, offsetof(struct noise_init, mac1));
+	ret = FW_OK;
+out:
+	explicit_bzero(k, sizeof(k));
+	return ret;
+}
+
+/*
+ * Open an initiation to us, leaving the initiator's static key and
+ * timestamp in hs for the caller to check before answering
+ */
+fw_err_t
+noise_consume_init(const noise_local_t *l, noise_hs_t *hs,
+    const struct noise_init *m)
+{
+	uint8_t k[NOISE_KEY_LEN];
+	fw_err_t ret = FW_ERR;
+
+	noise_hs_start(hs, l->hash);
+	memcpy(hs->eremote, m->ephemeral, NOISE_KEY_LEN);
+	noise_mix_ephemeral(hs, m->ephemeral);
+
+	if (noise_mix_dh(hs, k, l->priv, m->ephemeral) != FW_OK ||
+	    noise_open(hs, hs->spub, k, m->spub, sizeof(m->spub)) != FW_OK)
+		goto out;
+
+	if (noise_mix_dh(hs, k, l->priv, hs->spub) != FW_OK ||
+	    noise_open(hs, hs->ts, k, m->ts, sizeof(m->ts)) != FW_OK)
+		goto out;
+
+	ret = FW_OK;
+out:
+	explicit_bzero(k, sizeof(k));
+	return ret;
+}
+
+/* Mix the preshared key: (ck, t, k) = KDF3(ck, psk), hash t */
+static void
+noise_mix_psk(noise_hs_t *hs, uint8_t k[NOISE_KEY_LEN],
+    const uint8_t psk[NOISE_KEY_LEN])
+{
+	uint8_t t[NOISE_HASH_LEN];
+
+	noise_kdf(hs->ck, t, k, psk, NOISE_KEY_LEN);
+	noise_hash(hs->hash, hs->hash, NOISE_HASH_LEN, t, sizeof(t));
+	explicit_bzero(t, sizeof(t));
+}
+
+/* Answer a consumed initiation from r, which used index receiver */
+fw_err_t
+noise_create_resp(const noise_local_t *l, const noise_remote_t *r,
+    noise_hs_t *hs, struct noise_resp *m, uint32_t sender, uint32_t receiver)
+{
+	uint8_t k[NOISE_KEY_LEN], epriv[NOISE_KEY_LEN];
+	fw_err_t ret = FW_ERR;
+
+	memset(m, 0, sizeof(*m));
+	m->type = htole32(NOISE_MSG_RESP);
+	m->sender = htole32(sender);
+	m->receiver = htole32(receiver);
+
+	randombytes_buf(epriv, sizeof(epriv));
+	crypto_scalarmult_base(m->ephemeral, epriv);
+	noise_mix_ephemeral(hs, m->ephemeral);
+
+	if (noise_mix_dh(hs, NULL, epriv, hs->eremote) != FW_OK ||
+	    noise_mix_dh(hs, NULL, epriv, r->pub) != FW_OK)
+		goto out;
+
+	noise_mix_psk(hs, k, r->psk);
+	noise_seal(hs, m->empty, k, "", 0);
+
+	noise_mac(m->mac1, r->mac1, m, offsetof(struct noise_resp, mac1));
+	ret = FW_OK;
+out:
+	explicit_bzero(k, sizeof(k));
+	explicit_bzero(epriv, sizeof(epriv));
+	return ret;
+}
+
+/* Open r's answer to the initiation in hs */
+fw_err_t
+noise_consume_resp(const noise_local_t *l, const noise_remote_t *r,
+    noise_hs_t *hs, const struct noise_resp *m)
+{
+	uint8_t k[NOISE_KEY_LEN];
+	fw_err_t ret = FW_ERR;
+
+	noise_mix_ephemeral(hs, m->ephemeral);
+	if (noise_mix_dh(hs, NULL, hs->epriv, m->ephemeral) != FW_OK ||
+	    noise_mix_dh(hs, NULL, l->priv, m->ephemeral) != FW_OK)
+		goto out;
+
+	noise_mix_psk(hs, k, r->psk);
+	if (noise_open(hs, NULL, k, m->empty, sizeof(m->empty)) != FW_OK)
+		goto out;
+
+	ret = FW_OK;
+out:
+	explicit_bzero(k, sizeof(k));
+	return ret;
+}
+
+/* Derive transport keys from a finished handshake, then wipe it */
+void
+noise_derive(noise_hs_t *hs, int initiator, uint8_t send[NOISE_KEY_LEN],
+    uint8_t recv[NOISE_KEY_LEN])
+{
+	uint8_t t2[NOISE_KEY_LEN];
+
+	/* (T1, T2) = KDF2(ck, ""); T1 is the initiator's sending key */
+	noise_kdf(hs->ck, t2, NULL, "", 0);
+	memcpy(send, initiator ? hs->ck : t2, NOISE_KEY_LEN);
+	memcpy(recv, initiator ? t2 : hs->ck, NOISE_KEY_LEN);
+
+	explicit_bzero(t2, sizeof(t2));
+	explicit_bzero(hs, sizeof(*hs));
+}
@@ -0,0 +1,329 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "peertab.h"
+
+/* Initial entry count */
+#define PTAB_INIT_CAP 64
+
+/* Hash a public key; keys are curve points, so any 32 bits will do */
+static uint32_t
+ptab_hash(const uint8_t key[WG_KEY_LEN])
+{
+	uint32_t h;
+
+	memcpy(&h, key, sizeof(h));
+	return h;
+}
+
+/* Grow entry array and hash buckets */
+static fw_err_t
+ptab_grow(fw_ptab_t *pt)
+{
+	fw_pent_t *ents;
+	uint32_t *buckets;
+	size_t cap, nbuckets, i;
+	uint32_t b;
+
+	cap = pt->cap ? pt->cap * 2 : PTAB_INIT_CAP;
+	if (cap > UINT32_MAX - 1) {
+		errno = ENOMEM;
+		return FW_ERR;
+	}
+
+	ents = recallocarray(pt->ents, pt->cap, cap, sizeof(*ents));
+	if (ents == NULL)
+		return FW_ERR;
+	pt->ents = ents;
+
+	/* Chain new entries onto the free list, lowest id first */
+	for (i = cap; i > pt->cap; i--) {
+		ents[i - 1].next = pt->freelist;
+		pt->freelist = i;
+	}
+	pt->cap = cap;
+
+	/* Keep the load factor at or below one */
+	nbuckets = pt->nbuckets ? pt->nbuckets : PTAB_INIT_CAP;
+	while (nbuckets < cap)
+		nbuckets *= 2;
+	if (nbuckets == pt->nbuckets)
+		return FW_OK;
+
+	if ((buckets = calloc(nbuckets, sizeof(*buckets))) == NULL)
+		return FW_ERR;
+
+	for (i = 0; i < pt->cap; i++) {
+		if (!(ents[i].flags & FW_PE_USED))
+			continue;
+		b = ptab_hash(ents[i].key) & (nbuckets - 1);
+		ents[i].next = buckets[b];
+		buckets[b] = i + 1;
+	}
+
+	free(pt->buckets);
+	pt->buckets = buckets;
+	pt->nbuckets = nbuckets;
+
+	return FW_OK;
+}
+
+/* Initialize peer table with a resident peer cap */
+fw_err_t
+fw_ptab_init(fw_ptab_t *pt, size_t rcap)
+{
+	memset(pt, 0, sizeof(*pt));
+
+	if (rcap == 0) {
+		errno = EINVAL;
+		return FW_ERR;
+	}
+
+	if ((pt->ring = calloc(rcap, sizeof(*pt->ring))) == NULL)
+		return FW_ERR;
+	pt->rcap = rcap;
+
+	if (ptab_grow(pt) != FW_OK || fw_lpm_init(&pt->lpm) != FW_OK) {
+		fw_ptab_free(pt);
+		return FW_ERR;
+	}
+
+	return FW_OK;
+}
+
+/* Change the resident peer cap; the resident set must already fit */
+fw_err_t
+fw_ptab_set_cap(fw_ptab_t *pt, size_t rcap)
+{
+	uint32_t *ring;
+
+	if (rcap == 0 || rcap < pt->rcount) {
+		errno = EINVAL;
+		return FW_ERR;
+	}
+
+	if ((ring = reallocarray(pt->ring, rcap, sizeof(*ring))) == NULL)
+		return FW_ERR;
+	pt->ring = ring;
+	pt->rcap = rcap;
+
+	return FW_OK;
+}
+
+/* Free peer table */
+void
+fw_ptab_free(fw_ptab_t *pt)
+{
+	free(pt->ents);
+	free(pt->buckets);
+	free(pt->ring);
+	fw_lpm_free(&pt->lpm);
+	memset(pt, 0, sizeof(*pt));
+}
+
+/*
+ * Register peer; fails with EEXIST if the key is already known, or
+ * EADDRINUSE if another peer has the tunnel address.
+ */
+fw_err_t
+fw_ptab_add(fw_ptab_t *pt, const uint8_t key[WG_KEY_LEN],
+    struct in_addr addr, uint32_t *idp)
+{
+	fw_pent_t *pe;
+	uint32_t id, b;
+
+	if (fw_ptab_find(pt, key) != NULL) {
+		errno = EEXIST;
+		return FW_ERR;
+	}
+
+	if (pt->freelist == 0 && ptab_grow(pt) != FW_OK)
+		return FW_ERR;
+
+	id = pt->freelist - 1;
+	if (fw_lpm_insert(&pt->lpm, AF_INET, &addr, 32, id) != FW_OK) {
+		if (errno == EEXIST)
+			errno = EADDRINUSE;
+		return FW_ERR;
+	}
+
+	pe = &pt->ents[id];
+	pt->freelist = pe->next;
+
+	memset(pe, 0, sizeof(*pe));
+	memcpy(pe->key, key, WG_KEY_LEN);
+	pe->addr = addr;
+	pe->flags = FW_PE_USED;
+
+	b = ptab_hash(key) & (pt->nbuckets - 1);
+	pe->next = pt->buckets[b];
+	pt->buckets[b] = id + 1;
+	pt->count++;
+	pt->gen++;
+
+	if (idp != NULL)
+		*idp = id;
+
+	return FW_OK;
+}
+
+/* Unregister peer, dropping it from the resident set */
+fw_err_t
+fw_ptab_del(fw_ptab_t *pt, const uint8_t key[WG_KEY_LEN])
+{
+	fw_pent_t *pe;
+	uint32_t *link;
+
+	link = &pt->buckets[ptab_hash(key) & (pt->nbuckets - 1)];
+	while (*link != 0) {
+		pe = &pt->ents[*link - 1];
+		if (memcmp(pe->key, key, WG_KEY_LEN) == 0)
+			break;
+		link = &pe->next;
+	}
+
+	if (*link == 0) {
+		errno = ENOENT;
+		return FW_ERR;
+	}
+
+	pe = &pt->ents[*link - 1];
+	if (pe->flags & FW_PE_RESIDENT)
+		fw_ptab_release(pt, pe);
+	fw_lpm_delete(&pt->lpm, AF_INET, &pe->addr, 32);
+
+	/* Unlink from hash chain and push onto free list */
+	*link = pe->next;
+	pe->flags = 0;
+	pe->next = pt->freelist;
+	pt->freelist = (pe - pt->ents) + 1;
+	pt->count--;
+	pt->gen++;
+
+	return FW_OK;
+}
+
+/* Look up peer by public key */
+fw_pent_t *
+fw_ptab_find(fw_ptab_t *pt, const uint8_t key[WG_KEY_LEN])
+{
+	fw_pent_t *pe;
+	uint32_t id;
+
+	id = pt->buckets[ptab_hash(key) & (pt->nbuckets - 1)];
+	while (id != 0) {
+		pe = &pt->ents[id - 1];
+		if (memcmp(pe->key, key, WG_KEY_LEN) == 0)
+			return pe;
+		id = pe->next;
+	}
+
+	return NULL;
+}
+
+/* Look up the peer whose tunnel address covers addr */
+fw_pent_t *
+fw_ptab_owner(fw_ptab_t *pt, struct in_addr addr)
+{
+	uint32_t id;
+
+	if (fw_lpm_lookup(&pt->lpm, AF_INET, &addr, &id) != FW_OK)
+		return NULL;
+
+	return &pt->ents[id];
+}
+
+/* Add peer to the resident set; fails with ENOSPC at the cap */
+fw_err_t
+fw_ptab_admit(fw_ptab_t *pt, fw_pent_t *pe)
+{
+	if (pe->flags & FW_PE_RESIDENT)
+		return FW_OK;
+
+	if (pt->rcount >= pt->rcap) {
+		errno = ENOSPC;
+		return FW_ERR;
+	}
+
+	pe->slot = pt->rcount;
+	pe->flags |= FW_PE_RESIDENT | FW_PE_REF;
+	pt->ring[pt->rcount++] = pe - pt->ents;
+	pt->gen++;
+
+	return FW_OK;
+}
+
+/* Remove peer from the resident set */
+void
+fw_ptab_release(fw_ptab_t *pt, fw_pent_t *pe)
+{
+	uint32_t last;
+
+	if (!(pe->flags & FW_PE_RESIDENT))
+		return;
+
+	/* Move the last resident peer into the vacated slot */
+	last = pt->ring[--pt->rcount];
+	pt->ring[pe->slot] = last;
+	pt->ents[last].slot = pe->slot;
+
+	pe->flags &= ~(FW_PE_RESIDENT | FW_PE_REF);
+	pt->gen++;
+}
+
+/* Record peer activity */
+void
+fw_ptab_touch(fw_pent_t *pe, time_t when)
+{
+	if (when > pe->active)
+		pe->active = when;
+	pe->flags |= FW_PE_REF;
+}
+
+/*
+ * Sweep the CLOCK hand and release up to max resident peers, storing
+ * their ids in victims. A referenced peer has its bit cleared and is
+ * passed over once. Without force, only peers idle for at least idle
+ * seconds are taken; with force, the first unreferenced peer is.
+ */
+size_t
+fw_ptab_victims(fw_ptab_t *pt, time_t now, time_t idle, int force,
+    uint32_t *victims, size_t max)
+{
+	fw_pent_t *pe;
+	size_t n, steps;
+
+	n = 0;
+	for (steps = 2 * pt->rcount; steps > 0 && n < max && pt->rcount > 0;
+	    steps--) {
+		if (pt->hand >= pt->rcount)
+			pt->hand = 0;
+
+		pe = &pt->ents[pt->ring[pt->hand]];
+		if (pe->flags & FW_PE_REF) {
+			pe->flags &= ~FW_PE_REF;
+			pt->hand++;
+			continue;
+		}
+
+		if (!force && now - pe->active < idle) {
+			pt->hand++;
+			continue;
+		}
+
+		/* Release swaps another peer under the hand; don't advance */
+		victims[n++] = pt->ring[pt->hand];
+		fw_ptab_release(pt, pe);
+	}
+
+	return n;
+}
@@ -0,0 +1,532 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Privilege separation: a small privileged process owns the wg(4)
+ * handle and performs the interface ioctl(2)s for the unprivileged
+ * daemon. The two talk over a pair of single-producer, single-consumer
+ * byte rings in shared memory, one per direction:
+ *
+ *	daemon  --cmd ring-->   privileged process  --ioctl(2)-->  wg(4)
+ *	daemon  <--resp ring--  privileged process
+ *
+ * Every ioctl(2) is one ring record, and callers batch peer changes
+ * into one SIOCSWG per batch (see wg_add_peers(), wg_remove_peers()). A consumer spins briefly before going
+ * to sleep on a pipe; the producer writes to the pipe only if the
+ * consumer said it is asleep, so back-to-back operations don't pay for
+ * a wakeup. The privileged side only runs the four interface ioctls, on
+ * its own interface, from private copies of the data it has checked,
+ * and is pledged and unveiled to little more than that.
+ *
+ * The privileged process exits when the daemon goes away (its command
+ * pipe hits EOF).
+ */
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <net/if.h>
+#include <net/if_wg.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wireguard.h"
+
+/* Bytes of record data per ring; bounds a SIOCSWG/SIOCGWG buffer */
+#define PRIV_RING_SIZE  (1 << 20)
+
+/* Ring polls before a consumer sleeps (with more than one CPU) */
+#define PRIV_SPIN       2000
+
+/* Record header; len payload bytes follow, padded to a cache line */
+struct priv_hdr {
+	uint32_t len;      /* Payload bytes, PRIV_PAD to skip to start */
+	int32_t error;     /* errno of the ioctl(2) (responses)        */
+	uint64_t req;      /* ioctl(2) request                         */
+	uint64_t size;     /* wgd_size in, or out                      */
+};
+
+#define PRIV_PAD    UINT32_MAX
+#define PRIV_ALIGN  64
+#define PRIV_RECLEN(len) \
+	((sizeof(struct priv_hdr) + (len) + PRIV_ALIGN - 1) & ~(PRIV_ALIGN - 1))
+
+/*
+ * Largest payload; a record of at most half the ring fits an empty ring
+ * even after padding to its start
+ */
+#define PRIV_DATA_MAX  (PRIV_RING_SIZE / 2 - sizeof(struct priv_hdr))
+
+/* One direction; positions count bytes and only ever grow */
+struct priv_ring {
+	uint64_t head __attribute__((aligned(64)));     /* Producer     */
+	uint64_t tail __attribute__((aligned(64)));     /* Consumer     */
+	uint32_t waiting __attribute__((aligned(64)));  /* Consumer is asleep */
+	uint8_t data[PRIV_RING_SIZE] __attribute__((aligned(64)));
+};
+
+/* Shared memory */
+struct priv_shm {
+	struct priv_ring cmd;   /* Daemon to privileged process */
+	struct priv_ring resp;  /* Privileged process to daemon */
+};
+
+/* Daemon side of the channel */
+struct fw_priv {
+	struct priv_shm *shm;
+	pid_t pid;              /* Privileged process           */
+	int cmd_fd;             /* Wakes the privileged process */
+	int resp_fd;            /* Wakes us                     */
+};
+
+/* Spin count; on one CPU spinning only delays the other side */
+static int priv_spin;
+
+/*
+ * START ring functions
+ */
+
+/* Reserve a record for len payload bytes; NULL if it doesn't fit */
+static struct priv_hdr *
+ring_reserve(struct priv_ring *r, size_t len)
+{
+	uint64_t head = r->head;
+	uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	size_t reclen = PRIV_RECLEN(len), off, gap;
+	struct priv_hdr *h;
+
+	off = head % PRIV_RING_SIZE;
+	gap = PRIV_RING_SIZE - off;
+	if (reclen > PRIV_RING_SIZE ||
+	    PRIV_RING_SIZE - (head - tail) < reclen + (reclen > gap ? gap : 0))
+		return NULL;
+
+	/* Records don't wrap: pad to the start of the ring */
+	if (reclen > gap) {
+		h = (struct priv_hdr *)&r->data[off];
+		h->len = PRIV_PAD;
+		__atomic_store_n(&r->head, head + gap, __ATOMIC_RELEASE);
+		off = 0;
+	}
+
+	return (struct priv_hdr *)&r->data[off];
+}
+
+/* Publish the record reserved last */
+static void
+ring_commit(struct priv_ring *r, struct priv_hdr *h)
+{
+	__atomic_store_n(&r->head, r->head + PRIV_RECLEN(h->len),
+	    __ATOMIC_RELEASE);
+}
+
+/* Oldest unconsumed record, or NULL */
+static struct priv_hdr *
+ring_peek(struct priv_ring *r)
+{
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	struct priv_hdr *h;
+
+	while (r->tail != head) {
+		h = (struct priv_hdr *)&r->data[r->tail % PRIV_RING_SIZE];
+		if (h->len != PRIV_PAD)
+			return h;
+		__atomic_store_n(&r->tail, r->tail + PRIV_RING_SIZE -
+		    r->tail % PRIV_RING_SIZE, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/* Release the record returned by ring_peek() */
+static void
+ring_consume(struct priv_ring *r, struct priv_hdr *h)
+{
+	__atomic_store_n(&r->tail, r->tail + PRIV_RECLEN(h->len),
+	    __ATOMIC_RELEASE);
+}
+
+/* Wake the consumer of r if it is asleep */
+static void
+ring_wake(struct priv_ring *r, int fd)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&r->waiting, 0, __ATOMIC_SEQ_CST))
+		(void)write(fd, "", 1);
+}
+
+/*
+ * Wait for a record on r, spinning first, then sleeping on fd; returns
+ * -1 with EPIPE if the producer went away
+ */
+static int
+ring_wait(struct priv_ring *r, int fd)
+{
+	struct pollfd pfd;
+	char buf[64];
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < priv_spin; i++) {
+		if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail)
+			return 0;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		__atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != r->tail) {
+			__atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+			return 0;
+		}
+
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			return -1;
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			;
+		if (n == 0) {
+			errno = EPIPE;
+			return -1;
+		}
+	}
+}
+
+/*
+ * END ring functions
+ */
+
+/*
+ * Run one command against the interface, consume it, and answer on the
+ * resp ring; returns -1 if the daemon left no room for the answer
+ */
+static int
+priv_exec(wg_handle_t *wg, struct priv_shm *shm, struct priv_hdr *cmd,
+    void *buf)
+{
+	struct wg_data_io dio;
+	struct priv_hdr *resp;
+	struct ifreq ifr;
+	uint64_t req = cmd->req;
+	size_t len = 0;
+	int ret;
+
+	memset(&dio, 0, sizeof(dio));
+	strlcpy(dio.wgd_name, wg->ifname, IFNAMSIZ);
+	dio.wgd_interface = buf;
+
+	switch (cmd->req) {
+	case SIOCIFCREATE:
+	case SIOCIFDESTROY:
+		memset(&ifr, 0, sizeof(ifr));
+		strlcpy(ifr.ifr_name, wg->ifname, IFNAMSIZ);
+		ret = wg_ioctl(wg, cmd->req, &ifr);
+		break;
+	case SIOCSWG:
+		/* Work on a copy the daemon can't change under us */
+		memcpy(buf, cmd + 1, cmd->len);
+		dio.wgd_size = cmd->len;
+		if (!wg_data_valid(buf, cmd->len)) {
+			errno = EINVAL;
+			ret = -1;
+			break;
+		}
+		ret = wg_ioctl(wg, SIOCSWG, &dio);
+		break;
+	case SIOCGWG:
+		dio.wgd_size = cmd->size;
+		if ((ret = wg_ioctl(wg, SIOCGWG, &dio)) == -1)
+			break;
+		/* A short buffer only gets the interface header */
+		if (dio.wgd_size <= cmd->size)
+			len = dio.wgd_size;
+		else if (cmd->size >= sizeof(struct wg_interface_io))
+			len = sizeof(struct wg_interface_io);
+		break;
+	default:
+		errno = ENOTTY;
+		ret = -1;
+		break;
+	}
+
+	/* The daemon may send the next command once it has the answer */
+	ring_consume(&shm->cmd, cmd);
+
+	/*
+	 * The daemon waits for each answer and caps its size, so the ring
+	 * is empty and the answer fits; if not, say so without the data
+	 */
+	if ((resp = ring_reserve(&shm->resp, len)) == NULL) {
+		len = 0;
+		ret = -1;
+		errno = E2BIG;
+		if ((resp = ring_reserve(&shm->resp, 0)) == NULL)
+			return -1;
+	}
+	resp->len = len;
+	resp->error = ret == -1 ? errno : 0;
+	resp->req = req;
+	resp->size = dio.wgd_size;
+	memcpy(resp + 1, buf, len);
+	ring_commit(&shm->resp, resp);
+
+	return 0;
+}
+
+/* Confine the privileged process to serving the interface of backend */
+static int
+priv_restrict(const char *ifname, int backend)
+{
+	char path[sizeof("/dev/") + IFNAMSIZ];
+
+	switch (backend) {
+	case WG_BACKEND_MOCK:
+		return pledge("stdio", NULL);
+	case WG_BACKEND_USER:
+		/* SIOCIFCREATE opens the tun device, SIOCSWG rebinds the port */
+#ifdef __linux__
+		strlcpy(path, "/dev/net/tun", sizeof(path));
+#else
+		snprintf(path, sizeof(path), "/dev/%s", ifname);
+#endif
+		if (unveil(path, "rw") == -1 || unveil(NULL, NULL) == -1)
+			return -1;
+		return pledge("stdio rpath wpath inet", NULL);
+	default:
+		/* No pledge(2) promise covers the wg(4) ioctls; hide the files */
+		if (unveil("/", "") == -1 || unveil(NULL, NULL) == -1)
+			return -1;
+		return 0;
+	}
+}
+
+/* Privileged process: open the interface handle, then serve commands */
+static void __attribute__((noreturn))
+priv_main(struct priv_shm *shm, int cmd_fd, int resp_fd, const char *ifname,
+    int backend)
+{
+	struct priv_hdr *h;
+	wg_handle_t wg;
+	void *buf;
+
+	/* The daemon handles signals; we go when it does */
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+
+	memset(&wg, 0, sizeof(wg));
+	h = ring_reserve(&shm->resp, 0);
+	h->len = 0;
+	h->error = 0;
+	h->req = 0;
+	if ((buf = malloc(PRIV_RING_SIZE)) == NULL ||
+	    wg_open(&wg, ifname, backend) != FW_OK ||
+	    priv_restrict(ifname, backend) == -1)
+		h->error = errno;
+	ring_commit(&shm->resp, h);
+	ring_wake(&shm->resp, resp_fd);
+	if (h->error != 0)
+		_exit(1);
+
+	/* Drain every queued command per wakeup */
+	while (ring_wait(&shm->cmd, cmd_fd) == 0) {
+		while ((h = ring_peek(&shm->cmd)) != NULL) {
+			/* Don't trust the daemon with our memory */
+			if (h->len > (size_t)(shm->cmd.data +
+			    PRIV_RING_SIZE - (uint8_t *)(h + 1)) ||
+			    h->size > PRIV_RING_SIZE - sizeof(*h))
+				goto done;
+			if (priv_exec(&wg, shm, h, buf) == -1)
+				goto done;
+		}
+		ring_wake(&shm->resp, resp_fd);
+	}
+
+done:
+	wg_close_iface(&wg);
+	_exit(0);
+}
+
+/*
+ * Open a handle on interface ifname, of backend, through a new privileged
+ * process. Fork before opening anything the privileged side must not
+ * inherit.
+ */
+fw_err_t
+wg_open_priv(wg_handle_t *wg, const char *ifname, int backend)
+{
+	struct fw_priv *p;
+	struct priv_hdr *h;
+	int cmd[2] = { -1, -1 }, resp[2] = { -1, -1 }, i, error;
+
+	if (strlen(ifname) >= IFNAMSIZ) {
+		errno = EINVAL;
+		return FW_ERR;
+	}
+
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		return FW_ERR;
+	priv_spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? PRIV_SPIN : 0;
+	p->shm = mmap(NULL, sizeof(*p->shm), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANON, -1, 0);
+	if (p->shm == MAP_FAILED || pipe(cmd) == -1 || pipe(resp) == -1)
+		goto err;
+	for (i = 0; i < 2; i++) {
+		if (fcntl(cmd[i], F_SETFL, O_NONBLOCK) == -1 ||
+		    fcntl(resp[i], F_SETFL, O_NONBLOCK) == -1)
+			goto err;
+	}
+
+	switch ((p->pid = fork())) {
+	case -1:
+		goto err;
+	case 0:
+		close(cmd[1]);
+		close(resp[0]);
+		priv_main(p->shm, cmd[0], resp[1], ifname, backend);
+	}
+
+	close(cmd[0]);
+	close(resp[1]);
+	p->cmd_fd = cmd[1];
+	p->resp_fd = resp[0];
+
+	wg->sock = -1;
+	wg->mock = NULL;
+	wg->priv = p;
+	wg->user = NULL;
+	strlcpy(wg->ifname, ifname, IFNAMSIZ);
+
+	/* The privileged process reports whether it opened the handle */
+	if (ring_wait(&p->shm->resp, p->resp_fd) == -1 ||
+	    (h = ring_peek(&p->shm->resp)) == NULL) {
+		wg_priv_free(wg);
+		return FW_ERR;
+	}
+	error = h->error;
+	ring_consume(&p->shm->resp, h);
+	if (error != 0) {
+		wg_priv_free(wg);
+		errno = error;
+		return FW_ERR;
+	}
+
+	return FW_OK;
+
+err:
+	error = errno;
+	for (i = 0; i < 2; i++) {
+		if (cmd[i] != -1)
+			close(cmd[i]);
+		if (resp[i] != -1)
+			close(resp[i]);
+	}
+	if (p->shm != MAP_FAILED)
+		munmap(p->shm, sizeof(*p->shm));
+	free(p);
+	errno = error;
+	return FW_ERR;
+}
+
+/* Stop the privileged process */
+void
+wg_priv_free(wg_handle_t *wg)
+{
+	struct fw_priv *p = wg->priv;
+
+	if (p == NULL)
+		return;
+
+	close(p->cmd_fd);
+	close(p->resp_fd);
+	while (waitpid(p->pid, NULL, 0) == -1 && errno == EINTR)
+		;
+	munmap(p->shm, sizeof(*p->shm));
+	free(p);
+	wg->priv = NULL;
+}
+
+/* Forward an interface ioctl(2) to the privileged process */
+int
+wg_priv_ioctl(wg_handle_t *wg, unsigned long req, void *arg)
+{
+	struct fw_priv *p = wg->priv;
+	struct wg_data_io *dio = arg;
+	struct priv_hdr *h;
+	size_t len = 0;
+	int error;
+
+	switch (req) {
+	case SIOCIFCREATE:
+	case SIOCIFDESTROY:
+		break;
+	case SIOCGWG:
+		/* The answer has to fit the resp ring */
+		if (dio->wgd_size > PRIV_DATA_MAX) {
+			errno = E2BIG;
+			return -1;
+		}
+		break;
+	case SIOCSWG:
+		if (dio->wgd_size > PRIV_DATA_MAX) {
+			errno = E2BIG;
+			return -1;
+		}
+		len = dio->wgd_size;
+		break;
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+
+	if ((h = ring_reserve(&p->shm->cmd, len)) == NULL) {
+		errno = E2BIG;
+		return -1;
+	}
+	h->len = len;
+	h->error = 0;
+	h->req = req;
+	h->size = req == SIOCGWG ? dio->wgd_size : len;
+	if (len > 0)
+		memcpy(h + 1, dio->wgd_interface, len);
+	ring_commit(&p->shm->cmd, h);
+	ring_wake(&p->shm->cmd, p->cmd_fd);
+
+	if (ring_wait(&p->shm->resp, p->resp_fd) == -1 ||
+	    (h = ring_peek(&p->shm->resp)) == NULL) {
+		errno = EPIPE;
+		return -1;
+	}
+
+	if (req == SIOCGWG) {
+		if (h->len > dio->wgd_size) {
+			ring_consume(&p->shm->resp, h);
+			errno = EPROTO;
+			return -1;
+		}
+		memcpy(dio->wgd_interface, h + 1, h->len);
+		dio->wgd_size = h->size;
+	}
+	error = h->error;
+	ring_consume(&p->shm->resp, h);
+
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
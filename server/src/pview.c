@@ -0,0 +1,309 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Read-mostly peer views with epoch-based reclamation. The writer copies
+ * the peer table into an immutable view and swaps it in; a reader pins
+ * the current view by recording the global epoch in its own cache line,
+ * so reads take no locks and readers never write a shared line. A
+ * replaced view is stamped with the epoch it was retired in and freed
+ * once no reader entered at or before that epoch is still inside.
+ *
+ * Why that is enough: the writer swaps the view before bumping the
+ * epoch, and a reader records its epoch before loading the view (all
+ * sequentially consistent). A reader that recorded epoch e >= r loaded
+ * the view after the swap retired in r, so it can't hold that view; a
+ * reader the writer sees as idle will load the view after the swap.
+ */
+
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pview.h"
+
+/* Per-thread reader record, alone in its cache line */
+struct fw_pvreader {
+	uint64_t active;              /* Epoch entered in, 0 = outside */
+	unsigned int depth;           /* Nested fw_pv_enter() calls    */
+	struct fw_pvreader *next;
+} __attribute__((aligned(64)));
+
+/* Current thread's reader record */
+static __thread struct fw_pvreader *pv_tls = NULL;
+
+/* Every thread's reader record; records are never freed */
+static struct fw_pvreader *g_pv_readers = NULL;
+
+/* Published view and epoch, written only by the writer */
+static fw_pview_t *g_pv_cur = NULL;
+static uint64_t g_pv_epoch = 1;
+
+/* Views replaced but maybe still in use, newest first (writer only) */
+static fw_pview_t *g_pv_retired = NULL;
+
+/* Key index hash; keys are curve points, so any 32 bits will do */
+static uint32_t
+pv_hash(const uint8_t key[WG_KEY_LEN])
+{
+	uint32_t h;
+
+	memcpy(&h, key, sizeof(h));
+	return h;
+}
+
+/* Allocate and publish the calling thread's reader record */
+static struct fw_pvreader *
+pv_register(void)
+{
+	struct fw_pvreader *r;
+
+	if ((r = aligned_alloc(64, sizeof(*r))) == NULL)
+		err(1, "pv_register");
+	memset(r, 0, sizeof(*r));
+
+	r->next = __atomic_load_n(&g_pv_readers, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&g_pv_readers, &r->next, r, 1,
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	pv_tls = r;
+
+	return r;
+}
+
+/*
+ * Pin and return the current view (NULL before the first publish).
+ * Calls nest; the view stays valid until the matching fw_pv_leave().
+ */
+const fw_pview_t *
+fw_pv_enter(void)
+{
+	struct fw_pvreader *r = pv_tls;
+
+	if (r == NULL)
+		r = pv_register();
+
+	if (r->depth++ == 0)
+		__atomic_store_n(&r->active,
+		    __atomic_load_n(&g_pv_epoch, __ATOMIC_SEQ_CST),
+		    __ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(&g_pv_cur, __ATOMIC_SEQ_CST);
+}
+
+/* Unpin the view */
+void
+fw_pv_leave(void)
+{
+	struct fw_pvreader *r = pv_tls;
+
+	if (--r->depth == 0)
+		__atomic_store_n(&r->active, 0, __ATOMIC_RELEASE);
+}
+
+/* Look up peer by public key */
+const fw_pvent_t *
+fw_pv_find(const fw_pview_t *v, const uint8_t key[WG_KEY_LEN])
+{
+	size_t mask, s;
+	uint32_t pos;
+
+	if (v == NULL)
+		return NULL;
+
+	mask = v->nslots - 1;
+	for (s = pv_hash(key) & mask; (pos = v->bykey[s]) != 0;
+	    s = (s + 1) & mask) {
+		if (memcmp(v->ents[pos - 1].key, key, WG_KEY_LEN) == 0)
+			return &v->ents[pos - 1];
+	}
+
+	return NULL;
+}
+
+/* Look up the peer holding tunnel address addr */
+const fw_pvent_t *
+fw_pv_owner(const fw_pview_t *v, struct in_addr addr)
+{
+	uint32_t a = ntohl(addr.s_addr);
+	size_t lo, hi, mid;
+
+	if (v == NULL)
+		return NULL;
+
+	for (lo = 0, hi = v->count; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (v->byaddr[mid].addr < a)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == v->count || v->byaddr[lo].addr != a)
+		return NULL;
+
+	return &v->ents[v->byaddr[lo].pos];
+}
+
+/* Position of the first peer with table id id or above */
+size_t
+fw_pv_seek(const fw_pview_t *v, uint64_t id)
+{
+	size_t lo, hi, mid;
+
+	if (v == NULL)
+		return 0;
+
+	for (lo = 0, hi = v->count; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (v->ents[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Order address index entries */
+static int
+pv_addr_cmp(const void *a, const void *b)
+{
+	const fw_pvaddr_t *x = a, *y = b;
+
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/* Copy the table into a new view */
+static fw_pview_t *
+pv_build(const fw_ptab_t *pt)
+{
+	const fw_pent_t *pe;
+	fw_pview_t *v;
+	fw_pvent_t *e;
+	size_t i, n, nslots, mask, s;
+
+	nslots = 16;
+	while (nslots < pt->count * 2)
+		nslots *= 2;
+
+	v = malloc(sizeof(*v) + pt->count * (sizeof(fw_pvent_t) +
+	    sizeof(fw_pvaddr_t)) + nslots * sizeof(uint32_t));
+	if (v == NULL)
+		return NULL;
+	v->gen = pt->gen;
+	v->retired = 0;
+	v->next = NULL;
+	v->resident = pt->rcount;
+	v->byaddr = (fw_pvaddr_t *)&v->ents[pt->count];
+	v->bykey = (uint32_t *)&v->byaddr[pt->count];
+	v->nslots = nslots;
+	memset(v->bykey, 0, nslots * sizeof(uint32_t));
+
+	mask = nslots - 1;
+	for (i = 0, n = 0; i < pt->cap && n < pt->count; i++) {
+		pe = &pt->ents[i];
+		if (!(pe->flags & FW_PE_USED))
+			continue;
+
+		e = &v->ents[n];
+		memcpy(e->key, pe->key, WG_KEY_LEN);
+		e->addr = pe->addr;
+		e->handshake = pe->handshake;
+		e->id = i;
+		e->flags = pe->flags;
+
+		v->byaddr[n].addr = ntohl(pe->addr.s_addr);
+		v->byaddr[n].pos = n;
+		for (s = pv_hash(pe->key) & mask; v->bykey[s] != 0;
+		    s = (s + 1) & mask)
+			;
+		v->bykey[s] = ++n;
+	}
+	v->count = n;
+	qsort(v->byaddr, n, sizeof(*v->byaddr), pv_addr_cmp);
+
+	return v;
+}
+
+/* Table generation of the published view (0 before the first) */
+uint64_t
+fw_pv_gen(void)
+{
+	fw_pview_t *v = __atomic_load_n(&g_pv_cur, __ATOMIC_RELAXED);
+
+	return v != NULL ? v->gen : 0;
+}
+
+/*
+ * Publish a copy of the table. Mutations since the last publish become
+ * visible to readers together.
+ */
+fw_err_t
+fw_pv_publish(const fw_ptab_t *pt)
+{
+	fw_pview_t *v, *old;
+
+	if ((v = pv_build(pt)) == NULL)
+		return FW_ERR;
+
+	old = __atomic_exchange_n(&g_pv_cur, v, __ATOMIC_SEQ_CST);
+	if (old != NULL) {
+		old->retired = __atomic_add_fetch(&g_pv_epoch, 1,
+		    __ATOMIC_SEQ_CST);
+		old->next = g_pv_retired;
+		g_pv_retired = old;
+	}
+	fw_pv_reclaim();
+
+	return FW_OK;
+}
+
+/* Free retired views no reader can hold; returns how many are left */
+size_t
+fw_pv_reclaim(void)
+{
+	struct fw_pvreader *r;
+	fw_pview_t **vp, *v;
+	uint64_t min = UINT64_MAX, a;
+	size_t left = 0;
+
+	if (g_pv_retired == NULL)
+		return 0;
+
+	for (r = __atomic_load_n(&g_pv_readers, __ATOMIC_ACQUIRE); r != NULL;
+	    r = r->next) {
+		a = __atomic_load_n(&r->active, __ATOMIC_SEQ_CST);
+		if (a != 0 && a < min)
+			min = a;
+	}
+
+	for (vp = &g_pv_retired; (v = *vp) != NULL; ) {
+		if (v->retired <= min) {
+			*vp = v->next;
+			free(v);
+		} else {
+			vp = &v->next;
+			left++;
+		}
+	}
+
+	return left;
+}
+
+/* Drop every view; no reader may be inside */
+void
+fw_pv_clear(void)
+{
+	fw_pview_t *v;
+
+	free(__atomic_exchange_n(&g_pv_cur, NULL, __ATOMIC_SEQ_CST));
+	while ((v = g_pv_retired) != NULL) {
+		g_pv_retired = v->next;
+		free(v);
+	}
+}
@@ -0,0 +1,125 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Token-bucket rate limiting for the auth endpoints. Keys are hashed with
+ * a random SipHash key, so clients can't aim collisions at one set to
+ * flush someone else's bucket. New buckets start without the reference
+ * bit: under an address spray the one-shot keys are evicted first, and
+ * repeat offenders keep their (drained) buckets.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "ratelimit.h"
+
+/* One token, in fixed point */
+#define RL_ONE  256
+
+/* Milliseconds since fw_rl_new() */
+static uint32_t
+rl_now(const fw_ratelimit_t *rl)
+{
+	return (fw_metric_now() / 1000000) - rl->epoch;
+}
+
+/* Allocate a table with a fresh hash key */
+fw_ratelimit_t *
+fw_rl_new(void)
+{
+	fw_ratelimit_t *rl;
+
+	if ((rl = aligned_alloc(64, sizeof(*rl))) == NULL)
+		return NULL;
+	memset(rl, 0, sizeof(*rl));
+	randombytes_buf(rl->seed, sizeof(rl->seed));
+	rl->epoch = fw_metric_now() / 1000000;
+
+	return rl;
+}
+
+void
+fw_rl_free(fw_ratelimit_t *rl)
+{
+	free(rl);
+}
+
+/* Pick a bucket to reuse: a free one, else the CLOCK victim */
+static fw_rlent_t *
+rl_victim(fw_rlset_t *set)
+{
+	fw_rlent_t *e;
+
+	for (;;) {
+		e = &set->ways[set->ways[0].hand++ % FW_RL_WAYS];
+		if ((e->flags & (FW_RL_USED | FW_RL_REF)) !=
+		    (FW_RL_USED | FW_RL_REF))
+			return e;
+		e->flags &= ~FW_RL_REF;
+	}
+}
+
+/*
+ * Take a token from key's bucket, which refills at rate per minute up to
+ * burst (at most 255) tokens. Returns 1 if allowed; otherwise 0, with
+ * the seconds until the next token in wait.
+ */
+int
+fw_rl_take(fw_ratelimit_t *rl, const void *key, size_t len, int rate,
+    int burst, uint32_t *wait)
+{
+	uint8_t h[crypto_shorthash_BYTES];
+	uint64_t hash, tokens, full, add;
+	fw_rlset_t *set;
+	fw_rlent_t *e;
+	uint32_t now;
+	int i;
+
+	crypto_shorthash(h, key, len, rl->seed);
+	memcpy(&hash, h, sizeof(hash));
+	set = &rl->sets[hash & (FW_RL_SETS - 1)];
+	full = (uint64_t)burst * RL_ONE;
+	now = rl_now(rl);
+
+	for (i = 0; i < FW_RL_WAYS; i++) {
+		e = &set->ways[i];
+		if ((e->flags & FW_RL_USED) && e->key == hash)
+			break;
+	}
+
+	if (i < FW_RL_WAYS) {
+		/*
+		 * Refill for the time since the last refill (wrapping is
+		 * fine); under a flood of takes the stamp stays put until a
+		 * whole fixed-point unit has accrued.
+		 */
+		add = (uint64_t)(now - e->stamp) * rate * RL_ONE / 60000;
+		if (add > 0)
+			e->stamp = now;
+		tokens = e->tokens + add;
+		if (tokens > full)
+			tokens = full;
+		e->flags |= FW_RL_REF;
+	} else {
+		e = rl_victim(set);
+		e->key = hash;
+		e->stamp = now;
+		e->flags = FW_RL_USED;
+		tokens = full;
+	}
+
+	if (tokens < RL_ONE) {
+		e->tokens = tokens;
+		*wait = rate > 0 ? ((RL_ONE - tokens) * 60000 /
+		    ((uint64_t)rate * RL_ONE) + 999) / 1000 : 60;
+		return 0;
+	}
+
+	e->tokens = tokens - RL_ONE;
+	return 1;
+}
@@ -0,0 +1,196 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+/* FNV-1a 64 */
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+/* Continue an FNV-1a 64 hash h over buf */
+static uint64_t
+snap_fnv(uint64_t h, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= FNV_PRIME;
+	}
+
+	return h;
+}
+
+/* Checksum the header, with its checksum field zeroed, and the records */
+static uint64_t
+snap_checksum(const struct fw_snap_hdr *hdr, const void *recs, size_t len)
+{
+	struct fw_snap_hdr h;
+
+	memcpy(&h, hdr, sizeof(h));
+	h.checksum = 0;
+
+	return snap_fnv(snap_fnv(FNV_OFFSET, &h, sizeof(h)), recs, len);
+}
+
+/* Write all peer records to fd */
+static fw_err_t
+snap_write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return FW_ERR;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return FW_OK;
+}
+
+/*
+ * Write the peer table to path atomically: the snapshot is written to a
+ * temporary file in the same directory, synced, then renamed over path.
+ */
+fw_err_t
+fw_snap_write(const char *path, uint64_t generation, fw_ptab_t *pt)
+{
+	struct fw_snap_hdr hdr;
+	struct fw_snap_rec *recs, *r;
+	char tmp[PATH_MAX];
+	fw_pent_t *pe;
+	size_t i, n;
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXXXXXX", path) >=
+	    (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return FW_ERR;
+	}
+
+	if ((recs = calloc(pt->count ? pt->count : 1, sizeof(*recs))) == NULL)
+		return FW_ERR;
+
+	for (i = 0, n = 0; i < pt->cap && n < pt->count; i++) {
+		pe = &pt->ents[i];
+		if (!(pe->flags & FW_PE_USED))
+			continue;
+
+		r = &recs[n++];
+		memcpy(r->key, pe->key, WG_KEY_LEN);
+		r->addr = pe->addr.s_addr;
+		r->flags = (pe->flags & FW_PE_RESIDENT) ? FW_SNAP_RESIDENT : 0;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = FW_SNAP_MAGIC;
+	hdr.version = FW_SNAP_VERSION;
+	hdr.stride = sizeof(struct fw_snap_rec);
+	hdr.generation = generation;
+	hdr.count = n;
+	hdr.checksum = snap_checksum(&hdr, recs, n * sizeof(*recs));
+
+	if ((fd = mkstemp(tmp)) == -1) {
+		free(recs);
+		return FW_ERR;
+	}
+
+	if (snap_write_all(fd, &hdr, sizeof(hdr)) != FW_OK ||
+	    snap_write_all(fd, recs, n * sizeof(*recs)) != FW_OK ||
+	    fsync(fd) == -1 || close(fd) == -1) {
+		close(fd);
+		unlink(tmp);
+		free(recs);
+		return FW_ERR;
+	}
+	free(recs);
+
+	if (rename(tmp, path) == -1) {
+		unlink(tmp);
+		return FW_ERR;
+	}
+
+	return FW_OK;
+}
+
+/* Map and validate a snapshot; fails with EINVAL if it is damaged */
+fw_err_t
+fw_snap_open(fw_snap_t *snap, const char *path)
+{
+	const struct fw_snap_hdr *hdr;
+	struct stat st;
+	int fd;
+
+	memset(snap, 0, sizeof(*snap));
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return FW_ERR;
+
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return FW_ERR;
+	}
+
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		errno = EINVAL;
+		return FW_ERR;
+	}
+
+	snap->len = st.st_size;
+	snap->base = mmap(NULL, snap->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (snap->base == MAP_FAILED) {
+		snap->base = NULL;
+		return FW_ERR;
+	}
+
+	hdr = snap->base;
+	if (hdr->magic != FW_SNAP_MAGIC || hdr->version != FW_SNAP_VERSION ||
+	    hdr->stride != sizeof(struct fw_snap_rec) ||
+	    hdr->count > (snap->len - sizeof(*hdr)) / hdr->stride ||
+	    snap->len != sizeof(*hdr) + hdr->count * hdr->stride)
+		goto bad;
+
+	snap->hdr = hdr;
+	snap->recs = (const struct fw_snap_rec *)(hdr + 1);
+
+	if (snap_checksum(hdr, snap->recs, hdr->count * hdr->stride) !=
+	    hdr->checksum)
+		goto bad;
+
+	return FW_OK;
+
+bad:
+	fw_snap_close(snap);
+	errno = EINVAL;
+	return FW_ERR;
+}
+
+/* Unmap snapshot */
+void
+fw_snap_close(fw_snap_t *snap)
+{
+	if (snap->base != NULL)
+		munmap(snap->base, snap->len);
+	memset(snap, 0, sizeof(*snap));
+}
@@ -0,0 +1,124 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#ifdef FW_TRACE
+
+/* Current thread's ring */
+__thread struct fw_tring *fw_trtls = NULL;
+
+/* Every thread's ring; rings are never freed */
+static struct fw_tring *g_trings = NULL;
+static uint32_t g_trings_count = 0;
+
+/* Allocate and publish the calling thread's ring */
+struct fw_tring *
+fw_trace_register(void)
+{
+	struct fw_tring *r;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		err(1, "fw_trace_register");
+
+	r->tid = __atomic_fetch_add(&g_trings_count, 1, __ATOMIC_RELAXED);
+	r->next = __atomic_load_n(&g_trings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&g_trings, &r->next, r, 1,
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	fw_trtls = r;
+
+	return r;
+}
+
+/*
+ * Save every ring to path (written to a temporary file, then renamed).
+ * Rings are copied while their threads may still write, so the oldest
+ * events of a busy ring can be torn; everything after them is intact.
+ */
+fw_err_t
+fw_trace_dump(const char *path)
+{
+	struct fw_trace_hdr hdr;
+	struct fw_trace_rhdr rhdr;
+	struct fw_tring *r;
+	char tmp[PATH_MAX];
+	uint64_t head, first, i;
+	FILE *fp;
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXXXXXX", path) >=
+	    (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return FW_ERR;
+	}
+
+	if ((fd = mkstemp(tmp)) == -1)
+		return FW_ERR;
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		return FW_ERR;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = FW_TRACE_MAGIC;
+	hdr.version = FW_TRACE_VERSION;
+	hdr.evsize = sizeof(struct fw_tevent);
+	hdr.nrings = __atomic_load_n(&g_trings_count, __ATOMIC_ACQUIRE);
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	/* Rings registered after the header was written are skipped */
+	for (r = __atomic_load_n(&g_trings, __ATOMIC_ACQUIRE); r != NULL;
+	    r = r->next) {
+		if (r->tid >= hdr.nrings)
+			continue;
+
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		first = head > FW_TRACE_RING ? head - FW_TRACE_RING : 0;
+
+		rhdr.tid = r->tid;
+		rhdr.count = head - first;
+		fwrite(&rhdr, sizeof(rhdr), 1, fp);
+		for (i = first; i < head; i++)
+			fwrite(&r->ev[i & (FW_TRACE_RING - 1)],
+			    sizeof(struct fw_tevent), 1, fp);
+	}
+
+	if (fflush(fp) == EOF || ferror(fp) || fsync(fd) == -1) {
+		fclose(fp);
+		unlink(tmp);
+		return FW_ERR;
+	}
+	fclose(fp);
+
+	if (rename(tmp, path) == -1) {
+		unlink(tmp);
+		return FW_ERR;
+	}
+
+	return FW_OK;
+}
+
+#else /* !FW_TRACE */
+
+/* Tracing is compiled out */
+fw_err_t
+fw_trace_dump(const char *path)
+{
+	errno = EOPNOTSUPP;
+	return FW_ERR;
+}
+
+#endif /* FW_TRACE */
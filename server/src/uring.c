@@ -0,0 +1,464 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Minimal io_uring(7) driver for the API's socket I/O, on the raw system
+ * calls so the daemon needs no library for it. One ring, one sparse
+ * registered file table the caller manages slots in, one ring of
+ * provided buffers (group 0) for multishot receives. Only the requests
+ * the API issues are wrapped. Elsewhere every entry point fails with
+ * EOPNOTSUPP and callers stay on poll(2).
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+#endif
+
+#include "uring.h"
+
+#ifdef __linux__
+
+/* Completion queue entries per submission queue entry */
+#define URING_CQ_RATIO  4
+
+/* Queue one request, making room by submitting if the queue is full */
+static struct io_uring_sqe *
+uring_sqe(fw_uring_t *r, uint8_t op, int fd, uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head;
+
+	head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	if (r->sq_local - head == r->sq_entries) {
+		if (fw_uring_submit(r) != FW_OK)
+			return NULL;
+		head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+		if (r->sq_local - head == r->sq_entries) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+
+	sqe = (struct io_uring_sqe *)r->sqes + (r->sq_local & r->sq_mask);
+	r->sq_local++;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = data;
+
+	return sqe;
+}
+
+/* IOSQE_* flags for FW_URING_* chaining */
+static uint8_t
+uring_link(int link)
+{
+	if (link & FW_URING_HARD)
+		return IOSQE_IO_HARDLINK;
+	if (link & FW_URING_LINK)
+		return IOSQE_IO_LINK;
+	return 0;
+}
+
+/*
+ * Set up r with entries submission queue entries, a file table of files
+ * empty slots and nbufs provided buffers of buflen bytes each; nbufs is
+ * a power of two
+ */
+fw_err_t
+fw_uring_open(fw_uring_t *r, unsigned int entries, unsigned int files,
+    unsigned int nbufs, size_t buflen)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	unsigned int *array, i;
+	size_t sq_len, cq_len;
+	int *fds, serrno;
+
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+	r->ring = MAP_FAILED;
+	r->sqes = MAP_FAILED;
+	r->br = MAP_FAILED;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN |
+	    IORING_SETUP_SINGLE_ISSUER;
+	p.cq_entries = entries * URING_CQ_RATIO;
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd == -1 && errno == EINVAL) {
+		/* Kernels before 6.0 lack the task run hints */
+		p.flags = IORING_SETUP_CQSIZE;
+		r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	}
+	if (r->fd == -1)
+		return FW_ERR;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_NODROP)) {
+		errno = EOPNOTSUPP;
+		goto fail;
+	}
+
+	/* Both rings share one mapping */
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->ring_len = sq_len > cq_len ? sq_len : cq_len;
+	r->ring = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->ring == MAP_FAILED)
+		goto fail;
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	r->sq_head = (unsigned int *)((uint8_t *)r->ring + p.sq_off.head);
+	r->sq_tail = (unsigned int *)((uint8_t *)r->ring + p.sq_off.tail);
+	r->sq_mask = *(unsigned int *)((uint8_t *)r->ring +
+	    p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->sq_local = *r->sq_tail;
+	array = (unsigned int *)((uint8_t *)r->ring + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+	r->cq_head = (unsigned int *)((uint8_t *)r->ring + p.cq_off.head);
+	r->cq_tail = (unsigned int *)((uint8_t *)r->ring + p.cq_off.tail);
+	r->cq_mask = *(unsigned int *)((uint8_t *)r->ring +
+	    p.cq_off.ring_mask);
+	r->cqes = (uint8_t *)r->ring + p.cq_off.cqes;
+
+	/* Sparse file table */
+	if ((fds = malloc(files * sizeof(*fds))) == NULL)
+		goto fail;
+	for (i = 0; i < files; i++)
+		fds[i] = -1;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES,
+	    fds, files) == -1) {
+		free(fds);
+		goto fail;
+	}
+	free(fds);
+
+	/* Provided buffers: the ring, then the memory it points into */
+	r->nbufs = nbufs;
+	r->buflen = buflen;
+	r->br_len = nbufs * sizeof(struct io_uring_buf);
+	r->br = mmap(NULL, r->br_len, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->br == MAP_FAILED)
+		goto fail;
+	if ((r->bufs = malloc(nbufs * buflen)) == NULL)
+		goto fail;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)r->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+	    &reg, 1) == -1)
+		goto fail;
+	for (i = 0; i < nbufs; i++)
+		fw_uring_buf_put(r, i);
+
+	return FW_OK;
+
+fail:
+	serrno = errno;
+	fw_uring_close(r);
+	errno = serrno;
+	return FW_ERR;
+}
+
+/* Tear r down; requests still in flight are cancelled with it */
+void
+fw_uring_close(fw_uring_t *r)
+{
+	if (r->fd != -1)
+		close(r->fd);
+	if (r->ring != MAP_FAILED && r->ring != NULL)
+		munmap(r->ring, r->ring_len);
+	if (r->sqes != MAP_FAILED && r->sqes != NULL)
+		munmap(r->sqes, r->sqes_len);
+	if (r->br != MAP_FAILED && r->br != NULL)
+		munmap(r->br, r->br_len);
+	free(r->bufs);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+}
+
+/* Hand the queued requests to the kernel */
+fw_err_t
+fw_uring_submit(fw_uring_t *r)
+{
+	unsigned int n;
+	int ret;
+
+	__atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+	while ((n = r->sq_local - __atomic_load_n(r->sq_head,
+	    __ATOMIC_ACQUIRE)) > 0) {
+		ret = syscall(__NR_io_uring_enter, r->fd, n, 0, 0, NULL, 0);
+		if (ret == -1 && errno != EINTR)
+			return FW_ERR;
+	}
+
+	return FW_OK;
+}
+
+/* Take the next completion into cqe; 0 if there is none */
+int
+fw_uring_reap(fw_uring_t *r, fw_ucqe_t *cqe)
+{
+	struct io_uring_cqe *c;
+	unsigned int head;
+
+	head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	c = (struct io_uring_cqe *)r->cqes + (head & r->cq_mask);
+	cqe->data = c->user_data;
+	cqe->res = c->res;
+	cqe->flags = 0;
+	cqe->bid = 0;
+	if (c->flags & IORING_CQE_F_MORE)
+		cqe->flags |= FW_UCQE_MORE;
+	if (c->flags & IORING_CQE_F_BUFFER) {
+		cqe->flags |= FW_UCQE_BUF;
+		cqe->bid = c->flags >> IORING_CQE_BUFFER_SHIFT;
+	}
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/* Memory of provided buffer bid */
+void *
+fw_uring_buf(fw_uring_t *r, uint16_t bid)
+{
+	return r->bufs + (size_t)bid * r->buflen;
+}
+
+/* Give provided buffer bid back to the kernel */
+void
+fw_uring_buf_put(fw_uring_t *r, uint16_t bid)
+{
+	struct io_uring_buf_ring *br = r->br;
+	struct io_uring_buf *b;
+
+	/* The ring's tail overlays the first entry's resv: set fields */
+	b = &br->bufs[r->br_tail & (r->nbufs - 1)];
+	b->addr = (uintptr_t)fw_uring_buf(r, bid);
+	b->len = r->buflen;
+	b->bid = bid;
+	r->br_tail++;
+	__atomic_store_n(&br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+/* Multishot accept on listening socket fd, into regular descriptors */
+fw_err_t
+fw_uring_accept(fw_uring_t *r, int fd, uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(r, IORING_OP_ACCEPT, fd, data)) == NULL)
+		return FW_ERR;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+
+	return FW_OK;
+}
+
+/* Cancel the request whose user data is target */
+fw_err_t
+fw_uring_cancel(fw_uring_t *r, uint64_t target, int link, uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(r, IORING_OP_ASYNC_CANCEL, -1, data)) == NULL)
+		return FW_ERR;
+	sqe->addr = target;
+	sqe->flags = uring_link(link);
+
+	return FW_OK;
+}
+
+/* Close regular descriptor fd */
+fw_err_t
+fw_uring_close_fd(fw_uring_t *r, int fd, uint64_t data)
+{
+	return uring_sqe(r, IORING_OP_CLOSE, fd, data) == NULL ?
+	    FW_ERR : FW_OK;
+}
+
+/* Close, and so free, file table slot */
+fw_err_t
+fw_uring_close_file(fw_uring_t *r, unsigned int slot, uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(r, IORING_OP_CLOSE, 0, data)) == NULL)
+		return FW_ERR;
+	sqe->file_index = slot + 1;
+
+	return FW_OK;
+}
+
+/*
+ * Register the descriptor *fdp holds in file table slot. The kernel
+ * reads *fdp at submission, and requests queued after this one on slot
+ * are issued after it.
+ */
+fw_err_t
+fw_uring_install(fw_uring_t *r, int *fdp, unsigned int slot, uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(r, IORING_OP_FILES_UPDATE, -1, data)) == NULL)
+		return FW_ERR;
+	sqe->addr = (uintptr_t)fdp;
+	sqe->len = 1;
+	sqe->off = slot;
+
+	return FW_OK;
+}
+
+/* Multishot receive on file table slot into provided buffers */
+fw_err_t
+fw_uring_recv(fw_uring_t *r, unsigned int slot, uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(r, IORING_OP_RECV, slot, data)) == NULL)
+		return FW_ERR;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->buf_group = 0;
+
+	return FW_OK;
+}
+
+/* Write iovcnt vectors to file table slot; iov must outlive the write */
+fw_err_t
+fw_uring_writev(fw_uring_t *r, unsigned int slot, const struct iovec *iov,
+    int iovcnt, int link, uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(r, IORING_OP_WRITEV, slot, data)) == NULL)
+		return FW_ERR;
+	sqe->flags = IOSQE_FIXED_FILE | uring_link(link);
+	sqe->addr = (uintptr_t)iov;
+	sqe->len = iovcnt;
+
+	return FW_OK;
+}
+
+#else /* !__linux__ */
+
+/* io_uring(7) is Linux only */
+fw_err_t
+fw_uring_open(fw_uring_t *r, unsigned int entries, unsigned int files,
+    unsigned int nbufs, size_t buflen)
+{
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+	errno = EOPNOTSUPP;
+	return FW_ERR;
+}
+
+void
+fw_uring_close(fw_uring_t *r)
+{
+}
+
+fw_err_t
+fw_uring_submit(fw_uring_t *r)
+{
+	errno = EOPNOTSUPP;
+	return FW_ERR;
+}
+
+int
+fw_uring_reap(fw_uring_t *r, fw_ucqe_t *cqe)
+{
+	return 0;
+}
+
+void *
+fw_uring_buf(fw_uring_t *r, uint16_t bid)
+{
+	return NULL;
+}
+
+void
+fw_uring_buf_put(fw_uring_t *r, uint16_t bid)
+{
+}
+
+fw_err_t
+fw_uring_accept(fw_uring_t *r, int fd, uint64_t data)
+{
+	errno = EOPNOTSUPP;
+	return FW_ERR;
+}
+
+fw_err_t
+fw_uring_cancel(fw_uring_t *r, uint64_t target, int link, uint64_t data)
+{
+	errno = EOPNOTSUPP;
+	return FW_ERR;
+}
+
+fw_err_t
+fw_uring_close_fd(fw_uring_t *r, int fd, uint64_t data)
+{
+	errno = EOPNOTSUPP;
+	return FW_ERR;
+}
+
+fw_err_t
+fw_uring_close_file(fw_uring_t *r, unsigned int slot, uint64_t data)
+{
+	errno = EOPNOTSUPP;
+	return FW_ERR;
+}
+
+fw_err_t
+fw_uring_install(fw_uring_t *r, int *fdp, unsigned int slot, uint64_t data)
+{
+	errno = EOPNOTSUPP;
+	return FW_ERR;
+}
+
+fw_err_t
+fw_uring_recv(fw_uring_t *r, unsigned int slot, uint64_t data)
+{
+	errno = EOPNOTSUPP;
+	return FW_ERR;
+}
+
+fw_err_t
+fw_uring_writev(fw_uring_t *r, unsigned int slot, const struct iovec *iov,
+    int iovcnt, int link, uint64_t data)
+{
+	errno = EOPNOTSUPP;
+	return FW_ERR;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,238 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Write-back of last-login and handshake times. Marks are O(1) and never
+ * touch SQLite; fw_wb_flush() writes at most a bounded batch per call in
+ * one transaction, so a backlog drains over several event loop turns
+ * instead of holding the DB (and every API request behind it) at once.
+ * Stamps stay dirty until their transaction commits, so a failed flush
+ * loses nothing.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "db.h"
+#include "metrics.h"
+#include "wback.h"
+
+/* Initial entries per kind */
+#define WB_CAP_MIN  64
+
+void
+fw_wb_free(fw_wback_t *wb)
+{
+	int k;
+
+	for (k = 0; k < FW_WB_MAX; k++) {
+		free(wb->sets[k].ents);
+		free(wb->sets[k].index);
+	}
+	memset(wb, 0, sizeof(*wb));
+}
+
+fw_err_t
+fw_wb_init(fw_wback_t *wb)
+{
+	memset(wb, 0, sizeof(*wb));
+	randombytes_buf(wb->seed, sizeof(wb->seed));
+
+	return FW_OK;
+}
+
+/* Stamps waiting to be written */
+size_t
+fw_wb_dirty(const fw_wback_t *wb)
+{
+	size_t n = 0;
+	int k;
+
+	for (k = 0; k < FW_WB_MAX; k++)
+		n += wb->sets[k].count;
+
+	return n;
+}
+
+/* Index slots, a power of two */
+static size_t
+wb_slots(const fw_wbset_t *set)
+{
+	return set->cap * 2;
+}
+
+/* Index slot holding key, or the free slot where it would go */
+static size_t
+wb_probe(const fw_wbset_t *set, const uint8_t key[FW_WB_KEY_LEN],
+    uint32_t hash)
+{
+	size_t mask = wb_slots(set) - 1, s;
+	uint32_t pos;
+
+	for (s = hash & mask; (pos = set->index[s]) != 0; s = (s + 1) & mask) {
+		if (set->ents[pos - 1].hash == hash &&
+		    memcmp(set->ents[pos - 1].key, key, FW_WB_KEY_LEN) == 0)
+			break;
+	}
+
+	return s;
+}
+
+/* Double a set's capacity and rebuild its index */
+static fw_err_t
+wb_grow(fw_wbset_t *set)
+{
+	fw_wbent_t *ents;
+	uint32_t *index;
+	size_t cap, i, mask, s;
+
+	cap = set->cap == 0 ? WB_CAP_MIN : set->cap * 2;
+	if ((ents = reallocarray(set->ents, cap, sizeof(*ents))) == NULL)
+		return FW_ERR;
+	set->ents = ents;
+	if ((index = calloc(cap * 2, sizeof(*index))) == NULL)
+		return FW_ERR;
+	free(set->index);
+	set->index = index;
+	set->cap = cap;
+
+	mask = cap * 2 - 1;
+	for (i = 0; i < set->count; i++) {
+		for (s = ents[i].hash & mask; index[s] != 0; s = (s + 1) & mask)
+			;
+		index[s] = i + 1;
+	}
+
+	return FW_OK;
+}
+
+/*
+ * Drop the last entry. Later entries in its probe run shift back into
+ * the hole, so lookups never need tombstones.
+ */
+static void
+wb_pop(fw_wbset_t *set)
+{
+	fw_wbent_t *e = &set->ents[set->count - 1];
+	size_t mask = wb_slots(set) - 1, s, j, home;
+
+	s = wb_probe(set, e->key, e->hash);
+	set->index[s] = 0;
+	for (j = (s + 1) & mask; set->index[j] != 0; j = (j + 1) & mask) {
+		home = set->ents[set->index[j] - 1].hash & mask;
+
+		/* Stay put if home lies cyclically in (s, j] */
+		if (s <= j ? (s < home && home <= j) : (s < home || home <= j))
+			continue;
+		set->index[s] = set->index[j];
+		set->index[j] = 0;
+		s = j;
+	}
+	set->count--;
+}
+
+/* Record that key (a user ID or public key) was seen at when */
+fw_err_t
+fw_wb_mark(fw_wback_t *wb, enum fw_wb_kind kind, const void *key,
+    time_t when)
+{
+	uint8_t h[crypto_shorthash_BYTES];
+	fw_wbset_t *set = &wb->sets[kind];
+	fw_wbent_t *e;
+	uint32_t hash;
+	size_t s;
+
+	crypto_shorthash(h, key, FW_WB_KEY_LEN, wb->seed);
+	memcpy(&hash, h, sizeof(hash));
+
+	if (set->count == set->cap && wb_grow(set) != FW_OK)
+		return FW_ERR;
+
+	s = wb_probe(set, key, hash);
+	if (set->index[s] != 0) {
+		e = &set->ents[set->index[s] - 1];
+		if (when > e->when)
+			e->when = when;
+		return FW_OK;
+	}
+
+	e = &set->ents[set->count++];
+	memcpy(e->key, key, FW_WB_KEY_LEN);
+	e->when = when;
+	e->hash = hash;
+	set->index[s] = set->count;
+
+	return FW_OK;
+}
+
+/* Fill stamps from the last n entries of set */
+static fw_err_t
+wb_stamps(const fw_wbset_t *set, enum fw_wb_kind kind, fw_db_stamp_t *st,
+    size_t n)
+{
+	const fw_wbent_t *e;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		e = &set->ents[set->count - 1 - i];
+		st[i].when = e->when;
+		if (kind == FW_WB_LOGIN) {
+			memcpy(st[i].key, e->key, FW_WB_KEY_LEN);
+			st[i].key[FW_WB_KEY_LEN] = '\0';
+		} else if (wg_key_to_b64(st[i].key, sizeof(st[i].key),
+		    (uint8_t *)e->key) != FW_OK)
+			return FW_ERR;
+	}
+
+	return FW_OK;
+}
+
+/*
+ * Write up to max stamps of each kind in one transaction, most recently
+ * dirtied keys first. Call again while fw_wb_dirty() is non-zero to
+ * drain a backlog.
+ */
+fw_err_t
+fw_wb_flush(fw_wback_t *wb, sqlite3 *db, size_t max)
+{
+	fw_db_stamp_t *st[FW_WB_MAX];
+	size_t n[FW_WB_MAX], i;
+	uint64_t start;
+	fw_err_t ret = FW_ERR;
+	int k;
+
+	memset(st, 0, sizeof(st));
+	for (k = 0; k < FW_WB_MAX; k++) {
+		n[k] = wb->sets[k].count < max ? wb->sets[k].count : max;
+		if (n[k] > 0 &&
+		    ((st[k] = calloc(n[k], sizeof(**st))) == NULL ||
+		    wb_stamps(&wb->sets[k], k, st[k], n[k]) != FW_OK))
+			goto done;
+	}
+	if (n[FW_WB_LOGIN] + n[FW_WB_HANDSHAKE] == 0)
+		return FW_OK;
+
+	start = fw_metric_now();
+	ret = fw_db_write_stamps(db, st[FW_WB_LOGIN], n[FW_WB_LOGIN],
+	    st[FW_WB_HANDSHAKE], n[FW_WB_HANDSHAKE]);
+	fw_metric_observe(FW_H_WB_FLUSH, fw_metric_now() - start);
+	if (ret != FW_OK)
+		goto done;
+
+	/* Committed: forget what was written */
+	for (k = 0; k < FW_WB_MAX; k++) {
+		for (i = 0; i < n[k]; i++)
+			wb_pop(&wb->sets[k]);
+		fw_metric_add(FW_C_WB_ROWS, n[k]);
+	}
+	fw_metric_inc(FW_C_WB_FLUSHES);
+
+done:
+	for (k = 0; k < FW_WB_MAX; k++)
+		free(st[k]);
+
+	return ret;
+}
@@ -0,0 +1,267 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * wgmock.c - In-memory stand-in for a wg(4) interface. It answers the
+ * SIOCIFCREATE/SIOCIFDESTROY/SIOCSWG/SIOCGWG requests wireguard.c makes,
+ * so peer management can be exercised and benchmarked without root.
+ */
+
+#include <sys/ioctl.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sodium.h>
+
+#include "wireguard.h"
+
+/* Mock interface state */
+struct wg_mock {
+	int created;                 /* SIOCIFCREATE seen       */
+	struct wg_interface_io hdr;  /* Keys, port and flags    */
+	struct wg_peer_io **peers;   /* Peers with allowed IPs  */
+	size_t npeers;
+};
+
+/* Size of a peer with its allowed IPs */
+static size_t
+mock_peer_size(const struct wg_peer_io *p)
+{
+	return sizeof(*p) + p->p_aips_count * sizeof(struct wg_aip_io);
+}
+
+/* Find peer by public key */
+static size_t
+mock_find(struct wg_mock *m, const uint8_t key[WG_KEY_LEN])
+{
+	size_t i;
+
+	for (i = 0; i < m->npeers; i++)
+		if (memcmp(m->peers[i]->p_public, key, WG_KEY_LEN) == 0)
+			break;
+
+	return i;
+}
+
+/* Drop peer i; order is not preserved */
+static void
+mock_remove(struct wg_mock *m, size_t i)
+{
+	free(m->peers[i]);
+	m->peers[i] = m->peers[--m->npeers];
+}
+
+/* Drop every peer and forget the configuration */
+static void
+mock_reset(struct wg_mock *m)
+{
+	while (m->npeers > 0)
+		mock_remove(m, m->npeers - 1);
+	memset(&m->hdr, 0, sizeof(m->hdr));
+}
+
+/* Apply one peer from a SIOCSWG request */
+static int
+mock_set_peer(struct wg_mock *m, const struct wg_peer_io *in)
+{
+	struct wg_peer_io *p;
+	size_t i, naips, size;
+
+	i = mock_find(m, in->p_public);
+	if (in->p_flags & WG_PEER_REMOVE) {
+		if (i < m->npeers)
+			mock_remove(m, i);
+		return 0;
+	}
+
+	if (i == m->npeers) {
+		if (in->p_flags & WG_PEER_UPDATE)
+			return 0;
+		if (m->npeers >= WG_PEERS_MAX)
+			return ENOSPC;
+		if ((p = calloc(1, sizeof(*p))) == NULL)
+			return ENOMEM;
+		memcpy(p->p_public, in->p_public, WG_KEY_LEN);
+		m->peers[m->npeers++] = p;
+	}
+	p = m->peers[i];
+
+	if (in->p_flags & WG_PEER_HAS_PSK)
+		memcpy(p->p_psk, in->p_psk, WG_KEY_LEN);
+	if (in->p_flags & WG_PEER_HAS_PKA)
+		p->p_pka = in->p_pka;
+	if (in->p_flags & WG_PEER_HAS_ENDPOINT)
+		memcpy(&p->p_endpoint, &in->p_endpoint, sizeof(p->p_endpoint));
+	if (in->p_flags & WG_PEER_SET_DESCRIPTION)
+		memcpy(p->p_description, in->p_description,
+		    sizeof(p->p_description));
+
+	naips = in->p_aips_count;
+	if (!(in->p_flags & WG_PEER_REPLACE_AIPS))
+		naips += p->p_aips_count;
+	else
+		p->p_aips_count = 0;
+	if (naips == 0)
+		return 0;
+
+	size = sizeof(*p) + naips * sizeof(struct wg_aip_io);
+	if ((p = realloc(p, size)) == NULL)
+		return ENOMEM;
+	m->peers[i] = p;
+	memcpy(&p->p_aips[p->p_aips_count], in->p_aips,
+	    in->p_aips_count * sizeof(struct wg_aip_io));
+	p->p_aips_count = naips;
+
+	return 0;
+}
+
+/* SIOCSWG */
+static int
+mock_set(struct wg_mock *m, struct wg_data_io *dio)
+{
+	struct wg_interface_io *iface = dio->wgd_interface;
+	const struct wg_peer_io *in;
+	size_t i;
+	int error;
+
+	if (!wg_data_valid(iface, dio->wgd_size))
+		return EINVAL;
+
+	if (iface->i_flags & WG_INTERFACE_HAS_PRIVATE) {
+		memcpy(m->hdr.i_private, iface->i_private, WG_KEY_LEN);
+		crypto_scalarmult_base(m->hdr.i_public, m->hdr.i_private);
+		m->hdr.i_flags |= WG_INTERFACE_HAS_PRIVATE |
+		    WG_INTERFACE_HAS_PUBLIC;
+	}
+	if (iface->i_flags & WG_INTERFACE_HAS_PORT) {
+		m->hdr.i_port = iface->i_port;
+		m->hdr.i_flags |= WG_INTERFACE_HAS_PORT;
+	}
+	if (iface->i_flags & WG_INTERFACE_HAS_RTABLE) {
+		m->hdr.i_rtable = iface->i_rtable;
+		m->hdr.i_flags |= WG_INTERFACE_HAS_RTABLE;
+	}
+	if (iface->i_flags & WG_INTERFACE_REPLACE_PEERS)
+		while (m->npeers > 0)
+			mock_remove(m, m->npeers - 1);
+
+	in = &iface->i_peers[0];
+	for (i = 0; i < iface->i_peers_count; i++, in = WG_PEER_NEXT(in))
+		if ((error = mock_set_peer(m, in)) != 0)
+			return error;
+
+	return 0;
+}
+
+/*
+ * SIOCGWG. Like wg(4), report the size needed for every peer when the
+ * buffer is short; unlike it, always fill in the interface header.
+ */
+static int
+mock_get(struct wg_mock *m, struct wg_data_io *dio)
+{
+	struct wg_interface_io *iface = dio->wgd_interface;
+	struct wg_peer_io *out;
+	size_t i, size;
+
+	size = sizeof(*iface);
+	for (i = 0; i < m->npeers; i++)
+		size += mock_peer_size(m->peers[i]);
+
+	memcpy(iface, &m->hdr, sizeof(*iface));
+	iface->i_peers_count = 0;
+	if (dio->wgd_size < size) {
+		dio->wgd_size = size;
+		return 0;
+	}
+
+	out = &iface->i_peers[0];
+	for (i = 0; i < m->npeers; i++) {
+		memcpy(out, m->peers[i], mock_peer_size(m->peers[i]));
+		out = WG_PEER_NEXT(out);
+	}
+	iface->i_peers_count = m->npeers;
+	dio->wgd_size = size;
+
+	return 0;
+}
+
+/* Serve an interface ioctl(2) from the mock */
+int
+wg_mock_ioctl(wg_handle_t *wg, unsigned long req, void *arg)
+{
+	struct wg_mock *m = wg->mock;
+	int error;
+
+	switch (req) {
+	case SIOCIFCREATE:
+		error = m->created ? EEXIST : 0;
+		m->created = 1;
+		break;
+	case SIOCIFDESTROY:
+		error = m->created ? 0 : ENXIO;
+		mock_reset(m);
+		m->created = 0;
+		break;
+	case SIOCSWG:
+		error = m->created ? mock_set(m, arg) : ENXIO;
+		break;
+	case SIOCGWG:
+		error = m->created ? mock_get(m, arg) : ENXIO;
+		break;
+	default:
+		error = ENOTTY;
+		break;
+	}
+
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Free mock interface */
+void
+wg_mock_free(wg_handle_t *wg)
+{
+	if (wg->mock == NULL)
+		return;
+
+	mock_reset(wg->mock);
+	free(wg->mock->peers);
+	free(wg->mock);
+	wg->mock = NULL;
+}
+
+/* Open handle on a new mock interface; it still has to be created */
+fw_err_t
+wg_open_mock(wg_handle_t *wg, const char *ifname)
+{
+	struct wg_mock *m;
+
+	if (strlen(ifname) >= IFNAMSIZ) {
+		errno = EINVAL;
+		return FW_ERR;
+	}
+
+	if ((m = calloc(1, sizeof(*m))) == NULL)
+		return FW_ERR;
+	if ((m->peers = calloc(WG_PEERS_MAX, sizeof(*m->peers))) == NULL) {
+		free(m);
+		return FW_ERR;
+	}
+
+	wg->sock = -1;
+	wg->mock = m;
+	wg->priv = NULL;
+	wg->user = NULL;
+	strlcpy(wg->ifname, ifname, IFNAMSIZ);
+
+	return FW_OK;
+}
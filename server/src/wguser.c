@@ -0,0 +1,1549 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * wguser.c - Userspace WireGuard data plane. It answers the same
+ * SIOCIFCREATE/SIOCIFDESTROY/SIOCSWG/SIOCGWG requests as wg(4), but moves
+ * the packets itself, between a tun(4) device and UDP sockets:
+ *
+ * - One worker thread per CPU. Every worker polls the tun device and the
+ *   sockets and reads in batches (recvmmsg(2) for UDP), but each peer
+ *   belongs to one worker: packets for another worker's peer are copied
+ *   to that worker's inbox. A peer's sessions, counters and replay
+ *   windows are only touched by its worker and, under the peer lock, by
+ *   whichever worker reads a handshake for it.
+ * - Sealed packets leave in batches with sendmmsg(2).
+ * - Configuration changes take the device lock for writing, between
+ *   batches; the data path only ever holds it for reading.
+ *
+ * Left out: cookie replies under load (initiations are always answered)
+ * and queueing packets while a handshake is in flight (they are dropped;
+ * the initiator sends a keepalive as soon as the session is up).
+ */
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#ifdef __linux__
+#include <linux/if_tun.h>
+#endif
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sodium.h>
+
+#include "lpm.h"
+#include "metrics.h"
+#include "noise.h"
+#include "wireguard.h"
+
+/* Buffers and batching */
+#define WGU_PKT_MAX      2048  /* Packet buffer size                 */
+#define WGU_MTU_MAX      1920  /* Largest tunneled packet            */
+#define WGU_BATCH        32    /* Packets per read or send batch     */
+#define WGU_INBOX        256   /* Handed-off packets per worker      */
+#define WGU_THREADS_MAX  16    /* Worker threads                     */
+#define WGU_INDEXES      (4 * WG_PEERS_MAX)  /* Session indexes      */
+#define WGU_SOCKBUF      (4 * 1024 * 1024)   /* UDP socket buffers   */
+
+/* Protocol timers (ms) and limits, from the WireGuard paper */
+#define REKEY_AFTER_TIME       (120 * 1000)
+#define REJECT_AFTER_TIME      (180 * 1000)
+#define REKEY_ATTEMPT_TIME     (90 * 1000)
+#define REKEY_TIMEOUT          (5 * 1000)
+#define KEEPALIVE_TIMEOUT      (10 * 1000)
+#define INITIATION_INTERVAL    (1000 / 50)
+#define REKEY_AFTER_MESSAGES   (1ULL << 60)
+#define REJECT_AFTER_MESSAGES  (UINT64_MAX - (1ULL << 13))
+
+/* Replay window: words of 64 counters, one of them always partial */
+#define WGU_REPLAY_WORDS  32
+#define WGU_REPLAY_WIN    (64 * (WGU_REPLAY_WORDS - 1))
+
+/* Sessions by role */
+#define WGU_CUR   0  /* In use                                  */
+#define WGU_PREV  1  /* Replaced; still accepted until it ages  */
+#define WGU_NEXT  2  /* Ours as responder, until first data     */
+
+/* tun(4) packets carry their address family on OpenBSD */
+#ifdef __linux__
+#define WGU_TUN_HDR  0
+#else
+#define WGU_TUN_HDR  sizeof(uint32_t)
+#endif
+
+/* Keys and counters from one handshake */
+struct wgu_session {
+	uint8_t send[NOISE_KEY_LEN];
+	uint8_t recv[NOISE_KEY_LEN];
+	uint64_t nonce;                     /* Next sending counter        */
+	uint64_t top;                       /* Highest counter seen + 1    */
+	uint64_t replay[WGU_REPLAY_WORDS];  /* Counters seen below top     */
+	uint64_t born;                      /* Creation time (ms)          */
+	uint32_t local;                     /* Our index                   */
+	uint32_t remote;                    /* Their index                 */
+	int initiator;                      /* We started the handshake    */
+	int valid;
+};
+
+/* Peer */
+struct wgu_peer {
+	pthread_mutex_t lock;              /* Peer state, io contents      */
+	struct wg_peer_io *io;             /* Config and counters          */
+	noise_remote_t remote;             /* Static identity              */
+	noise_hs_t hs;                     /* Initiation we sent           */
+	uint32_t hs_local;                 /* Its index, 0 = none          */
+	uint64_t hs_started;               /* First attempt (ms)           */
+	uint64_t hs_sent;                  /* Last attempt (ms)            */
+	uint64_t init_recv;                /* Last initiation taken (ms)   */
+	uint8_t init_ts[NOISE_TS_LEN];     /* Its timestamp                */
+	struct wgu_session sess[3];        /* By role                      */
+	uint64_t sent;                     /* Last data sent (ms)          */
+	uint64_t recv;                     /* Last data received (ms)      */
+	uint32_t slot;                     /* Index in peers               */
+	int shard;                         /* Owning worker                */
+};
+
+/* Packet handed to another worker */
+struct wgu_pkt {
+	struct sockaddr_storage from;  /* Sender of a datagram  */
+	uint16_t len;
+	uint8_t tun;                   /* From tun(4), else UDP */
+	uint8_t data[WGU_PKT_MAX];
+};
+
+/* Datagrams to send, or received, in one batch */
+struct wgu_batch {
+	struct mmsghdr msgs[WGU_BATCH];
+	struct iovec iov[WGU_BATCH];
+	struct sockaddr_storage addrs[WGU_BATCH];
+	uint8_t bufs[WGU_BATCH][WGU_PKT_MAX];
+	unsigned int n;
+};
+
+/* Worker thread */
+struct wgu_worker {
+	struct wg_user *u;
+	pthread_t thread;
+	int id;
+	int wake[2];                      /* Inbox doorbell            */
+	pthread_mutex_t lock;             /* Inbox fill side           */
+	struct wgu_pkt *inbox[2];         /* Double-buffered inbox     */
+	size_t inbox_n[2];
+	int fill;                         /* Buffer producers fill     */
+	struct wgu_batch rx;              /* Datagrams read            */
+	struct wgu_batch tx[2];           /* Datagrams out, by family  */
+	uint8_t pkt[WGU_PKT_MAX];         /* Packet read from tun(4)   */
+};
+
+/* Session index slot */
+struct wgu_index {
+	uint32_t id;    /* Index handed out           */
+	uint32_t slot;  /* Peer slot + 1, 0 = free    */
+};
+
+/* Userspace interface state */
+struct wg_user {
+	pthread_rwlock_t lock;             /* Config, peers, fds        */
+	pthread_mutex_t gate;              /* Lets writers in first     */
+	int created;                       /* SIOCIFCREATE seen         */
+	int tunfd;                         /* Device handed in, or -1   */
+	int tun;                           /* Packet device             */
+	int udp[2];                        /* IPv4 and IPv6 sockets     */
+	struct wg_interface_io hdr;        /* Keys, port and flags      */
+	noise_local_t local;               /* Our identity              */
+	struct wgu_peer *peers[WG_PEERS_MAX];
+	size_t npeers;                     /* Slots in use, high mark   */
+	fw_lpm_t aips;                     /* Allowed IPs to peer slot  */
+	pthread_mutex_t ilock;             /* Session indexes           */
+	struct wgu_index index[WGU_INDEXES];
+	struct wgu_worker *workers;
+	int nworkers;
+	int stop;                          /* Workers should exit       */
+};
+
+/* Milliseconds on the monotonic clock */
+static uint64_t
+wgu_now(void)
+{
+	return fw_metric_now() / 1000000;
+}
+
+/* Take the device lock for reading, behind any waiting writer */
+static void
+wgu_rdlock(struct wg_user *u)
+{
+	pthread_mutex_lock(&u->gate);
+	pthread_mutex_unlock(&u->gate);
+	pthread_rwlock_rdlock(&u->lock);
+}
+
+/*
+ * START session indexes
+ */
+
+/* Hand out an index for peer slot; 0 if none are left */
+static uint32_t
+wgu_index_new(struct wg_user *u, uint32_t slot)
+{
+	uint32_t r, pos, id = 0, i;
+
+	r = randombytes_random();
+	pthread_mutex_lock(&u->ilock);
+	for (i = 0; i < WGU_INDEXES; i++) {
+		pos = (r + i) & (WGU_INDEXES - 1);
+		if (u->index[pos].slot != 0)
+			continue;
+
+		/* The low bits find the slot; 0 means "no index" */
+		id = (r & ~(WGU_INDEXES - 1)) | pos;
+		if (id == 0)
+			id = WGU_INDEXES;
+		u->index[pos].id = id;
+		u->index[pos].slot = slot + 1;
+		break;
+	}
+	pthread_mutex_unlock(&u->ilock);
+
+	return id;
+}
+
+static void
+wgu_index_free(struct wg_user *u, uint32_t id)
+{
+	struct wgu_index *e = &u->index[id & (WGU_INDEXES - 1)];
+
+	if (id == 0)
+		return;
+
+	pthread_mutex_lock(&u->ilock);
+	if (e->id == id)
+		memset(e, 0, sizeof(*e));
+	pthread_mutex_unlock(&u->ilock);
+}
+
+/* Peer holding index id, or NULL */
+static struct wgu_peer *
+wgu_index_peer(struct wg_user *u, uint32_t id)
+{
+	struct wgu_index *e = &u->index[id & (WGU_INDEXES - 1)];
+	uint32_t slot;
+
+	pthread_mutex_lock(&u->ilock);
+	slot = e->id == id ? e->slot : 0;
+	pthread_mutex_unlock(&u->ilock);
+
+	return slot != 0 ? u->peers[slot - 1] : NULL;
+}
+
+/*
+ * END session indexes
+ */
+
+/*
+ * START sessions
+ */
+
+/* Wipe a session and release its index */
+static void
+wgu_sess_clear(struct wg_user *u, struct wgu_session *s)
+{
+	if (s->valid)
+		wgu_index_free(u, s->local);
+	explicit_bzero(s, sizeof(*s));
+}
+
+/* Drop a peer's sessions and handshake, e.g. after a key change */
+static void
+wgu_peer_reset(struct wg_user *u, struct wgu_peer *p)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		wgu_sess_clear(u, &p->sess[i]);
+	wgu_index_free(u, p->hs_local);
+	p->hs_local = 0;
+	explicit_bzero(&p->hs, sizeof(p->hs));
+}
+
+/* Session usable for sending at now */
+static int
+wgu_sess_live(const struct wgu_session *s, uint64_t now)
+{
+	return s->valid && now - s->born < REJECT_AFTER_TIME &&
+	    s->nonce < REJECT_AFTER_MESSAGES;
+}
+
+/* Accept counter c once, after its packet authenticated */
+static int
+wgu_replay(struct wgu_session *s, uint64_t c)
+{
+	uint64_t *w, bit, top, word, i;
+
+	if (c >= REJECT_AFTER_MESSAGES)
+		return 0;
+
+	word = c >> 6;
+	if (c >= s->top) {
+		/* Slide the window, clearing the words it moves over */
+		top = s->top == 0 ? word : (s->top - 1) >> 6;
+		for (i = 1; i <= word - top && i <= WGU_REPLAY_WORDS; i++)
+			s->replay[(top + i) % WGU_REPLAY_WORDS] = 0;
+		s->top = c + 1;
+	} else if (s->top - c > WGU_REPLAY_WIN)
+		return 0;
+
+	w = &s->replay[word % WGU_REPLAY_WORDS];
+	bit = 1ULL << (c & 63);
+	if (*w & bit)
+		return 0;
+	*w |= bit;
+
+	return 1;
+}
+
+/*
+ * Seal len bytes of plain (padded in place, so plain needs 15 spare
+ * bytes) into a data message at out; returns the message length
+ */
+static size_t
+wgu_seal(struct wgu_session *s, uint8_t *out, uint8_t *plain, size_t len)
+{
+	struct noise_data *d = (struct noise_data *)out;
+	uint8_t nonce[crypto_aead_chacha20poly1305_ietf_NPUBBYTES];
+	size_t padded = (len + 15) & ~(size_t)15;
+
+	memset(plain + len, 0, padded - len);
+	d->type = htole32(NOISE_MSG_DATA);
+	d->receiver = htole32(s->remote);
+	d->counter = htole64(s->nonce++);
+
+	memset(nonce, 0, 4);
+	memcpy(nonce + 4, &d->counter, sizeof(d->counter));
+	crypto_aead_chacha20poly1305_ietf_encrypt(out + sizeof(*d), NULL,
+	    plain, padded, NULL, 0, NULL, nonce, s->send);
+
+	return sizeof(*d) + padded + NOISE_TAG_LEN;
+}
+
+/*
+ * END sessions
+ */
+
+/*
+ * START I/O
+ */
+
+/* Socket for an endpoint's family */
+static int
+wgu_sock(struct wg_user *u, const struct sockaddr *sa)
+{
+	return u->udp[sa->sa_family == AF_INET6];
+}
+
+static socklen_t
+wgu_salen(const struct sockaddr *sa)
+{
+	return sa->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) :
+	    sizeof(struct sockaddr_in);
+}
+
+/* Send one datagram to p's endpoint, outside any batch */
+static void
+wgu_sendto(struct wg_user *u, struct wgu_peer *p, const void *buf,
+    size_t len)
+{
+	const struct sockaddr *sa = &p->io->p_sa;
+
+	if (sendto(wgu_sock(u, sa), buf, len, 0, sa, wgu_salen(sa)) == -1)
+		fw_metric_inc(FW_C_DP_DROPS);
+}
+
+/* Send a batch of datagrams on socket fd */
+static void
+wgu_flush(struct wgu_batch *b, int fd)
+{
+	unsigned int off = 0;
+	int n;
+
+	while (off < b->n) {
+		if ((n = sendmmsg(fd, b->msgs + off, b->n - off, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			fw_metric_add(FW_C_DP_DROPS, b->n - off);
+			break;
+		}
+		off += n;
+	}
+	fw_metric_add(FW_C_DP_TX, off);
+	b->n = 0;
+}
+
+/* Hand a packet to the worker that owns its peer */
+static void
+wgu_handoff(struct wgu_worker *to, const void *data, size_t len, int tun,
+    const struct sockaddr_storage *from)
+{
+	struct wgu_pkt *pkt;
+	int ring = 0;
+
+	pthread_mutex_lock(&to->lock);
+	if (to->inbox_n[to->fill] < WGU_INBOX) {
+		pkt = &to->inbox[to->fill][to->inbox_n[to->fill]++];
+		memcpy(pkt->data, data, len);
+		pkt->len = len;
+		pkt->tun = tun;
+		if (from != NULL)
+			memcpy(&pkt->from, from, sizeof(pkt->from));
+		ring = to->inbox_n[to->fill] == 1;
+	} else
+		fw_metric_inc(FW_C_DP_DROPS);
+	pthread_mutex_unlock(&to->lock);
+
+	if (ring)
+		write(to->wake[1], "", 1);
+}
+
+/* Length of the IP packet at ip, with its family and addresses */
+static size_t
+wgu_ip(const uint8_t *ip, size_t len, int *af, const uint8_t **src,
+    const uint8_t **dst)
+{
+	size_t n;
+
+	if (len >= 20 && (ip[0] >> 4) == 4) {
+		n = ip[2] << 8 | ip[3];
+		*af = AF_INET;
+		*src = ip + 12;
+		*dst = ip + 16;
+		if (n < 20)
+			return 0;
+	} else if (len >= 40 && (ip[0] >> 4) == 6) {
+		n = 40 + (ip[4] << 8 | ip[5]);
+		*af = AF_INET6;
+		*src = ip + 8;
+		*dst = ip + 24;
+	} else
+		return 0;
+
+	return n <= len ? n : 0;
+}
+
+/*
+ * END I/O
+ */
+
+/*
+ * START handshakes
+ */
+
+/* Send an initiation to p, at most every REKEY_TIMEOUT */
+static void
+wgu_initiate(struct wg_user *u, struct wgu_peer *p, uint64_t now)
+{
+	struct noise_init m;
+
+	if (p->io->p_sa.sa_family == 0 ||
+	    !(u->hdr.i_flags & WG_INTERFACE_HAS_PRIVATE))
+		return;
+	if (p->hs_local != 0 && now - p->hs_sent < REKEY_TIMEOUT)
+		return;
+
+	if (p->hs_local == 0)
+		p->hs_started = now;
+	wgu_index_free(u, p->hs_local);
+	if ((p->hs_local = wgu_index_new(u, p->slot)) == 0)
+		return;
+
+	if (noise_create_init(&u->local, &p->remote, &p->hs, &m,
+	    p->hs_local) != FW_OK) {
+		wgu_index_free(u, p->hs_local);
+		p->hs_local = 0;
+		return;
+	}
+	p->hs_sent = now;
+	wgu_sendto(u, p, &m, sizeof(m));
+}
+
+/* Send an empty data message on p's current session */
+static void
+wgu_keepalive(struct wg_user *u, struct wgu_peer *p, uint64_t now)
+{
+	uint8_t buf[sizeof(struct noise_data) + NOISE_TAG_LEN], pad[16];
+	struct wgu_session *s = &p->sess[WGU_CUR];
+
+	if (!wgu_sess_live(s, now) || p->io->p_sa.sa_family == 0)
+		return;
+
+	wgu_sendto(u, p, buf, wgu_seal(s, buf, pad, 0));
+	p->sent = now;
+}
+
+/* Peer with static key pub, or NULL */
+static struct wgu_peer *
+wgu_find(struct wg_user *u, const uint8_t pub[WG_KEY_LEN])
+{
+	size_t i;
+
+	for (i = 0; i < u->npeers; i++) {
+		if (u->peers[i] != NULL &&
+		    memcmp(u->peers[i]->io->p_public, pub, WG_KEY_LEN) == 0)
+			return u->peers[i];
+	}
+
+	return NULL;
+}
+
+/* Answer an initiation with a response and a pending session */
+static void
+wgu_handle_init(struct wg_user *u, const struct noise_init *m,
+    const struct sockaddr_storage *from, uint64_t now)
+{
+	struct wgu_session *s;
+	struct noise_resp r;
+	struct wgu_peer *p;
+	noise_hs_t hs;
+	uint32_t local;
+
+	if (!(u->hdr.i_flags & WG_INTERFACE_HAS_PRIVATE) ||
+	    !noise_check_mac1(&u->local, m, sizeof(*m)) ||
+	    noise_consume_init(&u->local, &hs, m) != FW_OK ||
+	    (p = wgu_find(u, hs.spub)) == NULL)
+		goto drop;
+
+	pthread_mutex_lock(&p->lock);
+
+	/* Replayed or flooded initiations */
+	if (memcmp(hs.ts, p->init_ts, NOISE_TS_LEN) <= 0 ||
+	    now - p->init_recv < INITIATION_INTERVAL ||
+	    (local = wgu_index_new(u, p->slot)) == 0)
+		goto unlock;
+
+	if (noise_create_resp(&u->local, &p->remote, &hs, &r, local,
+	    le32toh(m->sender)) != FW_OK) {
+		wgu_index_free(u, local);
+		goto unlock;
+	}
+	memcpy(p->init_ts, hs.ts, NOISE_TS_LEN);
+	p->init_recv = now;
+
+	/* Not ours to send on until the initiator uses it */
+	s = &p->sess[WGU_NEXT];
+	wgu_sess_clear(u, s);
+	noise_derive(&hs, 0, s->send, s->recv);
+	s->born = now;
+	s->local = local;
+	s->remote = le32toh(m->sender);
+	s->valid = 1;
+
+	memcpy(&p->io->p_endpoint, from, wgu_salen((struct sockaddr *)from));
+	clock_gettime(CLOCK_REALTIME, &p->io->p_last_handshake);
+	wgu_sendto(u, p, &r, sizeof(r));
+	pthread_mutex_unlock(&p->lock);
+	fw_metric_inc(FW_C_DP_HANDSHAKES);
+	return;
+
+unlock:
+	pthread_mutex_unlock(&p->lock);
+drop:
+	explicit_bzero(&hs, sizeof(hs));
+	fw_metric_inc(FW_C_DP_DROPS);
+}
+
+/* Finish our handshake from its response, then confirm with a keepalive */
+static void
+wgu_handle_resp(struct wg_user *u, const struct noise_resp *m,
+    const struct sockaddr_storage *from, uint64_t now)
+{
+	uint32_t id = le32toh(m->receiver);
+	struct wgu_session *s;
+	struct wgu_peer *p;
+	noise_hs_t hs;
+
+	if (!noise_check_mac1(&u->local, m, sizeof(*m)) ||
+	    (p = wgu_index_peer(u, id)) == NULL) {
+		fw_metric_inc(FW_C_DP_DROPS);
+		return;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	memcpy(&hs, &p->hs, sizeof(hs));
+	if (p->hs_local != id ||
+	    noise_consume_resp(&u->local, &p->remote, &hs, m) != FW_OK) {
+		pthread_mutex_unlock(&p->lock);
+		explicit_bzero(&hs, sizeof(hs));
+		fw_metric_inc(FW_C_DP_DROPS);
+		return;
+	}
+
+	/* The handshake's index carries over to the session */
+	wgu_sess_clear(u, &p->sess[WGU_PREV]);
+	wgu_sess_clear(u, &p->sess[WGU_NEXT]);
+	memcpy(&p->sess[WGU_PREV], &p->sess[WGU_CUR], sizeof(*s));
+	s = &p->sess[WGU_CUR];
+	explicit_bzero(s, sizeof(*s));
+	noise_derive(&hs, 1, s->send, s->recv);
+	s->born = now;
+	s->local = id;
+	s->remote = le32toh(m->sender);
+	s->initiator = 1;
+	s->valid = 1;
+	p->hs_local = 0;
+	explicit_bzero(&p->hs, sizeof(p->hs));
+
+	memcpy(&p->io->p_endpoint, from, wgu_salen((struct sockaddr *)from));
+	clock_gettime(CLOCK_REALTIME, &p->io->p_last_handshake);
+	wgu_keepalive(u, p, now);
+	pthread_mutex_unlock(&p->lock);
+	fw_metric_inc(FW_C_DP_HANDSHAKES);
+}
+
+/*
+ * END handshakes
+ */
+
+/*
+ * START data path
+ */
+
+/* Seal a packet from tun(4) for p into the outgoing batch */
+static void
+wgu_tx(struct wgu_worker *w, struct wgu_peer *p, uint8_t *ip, size_t len,
+    uint64_t now)
+{
+	struct wg_user *u = w->u;
+	struct wgu_session *s = &p->sess[WGU_CUR];
+	struct wgu_batch *b;
+	struct sockaddr *sa;
+	int fam;
+
+	pthread_mutex_lock(&p->lock);
+	sa = &p->io->p_sa;
+	if (!wgu_sess_live(s, now) || sa->sa_family == 0) {
+		wgu_initiate(u, p, now);
+		pthread_mutex_unlock(&p->lock);
+		fw_metric_inc(FW_C_DP_DROPS);
+		return;
+	}
+	if (s->initiator && (now - s->born >= REKEY_AFTER_TIME ||
+	    s->nonce >= REKEY_AFTER_MESSAGES))
+		wgu_initiate(u, p, now);
+
+	fam = sa->sa_family == AF_INET6;
+	b = &w->tx[fam];
+	if (b->n == WGU_BATCH)
+		wgu_flush(b, u->udp[fam]);
+	b->iov[b->n].iov_len = wgu_seal(s, b->bufs[b->n], ip, len);
+	memcpy(&b->addrs[b->n], sa, wgu_salen(sa));
+	b->msgs[b->n].msg_hdr.msg_namelen = wgu_salen(sa);
+	b->n++;
+
+	p->io->p_txbytes += len;
+	p->sent = now;
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* Open a data message for p and write the packet to tun(4) */
+static void
+wgu_rx(struct wgu_worker *w, struct wgu_peer *p, uint8_t *buf, size_t len,
+    const struct sockaddr_storage *from, uint64_t now)
+{
+	struct noise_data *d = (struct noise_data *)buf;
+	uint8_t nonce[crypto_aead_chacha20poly1305_ietf_NPUBBYTES];
+	struct wg_user *u = w->u;
+	struct wgu_session *s = NULL;
+	const uint8_t *src, *dst;
+	uint8_t *ip = buf + sizeof(*d);
+	uint32_t id, slot;
+	uint64_t counter;
+	size_t iplen;
+	int i, af;
+
+	id = le32toh(d->receiver);
+	counter = le64toh(d->counter);
+	len -= sizeof(*d);
+
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; i < 3; i++) {
+		if (p->sess[i].valid && p->sess[i].local == id)
+			s = &p->sess[i];
+	}
+	if (s == NULL || now - s->born >= REJECT_AFTER_TIME)
+		goto drop;
+
+	memset(nonce, 0, 4);
+	memcpy(nonce + 4, &d->counter, sizeof(d->counter));
+	if (crypto_aead_chacha20poly1305_ietf_decrypt(ip, NULL, NULL, ip, len,
+	    NULL, 0, nonce, s->recv) != 0 || !wgu_replay(s, counter))
+		goto drop;
+	len -= NOISE_TAG_LEN;
+
+	/* First data on our pending session: the initiator has the keys */
+	if (s == &p->sess[WGU_NEXT]) {
+		wgu_sess_clear(u, &p->sess[WGU_PREV]);
+		memcpy(&p->sess[WGU_PREV], &p->sess[WGU_CUR], sizeof(*s));
+		memcpy(&p->sess[WGU_CUR], s, sizeof(*s));
+		explicit_bzero(s, sizeof(*s));
+		s = &p->sess[WGU_CUR];
+	}
+
+	/* Our own session: ask for fresh keys before it expires */
+	if (s == &p->sess[WGU_CUR] && s->initiator && now - s->born >=
+	    REJECT_AFTER_TIME - KEEPALIVE_TIMEOUT - REKEY_TIMEOUT)
+		wgu_initiate(u, p, now);
+
+	memcpy(&p->io->p_endpoint, from, wgu_salen((struct sockaddr *)from));
+	p->io->p_rxbytes += len + sizeof(*d) + NOISE_TAG_LEN;
+	if (len > 0)
+		p->recv = now;
+	slot = p->slot;
+	pthread_mutex_unlock(&p->lock);
+
+	/* A keepalive */
+	if (len == 0)
+		return;
+
+	/* Only accept sources the peer is allowed to use */
+	if ((iplen = wgu_ip(ip, len, &af, &src, &dst)) == 0 ||
+	    fw_lpm_lookup(&u->aips, af, src, &id) != FW_OK || id != slot) {
+		fw_metric_inc(FW_C_DP_DROPS);
+		return;
+	}
+
+#if WGU_TUN_HDR > 0
+	*(uint32_t *)(ip - WGU_TUN_HDR) = htonl(af);
+#endif
+	if (write(u->tun, ip - WGU_TUN_HDR, iplen + WGU_TUN_HDR) == -1)
+		fw_metric_inc(FW_C_DP_DROPS);
+	else
+		fw_metric_inc(FW_C_DP_RX);
+	return;
+
+drop:
+	pthread_mutex_unlock(&p->lock);
+	fw_metric_inc(FW_C_DP_DROPS);
+}
+
+/* Route a datagram: handshakes here, data to the peer's worker */
+static void
+wgu_datagram(struct wgu_worker *w, uint8_t *buf, size_t len,
+    const struct sockaddr_storage *from, uint64_t now)
+{
+	struct wg_user *u = w->u;
+	struct wgu_peer *p;
+	uint32_t type;
+
+	if (len < sizeof(type))
+		return;
+	memcpy(&type, buf, sizeof(type));
+
+	switch (le32toh(type)) {
+	case NOISE_MSG_INIT:
+		if (len == sizeof(struct noise_init))
+			wgu_handle_init(u, (struct noise_init *)buf, from, now);
+		return;
+	case NOISE_MSG_RESP:
+		if (len == sizeof(struct noise_resp))
+			wgu_handle_resp(u, (struct noise_resp *)buf, from, now);
+		return;
+	case NOISE_MSG_DATA:
+		if (len < sizeof(struct noise_data) + NOISE_TAG_LEN)
+			break;
+		p = wgu_index_peer(u,
+		    le32toh(((struct noise_data *)buf)->receiver));
+		if (p == NULL)
+			break;
+		if (p->shard != w->id)
+			wgu_handoff(&u->workers[p->shard], buf, len, 0, from);
+		else
+			wgu_rx(w, p, buf, len, from, now);
+		return;
+	}
+
+	fw_metric_inc(FW_C_DP_DROPS);
+}
+
+/* Route a packet from tun(4) to the worker of the peer it's for */
+static void
+wgu_packet(struct wgu_worker *w, uint8_t *ip, size_t len, uint64_t now)
+{
+	struct wg_user *u = w->u;
+	const uint8_t *src, *dst;
+	struct wgu_peer *p;
+	uint32_t slot;
+	int af;
+
+	if ((len = wgu_ip(ip, len, &af, &src, &dst)) == 0 ||
+	    fw_lpm_lookup(&u->aips, af, dst, &slot) != FW_OK ||
+	    (p = u->peers[slot]) == NULL) {
+		fw_metric_inc(FW_C_DP_DROPS);
+		return;
+	}
+
+	if (p->shard != w->id)
+		wgu_handoff(&u->workers[p->shard], ip, len, 1, NULL);
+	else
+		wgu_tx(w, p, ip, len, now);
+}
+
+/* Process packets other workers handed us */
+static void
+wgu_inbox(struct wgu_worker *w, uint64_t now)
+{
+	struct wgu_pkt *pkt;
+	size_t i, n;
+	int b;
+	char c;
+
+	while (read(w->wake[0], &c, 1) == 1)
+		;
+
+	pthread_mutex_lock(&w->lock);
+	b = w->fill;
+	w->fill ^= 1;
+	pthread_mutex_unlock(&w->lock);
+
+	/* Producers only fill the other buffer now */
+	n = w->inbox_n[b];
+	for (i = 0; i < n; i++) {
+		pkt = &w->inbox[b][i];
+		if (pkt->tun)
+			wgu_packet(w, pkt->data, pkt->len, now);
+		else
+			wgu_datagram(w, pkt->data, pkt->len, &pkt->from, now);
+	}
+	w->inbox_n[b] = 0;
+}
+
+/* Receive a batch of datagrams on fd; returns how many */
+static int
+wgu_recv(struct wgu_worker *w, int fd, uint64_t now)
+{
+	struct wgu_batch *b = &w->rx;
+	int i, n;
+
+	if (fd == -1)
+		return 0;
+
+	for (i = 0; i < WGU_BATCH; i++) {
+		b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+		b->iov[i].iov_len = WGU_PKT_MAX;
+	}
+	if ((n = recvmmsg(fd, b->msgs, WGU_BATCH, MSG_DONTWAIT, NULL)) <= 0)
+		return 0;
+
+	for (i = 0; i < n; i++)
+		wgu_datagram(w, b->bufs[i], b->msgs[i].msg_len, &b->addrs[i],
+		    now);
+
+	return n;
+}
+
+/* Read a batch of packets from tun(4); returns how many */
+static int
+wgu_read_tun(struct wgu_worker *w, uint64_t now)
+{
+	ssize_t len;
+	int n;
+
+	for (n = 0; n < WGU_BATCH; n++) {
+		len = read(w->u->tun, w->pkt, WGU_TUN_HDR + WGU_MTU_MAX);
+		if (len <= (ssize_t)WGU_TUN_HDR)
+			break;
+		wgu_packet(w, w->pkt + WGU_TUN_HDR, len - WGU_TUN_HDR, now);
+	}
+
+	return n;
+}
+
+/* Keepalives, rekeying and expiry, about once a second */
+static void
+wgu_timers(struct wg_user *u, uint64_t now)
+{
+	struct wgu_session *s;
+	struct wgu_peer *p;
+	size_t i;
+	int j;
+
+	for (i = 0; i < u->npeers; i++) {
+		if ((p = u->peers[i]) == NULL)
+			continue;
+
+		pthread_mutex_lock(&p->lock);
+		for (j = 0; j < 3; j++) {
+			s = &p->sess[j];
+			if (s->valid && now - s->born >= 3 * REJECT_AFTER_TIME)
+				wgu_sess_clear(u, s);
+		}
+
+		/* Retry an unanswered initiation for a while, then give up */
+		if (p->hs_local != 0) {
+			if (now - p->hs_started >= REKEY_ATTEMPT_TIME) {
+				wgu_index_free(u, p->hs_local);
+				p->hs_local = 0;
+				explicit_bzero(&p->hs, sizeof(p->hs));
+			} else
+				wgu_initiate(u, p, now);
+		}
+
+		/* Persistent keepalives bring the session up, too */
+		s = &p->sess[WGU_CUR];
+		if (p->io->p_pka > 0 && !wgu_sess_live(s, now))
+			wgu_initiate(u, p, now);
+		else if (p->io->p_pka > 0 &&
+		    now - p->sent >= p->io->p_pka * 1000ULL)
+			wgu_keepalive(u, p, now);
+		else if (p->recv > p->sent &&
+		    now - p->recv >= KEEPALIVE_TIMEOUT)
+			wgu_keepalive(u, p, now);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+/* Worker thread: poll, then drain every source in batches */
+static void *
+wgu_worker(void *arg)
+{
+	struct wgu_worker *w = arg;
+	struct wg_user *u = w->u;
+	struct pollfd pfd[4];
+	uint64_t now, tick = 0;
+	int busy = 0, i;
+
+	pfd[0].fd = w->wake[0];
+	for (i = 0; i < 4; i++)
+		pfd[i].events = POLLIN;
+
+	for (;;) {
+		wgu_rdlock(u);
+		pfd[1].fd = u->tun;
+		pfd[2].fd = u->udp[0];
+		pfd[3].fd = u->udp[1];
+		pthread_rwlock_unlock(&u->lock);
+
+		if (!busy && poll(pfd, 4, 1000) == -1 && errno != EINTR)
+			break;
+		if (__atomic_load_n(&u->stop, __ATOMIC_ACQUIRE))
+			break;
+
+		wgu_rdlock(u);
+		now = wgu_now();
+		wgu_inbox(w, now);
+		busy = wgu_recv(w, u->udp[0], now) == WGU_BATCH;
+		busy |= wgu_recv(w, u->udp[1], now) == WGU_BATCH;
+		busy |= wgu_read_tun(w, now) == WGU_BATCH;
+		for (i = 0; i < 2; i++)
+			wgu_flush(&w->tx[i], u->udp[i]);
+
+		if (w->id == 0 && now - tick >= 1000) {
+			wgu_timers(u, now);
+			tick = now;
+		}
+		pthread_rwlock_unlock(&u->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * END data path
+ */
+
+/*
+ * START device
+ */
+
+/* Open the tun(4) device named ifname */
+static int
+wgu_open_tun(const char *ifname)
+{
+#ifdef __linux__
+	struct ifreq ifr;
+#else
+	char path[sizeof("/dev/") + IFNAMSIZ];
+#endif
+	int fd;
+
+#ifdef __linux__
+	if ((fd = open("/dev/net/tun", O_RDWR)) == -1)
+		return -1;
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	strlcpy(ifr.ifr_name, ifname, IFNAMSIZ);
+	if (ioctl(fd, TUNSETIFF, &ifr) == -1) {
+		close(fd);
+		return -1;
+	}
+#else
+	snprintf(path, sizeof(path), "/dev/%s", ifname);
+	if ((fd = open(path, O_RDWR)) == -1)
+		return -1;
+#endif
+
+	return fd;
+}
+
+/* Open non-blocking UDP sockets on port, IPv6 if the host has it */
+static int
+wgu_bind(int udp[2], in_port_t port)
+{
+	struct sockaddr_in6 sin6;
+	struct sockaddr_in sin;
+	socklen_t len;
+	int one = 1, buf = WGU_SOCKBUF, i;
+
+	udp[0] = udp[1] = -1;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	memset(&sin6, 0, sizeof(sin6));
+	sin6.sin6_family = AF_INET6;
+
+	if ((udp[0] = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+	    bind(udp[0], (struct sockaddr *)&sin, sizeof(sin)) == -1)
+		goto err;
+
+	/* Share the port the kernel picked */
+	len = sizeof(sin);
+	if (getsockname(udp[0], (struct sockaddr *)&sin, &len) == -1)
+		goto err;
+	sin6.sin6_port = sin.sin_port;
+	if ((udp[1] = socket(AF_INET6, SOCK_DGRAM, 0)) != -1 &&
+	    (setsockopt(udp[1], IPPROTO_IPV6, IPV6_V6ONLY, &one,
+	    sizeof(one)) == -1 || bind(udp[1], (struct sockaddr *)&sin6,
+	    sizeof(sin6)) == -1)) {
+		close(udp[1]);
+		udp[1] = -1;
+	}
+
+	for (i = 0; i < 2 && udp[i] != -1; i++) {
+		setsockopt(udp[i], SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+		setsockopt(udp[i], SOL_SOCKET, SO_SNDBUF, &buf, sizeof(buf));
+		if (fcntl(udp[i], F_SETFL, O_NONBLOCK) == -1)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	for (i = 0; i < 2; i++) {
+		if (udp[i] != -1)
+			close(udp[i]);
+		udp[i] = -1;
+	}
+	return -1;
+}
+
+/* Move to a new port; existing fds keep their numbers */
+static int
+wgu_rebind(struct wg_user *u, in_port_t port)
+{
+	int udp[2], i;
+
+	if (wgu_bind(udp, port) == -1)
+		return errno;
+
+	for (i = 0; i < 2; i++) {
+		if (u->udp[i] != -1 && udp[i] != -1) {
+			dup2(udp[i], u->udp[i]);
+			close(udp[i]);
+		} else {
+			if (u->udp[i] != -1)
+				close(u->udp[i]);
+			u->udp[i] = udp[i];
+		}
+	}
+
+	return 0;
+}
+
+/* Point a batch's headers at its buffers */
+static void
+wgu_batch_init(struct wgu_batch *b)
+{
+	int i;
+
+	for (i = 0; i < WGU_BATCH; i++) {
+		b->iov[i].iov_base = b->bufs[i];
+		b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+	}
+}
+
+/* Stop and free the workers */
+static void
+wgu_stop(struct wg_user *u)
+{
+	struct wgu_worker *w;
+	int i;
+
+	__atomic_store_n(&u->stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < u->nworkers; i++)
+		write(u->workers[i].wake[1], "", 1);
+
+	for (i = 0; i < u->nworkers; i++) {
+		w = &u->workers[i];
+		if (w->thread != 0)
+			pthread_join(w->thread, NULL);
+		close(w->wake[0]);
+		close(w->wake[1]);
+		pthread_mutex_destroy(&w->lock);
+		free(w->inbox[0]);
+		free(w->inbox[1]);
+	}
+
+	free(u->workers);
+	u->workers = NULL;
+	u->nworkers = 0;
+	u->stop = 0;
+}
+
+/* Start one worker per CPU, with signals left to the main thread */
+static int
+wgu_start(struct wg_user *u)
+{
+	struct wgu_worker *w;
+	sigset_t all, old;
+	long ncpu;
+	int i, error = 0;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	u->nworkers = ncpu < 1 ? 1 : ncpu > WGU_THREADS_MAX ?
+	    WGU_THREADS_MAX : ncpu;
+	if ((u->workers = calloc(u->nworkers, sizeof(*w))) == NULL)
+		return ENOMEM;
+
+	for (i = 0; i < u->nworkers; i++) {
+		w = &u->workers[i];
+		w->u = u;
+		w->id = i;
+		w->wake[0] = w->wake[1] = -1;
+		pthread_mutex_init(&w->lock, NULL);
+		w->inbox[0] = calloc(WGU_INBOX, sizeof(struct wgu_pkt));
+		w->inbox[1] = calloc(WGU_INBOX, sizeof(struct wgu_pkt));
+		if (w->inbox[0] == NULL || w->inbox[1] == NULL ||
+		    pipe(w->wake) == -1 ||
+		    fcntl(w->wake[0], F_SETFL, O_NONBLOCK) == -1 ||
+		    fcntl(w->wake[1], F_SETFL, O_NONBLOCK) == -1) {
+			error = errno;
+			break;
+		}
+		wgu_batch_init(&w->rx);
+		wgu_batch_init(&w->tx[0]);
+		wgu_batch_init(&w->tx[1]);
+	}
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; error == 0 && i < u->nworkers; i++)
+		error = pthread_create(&u->workers[i].thread, NULL, wgu_worker,
+		    &u->workers[i]);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (error != 0)
+		wgu_stop(u);
+
+	return error;
+}
+
+/* Free peer slot i */
+static void
+wgu_remove(struct wg_user *u, size_t i)
+{
+	struct wgu_peer *p = u->peers[i];
+
+	wgu_peer_reset(u, p);
+	pthread_mutex_destroy(&p->lock);
+	free(p->io);
+	freezero(p, sizeof(*p));
+	u->peers[i] = NULL;
+
+	while (u->npeers > 0 && u->peers[u->npeers - 1] == NULL)
+		u->npeers--;
+}
+
+/* Rebuild the allowed IP index; later peers win overlaps */
+static int
+wgu_route(struct wg_user *u)
+{
+	struct wg_aip_io *a;
+	fw_lpm_t aips;
+	size_t i, j;
+
+	if (fw_lpm_init(&aips) != FW_OK)
+		return errno;
+
+	for (i = 0; i < u->npeers; i++) {
+		if (u->peers[i] == NULL)
+			continue;
+		for (j = 0; j < u->peers[i]->io->p_aips_count; j++) {
+			a = &u->peers[i]->io->p_aips[j];
+			fw_lpm_delete(&aips, a->a_af, &a->a_addr, a->a_cidr);
+			if (fw_lpm_insert(&aips, a->a_af, &a->a_addr,
+			    a->a_cidr, i) != FW_OK && errno != EINVAL &&
+			    errno != EAFNOSUPPORT) {
+				fw_lpm_free(&aips);
+				return errno;
+			}
+		}
+	}
+
+	fw_lpm_free(&u->aips);
+	u->aips = aips;
+
+	return 0;
+}
+
+/* Apply one peer from a SIOCSWG request */
+static int
+wgu_set_peer(struct wg_user *u, const struct wg_peer_io *in)
+{
+	struct wg_peer_io *io;
+	struct wgu_peer *p;
+	size_t i, naips, size;
+
+	p = wgu_find(u, in->p_public);
+	if (in->p_flags & WG_PEER_REMOVE) {
+		if (p != NULL)
+			wgu_remove(u, p->slot);
+		return 0;
+	}
+
+	if (p == NULL) {
+		if (in->p_flags & WG_PEER_UPDATE)
+			return 0;
+		for (i = 0; i < WG_PEERS_MAX && u->peers[i] != NULL; i++)
+			;
+		if (i == WG_PEERS_MAX)
+			return ENOSPC;
+		if ((p = calloc(1, sizeof(*p))) == NULL)
+			return ENOMEM;
+		if ((p->io = calloc(1, sizeof(*p->io))) == NULL) {
+			free(p);
+			return ENOMEM;
+		}
+		pthread_mutex_init(&p->lock, NULL);
+		memcpy(p->io->p_public, in->p_public, WG_KEY_LEN);
+		noise_remote_init(&p->remote, in->p_public, NULL);
+		p->slot = i;
+		p->shard = i % u->nworkers;
+		u->peers[i] = p;
+		if (i >= u->npeers)
+			u->npeers = i + 1;
+	}
+
+	if (in->p_flags & WG_PEER_HAS_PSK) {
+		memcpy(p->io->p_psk, in->p_psk, WG_KEY_LEN);
+		noise_remote_init(&p->remote, in->p_public, in->p_psk);
+	}
+	if (in->p_flags & WG_PEER_HAS_PKA)
+		p->io->p_pka = in->p_pka;
+	if (in->p_flags & WG_PEER_HAS_ENDPOINT)
+		memcpy(&p->io->p_endpoint, &in->p_endpoint,
+		    sizeof(p->io->p_endpoint));
+	if (in->p_flags & WG_PEER_SET_DESCRIPTION)
+		memcpy(p->io->p_description, in->p_description,
+		    sizeof(p->io->p_description));
+
+	naips = in->p_aips_count;
+	if (!(in->p_flags & WG_PEER_REPLACE_AIPS))
+		naips += p->io->p_aips_count;
+	else
+		p->io->p_aips_count = 0;
+	if (naips == 0)
+		return 0;
+
+	size = sizeof(*io) + naips * sizeof(struct wg_aip_io);
+	if ((io = realloc(p->io, size)) == NULL)
+		return ENOMEM;
+	p->io = io;
+	memcpy(&io->p_aips[io->p_aips_count], in->p_aips,
+	    in->p_aips_count * sizeof(struct wg_aip_io));
+	io->p_aips_count = naips;
+
+	return 0;
+}
+
+/* SIOCSWG */
+static int
+wgu_set(struct wg_user *u, struct wg_data_io *dio)
+{
+	struct wg_interface_io *iface = dio->wgd_interface;
+	const struct wg_peer_io *in;
+	size_t i;
+	int error = 0, route;
+
+	if (!wg_data_valid(iface, dio->wgd_size))
+		return EINVAL;
+
+	if (iface->i_flags & WG_INTERFACE_HAS_PRIVATE) {
+		memcpy(u->hdr.i_private, iface->i_private, WG_KEY_LEN);
+		noise_local_init(&u->local, iface->i_private);
+		memcpy(u->hdr.i_public, u->local.pub, WG_KEY_LEN);
+		u->hdr.i_flags |= WG_INTERFACE_HAS_PRIVATE |
+		    WG_INTERFACE_HAS_PUBLIC;
+		for (i = 0; i < u->npeers; i++)
+			if (u->peers[i] != NULL)
+				wgu_peer_reset(u, u->peers[i]);
+	}
+	if ((iface->i_flags & WG_INTERFACE_HAS_PORT) &&
+	    iface->i_port != u->hdr.i_port) {
+		if ((error = wgu_rebind(u, iface->i_port)) != 0)
+			return error;
+		u->hdr.i_port = iface->i_port;
+		u->hdr.i_flags |= WG_INTERFACE_HAS_PORT;
+	}
+	if (iface->i_flags & WG_INTERFACE_HAS_RTABLE) {
+		u->hdr.i_rtable = iface->i_rtable;
+		u->hdr.i_flags |= WG_INTERFACE_HAS_RTABLE;
+	}
+
+	route = iface->i_peers_count > 0;
+	if (iface->i_flags & WG_INTERFACE_REPLACE_PEERS) {
+		for (i = 0; i < u->npeers; i++)
+			if (u->peers[i] != NULL)
+				wgu_remove(u, i);
+		route = 1;
+	}
+
+	in = &iface->i_peers[0];
+	for (i = 0; i < iface->i_peers_count; i++, in = WG_PEER_NEXT(in))
+		if ((error = wgu_set_peer(u, in)) != 0)
+			break;
+
+	if (route && (i = wgu_route(u)) != 0 && error == 0)
+		error = i;
+
+	return error;
+}
+
+/* Size of a peer with its allowed IPs */
+static size_t
+wgu_peer_size(const struct wg_peer_io *p)
+{
+	return sizeof(*p) + p->p_aips_count * sizeof(struct wg_aip_io);
+}
+
+/*
+ * SIOCGWG. Like wg(4), report the size needed for every peer when the
+ * buffer is short; unlike it, always fill in the interface header.
+ */
+static int
+wgu_get(struct wg_user *u, struct wg_data_io *dio)
+{
+	struct wg_interface_io *iface = dio->wgd_interface;
+	struct wg_peer_io *out;
+	struct wgu_peer *p;
+	size_t i, size, n = 0;
+
+	size = sizeof(*iface);
+	for (i = 0; i < u->npeers; i++)
+		if (u->peers[i] != NULL)
+			size += wgu_peer_size(u->peers[i]->io);
+
+	memcpy(iface, &u->hdr, sizeof(*iface));
+	iface->i_peers_count = 0;
+	if (dio->wgd_size < size) {
+		dio->wgd_size = size;
+		return 0;
+	}
+
+	out = &iface->i_peers[0];
+	for (i = 0; i < u->npeers; i++) {
+		if ((p = u->peers[i]) == NULL)
+			continue;
+		pthread_mutex_lock(&p->lock);
+		memcpy(out, p->io, wgu_peer_size(p->io));
+		pthread_mutex_unlock(&p->lock);
+		out = WG_PEER_NEXT(out);
+		n++;
+	}
+	iface->i_peers_count = n;
+	dio->wgd_size = size;
+
+	return 0;
+}
+
+/* SIOCIFCREATE: open the device and sockets, start the workers */
+static int
+wgu_create(wg_handle_t *wg)
+{
+	struct wg_user *u = wg->user;
+	int error;
+
+	u->tun = u->tunfd != -1 ? dup(u->tunfd) : wgu_open_tun(wg->ifname);
+	if (u->tun == -1)
+		return errno;
+	if (fcntl(u->tun, F_SETFL, O_NONBLOCK) == -1 ||
+	    wgu_bind(u->udp, 0) == -1) {
+		error = errno;
+		close(u->tun);
+		return error;
+	}
+
+	if ((error = wgu_start(u)) != 0) {
+		close(u->tun);
+		close(u->udp[0]);
+		if (u->udp[1] != -1)
+			close(u->udp[1]);
+		return error;
+	}
+	u->created = 1;
+
+	return 0;
+}
+
+/* SIOCIFDESTROY: stop the workers, then drop everything */
+static void
+wgu_destroy(struct wg_user *u)
+{
+	size_t i;
+
+	wgu_stop(u);
+	for (i = 0; i < u->npeers; i++)
+		if (u->peers[i] != NULL)
+			wgu_remove(u, i);
+	fw_lpm_free(&u->aips);
+	fw_lpm_init(&u->aips);
+
+	close(u->tun);
+	for (i = 0; i < 2; i++)
+		if (u->udp[i] != -1)
+			close(u->udp[i]);
+	u->tun = u->udp[0] = u->udp[1] = -1;
+	explicit_bzero(&u->hdr, sizeof(u->hdr));
+	explicit_bzero(&u->local, sizeof(u->local));
+	u->created = 0;
+}
+
+/* Serve an interface ioctl(2) from the userspace data plane */
+int
+wg_user_ioctl(wg_handle_t *wg, unsigned long req, void *arg)
+{
+	struct wg_user *u = wg->user;
+	int error;
+
+	if (req == SIOCGWG)
+		wgu_rdlock(u);
+	else {
+		pthread_mutex_lock(&u->gate);
+		pthread_rwlock_wrlock(&u->lock);
+	}
+
+	switch (req) {
+	case SIOCIFCREATE:
+		error = u->created ? EEXIST : wgu_create(wg);
+		break;
+	case SIOCIFDESTROY:
+		error = u->created ? 0 : ENXIO;
+		if (u->created) {
+			/* Workers take the lock; let them finish outside it */
+			pthread_rwlock_unlock(&u->lock);
+			pthread_mutex_unlock(&u->gate);
+			wgu_stop(u);
+			pthread_mutex_lock(&u->gate);
+			pthread_rwlock_wrlock(&u->lock);
+			wgu_destroy(u);
+		}
+		break;
+	case SIOCSWG:
+		error = u->created ? wgu_set(u, arg) : ENXIO;
+		break;
+	case SIOCGWG:
+		error = u->created ? wgu_get(u, arg) : ENXIO;
+		break;
+	default:
+		error = ENOTTY;
+		break;
+	}
+
+	pthread_rwlock_unlock(&u->lock);
+	if (req != SIOCGWG)
+		pthread_mutex_unlock(&u->gate);
+
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Free userspace interface, destroying it if still up */
+void
+wg_user_free(wg_handle_t *wg)
+{
+	struct wg_user *u = wg->user;
+
+	if (u == NULL)
+		return;
+
+	if (u->created) {
+		wgu_stop(u);
+		wgu_destroy(u);
+	}
+	fw_lpm_free(&u->aips);
+	if (u->tunfd != -1)
+		close(u->tunfd);
+	pthread_rwlock_destroy(&u->lock);
+	pthread_mutex_destroy(&u->gate);
+	pthread_mutex_destroy(&u->ilock);
+	freezero(u, sizeof(*u));
+	wg->user = NULL;
+}
+
+/*
+ * Open handle on a new userspace interface; it still has to be created.
+ * Packets go through tun(4) device ifname, or through tunfd if it isn't
+ * -1 (any descriptor passing one packet per read and write; the handle
+ * takes it over).
+ */
+fw_err_t
+wg_open_user(wg_handle_t *wg, const char *ifname, int tunfd)
+{
+	struct wg_user *u;
+
+	if (strlen(ifname) >= IFNAMSIZ) {
+		errno = EINVAL;
+		return FW_ERR;
+	}
+
+	if ((u = calloc(1, sizeof(*u))) == NULL)
+		return FW_ERR;
+	if (fw_lpm_init(&u->aips) != FW_OK) {
+		free(u);
+		return FW_ERR;
+	}
+	pthread_rwlock_init(&u->lock, NULL);
+	pthread_mutex_init(&u->gate, NULL);
+	pthread_mutex_init(&u->ilock, NULL);
+	u->tunfd = tunfd;
+	u->tun = u->udp[0] = u->udp[1] = -1;
+
+	wg->sock = -1;
+	wg->mock = NULL;
+	wg->priv = NULL;
+	wg->user = u;
+	strlcpy(wg->ifname, ifname, IFNAMSIZ);
+
+	return FW_OK;
+}
+
+/*
+ * END device
+ */
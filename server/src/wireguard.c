@@ -21,8 +21,43 @@
 #include <sodium.h>
 
 #include "base64.h"
+#include "metrics.h"
+#include "trace.h"
 #include "wireguard.h"
 
+/*
+ * Issue an ioctl(2) on the interface socket, or hand it to the mock
+ * interface, userspace data plane or privileged process, timing
+ * SIOCSWG/SIOCGWG
+ */
+int
+wg_ioctl(wg_handle_t *wg, unsigned long req, void *arg)
+{
+	uint64_t start;
+	int ret;
+
+	FW_TRACE_BEGIN(FW_P_WG_IOCTL, req);
+	start = fw_metric_now();
+	if (wg->mock != NULL)
+		ret = wg_mock_ioctl(wg, req, arg);
+	else if (wg->user != NULL)
+		ret = wg_user_ioctl(wg, req, arg);
+	else if (wg->priv != NULL)
+		ret = wg_priv_ioctl(wg, req, arg);
+	else
+		ret = ioctl(wg->sock, req, arg);
+	FW_TRACE_END(FW_P_WG_IOCTL, req, ret == -1 ? errno : 0);
+
+	if (req == SIOCSWG)
+		fw_metric_observe(FW_H_WG_SET, fw_metric_now() - start);
+	else if (req == SIOCGWG)
+		fw_metric_observe(FW_H_WG_GET, fw_metric_now() - start);
+	if (ret == -1)
+		fw_metric_inc(FW_C_WG_ERRORS);
+
+	return ret;
+}
+
 /*
  * START wg(4) interface functions
  */
@@ -35,6 +70,9 @@ wg_close_iface(wg_handle_t *wg)
 		close(wg->sock);
 		wg->sock = -1;
 	}
+	wg_mock_free(wg);
+	wg_user_free(wg);
+	wg_priv_free(wg);
 }
 
 /* Create WireGuard interface */
@@ -46,7 +84,7 @@ wg_create_iface(wg_handle_t *wg)
 	memset(&ifr, 0, sizeof(ifr));
 	strlcpy(ifr.ifr_name, wg->ifname, IFNAMSIZ);
 
-	if (ioctl(wg->sock, SIOCIFCREATE, &ifr) == -1)
+	if (wg_ioctl(wg, SIOCIFCREATE, &ifr) == -1)
 		return FW_ERR;
 
 	return FW_OK;
@@ -61,7 +99,7 @@ wg_destroy_iface(wg_handle_t *wg)
 	memset(&ifr, 0, sizeof(ifr));
 	strlcpy(ifr.ifr_name, wg->ifname, IFNAMSIZ);
 
-	if (ioctl(wg->sock, SIOCIFDESTROY, &ifr) == -1)
+	if (wg_ioctl(wg, SIOCIFDESTROY, &ifr) == -1)
 		return FW_ERR;
 
 	return FW_OK;
@@ -78,12 +116,26 @@ wg_get_iface(wg_handle_t *wg, struct wg_interface_io *iface)
 	dio.wgd_interface = iface;
 	dio.wgd_size = sizeof(*iface);
 
-	if (ioctl(wg->sock, SIOCGWG, &dio) == -1)
+	if (wg_ioctl(wg, SIOCGWG, &dio) == -1)
 		return FW_ERR;
 
 	return FW_OK;
 }
 
+/* Open interface handle on backend (WG_BACKEND_*) */
+fw_err_t
+wg_open(wg_handle_t *wg, const char *ifname, int backend)
+{
+	switch (backend) {
+	case WG_BACKEND_MOCK:
+		return wg_open_mock(wg, ifname);
+	case WG_BACKEND_USER:
+		return wg_open_user(wg, ifname, -1);
+	default:
+		return wg_open_iface(wg, ifname);
+	}
+}
+
 /* Open WireGuard interface handle */
 fw_err_t
 wg_open_iface(wg_handle_t *wg, const char *ifname)
@@ -93,6 +145,9 @@ wg_open_iface(wg_handle_t *wg, const char *ifname)
 		return FW_ERR;
 	}
 
+	wg->mock = NULL;
+	wg->priv = NULL;
+	wg->user = NULL;
 	wg->sock = socket(AF_INET, SOCK_DGRAM, 0);
 	if (wg->sock == -1)
 		return FW_ERR;
@@ -113,7 +168,7 @@ wg_set_iface(wg_handle_t *wg, struct wg_interface_io *iface)
 	dio.wgd_interface = iface;
 	dio.wgd_size = sizeof(*iface);
 
-	if (ioctl(wg->sock, SIOCSWG, &dio) == -1)
+	if (wg_ioctl(wg, SIOCSWG, &dio) == -1)
 		return FW_ERR;
 
 	return FW_OK;
@@ -134,7 +189,9 @@ wg_gen_keypair(uint8_t privkey[WG_KEY_LEN], uint8_t pubkey[WG_KEY_LEN])
 	if (sodium_init() < 0)
 		return FW_ERR;
 
+	FW_TRACE_BEGIN(FW_P_KEYGEN, 0);
 	crypto_box_keypair(pubkey, privkey);
+	FW_TRACE_END(FW_P_KEYGEN, 0, 0);
 
 	return FW_OK;
 }
@@ -179,15 +236,17 @@ wg_set_privkey(wg_handle_t *wg, const uint8_t key[WG_KEY_LEN])
  * START peer management functions
  */
 
-/* Add peer to interface */
+/* Add peer (and its allowed IPs) to interface */
 fw_err_t
 wg_add_peer(wg_handle_t *wg, struct wg_peer_io *peer)
 {
 	struct wg_data_io dio;
 	struct wg_interface_io *iface;
-	size_t size;
+	size_t peer_size, size;
 
-	size = sizeof(*iface) + sizeof(*peer);
+	peer_size = sizeof(*peer) + peer->p_aips_count *
+	    sizeof(struct wg_aip_io);
+	size = sizeof(*iface) + peer_size;
 	iface = calloc(1, size);
 
 	if (wg_get_iface(wg, iface) != FW_OK)
@@ -199,7 +258,8 @@ wg_add_peer(wg_handle_t *wg, struct wg_peer_io *peer)
 	}
 
     /* Set up wg_interface_io */
-	memcpy(&iface->i_peers[0], peer, sizeof(*peer));
+	memset(iface, 0, sizeof(*iface));
+	memcpy(&iface->i_peers[0], peer, peer_size);
 	iface->i_peers_count = 1;
 
     /* Set up wg_data_io */
@@ -208,8 +268,10 @@ wg_add_peer(wg_handle_t *wg, struct wg_peer_io *peer)
 	dio.wgd_interface = iface;
 	dio.wgd_size = size;
 
-	if (ioctl(wg->sock, SIOCSWG, &dio) == -1)
-		return FW_ERR;
+	if (wg_ioctl(wg, SIOCSWG, &dio) == -1)
+		goto err;
+
+	free(iface);
 
 	return FW_OK;
 
@@ -218,6 +280,52 @@ err:
 	return FW_ERR;
 }
 
+/*
+ * Add several peers in one ioctl(2), each with its tunnel address as
+ * its only allowed IP. The interface itself refuses peers over its cap.
+ */
+fw_err_t
+wg_add_peers(wg_handle_t *wg, const uint8_t (*pubkeys)[WG_KEY_LEN],
+    const struct in_addr *addrs, size_t count)
+{
+	struct wg_data_io dio;
+	struct wg_interface_io *iface;
+	struct wg_peer_io *p;
+	size_t i, size;
+
+	if (count == 0)
+		return FW_OK;
+
+    /* Each peer is followed by its one allowed IP */
+	size = sizeof(*iface) + count * (sizeof(*p) + sizeof(struct wg_aip_io));
+	if ((iface = calloc(1, size)) == NULL)
+		return FW_ERR;
+	iface->i_peers_count = count;
+	p = &iface->i_peers[0];
+	for (i = 0; i < count; i++, p = WG_PEER_NEXT(p)) {
+		memcpy(p->p_public, pubkeys[i], WG_KEY_LEN);
+		p->p_flags = WG_PEER_HAS_PUBLIC | WG_PEER_REPLACE_AIPS;
+		p->p_aips_count = 1;
+		p->p_aips[0].a_af = AF_INET;
+		p->p_aips[0].a_cidr = 32;
+		p->p_aips[0].a_ipv4 = addrs[i];
+	}
+
+	memset(&dio, 0, sizeof(dio));
+	strlcpy(dio.wgd_name, wg->ifname, IFNAMSIZ);
+	dio.wgd_interface = iface;
+	dio.wgd_size = size;
+
+	if (wg_ioctl(wg, SIOCSWG, &dio) == -1) {
+		free(iface);
+		return FW_ERR;
+	}
+
+	free(iface);
+
+	return FW_OK;
+}
+
 /* Remove peer from interface */
 fw_err_t
 wg_remove_peer(wg_handle_t *wg, const uint8_t pubkey[WG_KEY_LEN])
@@ -239,7 +347,7 @@ wg_remove_peer(wg_handle_t *wg, const uint8_t pubkey[WG_KEY_LEN])
 	dio.wgd_interface = iface;
 	dio.wgd_size = size;
 
-	if (ioctl(wg->sock, SIOCSWG, &dio) == -1) {
+	if (wg_ioctl(wg, SIOCSWG, &dio) == -1) {
 		free(iface);
 		return FW_ERR;
 	}
@@ -249,43 +357,120 @@ wg_remove_peer(wg_handle_t *wg, const uint8_t pubkey[WG_KEY_LEN])
 	return FW_OK;
 }
 
-/* Get peer configuration */
+/* Remove several peers from interface in one ioctl(2) */
 fw_err_t
-wg_get_peer(wg_handle_t *wg, const uint8_t pubkey[WG_KEY_LEN],
-    struct wg_peer_io *peer)
+wg_remove_peers(wg_handle_t *wg, const uint8_t (*pubkeys)[WG_KEY_LEN],
+    size_t count)
 {
 	struct wg_data_io dio;
 	struct wg_interface_io *iface;
-	size_t size;
+	size_t i, size;
 
-    /* Set up wg_peer_io */
-	memset(peer, 0, sizeof(*peer));
-	memcpy(peer->p_public, pubkey, WG_KEY_LEN);
+	if (count == 0)
+		return FW_OK;
 
-    /* Set up wg_interface_io */
-	size = sizeof(struct wg_interface_io) + sizeof(struct wg_peer_io);
-	iface = calloc(1, size);
-	iface->i_peers_count = 1;
-	memcpy(&iface->i_peers[0], peer, sizeof(*peer));
+    /* Peers without allowed IPs are laid out back to back */
+	size = sizeof(*iface) + count * sizeof(struct wg_peer_io);
+	if ((iface = calloc(1, size)) == NULL)
+		return FW_ERR;
+	iface->i_peers_count = count;
+	for (i = 0; i < count; i++) {
+		memcpy(iface->i_peers[i].p_public, pubkeys[i], WG_KEY_LEN);
+		iface->i_peers[i].p_flags = WG_PEER_REMOVE;
+	}
 
-    /* Set up wg_data_io */
 	memset(&dio, 0, sizeof(dio));
 	strlcpy(dio.wgd_name, wg->ifname, IFNAMSIZ);
 	dio.wgd_interface = iface;
 	dio.wgd_size = size;
 
-	if (ioctl(wg->sock, SIOCGWG, &dio) == -1) {
+	if (wg_ioctl(wg, SIOCSWG, &dio) == -1) {
 		free(iface);
 		return FW_ERR;
 	}
 
-    /* Copy peer data back */
-	memcpy(peer, &iface->i_peers[0], sizeof(*peer));
 	free(iface);
 
 	return FW_OK;
 }
 
+/* Get peer configuration */
+fw_err_t
+wg_get_peer(wg_handle_t *wg, const uint8_t pubkey[WG_KEY_LEN],
+    struct wg_peer_io *peer)
+{
+	struct wg_interface_io *iface;
+	struct wg_peer_io *p;
+	size_t i;
+
+    /* SIOCGWG always dumps every peer, so search the dump */
+	if (wg_get_peers(wg, &iface, NULL) != FW_OK)
+		return FW_ERR;
+
+	p = &iface->i_peers[0];
+	for (i = 0; i < iface->i_peers_count; i++, p = WG_PEER_NEXT(p)) {
+		if (memcmp(p->p_public, pubkey, WG_KEY_LEN) != 0)
+			continue;
+
+	    /* Copy peer data back, without allowed IPs */
+		memcpy(peer, p, sizeof(*peer));
+		peer->p_aips_count = 0;
+		free(iface);
+		return FW_OK;
+	}
+
+	free(iface);
+	errno = ENOENT;
+
+	return FW_ERR;
+}
+
+/*
+ * Get interface configuration with every peer and allowed IP. The dump
+ * is allocated and must be freed by the caller; walk it with
+ * WG_PEER_NEXT().
+ */
+fw_err_t
+wg_get_peers(wg_handle_t *wg, struct wg_interface_io **ifacep,
+    size_t *sizep)
+{
+	struct wg_data_io dio;
+	struct wg_interface_io *iface, *tmp;
+	size_t size;
+
+	iface = NULL;
+	size = sizeof(*iface);
+	for (;;) {
+		if ((tmp = realloc(iface, size)) == NULL) {
+			free(iface);
+			return FW_ERR;
+		}
+		iface = tmp;
+		memset(iface, 0, size);
+
+		memset(&dio, 0, sizeof(dio));
+		strlcpy(dio.wgd_name, wg->ifname, IFNAMSIZ);
+		dio.wgd_interface = iface;
+		dio.wgd_size = size;
+
+		if (wg_ioctl(wg, SIOCGWG, &dio) == -1) {
+			free(iface);
+			return FW_ERR;
+		}
+
+	    /* wg(4) reports the size it needs; retry if we were short */
+		if (dio.wgd_size <= size)
+			break;
+		size = dio.wgd_size;
+	}
+
+	*ifacep = iface;
+	if (sizep != NULL)
+		*sizep = size;
+
+	return FW_OK;
+}
+
 /*
  * END peer management functions
  */
@@ -294,6 +479,31 @@ wg_get_peer(wg_handle_t *wg, const uint8_t pubkey[WG_KEY_LEN],
  * START helper functions
  */
 
+/*
+ * Whether a SIOCSWG buffer of size bytes holds the interface header and
+ * every peer and allowed IP it says it does
+ */
+int
+wg_data_valid(const struct wg_interface_io *iface, size_t size)
+{
+	const struct wg_peer_io *p;
+	size_t i, left;
+
+	if (size < sizeof(*iface))
+		return 0;
+	left = size - sizeof(*iface);
+
+	p = &iface->i_peers[0];
+	for (i = 0; i < iface->i_peers_count; i++, p = WG_PEER_NEXT(p)) {
+		if (left < sizeof(*p) || p->p_aips_count >
+		    (left - sizeof(*p)) / sizeof(struct wg_aip_io))
+			return 0;
+		left -= sizeof(*p) + p->p_aips_count * sizeof(struct wg_aip_io);
+	}
+
+	return 1;
+}
+
 /* Convert key to base64 */
 fw_err_t
 wg_key_to_b64(char *dst, size_t dstlen, uint8_t key[WG_KEY_LEN])
@@ -304,7 +514,9 @@ wg_key_to_b64(char *dst, size_t dstlen, uint8_t key[WG_KEY_LEN])
 		return FW_ERR;
 
     /* See server/src/base64/b64_ntop.c */
+	FW_TRACE_BEGIN(FW_P_B64_ENCODE, WG_KEY_LEN);
 	len = b64_ntop(key, WG_KEY_LEN, dst, dstlen);
+	FW_TRACE_END(FW_P_B64_ENCODE, WG_KEY_LEN, len);
 	if (len == -1)
 		return FW_ERR;
 
@@ -318,7 +530,9 @@ wg_key_from_b64(uint8_t key[WG_KEY_LEN], const char *src)
 	int len;
 
     /* See server/src/base64/b64_pton.c */
+	FW_TRACE_BEGIN(FW_P_B64_DECODE, WG_KEY_LEN);
 	len = b64_pton(src, key, WG_KEY_LEN);
+	FW_TRACE_END(FW_P_B64_DECODE, WG_KEY_LEN, len);
 	if (len == -1 || len != WG_KEY_LEN)
 		return FW_ERR;
 
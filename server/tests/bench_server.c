@@ -0,0 +1,936 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * bench_server.c - Microbenchmarks for fwvpnd hot paths. Peer operations
+ * run against a mock interface, so no root or wg(4) is needed.
+ *
+ * Each benchmark prints one JSON object per line:
+ *
+ *	{"bench":"b64_ntop","batch":256,"samples":1000,"ns_op":41.2,
+ *	 "p50":40.9,"p90":41.8,"p99":44.0,"p999":61.3,"max":88.1}
+ *
+ * Operations are timed in batches sized to run for at least BATCH_NS, so
+ * clock overhead stays out of the numbers; percentiles are over per-batch
+ * ns/op samples.
+ */
+
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sodium.h>
+#include <sqlite3.h>
+
+#include "backup.h"
+#include "base64.h"
+#include "cfgcache.h"
+#include "cluster.h"
+#include "db.h"
+#include "jobs.h"
+#include "lpm.h"
+#include "peertab.h"
+#include "pview.h"
+#include "ratelimit.h"
+#include "wback.h"
+#include "wireguard.h"
+
+/* Minimum batch duration */
+#define BATCH_NS      10000
+
+/* Default sample count and per-benchmark time budget */
+#define SAMPLES_MAX   1000
+#define SAMPLES_MIN   50
+#define BUDGET_MS     1000
+
+/* Peers installed on the mock interface, and spare keys to add/remove */
+#define PEERS_LOADED  512
+#define PEERS_SPARE   256
+
+/* Tunnel prefixes in the address index */
+#define LPM_PREFIXES  65536
+
+/* Users with cached client configs */
+#define CFG_USERS     1024
+
+/* Rows of BKROW_LEN bytes in the database being backed up (~8 MB) */
+#define BK_ROWS       2000
+#define BKROW_LEN     4000
+
+/* Cluster nodes on the placement ring */
+#define RING_NODES    16
+
+/* Background jobs on the timer wheel */
+#define SCHED_JOBS    64
+
+/* Users, each with a config and a session, in the schema comparison */
+#define SCHEMA_USERS  16384
+#define SCHEMA_HASH   "$argon2id$v=19$m=65536,t=2,p=1$" \
+    "c29tZXNhbHRzb21lc2FsdA$cGFzc3dvcmRoYXNocGFzc3dvcmRoYXNocGFzc3dvcmQ"
+
+/* Benchmark: setup runs untimed before each batch of n ops */
+struct bench {
+	const char *name;
+	size_t maxbatch;            /* Batch cap, 0 for none    */
+	void (*setup)(size_t);
+	void (*op)(size_t);
+};
+
+static wg_handle_t g_wg;
+static wg_handle_t g_priv;
+static uint8_t g_keys[PEERS_LOADED + PEERS_SPARE][WG_KEY_LEN];
+static uint8_t g_key[WG_KEY_LEN];
+static char g_key_b64[WG_KEY_B64_LEN];
+static fw_cfgcache_t g_cache;
+static fw_db_user_t g_users[CFG_USERS];
+static fw_ratelimit_t *g_rl;
+static fw_lpm_t g_lpm;
+static fw_ptab_t g_ptab;
+static fw_db_node_t g_nodes[RING_NODES];
+static fw_ring_t g_ring;
+static sqlite3 *g_db;
+static char g_db_path[] = "/tmp/bench_server.XXXXXX";
+static fw_wback_t g_wb;
+static fw_backup_t g_bk;
+static char g_bk_path[] = "/tmp/bench_backup.XXXXXX";
+static uint8_t g_addrs[LPM_PREFIXES][4];
+static uint8_t g_addrs6[LPM_PREFIXES][16];
+static sqlite3 *g_v1;
+static sqlite3 *g_v2;
+static char g_tokens[SCHEMA_USERS][FW_DB_TOKEN_LEN];
+static fw_sched_t g_sched;
+static fw_job_t g_jobs[SCHED_JOBS];
+
+/* The v1 schema's user tables, to compare the current one against */
+static const char *v1_sql =
+    "CREATE TABLE users ("
+    "	created_at INTEGER,"
+    "	id TEXT PRIMARY KEY,"
+    "	email TEXT UNIQUE,"
+    "	password TEXT NOT NULL,"
+    "	last_login INTEGER"
+    ");"
+    "CREATE TABLE vpn_configs ("
+    "	user_id TEXT PRIMARY KEY,"
+    "	assigned_ip TEXT UNIQUE,"
+    "	created_at INTEGER,"
+    "	private_key TEXT UNIQUE,"
+    "	public_key TEXT UNIQUE,"
+    "	FOREIGN KEY(user_id) REFERENCES users(id)"
+    ");"
+    "CREATE TABLE sessions ("
+    "	token TEXT PRIMARY KEY,"
+    "	expires_at INTEGER,"
+    "	user_id TEXT,"
+    "	FOREIGN KEY(user_id) REFERENCES users(id)"
+    ");"
+    "CREATE INDEX sessions_user ON sessions (user_id);"
+    "CREATE TABLE vpn_config_versions ("
+    "	user_id TEXT PRIMARY KEY,"
+    "	version INTEGER NOT NULL"
+    ");";
+
+/* Keeps results alive so ops aren't optimized away */
+static volatile int g_sink;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Install key i on interface wg with a /32 allowed IP */
+static void
+peer_add_to(wg_handle_t *wg, size_t i)
+{
+	struct {
+		struct wg_peer_io peer;
+		struct wg_aip_io aip;
+	} p;
+
+	memset(&p, 0, sizeof(p));
+	p.peer.p_flags = WG_PEER_HAS_PUBLIC | WG_PEER_REPLACE_AIPS;
+	memcpy(p.peer.p_public, g_keys[i], WG_KEY_LEN);
+	p.peer.p_aips_count = 1;
+	p.aip.a_af = AF_INET;
+	p.aip.a_cidr = 32;
+	p.aip.a_ipv4.s_addr = htonl(0x0a000002 + i);
+
+	if (wg_add_peer(wg, &p.peer) != FW_OK)
+		err(1, "wg_add_peer");
+}
+
+/* Install key i on the mock interface */
+static void
+peer_add(size_t i)
+{
+	peer_add_to(&g_wg, i);
+}
+
+/*
+ * START benchmarks
+ */
+
+static void
+op_b64_ntop(size_t i)
+{
+	char buf[WG_KEY_B64_LEN];
+
+	g_sink = b64_ntop(g_key, WG_KEY_LEN, buf, sizeof(buf));
+}
+
+static void
+op_b64_pton(size_t i)
+{
+	uint8_t key[WG_KEY_LEN];
+
+	g_sink = b64_pton(g_key_b64, key, sizeof(key));
+}
+
+static void
+op_key_to_b64(size_t i)
+{
+	char buf[WG_KEY_B64_LEN];
+
+	g_sink = wg_key_to_b64(buf, sizeof(buf), g_key);
+}
+
+static void
+op_key_from_b64(size_t i)
+{
+	uint8_t key[WG_KEY_LEN];
+
+	g_sink = wg_key_from_b64(key, g_key_b64);
+}
+
+static void
+op_gen_keypair(size_t i)
+{
+	uint8_t privkey[WG_KEY_LEN], pubkey[WG_KEY_LEN];
+
+	g_sink = wg_gen_keypair(privkey, pubkey);
+}
+
+/* Clear spare peers so each batch adds to the same table */
+static void
+setup_add_peer(size_t n)
+{
+	if (wg_remove_peers(&g_wg, &g_keys[PEERS_LOADED], n) != FW_OK)
+		err(1, "wg_remove_peers");
+}
+
+static void
+op_add_peer(size_t i)
+{
+	peer_add(PEERS_LOADED + i);
+}
+
+/* Install spare peers for the batch to remove */
+static void
+setup_remove_peer(size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		peer_add(PEERS_LOADED + i);
+}
+
+static void
+op_remove_peer(size_t i)
+{
+	if (wg_remove_peer(&g_wg, g_keys[PEERS_LOADED + i]) != FW_OK)
+		err(1, "wg_remove_peer");
+}
+
+static void
+op_get_peer(size_t i)
+{
+	struct wg_peer_io peer;
+
+	if (wg_get_peer(&g_wg, g_keys[i % PEERS_LOADED], &peer) != FW_OK)
+		err(1, "wg_get_peer");
+}
+
+/* wg_get_peer through the privileged process's rings */
+static void
+op_priv_get_peer(size_t i)
+{
+	struct wg_peer_io peer;
+
+	if (wg_get_peer(&g_priv, g_keys[i % PEERS_LOADED], &peer) != FW_OK)
+		err(1, "wg_get_peer");
+}
+
+/* Open a fresh in-memory database and create the schema */
+static void
+op_db_schema(size_t i)
+{
+	sqlite3 *db;
+
+	if (fw_db_open(":memory:", &db) != FW_OK)
+		errx(1, "fw_db_open");
+	sqlite3_close(db);
+}
+
+/* Serve a cached config */
+static void
+op_cfgcache_hit(size_t i)
+{
+	g_sink += fw_cfgcache_get(&g_cache, g_users[i % CFG_USERS].id,
+	    1)->len;
+}
+
+/* Render a config after its row changed (the cache miss path) */
+static void
+op_cfgcache_render(size_t i)
+{
+	static uint64_t version = 1;
+	fw_cfgbody_t *body;
+
+	if ((body = fw_cfgcache_render(&g_cache, &g_users[i % CFG_USERS],
+	    ++version)) == NULL)
+		errx(1, "fw_cfgcache_render");
+	g_sink += body->len;
+}
+
+/* Put every user back at version 1 */
+static void
+setup_cfgcache_hit(size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < CFG_USERS; i++)
+		if (fw_cfgcache_get(&g_cache, g_users[i].id, 1) == NULL &&
+		    fw_cfgcache_render(&g_cache, &g_users[i], 1) == NULL)
+			errx(1, "fw_cfgcache_render");
+}
+
+/* Charge one client over and over: the refusal path under a flood */
+static void
+op_rl_take(size_t i)
+{
+	uint32_t wait;
+
+	g_sink += fw_rl_take(g_rl, g_key, 5, 6, 10, &wait);
+}
+
+/* A new client every time: the address spray path, always evicting */
+static void
+op_rl_spray(size_t i)
+{
+	static uint32_t next;
+	uint32_t wait;
+
+	next++;
+	g_sink += fw_rl_take(g_rl, &next, sizeof(next), 6, 10, &wait);
+}
+
+/*
+ * Logins cycle through every user, across batches too, so write-back
+ * coalesces nothing and each flush writes FW_WB_BATCH distinct rows.
+ */
+static size_t g_logins;
+
+/* Record a login the old way: one UPDATE transaction per login */
+static void
+op_db_login(size_t i)
+{
+	fw_db_stamp_t st;
+
+	strlcpy(st.key, g_users[g_logins++ % CFG_USERS].id, sizeof(st.key));
+	st.when = time(NULL);
+	if (fw_db_write_stamps(g_db, &st, 1, NULL, 0) != FW_OK)
+		errx(1, "fw_db_write_stamps");
+}
+
+/* Record a login through write-back, flushing a batch when one is full */
+static void
+op_wb_login(size_t i)
+{
+	if (fw_wb_mark(&g_wb, FW_WB_LOGIN, g_users[g_logins++ % CFG_USERS].id,
+	    time(NULL)) != FW_OK)
+		err(1, "fw_wb_mark");
+	if (fw_wb_dirty(&g_wb) >= FW_WB_BATCH &&
+	    fw_wb_flush(&g_wb, g_db, FW_WB_BATCH) != FW_OK)
+		errx(1, "fw_wb_flush");
+}
+
+/* Restore every peer from the v1 schema, decoding each text row */
+static void
+op_restore_v1(size_t i)
+{
+	sqlite3_stmt *stmt;
+	uint8_t key[WG_KEY_LEN];
+	struct in_addr addr;
+
+	if (sqlite3_prepare_v2(g_v1,
+	    "SELECT public_key, assigned_ip FROM vpn_configs "
+	    "WHERE public_key IS NOT NULL AND assigned_ip IS NOT NULL",
+	    -1, &stmt, NULL) != SQLITE_OK)
+		errx(1, "%s", sqlite3_errmsg(g_v1));
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		if (wg_key_from_b64(key,
+		    (const char *)sqlite3_column_text(stmt, 0)) != FW_OK ||
+		    inet_pton(AF_INET, (const char *)sqlite3_column_text(stmt,
+		    1), &addr) != 1)
+			errx(1, "malformed v1 peer");
+		g_sink += key[0] + addr.s_addr;
+	}
+	sqlite3_finalize(stmt);
+}
+
+static fw_err_t
+restore_peer(void *arg, const uint8_t *key, struct in_addr addr)
+{
+	g_sink += key[0] + addr.s_addr;
+	return FW_OK;
+}
+
+/* Restore every peer from the current schema */
+static void
+op_restore_v2(size_t i)
+{
+	if (fw_db_load_peers(g_v2, NULL, restore_peer, NULL) != FW_OK)
+		errx(1, "fw_db_load_peers");
+}
+
+/* Check a session against the v1 schema, as its fw_db_get_session() did */
+static void
+op_session_v1(size_t i)
+{
+	sqlite3_stmt *stmt;
+
+	if (sqlite3_prepare_v2(g_v1,
+	    "SELECT c.user_id, COALESCE(v.version, 0) "
+	    "FROM sessions s JOIN vpn_configs c ON c.user_id = s.user_id "
+	    "LEFT JOIN vpn_config_versions v ON v.user_id = s.user_id "
+	    "WHERE s.token = ? AND s.expires_at > ?", -1, &stmt, NULL) !=
+	    SQLITE_OK)
+		errx(1, "%s", sqlite3_errmsg(g_v1));
+	sqlite3_bind_text(stmt, 1, g_tokens[i * 7919 % SCHEMA_USERS], -1,
+	    SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, 0);
+	if (sqlite3_step(stmt) != SQLITE_ROW)
+		errx(1, "v1 session");
+	g_sink += sqlite3_column_bytes(stmt, 0);
+	sqlite3_finalize(stmt);
+}
+
+/* Check a session against the current schema */
+static void
+op_session_v2(size_t i)
+{
+	char id[FW_DB_ID_LEN];
+	uint64_t version;
+
+	if (fw_db_get_session(g_v2, g_tokens[i * 7919 % SCHEMA_USERS], 0, id,
+	    &version) != FW_OK)
+		errx(1, "fw_db_get_session");
+	g_sink += version;
+}
+
+/* Look a peer up in the published view, as a concurrent reader would */
+static void
+op_pview_find(size_t i)
+{
+	const fw_pvent_t *pe;
+
+	pe = fw_pv_find(fw_pv_enter(), g_keys[i % PEERS_LOADED]);
+	g_sink += pe != NULL ? pe->id : 0;
+	fw_pv_leave();
+}
+
+/* Publish a new view of the table: the writer's cost per batch */
+static void
+op_pview_publish(size_t i)
+{
+	g_ptab.gen++;
+	if (fw_pv_publish(&g_ptab) != FW_OK)
+		err(1, "fw_pv_publish");
+}
+
+/* Find the peer owning an IPv4 address */
+static void
+op_lpm_lookup(size_t i)
+{
+	uint32_t value;
+
+	fw_lpm_lookup(&g_lpm, AF_INET, g_addrs[i % LPM_PREFIXES], &value);
+	g_sink += value;
+}
+
+/*
+ * One online backup step of the user database, starting over once the
+ * copy is done: the longest a foreground request waits on a backup
+ */
+static void
+op_bk_step(size_t i)
+{
+	int done;
+
+	if (!fw_bk_running(&g_bk) && fw_bk_start(&g_bk, g_db, g_bk_path) !=
+	    FW_OK)
+		err(1, "fw_bk_start");
+	if (fw_bk_step(&g_bk, &done) != FW_OK)
+		err(1, "fw_bk_step");
+}
+
+/* Place a user on the cluster ring, then take it back off */
+static void
+op_ring_pick(size_t i)
+{
+	size_t node;
+
+	if (fw_ring_pick(&g_ring, g_users[i % CFG_USERS].id, &node) != FW_OK)
+		err(1, "fw_ring_pick");
+	g_nodes[node].placed--;
+	g_sink += node;
+}
+
+/* Find the peer owning an IPv6 address */
+static void
+op_lpm_lookup6(size_t i)
+{
+	uint32_t value;
+
+	fw_lpm_lookup(&g_lpm, AF_INET6, g_addrs6[i % LPM_PREFIXES], &value);
+	g_sink += value;
+}
+
+static int
+job_noop(void *arg, uint64_t budget)
+{
+	g_sink++;
+	return FW_JOB_DONE;
+}
+
+/* An event loop turn with no job due: the scheduler's cost per turn */
+static void
+op_sched_turn(size_t i)
+{
+	g_sink += fw_sched_run(&g_sched);
+}
+
+/* Fire a loop job and run it: the overhead around each job run */
+static void
+op_sched_kick(size_t i)
+{
+	fw_sched_kick(&g_sched, &g_jobs[i % SCHED_JOBS]);
+	g_sink += fw_sched_run(&g_sched);
+}
+
+static const struct bench benches[] = {
+	{ "b64_ntop", 0, NULL, op_b64_ntop },
+	{ "b64_pton", 0, NULL, op_b64_pton },
+	{ "wg_key_to_b64", 0, NULL, op_key_to_b64 },
+	{ "wg_key_from_b64", 0, NULL, op_key_from_b64 },
+	{ "wg_gen_keypair", 0, NULL, op_gen_keypair },
+	{ "wg_add_peer", PEERS_SPARE, setup_add_peer, op_add_peer },
+	{ "wg_remove_peer", PEERS_SPARE, setup_remove_peer, op_remove_peer },
+	{ "wg_get_peer", 0, NULL, op_get_peer },
+	{ "priv_get_peer", 0, NULL, op_priv_get_peer },
+	{ "db_schema", 0, NULL, op_db_schema },
+	{ "db_restore_v1", 0, NULL, op_restore_v1 },
+	{ "db_restore_v2", 0, NULL, op_restore_v2 },
+	{ "db_session_v1", 0, NULL, op_session_v1 },
+	{ "db_session_v2", 0, NULL, op_session_v2 },
+	{ "db_login", 0, NULL, op_db_login },
+	{ "wb_login", 0, NULL, op_wb_login },
+	{ "bk_step", 0, NULL, op_bk_step },
+	{ "cfgcache_hit", 0, setup_cfgcache_hit, op_cfgcache_hit },
+	{ "cfgcache_render", 0, NULL, op_cfgcache_render },
+	{ "rl_take", 0, NULL, op_rl_take },
+	{ "rl_spray", 0, NULL, op_rl_spray },
+	{ "pview_find", 0, NULL, op_pview_find },
+	{ "pview_publish", 0, NULL, op_pview_publish },
+	{ "ring_pick", 0, NULL, op_ring_pick },
+	{ "lpm_lookup", 0, NULL, op_lpm_lookup },
+	{ "lpm_lookup6", 0, NULL, op_lpm_lookup6 },
+	{ "sched_turn", 0, NULL, op_sched_turn },
+	{ "sched_kick", 0, NULL, op_sched_kick },
+};
+
+/*
+ * END benchmarks
+ */
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Time one batch of n ops, in nanoseconds */
+static uint64_t
+run_batch(const struct bench *b, size_t n)
+{
+	uint64_t start;
+	size_t i;
+
+	if (b->setup != NULL)
+		b->setup(n);
+
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		b->op(i);
+
+	return now_ns() - start;
+}
+
+/* Run a benchmark and print its result line */
+static void
+run(const struct bench *b, size_t maxsamples, uint64_t budget)
+{
+	double *samples, sum;
+	uint64_t start, ns;
+	size_t batch, n;
+
+	if ((samples = calloc(maxsamples, sizeof(*samples))) == NULL)
+		err(1, NULL);
+
+	/* Size batches; the calibration runs double as warmup */
+	batch = 1;
+	while (run_batch(b, batch) < BATCH_NS &&
+	    (b->maxbatch == 0 || batch * 2 <= b->maxbatch))
+		batch *= 2;
+
+	sum = 0;
+	start = now_ns();
+	for (n = 0; n < maxsamples; n++) {
+		if (n >= SAMPLES_MIN && now_ns() - start >= budget)
+			break;
+		ns = run_batch(b, batch);
+		samples[n] = (double)ns / batch;
+		sum += ns;
+	}
+
+	qsort(samples, n, sizeof(*samples), cmp_double);
+	printf("{\"bench\":\"%s\",\"batch\":%zu,\"samples\":%zu,"
+	    "\"ns_op\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+	    "\"p999\":%.1f,\"max\":%.1f}\n", b->name, batch, n,
+	    sum / (n * batch), samples[n * 50 / 100], samples[n * 90 / 100],
+	    samples[n * 99 / 100], samples[n * 999 / 1000], samples[n - 1]);
+	fflush(stdout);
+
+	free(samples);
+}
+
+/*
+ * Fill the v1 and current schemas with the same users, each with a
+ * config and a session
+ */
+static void
+schema_setup(void)
+{
+	sqlite3_stmt *stmt[4];
+	fw_db_user_t user;
+	char email[32];
+	uint8_t raw[32];
+	size_t i, k;
+
+	if (sqlite3_open(":memory:", &g_v1) != SQLITE_OK ||
+	    sqlite3_exec(g_v1, v1_sql, NULL, NULL, NULL) != SQLITE_OK ||
+	    sqlite3_exec(g_v1, "BEGIN", NULL, NULL, NULL) != SQLITE_OK)
+		errx(1, "v1 schema");
+	if (fw_db_open(":memory:", &g_v2) != FW_OK)
+		errx(1, "fw_db_open");
+	if (sqlite3_prepare_v2(g_v1, "INSERT INTO users (created_at, id, "
+	    "email, password) VALUES (1, ?1, ?2, ?3)", -1, &stmt[0], NULL) !=
+	    SQLITE_OK ||
+	    sqlite3_prepare_v2(g_v1, "INSERT INTO vpn_configs (user_id, "
+	    "assigned_ip, created_at, private_key, public_key) "
+	    "VALUES (?1, ?4, 1, ?5, ?6)", -1, &stmt[1], NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(g_v1, "INSERT INTO sessions (token, "
+	    "expires_at, user_id) VALUES (?7, 1 << 40, ?1)", -1, &stmt[2],
+	    NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(g_v1, "INSERT INTO vpn_config_versions "
+	    "(user_id, version) VALUES (?1, 1)", -1, &stmt[3], NULL) !=
+	    SQLITE_OK)
+		errx(1, "%s", sqlite3_errmsg(g_v1));
+
+	for (i = 0; i < SCHEMA_USERS; i++) {
+		randombytes_buf(raw, 16);
+		sodium_bin2hex(user.id, sizeof(user.id), raw, 16);
+		randombytes_buf(raw, sizeof(raw));
+		wg_key_to_b64(user.private_key, sizeof(user.private_key), raw);
+		randombytes_buf(raw, sizeof(raw));
+		wg_key_to_b64(user.public_key, sizeof(user.public_key), raw);
+		snprintf(user.assigned_ip, sizeof(user.assigned_ip),
+		    "10.%zu.%zu.%zu", i >> 16, i >> 8 & 0xff, i & 0xff);
+		randombytes_buf(raw, sizeof(raw));
+		sodium_bin2hex(g_tokens[i], sizeof(g_tokens[i]), raw,
+		    sizeof(raw));
+		snprintf(email, sizeof(email), "%zu@example.com",
+		    i);
+
+		for (k = 0; k < 4; k++) {
+			sqlite3_bind_text(stmt[k], 1, user.id, -1,
+			    SQLITE_STATIC);
+			sqlite3_bind_text(stmt[k], 2, email, -1,
+			    SQLITE_STATIC);
+			sqlite3_bind_text(stmt[k], 3, SCHEMA_HASH, -1,
+			    SQLITE_STATIC);
+			sqlite3_bind_text(stmt[k], 4, user.assigned_ip, -1,
+			    SQLITE_STATIC);
+			sqlite3_bind_text(stmt[k], 5, user.private_key, -1,
+			    SQLITE_STATIC);
+			sqlite3_bind_text(stmt[k], 6, user.public_key, -1,
+			    SQLITE_STATIC);
+			sqlite3_bind_text(stmt[k], 7, g_tokens[i], -1,
+			    SQLITE_STATIC);
+			if (sqlite3_step(stmt[k]) != SQLITE_DONE)
+				errx(1, "%s", sqlite3_errmsg(g_v1));
+			sqlite3_reset(stmt[k]);
+		}
+
+		if (fw_db_add_user(g_v2, &user, email, SCHEMA_HASH, 1) !=
+		    FW_OK ||
+		    fw_db_add_session(g_v2, g_tokens[i], user.id,
+		    (time_t)1 << 40) != FW_OK)
+			errx(1, "fw_db_add_user");
+	}
+	for (k = 0; k < 4; k++)
+		sqlite3_finalize(stmt[k]);
+	if (sqlite3_exec(g_v1, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+		errx(1, "%s", sqlite3_errmsg(g_v1));
+}
+
+/* Print the bytes a schema's user tables and their indexes take up */
+static void
+schema_size(const char *name, sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	int64_t bytes[2];
+	int k;
+
+	for (k = 0; k < 2; k++) {
+		if (sqlite3_prepare_v2(db, "SELECT sum(pgsize) FROM dbstat "
+		    "WHERE name IN (SELECT name FROM sqlite_master WHERE "
+		    "type = ? AND tbl_name IN "
+		    "('users', 'vpn_configs', 'sessions', 'vpn_config_versions'))",
+		    -1, &stmt, NULL) != SQLITE_OK)
+			errx(1, "dbstat: %s", sqlite3_errmsg(db));
+		sqlite3_bind_text(stmt, 1, k == 0 ? "table" : "index", -1,
+		    SQLITE_STATIC);
+		if (sqlite3_step(stmt) != SQLITE_ROW)
+			errx(1, "dbstat: %s", sqlite3_errmsg(db));
+		bytes[k] = sqlite3_column_int64(stmt, 0);
+		sqlite3_finalize(stmt);
+	}
+
+	printf("{\"bench\":\"%s\",\"users\":%d,\"table_bytes\":%lld,"
+	    "\"index_bytes\":%lld}\n", name, SCHEMA_USERS,
+	    (long long)bytes[0], (long long)bytes[1]);
+	fflush(stdout);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: bench_server [-n samples] [-t msec] "
+	    "[bench ...]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct in_addr addr;
+	char sql[256];
+	const char *errstr;
+	size_t i, maxsamples = SAMPLES_MAX;
+	uint64_t budget = BUDGET_MS;
+	int ch, fd, j;
+
+	while ((ch = getopt(argc, argv, "n:t:")) != -1) {
+		switch (ch) {
+		case 'n':
+			maxsamples = strtonum(optarg, SAMPLES_MIN, 1000000,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "samples %s: %s", errstr, optarg);
+			break;
+		case 't':
+			budget = strtonum(optarg, 1, 3600000, &errstr);
+			if (errstr != NULL)
+				errx(1, "msec %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (sodium_init() < 0)
+		errx(1, "sodium_init");
+
+	randombytes_buf(g_key, sizeof(g_key));
+	if (wg_key_to_b64(g_key_b64, sizeof(g_key_b64), g_key) != FW_OK)
+		errx(1, "wg_key_to_b64");
+	randombytes_buf(g_keys, sizeof(g_keys));
+
+	/* Mock interface with a realistic peer table */
+	if (wg_open_mock(&g_wg, "wg0") != FW_OK ||
+	    wg_create_iface(&g_wg) != FW_OK)
+		err(1, "mock interface");
+	for (i = 0; i < PEERS_LOADED; i++)
+		peer_add(i);
+
+	/* The same table behind a privileged process */
+	if (wg_open_priv(&g_priv, "wg1", WG_BACKEND_MOCK) != FW_OK ||
+	    wg_create_iface(&g_priv) != FW_OK)
+		err(1, "privsep mock interface");
+	for (i = 0; i < PEERS_LOADED; i++)
+		peer_add_to(&g_priv, i);
+
+	if ((g_rl = fw_rl_new()) == NULL)
+		err(1, "fw_rl_new");
+
+	/* Address index: /32s in 10/8 and /128s in fd00::/48, plus pools */
+	if (fw_lpm_init(&g_lpm) != FW_OK)
+		err(1, "fw_lpm_init");
+	randombytes_buf(g_addrs, sizeof(g_addrs));
+	randombytes_buf(g_addrs6, sizeof(g_addrs6));
+	for (i = 0; i < LPM_PREFIXES; i++) {
+		g_addrs[i][0] = 10;
+		memset(g_addrs6[i], 0, 6);
+		g_addrs6[i][0] = 0xfd;
+		if ((fw_lpm_insert(&g_lpm, AF_INET, g_addrs[i], 32, i) !=
+		    FW_OK && errno != EEXIST) ||
+		    fw_lpm_insert(&g_lpm, AF_INET6, g_addrs6[i], 128, i) !=
+		    FW_OK)
+			err(1, "fw_lpm_insert");
+	}
+	if (fw_lpm_insert(&g_lpm, AF_INET, g_addrs[0], 8, 0) != FW_OK ||
+	    fw_lpm_insert(&g_lpm, AF_INET6, g_addrs6[0], 48, 0) != FW_OK)
+		err(1, "fw_lpm_insert");
+
+	/* The loaded peers as a published view */
+	if (fw_ptab_init(&g_ptab, PEERS_LOADED) != FW_OK)
+		err(1, "fw_ptab_init");
+	for (i = 0; i < PEERS_LOADED; i++) {
+		addr.s_addr = htonl(0x0a000002 + i);
+		if (fw_ptab_add(&g_ptab, g_keys[i], addr, NULL) != FW_OK)
+			err(1, "fw_ptab_add");
+	}
+	if (fw_pv_publish(&g_ptab) != FW_OK)
+		err(1, "fw_pv_publish");
+
+	/* Config cache over a user population */
+	if (fw_cfgcache_resize(&g_cache, FW_CFGCACHE_SIZE) != FW_OK)
+		err(1, "fw_cfgcache_resize");
+	fw_cfgcache_set_server(&g_cache, g_key_b64, "vpn.example.com", 51820);
+	for (i = 0; i < CFG_USERS; i++) {
+		snprintf(g_users[i].id, sizeof(g_users[i].id), "%032zx", i);
+		strlcpy(g_users[i].private_key, g_key_b64,
+		    sizeof(g_users[i].private_key));
+		if (wg_key_to_b64(g_users[i].public_key,
+		    sizeof(g_users[i].public_key), g_keys[i % PEERS_LOADED]) !=
+		    FW_OK)
+			errx(1, "wg_key_to_b64");
+		snprintf(g_users[i].assigned_ip, sizeof(g_users[i].assigned_ip),
+		    "10.8.%zu.%zu", i / 250, i % 250 + 2);
+	}
+
+	/* The same users in an on-disk database, for login write-back */
+	if ((fd = mkstemp(g_db_path)) == -1)
+		err(1, "mkstemp");
+	close(fd);
+	if (fw_db_open(g_db_path, &g_db) != FW_OK)
+		errx(1, "fw_db_open");
+	for (i = 0; i < CFG_USERS; i++) {
+		snprintf(sql, sizeof(sql), "INSERT INTO users (id, email, "
+		    "password) VALUES (X'%s', '%zu@example.com', 'x')",
+		    g_users[i].id, i);
+		if (sqlite3_exec(g_db, sql, NULL, NULL, NULL) != SQLITE_OK)
+			errx(1, "%s", sqlite3_errmsg(g_db));
+	}
+	fw_wb_init(&g_wb);
+
+	/* Bulk for the online backup to copy */
+	if ((fd = mkstemp(g_bk_path)) == -1)
+		err(1, "mkstemp");
+	close(fd);
+	snprintf(sql, sizeof(sql), "CREATE TABLE bulk (b BLOB); "
+	    "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n "
+	    "WHERE i < %d) INSERT INTO bulk SELECT randomblob(%d) FROM n",
+	    BK_ROWS, BKROW_LEN);
+	if (sqlite3_exec(g_db, sql, NULL, NULL, NULL) != SQLITE_OK)
+		errx(1, "%s", sqlite3_errmsg(g_db));
+
+	/* The same users in the v1 and the current schema */
+	schema_setup();
+	for (j = 0; j < argc; j++)
+		if (strcmp(argv[j], "db_size") == 0)
+			break;
+	if (argc == 0 || j < argc) {
+		schema_size("db_size_v1", g_v1);
+		schema_size("db_size_v2", g_v2);
+	}
+
+	/* Cluster ring with every node a quarter full */
+	for (i = 0; i < RING_NODES; i++) {
+		snprintf(g_nodes[i].name, sizeof(g_nodes[i].name), "node%zu", i);
+		g_nodes[i].capacity = 65536;
+		g_nodes[i].placed = 16384;
+	}
+	if (fw_ring_init(&g_ring, g_nodes, RING_NODES, 16384 * RING_NODES) !=
+	    FW_OK)
+		err(1, "fw_ring_init");
+
+	/* Loop jobs a minute apart, spread over the wheel by their jitter */
+	if (fw_sched_init(&g_sched, 0) != FW_OK)
+		err(1, "fw_sched_init");
+	for (i = 0; i < SCHED_JOBS; i++) {
+		g_jobs[i].name = "noop";
+		g_jobs[i].fn = job_noop;
+		g_jobs[i].interval = 60000;
+		g_jobs[i].jitter = 30000;
+		g_jobs[i].flags = FW_JOB_LOOP;
+		fw_sched_add(&g_sched, &g_jobs[i], 30000 + i * 500);
+	}
+
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		for (j = 0; j < argc; j++)
+			if (strcmp(argv[j], benches[i].name) == 0)
+				break;
+		if (argc == 0 || j < argc)
+			run(&benches[i], maxsamples, budget * 1000000);
+	}
+
+	fw_sched_free(&g_sched);
+	fw_cfgcache_free(&g_cache);
+	fw_rl_free(g_rl);
+	fw_pv_clear();
+	fw_ring_free(&g_ring);
+	fw_ptab_free(&g_ptab);
+	fw_wb_free(&g_wb);
+	fw_bk_abort(&g_bk);
+	unlink(g_bk_path);
+	sqlite3_close(g_db);
+	unlink(g_db_path);
+	sqlite3_close(g_v1);
+	sqlite3_close(g_v2);
+	wg_destroy_iface(&g_priv);
+	wg_close_iface(&g_priv);
+	wg_destroy_iface(&g_wg);
+	wg_close_iface(&g_wg);
+
+	return 0;
+}
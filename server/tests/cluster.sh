@@ -0,0 +1,148 @@
+#!/bin/sh
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#
+# cluster.sh - End-to-end test of cluster mode (Linux, as root). Three
+# fwvpnd nodes with mock wg(4) backends share one database inside a
+# private network namespace. Users signed up through any node must be
+# spread over all three; once a node stops, the coordinator must move its
+# users, and only its users, to the other two.
+#
+#	usage: cluster.sh [path/to/fwvpnd]
+
+set -e
+
+FWVPND=$(realpath "${1:-../src/fwvpnd}")
+USERS=30
+
+# Re-run ourselves in a fresh network namespace
+if [ -z "$FW_CLUSTER_NS" ]; then
+	export FW_CLUSTER_NS=1
+	exec unshare -n "$0" "$FWVPND"
+fi
+
+DIR=$(mktemp -d)
+PIDS=
+
+cleanup() {
+	kill $PIDS 2>/dev/null || true
+	wait 2>/dev/null || true
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+ip link set lo up
+
+# node N [keyword ...]: start node nN, serving from 127.0.0.N
+node() {
+	n=$1
+	shift
+	cat >"$DIR/n$n.conf" <<-EOF
+	api_port $((18080 + n))
+	auth_burst 255
+	auth_rate 60000
+	ctl_path $DIR/n$n.sock
+	db_path $DIR/vpn.db
+	listen_port $((51820 + n))
+	node_name n$n
+	node_timeout 3
+	poll_interval 1
+	server_addr 127.0.0.$n
+	snap_path $DIR/n$n.snap
+	vpn_subnet 10.8.0.0/16
+	wg_iface fwc$n
+	wg_mock yes
+	EOF
+	for kw; do
+		echo "$kw" >>"$DIR/n$n.conf"
+	done
+
+	"$FWVPND" -f "$DIR/n$n.conf" 2>>"$DIR/n$n.log" &
+	PIDS="$PIDS $!"
+	eval PID$n=$!
+}
+
+ctl() {
+	echo "$2" | nc -U "$DIR/n$1.sock"
+}
+
+fail() {
+	echo "FAIL: $*" >&2
+	cat "$DIR"/n*.log >&2
+	exit 1
+}
+
+# Node endpoint in each user's config, one "email host" line per user
+endpoints() {
+	for i in $(seq $USERS); do
+		tok=$(cat "$DIR/u$i.tok")
+		host=$(curl -sf -H "Authorization: Bearer $tok" \
+		    "http://127.0.0.1:$1/config" |
+		    sed -n 's/^Endpoint = \(.*\):.*/\1/p')
+		[ -n "$host" ] || fail "no config for u$i"
+		echo "u$i $host"
+	done
+}
+
+node 1 "node_coordinator yes"
+sleep 0.5
+node 2
+node 3
+for n in 1 2 3; do
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		[ -S "$DIR/n$n.sock" ] && break
+		sleep 0.5
+	done
+done
+sleep 1.5
+[ $(ctl 1 nodes | grep -c '"up":true') -eq 3 ] || fail "nodes not up"
+
+# Sign up through every node in turn, log in through the first
+for i in $(seq $USERS); do
+	port=$((18080 + i % 3 + 1))
+	curl -sf -XPOST -d "email=u$i@example.com&password=hunter22xx" \
+	    "http://127.0.0.1:$port/signup" >/dev/null ||
+	    fail "signup u$i"
+	curl -sf -XPOST -d "email=u$i@example.com&password=hunter22xx" \
+	    http://127.0.0.1:18081/login |
+	    sed -n 's/.*"token":"\([0-9a-f]*\)".*/\1/p' >"$DIR/u$i.tok"
+done
+
+endpoints 18081 >"$DIR/before"
+for n in 1 2 3; do
+	grep -q " 127.0.0.$n\$" "$DIR/before" || fail "no users on n$n"
+done
+echo "ok: $USERS users over 3 nodes:" \
+    $(cut -d' ' -f2 "$DIR/before" | sort | uniq -c | tr '\n' ' ')
+
+# Each node serves exactly the users placed on it
+sleep 2
+for n in 1 2 3; do
+	want=$(grep -c " 127.0.0.$n\$" "$DIR/before")
+	got=$(ctl $n status | sed -n 's/^peers //p')
+	[ "$got" = "$want" ] || fail "n$n has $got peers, placed $want"
+done
+echo "ok: nodes serve their placements"
+
+# Stop n3; after node_timeout its users must land on n1 and n2
+kill $PID3
+sleep 6
+endpoints 18082 >"$DIR/after"
+while read -r user host; do
+	now=$(grep "^$user " "$DIR/after" | cut -d' ' -f2)
+	if [ "$host" = 127.0.0.3 ]; then
+		[ "$now" != 127.0.0.3 ] || fail "$user still on n3"
+	else
+		[ "$now" = "$host" ] || fail "$user moved from $host to $now"
+	fi
+done <"$DIR/before"
+echo "ok: only users of the stopped node moved"
+
+for n in 1 2; do
+	want=$(grep -c " 127.0.0.$n\$" "$DIR/after")
+	got=$(ctl $n status | sed -n 's/^peers //p')
+	[ "$got" = "$want" ] || fail "n$n has $got peers, placed $want"
+done
+echo "ok: surviving nodes took the peers over"
@@ -0,0 +1,68 @@
+#!/bin/sh
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#
+# dataplane.sh - End-to-end test of the userspace data plane (Linux, as
+# root). Two "fwtunnel up" instances talk over loopback inside a private
+# network namespace; one tun device is moved into a second namespace so
+# the ping has to cross the tunnel both ways. Then runs the throughput
+# benchmark.
+#
+#	usage: dataplane.sh [path/to/fwtunnel]
+
+set -e
+
+FWTUNNEL=$(realpath "${1:-../tools/fwtunnel}")
+NS=fwtest$$
+
+# Re-run ourselves in a fresh network namespace
+if [ -z "$FW_DATAPLANE_NS" ]; then
+	export FW_DATAPLANE_NS=1
+	exec unshare -n "$0" "$FWTUNNEL"
+fi
+
+cleanup() {
+	kill $PIDS 2>/dev/null || true
+	wait 2>/dev/null || true
+	ip netns del $NS 2>/dev/null || true
+}
+trap cleanup EXIT
+
+ip link set lo up
+
+set -- $("$FWTUNNEL" keypair)
+PRIV0=$1 PUB0=$2
+set -- $("$FWTUNNEL" keypair)
+PRIV1=$1 PUB1=$2
+
+"$FWTUNNEL" up -i fwt0 -k "$PRIV0" -p 51820 -P "$PUB1" \
+    -e 127.0.0.1:51821 -a 10.99.0.2/32 &
+PIDS=$!
+"$FWTUNNEL" up -i fwt1 -k "$PRIV1" -p 51821 -P "$PUB0" \
+    -e 127.0.0.1:51820 -a 10.99.0.1/32 &
+PIDS="$PIDS $!"
+
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	ip link show fwt1 >/dev/null 2>&1 && break
+	sleep 0.2
+done
+
+ip netns add $NS
+ip link set fwt1 netns $NS
+ip addr add 10.99.0.1/24 dev fwt0
+ip link set fwt0 up
+ip netns exec $NS ip addr add 10.99.0.2/24 dev fwt1
+ip netns exec $NS ip link set fwt1 up
+
+# The first packet starts the handshake and is dropped
+ping -c 1 -W 1 10.99.0.2 >/dev/null 2>&1 || true
+if ! ping -c 3 -W 2 10.99.0.2; then
+	echo "FAIL: no replies through the tunnel" >&2
+	exit 1
+fi
+echo "ok: ping through tunnel"
+
+"$FWTUNNEL" bench -j -d 3 -s 1420 -p 51830
+"$FWTUNNEL" bench -j -d 3 -s 64 -p 51830
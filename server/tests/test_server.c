@@ -7,16 +7,1765 @@
  * test_server.c - Simple test program to validate fwvpnd
  */
 
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/if_wg.h>
+#include <netinet/in.h>
+
+#include <dirent.h>
+#include <endian.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sodium.h>
+#include <sqlite3.h>
+
+#include "admit.h"
+#include "api.h"
+#include "backup.h"
 #include "base64.h"
+#include "cfgcache.h"
+#include "cluster.h"
+#include "conf.h"
+#include "db.h"
 #include "fwvpnd.h"
+#include "jobs.h"
+#include "metrics.h"
+#include "migrate.h"
+#include "noise.h"
+#include "peertab.h"
+#include "pview.h"
+#include "ratelimit.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "wback.h"
 #include "wireguard.h"
 
+/* The schema the first fwvpnd created: users, configs and sessions only */
+static const char *baseline_sql =
+    "PRAGMA foreign_keys = ON;"
+    "CREATE TABLE IF NOT EXISTS users ("
+    "	created_at INTEGER,"
+    "	id TEXT PRIMARY KEY,"
+    "	email TEXT UNIQUE,"
+    "	password TEXT NOT NULL,"
+    "	last_login INTEGER"
+    ");"
+    "CREATE TABLE IF NOT EXISTS vpn_configs ("
+    "	user_id TEXT PRIMARY KEY,"
+    "	assigned_ip TEXT UNIQUE,"
+    "	created_at INTEGER,"
+    "	private_key TEXT UNIQUE,"
+    "	public_key TEXT UNIQUE,"
+    "	FOREIGN KEY(user_id) REFERENCES users(id)"
+    ");"
+    "CREATE TABLE IF NOT EXISTS sessions ("
+    "	token TEXT PRIMARY KEY,"
+    "	expires_at INTEGER,"
+    "	user_id TEXT,"
+    "	FOREIGN KEY(user_id) REFERENCES users(id)"
+    ");"
+    "INSERT INTO users VALUES (1, '00112233445566778899aabbccddeeff',"
+    "	'baseline@example.com', 'x', NULL);"
+    "INSERT INTO vpn_configs VALUES ('00112233445566778899aabbccddeeff',"
+    "	'10.8.0.2/32', 1, 'AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA=',"
+    "	'AQEBAQEBAQEBAQEBAQEBAQEBAQEBAQEBAQEBAQEBAQE=');"
+    "INSERT INTO sessions VALUES ('00112233445566778899aabbccddeeff"
+    "00112233445566778899aabbccddeeff', 4102444800,"
+    "	'00112233445566778899aabbccddeeff');";
+
+/* Migrate a database created by the baseline schema */
+static void
+test_db_migrate(void)
+{
+	char path[] = "/tmp/test_server.XXXXXX";
+	char id[FW_DB_ID_LEN];
+	fw_db_user_t user;
+	sqlite3 *db;
+	uint64_t version;
+	int fd, schema;
+
+	printf("Test migrate a baseline database...\n");
+	if ((fd = mkstemp(path)) == -1)
+		err(1, "mkstemp");
+	close(fd);
+	if (sqlite3_open(path, &db) != SQLITE_OK ||
+	    sqlite3_exec(db, baseline_sql, NULL, NULL, NULL) != SQLITE_OK)
+		errx(1, "sqlite3_exec: %s", sqlite3_errmsg(db));
+	sqlite3_close(db);
+
+	if (fw_db_open(path, &db) != FW_OK)
+		errx(1, "fw_db_open: failed to migrate a baseline database");
+	if (fw_mig_version(db, &schema) != FW_OK || schema != FW_DB_VERSION)
+		errx(1, "fw_mig_version: schema not brought up to date");
+	if (fw_db_get_user(db, "00112233445566778899aabbccddeeff", &user) !=
+	    FW_OK || strcmp(user.assigned_ip, "10.8.0.2") != 0 ||
+	    strcmp(user.public_key,
+	    "AQEBAQEBAQEBAQEBAQEBAQEBAQEBAQEBAQEBAQEBAQE=") != 0)
+		errx(1, "fw_db_get_user: migrated user does not match");
+	if (fw_db_get_session(db, "00112233445566778899aabbccddeeff"
+	    "00112233445566778899aabbccddeeff", time(NULL), id,
+	    &version) != FW_OK ||
+	    strcmp(id, "00112233445566778899aabbccddeeff") != 0)
+		errx(1, "fw_db_get_session: migrated session does not match");
+	sqlite3_close(db);
+
+	printf("Test reopen a migrated database...\n");
+	if (fw_db_open(path, &db) != FW_OK)
+		errx(1, "fw_db_open: failed to reopen a migrated database");
+	sqlite3_close(db);
+	unlink(path);
+}
+
+/*
+ * WireGuard handshake vectors, from a separate implementation of the
+ * whitepaper (BLAKE2s and HMAC from Python's hashlib, X25519 and
+ * ChaCha20-Poly1305 from libsodium) that reproduces WireGuard's initial
+ * chaining key and hash. Keys count up from their first byte: responder
+ * static 0x00, initiator static 0x20, initiator ephemeral 0x40 and
+ * responder ephemeral 0x60; the preshared key is 0xa5 repeated.
+ */
+static const uint8_t vec_ts[NOISE_TS_LEN] = {
+	0x40, 0x00, 0x00, 0x00, 0x65, 0x53, 0xf1, 0x00,
+	0x00, 0x00, 0x00, 0x00,
+};
+
+/* Responder's initial hash, before the initiation */
+static const uint8_t vec_hash[32] = {
+	0x5c, 0x85, 0xe0, 0x14, 0x19, 0xff, 0x91, 0x51,
+	0x23, 0xec, 0x17, 0x2d, 0xae, 0xdb, 0x04, 0xae,
+	0x1d, 0xa8, 0x7f, 0x92, 0x10, 0xda, 0x2e, 0xe7,
+	0x68, 0x07, 0x2c, 0xd6, 0x3f, 0xa1, 0x26, 0xe3,
+};
+
+/* Initiation, sender 0x11223344 */
+static const uint8_t vec_init[148] = {
+	0x01, 0x00, 0x00, 0x00, 0x44, 0x33, 0x22, 0x11,
+	0x79, 0xa6, 0x31, 0xee, 0xde, 0x1b, 0xf9, 0xc9,
+	0x8f, 0x12, 0x03, 0x2c, 0xde, 0xad, 0xd0, 0xe7,
+	0xa0, 0x79, 0x39, 0x8f, 0xc7, 0x86, 0xb8, 0x8c,
+	0xc8, 0x46, 0xec, 0x89, 0xaf, 0x85, 0xa5, 0x1a,
+	0x7d, 0xdc, 0xb8, 0xb7, 0x44, 0xa0, 0x22, 0xc9,
+	0xc8, 0x78, 0x23, 0x84, 0xac, 0xcd, 0x9e, 0x66,
+	0x6f, 0x21, 0x02, 0xba, 0x53, 0x0a, 0x63, 0x9e,
+	0x23, 0xb5, 0x48, 0xc7, 0x5c, 0x04, 0x1c, 0xd0,
+	0x54, 0xcd, 0xd3, 0x71, 0xb0, 0xe3, 0x63, 0x18,
+	0x1b, 0xc1, 0x65, 0x2b, 0x98, 0xc9, 0x62, 0x5a,
+	0xb4, 0x7e, 0x11, 0xa8, 0x87, 0x60, 0x4b, 0xab,
+	0x0c, 0x6c, 0x3f, 0x69, 0xe8, 0x7e, 0x8e, 0x48,
+	0x24, 0x04, 0xf0, 0x96, 0xdf, 0x5e, 0x9d, 0x16,
+	0xb7, 0x1a, 0xbd, 0x04, 0x0e, 0x86, 0xfd, 0x59,
+	0x40, 0x35, 0x1d, 0xe0, 0x4b, 0x39, 0x5e, 0x01,
+	0x34, 0x22, 0x41, 0x75, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00,
+};
+
+/* Chaining key after the initiation */
+static const uint8_t vec_init_ck[32] = {
+	0x9b, 0x94, 0x51, 0x6e, 0x65, 0xf3, 0x83, 0x3d,
+	0xf2, 0x2e, 0x91, 0x6d, 0x00, 0xff, 0x23, 0x72,
+	0x7c, 0xa6, 0xbe, 0x57, 0x4e, 0xc5, 0xc4, 0x68,
+	0x12, 0x5d, 0x99, 0x37, 0xb8, 0x87, 0xf8, 0x5e,
+};
+
+/* Handshake hash after the initiation */
+static const uint8_t vec_init_hash[32] = {
+	0x58, 0x53, 0x72, 0x96, 0xb7, 0x8d, 0xa0, 0x36,
+	0xef, 0xc1, 0x44, 0xfb, 0x4a, 0x16, 0x0d, 0x54,
+	0x3e, 0xaf, 0x4e, 0x33, 0x89, 0xfa, 0xaf, 0x70,
+	0xa6, 0xf9, 0x0b, 0x59, 0xab, 0xbb, 0x02, 0xb2,
+};
+
+/* Response, sender 0x55667788 */
+static const uint8_t vec_resp[92] = {
+	0x02, 0x00, 0x00, 0x00, 0x88, 0x77, 0x66, 0x55,
+	0x44, 0x33, 0x22, 0x11, 0x67, 0x5d, 0xd5, 0x74,
+	0xed, 0x77, 0x89, 0x31, 0x0b, 0x3d, 0x2e, 0x76,
+	0x81, 0xf3, 0x79, 0x0b, 0x46, 0x6c, 0x77, 0x3b,
+	0x15, 0x21, 0xfe, 0xcf, 0x36, 0x57, 0x79, 0x58,
+	0x37, 0x1e, 0xa5, 0x2f, 0x6a, 0x1c, 0xf3, 0xfd,
+	0xf8, 0xe2, 0x88, 0xb8, 0x3a, 0x38, 0xab, 0xc4,
+	0x7d, 0x9b, 0x25, 0xcc, 0xb5, 0x62, 0x1e, 0x4c,
+	0x46, 0xba, 0x3f, 0x20, 0x57, 0x95, 0xfe, 0x66,
+	0xfa, 0x5a, 0xc8, 0x9a, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00,
+};
+
+/* Initiator's sending key */
+static const uint8_t vec_send[32] = {
+	0x3a, 0xc5, 0x80, 0xba, 0xc2, 0x87, 0xd0, 0x26,
+	0x42, 0x17, 0x49, 0xe1, 0x0c, 0xa3, 0x36, 0xf6,
+	0xa8, 0x83, 0x64, 0x1d, 0xea, 0x6b, 0x83, 0x57,
+	0x9e, 0x46, 0x93, 0x07, 0x63, 0x2a, 0x37, 0xe3,
+};
+
+/* Initiator's receiving key */
+static const uint8_t vec_recv[32] = {
+	0xe1, 0x0d, 0x1c, 0xe3, 0xb1, 0x46, 0x89, 0x95,
+	0xdd, 0xf9, 0x89, 0x85, 0xce, 0xa8, 0x45, 0x72,
+	0xe4, 0x31, 0x4e, 0xab, 0xfb, 0xed, 0xad, 0xfe,
+	0xad, 0x2c, 0xaf, 0xd0, 0xa7, 0xbf, 0xa5, 0x33,
+};
+
+/* Initiator's first data message: a keepalive, counter 0 */
+static const uint8_t vec_data[32] = {
+	0x04, 0x00, 0x00, 0x00, 0x88, 0x77, 0x66, 0x55,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0xd6, 0x3c, 0x62, 0x5e, 0xc3, 0xd5, 0x4e, 0x91,
+	0xa1, 0x59, 0x7b, 0x8c, 0x03, 0xdc, 0xa5, 0x16,
+};
+
+/* Fill key with bytes counting up from first */
+static void
+test_key(uint8_t key[NOISE_KEY_LEN], uint8_t first)
+{
+	size_t i;
+
+	for (i = 0; i < NOISE_KEY_LEN; i++)
+		key[i] = first + i;
+}
+
+/* The initiator's state after sending vec_init */
+static void
+test_init_state(noise_hs_t *hs)
+{
+	memset(hs, 0, sizeof(*hs));
+	memcpy(hs->ck, vec_init_ck, sizeof(hs->ck));
+	memcpy(hs->hash, vec_init_hash, sizeof(hs->hash));
+	test_key(hs->epriv, 0x40);
+}
+
+/* Noise_IKpsk2 handshake and transport keys */
+static void
+test_noise(void)
+{
+	uint8_t nonce[crypto_aead_chacha20poly1305_ietf_NPUBBYTES];
+	uint8_t msg[sizeof(struct noise_data) + NOISE_TAG_LEN];
+	uint8_t key[NOISE_KEY_LEN], psk[NOISE_KEY_LEN];
+	uint8_t isend[NOISE_KEY_LEN], irecv[NOISE_KEY_LEN];
+	uint8_t rsend[NOISE_KEY_LEN], rrecv[NOISE_KEY_LEN];
+	noise_remote_t to_resp, to_init;
+	noise_local_t resp, init;
+	noise_hs_t hs, ihs;
+	struct noise_init im;
+	struct noise_resp rm;
+	struct noise_data *d;
+
+	if (sodium_init() < 0)
+		errx(1, "sodium_init");
+
+	printf("Test Noise identities...\n");
+	test_key(key, 0x00);
+	noise_local_init(&resp, key);
+	test_key(key, 0x20);
+	noise_local_init(&init, key);
+	memset(psk, 0xa5, sizeof(psk));
+	noise_remote_init(&to_resp, resp.pub, psk);
+	noise_remote_init(&to_init, init.pub, psk);
+	if (memcmp(resp.hash, vec_hash, sizeof(vec_hash)) != 0 ||
+	    memcmp(to_resp.hash, vec_hash, sizeof(vec_hash)) != 0)
+		errx(1, "noise_local_init: initial hash does not match");
+
+	printf("Test Noise consume a known initiation...\n");
+	memcpy(&im, vec_init, sizeof(im));
+	if (!noise_check_mac1(&resp, &im, sizeof(im)) ||
+	    noise_consume_init(&resp, &hs, &im) != FW_OK)
+		errx(1, "noise_consume_init: rejected a valid initiation");
+	if (memcmp(hs.spub, init.pub, sizeof(hs.spub)) != 0 ||
+	    memcmp(hs.ts, vec_ts, sizeof(hs.ts)) != 0)
+		errx(1, "noise_consume_init: static key or timestamp does not "
+		    "match");
+	if (memcmp(hs.ck, vec_init_ck, sizeof(hs.ck)) != 0 ||
+	    memcmp(hs.hash, vec_init_hash, sizeof(hs.hash)) != 0)
+		errx(1, "noise_consume_init: handshake state does not match");
+
+	printf("Test Noise consume a known response...\n");
+	test_init_state(&ihs);
+	memcpy(&rm, vec_resp, sizeof(rm));
+	if (!noise_check_mac1(&init, &rm, sizeof(rm)) ||
+	    noise_consume_resp(&init, &to_resp, &ihs, &rm) != FW_OK)
+		errx(1, "noise_consume_resp: rejected a valid response");
+	noise_derive(&ihs, 1, isend, irecv);
+	if (memcmp(isend, vec_send, sizeof(isend)) != 0 ||
+	    memcmp(irecv, vec_recv, sizeof(irecv)) != 0)
+		errx(1, "noise_derive: transport keys do not match");
+
+	/* Sealed as wguser.c does: 32 zero bits, then the counter */
+	printf("Test Noise transport keepalive...\n");
+	d = (struct noise_data *)msg;
+	d->type = htole32(NOISE_MSG_DATA);
+	d->receiver = htole32(0x55667788);
+	d->counter = htole64(0);
+	memset(nonce, 0, sizeof(nonce));
+	memcpy(nonce + 4, &d->counter, sizeof(d->counter));
+	crypto_aead_chacha20poly1305_ietf_encrypt(msg + sizeof(*d), NULL,
+	    NULL, 0, NULL, 0, NULL, nonce, isend);
+	if (memcmp(msg, vec_data, sizeof(vec_data)) != 0)
+		errx(1, "transport: keepalive does not match");
+
+	printf("Test Noise handshake round trip...\n");
+	if (noise_create_init(&init, &to_resp, &ihs, &im, 1) != FW_OK ||
+	    !noise_check_mac1(&resp, &im, sizeof(im)) ||
+	    noise_consume_init(&resp, &hs, &im) != FW_OK ||
+	    memcmp(hs.spub, init.pub, sizeof(hs.spub)) != 0)
+		errx(1, "noise_consume_init: rejected our own initiation");
+	if (noise_create_resp(&resp, &to_init, &hs, &rm, 2, 1) != FW_OK ||
+	    !noise_check_mac1(&init, &rm, sizeof(rm)) ||
+	    noise_consume_resp(&init, &to_resp, &ihs, &rm) != FW_OK)
+		errx(1, "noise_consume_resp: rejected our own response");
+	noise_derive(&ihs, 1, isend, irecv);
+	noise_derive(&hs, 0, rsend, rrecv);
+	if (memcmp(isend, rrecv, sizeof(isend)) != 0 ||
+	    memcmp(irecv, rsend, sizeof(irecv)) != 0 ||
+	    memcmp(isend, irecv, sizeof(isend)) == 0)
+		errx(1, "noise_derive: transport keys do not pair up");
+
+	printf("Test Noise reject tampered messages...\n");
+	memcpy(&im, vec_init, sizeof(im));
+	im.ts[0] ^= 1;
+	if (noise_check_mac1(&resp, &im, sizeof(im)) ||
+	    noise_consume_init(&resp, &hs, &im) == FW_OK)
+		errx(1, "noise_consume_init: accepted a tampered initiation");
+	test_init_state(&ihs);
+	noise_remote_init(&to_resp, resp.pub, NULL);
+	memcpy(&rm, vec_resp, sizeof(rm));
+	if (noise_consume_resp(&init, &to_resp, &ihs, &rm) == FW_OK)
+		errx(1, "noise_consume_resp: accepted the wrong preshared key");
+}
+
+/* Create an empty temporary file from template path */
+static void
+test_tmpfile(char *path)
+{
+	int fd;
+
+	if ((fd = mkstemp(path)) == -1)
+		err(1, "mkstemp");
+	close(fd);
+}
+
+/* Base64 of a key filled with byte b */
+static void
+test_b64(char buf[WG_KEY_B64_LEN], uint8_t b)
+{
+	uint8_t key[WG_KEY_LEN];
+
+	memset(key, b, sizeof(key));
+	if (wg_key_to_b64(buf, WG_KEY_B64_LEN, key) != FW_OK)
+		errx(1, "wg_key_to_b64");
+}
+
+/* Configuration for fwvpnd on a mock interface, without the API */
+static void
+test_cfg(fw_cfg_t *cfg, char *db_path)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->db_path = db_path;
+	cfg->listen_addr = "127.0.0.1";
+	cfg->listen_port = 51820;
+	cfg->server_addr = "10.0.0.1";
+	cfg->vpn_subnet = "10.8.0.0/24";
+	cfg->wg_iface = "wg9";
+	cfg->wg_mock = 1;
+}
+
+/* Start fwvpnd with cfg */
+static fw_ctx_t *
+test_start(fw_cfg_t *cfg)
+{
+	if (fw_init(cfg) != FW_OK || fw_start() != FW_OK)
+		errx(1, "fw_start: failed to start on a mock interface");
+
+	return fw_get_ctx();
+}
+
+/* Is the peer with key filled with byte b known? */
+static int
+test_has_peer(fw_ctx_t *ctx, uint8_t b)
+{
+	char pub[WG_KEY_B64_LEN];
+	fw_peer_t peer;
+
+	test_b64(pub, b);
+	return fw_get_peer(ctx, pub, &peer) == FW_OK;
+}
+
+/* Migrate in steps while an older fwvpnd writes to the v1 tables */
+static void
+test_mig_online(void)
+{
+	char path[] = "/tmp/test_server.XXXXXX";
+	char sql[512], priv[WG_KEY_B64_LEN], pub[WG_KEY_B64_LEN];
+	char moved[WG_KEY_B64_LEN];
+	fw_db_user_t user;
+	fw_migrate_t m;
+	sqlite3 *db, *old;
+	int schema, steps;
+
+	test_tmpfile(path);
+	if (sqlite3_open(path, &old) != SQLITE_OK ||
+	    sqlite3_exec(old, baseline_sql, NULL, NULL, NULL) != SQLITE_OK ||
+	    sqlite3_exec(old, "INSERT INTO users VALUES (2,"
+	    "	'0123456789abcdef0123456789abcdef', 'two@example.com', 'x',"
+	    "	NULL);", NULL, NULL, NULL) != SQLITE_OK)
+		errx(1, "sqlite3_exec: %s", sqlite3_errmsg(old));
+
+	printf("Test migrate abort...\n");
+	if (sqlite3_open(path, &db) != SQLITE_OK)
+		errx(1, "sqlite3_open: %s", path);
+	if (fw_mig_start(&m, db, 1) != FW_OK || fw_mig_step(&m) != FW_OK ||
+	    fw_mig_abort(&m) != FW_OK)
+		errx(1, "fw_mig_abort: failed");
+	if (fw_mig_version(db, &schema) != FW_OK || schema != 1 ||
+	    sqlite3_exec(db, "SELECT * FROM users_v2", NULL, NULL, NULL) ==
+	    SQLITE_OK)
+		errx(1, "fw_mig_abort: left the migration behind");
+
+	printf("Test migrate past concurrent v1 writes...\n");
+	if (fw_mig_start(&m, db, 1) != FW_OK || fw_mig_step(&m) != FW_OK ||
+	    fw_mig_step(&m) != FW_OK)
+		errx(1, "fw_mig_step: failed");
+	test_b64(moved, 0x02);
+	test_b64(priv, 0x03);
+	test_b64(pub, 0x04);
+	snprintf(sql, sizeof(sql), "UPDATE vpn_configs SET public_key = '%s'"
+	    "	WHERE user_id = '00112233445566778899aabbccddeeff';"
+	    "INSERT INTO vpn_configs VALUES ('0123456789abcdef0123456789abcdef',"
+	    "	'10.8.0.3/32', 2, '%s', '%s');", moved, priv, pub);
+	if (sqlite3_exec(old, sql, NULL, NULL, NULL) != SQLITE_OK)
+		errx(1, "sqlite3_exec: %s", sqlite3_errmsg(old));
+	for (steps = 0; m.stage != FW_MIG_DONE && steps < 100; steps++)
+		if (fw_mig_step(&m) != FW_OK)
+			errx(1, "fw_mig_step: failed");
+	if (m.stage != FW_MIG_DONE || m.replayed == 0)
+		errx(1, "fw_mig_step: changed rows not replayed");
+	sqlite3_close(old);
+	sqlite3_close(db);
+
+	if (fw_db_open(path, &db) != FW_OK)
+		errx(1, "fw_db_open: failed to open the migrated database");
+	if (fw_db_get_user(db, "00112233445566778899aabbccddeeff", &user) !=
+	    FW_OK || strcmp(user.public_key, moved) != 0)
+		errx(1, "fw_mig_step: lost an update made while copying");
+	if (fw_db_get_user(db, "0123456789abcdef0123456789abcdef", &user) !=
+	    FW_OK || strcmp(user.assigned_ip, "10.8.0.3") != 0 ||
+	    strcmp(user.public_key, pub) != 0)
+		errx(1, "fw_mig_step: lost a row added while copying");
+	sqlite3_close(db);
+	unlink(path);
+}
+
+/* Write a snapshot of one peer, key filled with byte b */
+static void
+test_snap_one(const char *path, uint64_t generation, uint8_t b)
+{
+	uint8_t key[WG_KEY_LEN];
+	struct in_addr addr;
+	fw_ptab_t pt;
+
+	memset(key, b, sizeof(key));
+	addr.s_addr = htonl(0x0a080063);
+	if (fw_ptab_init(&pt, 16) != FW_OK ||
+	    fw_ptab_add(&pt, key, addr, NULL) != FW_OK ||
+	    fw_snap_write(path, generation, &pt) != FW_OK)
+		err(1, "fw_snap_write");
+	fw_ptab_free(&pt);
+}
+
+/* Peer snapshot round trip, damage, and the DB fallback when stale */
+static void
+test_snapshot(void)
+{
+	char snap_path[] = "/tmp/test_server.XXXXXX";
+	char db_path[] = "/tmp/test_server.XXXXXX";
+	const struct fw_snap_rec *r;
+	uint8_t key[WG_KEY_LEN];
+	struct in_addr addr;
+	fw_db_user_t user;
+	fw_snap_t snap;
+	fw_ptab_t pt;
+	fw_cfg_t cfg;
+	fw_ctx_t *ctx;
+	uint64_t gen, i;
+	uint32_t id;
+	FILE *fp;
+
+	test_tmpfile(snap_path);
+	test_tmpfile(db_path);
+
+	printf("Test snapshot round trip...\n");
+	if (fw_ptab_init(&pt, 16) != FW_OK)
+		err(1, "fw_ptab_init");
+	for (i = 0; i < 3; i++) {
+		memset(key, 0x10 + i, sizeof(key));
+		addr.s_addr = htonl(0x0a080002 + i);
+		if (fw_ptab_add(&pt, key, addr, &id) != FW_OK)
+			err(1, "fw_ptab_add");
+		if (i == 1 && fw_ptab_admit(&pt, &pt.ents[id]) != FW_OK)
+			err(1, "fw_ptab_admit");
+	}
+	if (fw_snap_write(snap_path, 7, &pt) != FW_OK)
+		err(1, "fw_snap_write");
+	if (fw_snap_open(&snap, snap_path) != FW_OK)
+		err(1, "fw_snap_open: failed to open a fresh snapshot");
+	if (snap.hdr->generation != 7 || snap.hdr->count != 3)
+		errx(1, "fw_snap_open: header does not match");
+	for (i = 0; i < snap.hdr->count; i++) {
+		r = &snap.recs[i];
+		memset(key, r->key[0], sizeof(key));
+		if (r->key[0] < 0x10 || r->key[0] > 0x12 ||
+		    memcmp(r->key, key, sizeof(key)) != 0 ||
+		    r->addr != htonl(0x0a080002 + r->key[0] - 0x10) ||
+		    !(r->flags & FW_SNAP_RESIDENT) != (r->key[0] != 0x11))
+			errx(1, "fw_snap_open: record %llu does not match",
+			    (unsigned long long)i);
+	}
+	fw_snap_close(&snap);
+
+	printf("Test snapshot reject a damaged file...\n");
+	if ((fp = fopen(snap_path, "r+")) == NULL ||
+	    fseek(fp, offsetof(struct fw_snap_hdr, generation), SEEK_SET) ==
+	    -1 || fputc(8, fp) == EOF || fclose(fp) == EOF)
+		err(1, "%s", snap_path);
+	if (fw_snap_open(&snap, snap_path) == FW_OK || errno != EINVAL)
+		errx(1, "fw_snap_open: accepted a damaged header");
+	if (fw_snap_write(snap_path, 7, &pt) != FW_OK)
+		err(1, "fw_snap_write");
+	fw_ptab_free(&pt);
+	if ((fp = fopen(snap_path, "r+")) == NULL ||
+	    fseek(fp, -1, SEEK_END) == -1 || fputc(0xff, fp) == EOF ||
+	    fclose(fp) == EOF)
+		err(1, "%s", snap_path);
+	if (fw_snap_open(&snap, snap_path) == FW_OK || errno != EINVAL)
+		errx(1, "fw_snap_open: accepted a damaged record");
+	if (truncate(snap_path, sizeof(struct fw_snap_hdr) + 1) == -1)
+		err(1, "truncate");
+	if (fw_snap_open(&snap, snap_path) == FW_OK || errno != EINVAL)
+		errx(1, "fw_snap_open: accepted a truncated file");
+
+	/* One user in the DB, peer key 0x01; snapshots hold peer 0x02 */
+	unlink(snap_path);
+	test_cfg(&cfg, db_path);
+	cfg.snap_path = snap_path;
+	ctx = test_start(&cfg);
+	memset(&user, 0, sizeof(user));
+	strlcpy(user.id, "00112233445566778899aabbccddeeff", sizeof(user.id));
+	test_b64(user.private_key, 0x03);
+	test_b64(user.public_key, 0x01);
+	strlcpy(user.assigned_ip, "10.8.0.2", sizeof(user.assigned_ip));
+	if (fw_db_add_user(ctx->db_conn, &user, "snap@example.com", "x",
+	    time(NULL)) != FW_OK || fw_db_generation(ctx->db_conn, &gen) !=
+	    FW_OK)
+		errx(1, "fw_db_add_user: %s", sqlite3_errmsg(ctx->db_conn));
+	fw_cleanup();
+
+	printf("Test start from a current snapshot...\n");
+	test_snap_one(snap_path, gen, 0x02);
+	ctx = test_start(&cfg);
+	if (!test_has_peer(ctx, 0x02) || test_has_peer(ctx, 0x01))
+		errx(1, "fw_start: did not load the current snapshot");
+	fw_cleanup();
+
+	printf("Test start from the DB past a stale snapshot...\n");
+	test_snap_one(snap_path, gen - 1, 0x02);
+	ctx = test_start(&cfg);
+	if (!test_has_peer(ctx, 0x01) || test_has_peer(ctx, 0x02))
+		errx(1, "fw_start: loaded a stale snapshot");
+	fw_cleanup();
+
+	printf("Test start from the DB past a damaged snapshot...\n");
+	test_snap_one(snap_path, gen, 0x02);
+	if (truncate(snap_path, sizeof(struct fw_snap_hdr) + 1) == -1)
+		err(1, "truncate");
+	ctx = test_start(&cfg);
+	if (!test_has_peer(ctx, 0x01) || test_has_peer(ctx, 0x02))
+		errx(1, "fw_start: loaded a damaged snapshot");
+	fw_cleanup();
+
+	unlink(snap_path);
+	unlink(db_path);
+}
+
+/* Replace the file at path with text */
+static void
+test_write(const char *path, const char *text)
+{
+	FILE *fp;
+
+	if ((fp = fopen(path, "w")) == NULL || fputs(text, fp) == EOF ||
+	    fclose(fp) == EOF)
+		err(1, "%s", path);
+}
+
+/* fwvpnd.conf(5) parsing */
+static void
+test_conf(void)
+{
+	static const char *bad[] = {
+		"no_such_keyword 1\n",
+		"api_port\n",
+		"lazy_peers maybe\n",
+		"api_port 65536\n",
+		"job_workers -1\n",
+	};
+	char path[] = "/tmp/test_server.XXXXXX";
+	fw_cfg_t cfg;
+	size_t i;
+
+	test_tmpfile(path);
+
+	printf("Test load the default configuration...\n");
+	if (fw_conf_load(NULL, &cfg) != FW_OK)
+		errx(1, "fw_conf_load: failed without a file");
+	if (cfg.conf_path != NULL || cfg.listen_port != 8080 ||
+	    strcmp(cfg.db_path, "/var/fwvpn/db/vpn.db") != 0)
+		errx(1, "fw_conf_load: defaults do not match");
+	fw_conf_free(&cfg);
+
+	printf("Test parse a configuration file...\n");
+	test_write(path,
+	    "# fwvpnd.conf\n"
+	    "\n"
+	    "api_port      18080\n"
+	    "  db_path     /tmp/vpn.db   # trailing comment\n"
+	    "lazy_peers    yes\n"
+	    "idle_timeout  300\t\n"
+	    "max_resident  512\n"
+	    "config_cache  64\n"
+	    "job_workers   4\n");
+	if (fw_conf_load(path, &cfg) != FW_OK)
+		errx(1, "fw_conf_load: failed to parse %s", path);
+	if (strcmp(cfg.conf_path, path) != 0 || cfg.api_port != 18080 ||
+	    strcmp(cfg.db_path, "/tmp/vpn.db") != 0 || cfg.lazy_peers != 1 ||
+	    cfg.idle_timeout != 300 || cfg.max_resident != 512 ||
+	    cfg.config_cache != 64 || cfg.job_workers != 4)
+		errx(1, "fw_conf_load: parsed values do not match");
+	if (strcmp(cfg.ctl_path, "/var/run/fwvpnd.sock") != 0)
+		errx(1, "fw_conf_load: lost a default");
+	fw_conf_free(&cfg);
+
+	printf("Test reject bad configuration lines...\n");
+	for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		test_write(path, bad[i]);
+		if (fw_conf_load(path, &cfg) == FW_OK)
+			errx(1, "fw_conf_load: accepted \"%.*s\"",
+			    (int)strcspn(bad[i], "\n"), bad[i]);
+		if (cfg.db_path != NULL)
+			errx(1, "fw_conf_load: left strings after failing");
+	}
+
+	unlink(path);
+}
+
+/* Apply a changed configuration to a running fwvpnd */
+static void
+test_reload(void)
+{
+	char db_path[] = "/tmp/test_server.XXXXXX";
+	char email[MAX_EMAIL_LEN];
+	struct wg_interface_io iface;
+	fw_db_user_t user;
+	fw_cfg_t cfg, new;
+	fw_ctx_t *ctx;
+	fw_sched_t *sched;
+	size_t peers, resident, i;
+	sqlite3 *db;
+
+	test_tmpfile(db_path);
+	if (fw_db_open(db_path, &db) != FW_OK)
+		errx(1, "fw_db_open: failed to create %s", db_path);
+	for (i = 0; i < 3; i++) {
+		memset(&user, 0, sizeof(user));
+		snprintf(user.id, sizeof(user.id), "%032zx", i + 1);
+		test_b64(user.private_key, 0x20 + i);
+		test_b64(user.public_key, 0x30 + i);
+		snprintf(user.assigned_ip, sizeof(user.assigned_ip),
+		    "10.8.0.%zu", i + 2);
+		snprintf(email, sizeof(email), "reload%zu@example.com", i);
+		if (fw_db_add_user(db, &user, email, "x", time(NULL)) != FW_OK)
+			errx(1, "fw_db_add_user: %s", sqlite3_errmsg(db));
+	}
+	sqlite3_close(db);
+
+	test_cfg(&cfg, db_path);
+	ctx = test_start(&cfg);
+	sched = ctx->sched;
+	if (fw_get_server_stats(ctx, &peers, &resident) != FW_OK ||
+	    peers != 3 || resident != 3 ||
+	    sched->nworkers != FW_SCHED_WORKERS)
+		errx(1, "fw_start: unexpected starting state");
+
+	printf("Test reload reloadable settings...\n");
+	memcpy(&new, &cfg, sizeof(new));
+	new.idle_timeout = 1234;
+	new.poll_interval = 7;
+	new.auth_rate = 99;
+	new.listen_port = 51821;
+	new.max_resident = 1;
+	new.job_workers = 4;
+	new.config_cache = 16;
+	if (fw_reload(&new) != FW_OK)
+		errx(1, "fw_reload: failed");
+	if (ctx->config.idle_timeout != 1234 ||
+	    ctx->config.poll_interval != 7 || ctx->config.auth_rate != 99 ||
+	    ctx->config.listen_port != 51821 ||
+	    ctx->config.config_cache != 16)
+		errx(1, "fw_reload: settings not applied");
+	if (ctx->config.job_workers != 4 || sched->nworkers != 4)
+		errx(1, "fw_reload: job_workers not applied");
+	if (fw_get_server_stats(ctx, &peers, &resident) != FW_OK ||
+	    peers != 3 || resident != 1 || ctx->config.max_resident != 1)
+		errx(1, "fw_reload: smaller max_resident did not evict");
+
+	printf("Test reload keep restart-only settings...\n");
+	memcpy(&new, &cfg, sizeof(new));
+	new.db_path = "/nonexistent/vpn.db";
+	new.wg_iface = "wg8";
+	new.api_port = 18081;
+	if (fw_reload(&new) != FW_OK)
+		errx(1, "fw_reload: failed");
+	if (ctx->config.db_path != cfg.db_path ||
+	    strcmp(ctx->config.wg_iface, "wg9") != 0 ||
+	    ctx->config.api_port != 0 || ctx->api != NULL)
+		errx(1, "fw_reload: changed a restart-only setting");
+	if (ctx->config.idle_timeout != FW_IDLE_TIMEOUT ||
+	    ctx->config.poll_interval != FW_POLL_INTERVAL ||
+	    ctx->config.job_workers != FW_SCHED_WORKERS ||
+	    sched->nworkers != FW_SCHED_WORKERS ||
+	    ctx->config.max_resident != WG_PEERS_MAX)
+		errx(1, "fw_reload: defaults not restored");
+	fw_cleanup();
+
+	printf("Test reload before start and with -k...\n");
+	test_cfg(&cfg, db_path);
+	cfg.keep_iface = 1;
+	if (fw_init(&cfg) != FW_OK || (ctx = fw_get_ctx()) == NULL)
+		errx(1, "fw_init: failed");
+	if (!ctx->config.handover)
+		errx(1, "fw_init: -k did not force handover");
+	memcpy(&new, &cfg, sizeof(new));
+	new.listen_port = 51822;
+	if (fw_reload(&new) != FW_OK)
+		errx(1, "fw_reload: failed");
+	if (ctx->config.listen_port != 51822 || !ctx->config.handover)
+		errx(1, "fw_reload: lost listen_port or -k before fw_start");
+	memset(&iface, 0, sizeof(iface));
+	if (fw_start() != FW_OK ||
+	    wg_get_iface(ctx->wg_handle, &iface) != FW_OK ||
+	    iface.i_port != 51822)
+		errx(1, "fw_start: reloaded listen_port not set");
+	fw_cleanup();
+
+	unlink(db_path);
+}
+
+/* Value of the series name in the metrics exposition */
+static double
+test_metric(const char *name)
+{
+	char line[256];
+	size_t len = strlen(name);
+	double v = -1;
+	FILE *fp;
+
+	if ((fp = tmpfile()) == NULL || fw_metrics_write(fp) != FW_OK)
+		err(1, "fw_metrics_write");
+	rewind(fp);
+	while (fgets(line, sizeof(line), fp) != NULL)
+		if (strncmp(line, name, len) == 0 && line[len] == ' ') {
+			v = strtod(line + len + 1, NULL);
+			break;
+		}
+	fclose(fp);
+	if (v < 0)
+		errx(1, "fw_metrics_write: no %s", name);
+
+	return v;
+}
+
+/* Bump the control error counter from a thread of its own */
+static void *
+test_metric_thread(void *arg)
+{
+	fw_metric_add(FW_C_CTL_ERRORS, 2);
+	return NULL;
+}
+
+/* Per-thread metric blocks summed in the exposition */
+static void
+test_metrics(void)
+{
+	double errors, count, sum;
+	pthread_t thread;
+	uint64_t v;
+
+	printf("Test metrics sum counters over threads...\n");
+	errors = test_metric("fwvpnd_ctl_errors_total");
+	fw_metric_inc(FW_C_CTL_ERRORS);
+	if (pthread_create(&thread, NULL, test_metric_thread, NULL) != 0 ||
+	    pthread_join(thread, NULL) != 0)
+		errx(1, "pthread_create");
+	if (test_metric("fwvpnd_ctl_errors_total") != errors + 3)
+		errx(1, "fw_metrics_write: lost a thread's counts");
+
+	printf("Test metrics histogram count and sum...\n");
+	count = test_metric("fwvpnd_ctl_request_seconds_count");
+	sum = test_metric("fwvpnd_ctl_request_seconds_sum");
+	fw_metric_observe(FW_H_CTL, 1500);
+	fw_metric_observe(FW_H_CTL, 2000000);
+	if (test_metric("fwvpnd_ctl_request_seconds_count") != count + 2 ||
+	    test_metric("fwvpnd_ctl_request_seconds_sum") - sum < 0.0020014 ||
+	    test_metric("fwvpnd_ctl_request_seconds_sum") - sum > 0.0020016)
+		errx(1, "fw_metrics_write: histogram does not add up");
+
+	printf("Test metrics histogram buckets...\n");
+	for (v = 1; v < (1ULL << 40); v += v / 7 + 1)
+		if (fw_hist_bucket(v) < fw_hist_bucket(v - 1))
+			errx(1, "fw_hist_bucket: %llu went down a bucket",
+			    (unsigned long long)v);
+	if (fw_hist_bucket(UINT64_MAX) >= FW_HIST_BUCKETS)
+		errx(1, "fw_hist_bucket: past the last bucket");
+}
+
+/* Trace rings and their dump, or the stub without FW_TRACE */
+static void
+test_trace(void)
+{
+	char path[] = "/tmp/test_server.XXXXXX";
+#ifdef FW_TRACE
+	struct fw_trace_hdr hdr;
+	struct fw_trace_rhdr rhdr;
+	struct fw_tevent ev, last;
+	uint32_t r, i;
+	FILE *fp;
+#endif
+
+	test_tmpfile(path);
+
+#ifdef FW_TRACE
+	printf("Test trace dump a ring that wrapped...\n");
+	for (i = 0; i < FW_TRACE_RING + 10; i++) {
+		FW_TRACE_BEGIN(FW_P_KEYGEN, i);
+		FW_TRACE_END(FW_P_KEYGEN, i, 0);
+	}
+	if (fw_trace_dump(path) != FW_OK)
+		err(1, "fw_trace_dump");
+	if ((fp = fopen(path, "r")) == NULL ||
+	    fread(&hdr, sizeof(hdr), 1, fp) != 1)
+		err(1, "%s", path);
+	if (hdr.magic != FW_TRACE_MAGIC || hdr.version != FW_TRACE_VERSION ||
+	    hdr.evsize != sizeof(struct fw_tevent) || hdr.nrings == 0)
+		errx(1, "fw_trace_dump: header does not match");
+	for (r = 0; r < hdr.nrings; r++) {
+		if (fread(&rhdr, sizeof(rhdr), 1, fp) != 1)
+			errx(1, "fw_trace_dump: short dump");
+		memset(&last, 0, sizeof(last));
+		for (i = 0; i < rhdr.count; i++) {
+			if (fread(&ev, sizeof(ev), 1, fp) != 1)
+				errx(1, "fw_trace_dump: short ring");
+			if (ev.ts < last.ts || ev.tid != rhdr.tid)
+				errx(1, "fw_trace_dump: ring out of order");
+			last = ev;
+		}
+		if (rhdr.tid == fw_trtls->tid &&
+		    (rhdr.count != FW_TRACE_RING ||
+		    last.probe != FW_P_KEYGEN || last.phase != FW_TR_END ||
+		    last.a0 != FW_TRACE_RING + 9))
+			errx(1, "fw_trace_dump: ring does not end in the "
+			    "newest event");
+	}
+	fclose(fp);
+#else
+	printf("Test trace dump compiled out...\n");
+	if (fw_trace_dump(path) != FW_ERR || errno != EOPNOTSUPP)
+		errx(1, "fw_trace_dump: no error without FW_TRACE");
+#endif
+
+	unlink(path);
+}
+
+/* API port for the request parsing tests */
+#define TEST_API_PORT  18089
+
+/* Responses test_api() collected, NUL-terminated */
+static char test_resp[FW_API_BUF * 4];
+
+/* One turn of the event loop's API half */
+static void
+test_api_turn(fw_ctx_t *ctx, int timeout)
+{
+	struct pollfd pfds[FW_API_POLLFDS];
+	size_t n;
+
+	n = fw_api_pollfds(ctx, pfds);
+	if (poll(pfds, n, timeout) == -1)
+		err(1, "poll");
+	fw_api_serve(ctx, pfds, n);
+}
+
+/*
+ * Send the NULL-terminated parts of a request to the API, serving a few
+ * turns after each, then collect responses until the server closes.
+ * Returns the status codes in order, "" when there were none.
+ */
+static const char *
+test_api(fw_ctx_t *ctx, const char * const *parts)
+{
+	static char codes[64];
+	struct sockaddr_in sin;
+	char *buf = test_resp, *p;
+	size_t len = 0, i;
+	ssize_t n;
+	int fd, turn;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(TEST_API_PORT);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	    connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+	    fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+		err(1, "connect");
+
+	for (; *parts != NULL; parts++) {
+		if (send(fd, *parts, strlen(*parts), 0) == -1)
+			err(1, "send");
+		for (turn = 0; turn < 3; turn++)
+			test_api_turn(ctx, 20);
+	}
+
+	for (turn = 0; turn < 500; turn++) {
+		test_api_turn(ctx, 10);
+		n = recv(fd, buf + len, sizeof(test_resp) - 1 - len, 0);
+		if (n == 0)
+			break;
+		if (n == -1 && errno != EAGAIN)
+			err(1, "recv");
+		if (n > 0)
+			len += n;
+	}
+	close(fd);
+	if (turn == 500)
+		errx(1, "fw_api_serve: connection left open");
+
+	/* Status lines start responses; bodies are short JSON */
+	buf[len] = '\0';
+	codes[0] = '\0';
+	for (p = buf; (p = strstr(p, "HTTP/1.1 ")) != NULL; p += 9) {
+		i = strlen(codes);
+		snprintf(codes + i, sizeof(codes) - i, "%s%.3s",
+		    i > 0 ? " " : "", p + 9);
+	}
+
+	return codes;
+}
+
+/* HTTP API request parsing, on poll(2) or io_uring(7) */
+static void
+test_api_parse(int uring)
+{
+	static const struct {
+		const char *name;
+		const char *parts[3];
+		const char *codes;
+	} tests[] = {
+		{ "a request split inside a header",
+		    { "GET /nowhere HTTP/1.1\r\nConnection: cl",
+		    "ose\r\n\r\n" }, "404" },
+		{ "a body split across reads",
+		    { "POST /login HTTP/1.1\r\nContent-Length: 5\r\n"
+		    "Connection: close\r\n\r\nab", "cde" }, "400" },
+		{ "a form body",
+		    { "POST /login HTTP/1.1\r\nContent-Length: 41\r\n"
+		    "Connection: close\r\n\r\n"
+		    "email=no%40example.com&password=password1" }, "401" },
+		{ "pipelined requests",
+		    { "GET /nowhere HTTP/1.1\r\n\r\n"
+		    "DELETE /login HTTP/1.1\r\n\r\n"
+		    "GET /config HTTP/1.1\r\nConnection: close\r\n\r\n" },
+		    "404 405 401" },
+		{ "a bearer token",
+		    { "GET /config HTTP/1.1\r\nAuthorization: Bearer x\r\n"
+		    "Connection: close\r\n\r\n" }, "401" },
+		{ "HTTP/1.0 closing after one response",
+		    { "GET /nowhere HTTP/1.0\r\n\r\n"
+		    "GET /nowhere HTTP/1.0\r\n\r\n" }, "404" },
+		{ "a request line without a version",
+		    { "GET /config\r\n\r\n" }, "400" },
+		{ "a request line with another protocol",
+		    { "GET /config FTP/1.0\r\n\r\n" }, "400" },
+		{ "a malformed content length",
+		    { "POST /login HTTP/1.1\r\nContent-Length: 12x\r\n\r\n" },
+		    "400" },
+		{ "an overflowing content length",
+		    { "POST /login HTTP/1.1\r\n"
+		    "Content-Length: 99999999999\r\n\r\n" }, "400" },
+		{ "a body over the buffer",
+		    { "POST /login HTTP/1.1\r\nContent-Length: 100000\r\n"
+		    "\r\n" }, "413" },
+	};
+	char db_path[] = "/tmp/test_server.XXXXXX";
+	char big[FW_API_BUF + 16];
+	const char *on = uring ? " on io_uring" : "";
+	const char *parts[2], *codes;
+	fw_cfg_t cfg;
+	fw_ctx_t *ctx;
+	uint64_t hashed;
+	size_t i;
+
+	test_tmpfile(db_path);
+	test_cfg(&cfg, db_path);
+	cfg.api_port = TEST_API_PORT;
+	cfg.api_uring = uring;
+	ctx = test_start(&cfg);
+
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		printf("Test API parse %s%s...\n", tests[i].name, on);
+		if (strcmp(codes = test_api(ctx, tests[i].parts),
+		    tests[i].codes) != 0)
+			errx(1, "fw_api_serve: answered \"%s\", not \"%s\"",
+			    codes, tests[i].codes);
+	}
+
+	printf("Test API parse headers over the buffer%s...\n", on);
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	memcpy(big, "GET / HTTP/1.1\r\nX: ", 19);
+	parts[0] = big;
+	parts[1] = NULL;
+	if (strcmp(codes = test_api(ctx, parts), "413") != 0)
+		errx(1, "fw_api_serve: answered \"%s\", not \"413\"", codes);
+
+	printf("Test API login hash for an unknown email%s...\n", on);
+	hashed = fw_mthread()->hist_sum[FW_H_PWHASH];
+	parts[0] = "POST /login HTTP/1.1\r\nContent-Length: 41\r\n"
+	    "Connection: close\r\n\r\n"
+	    "email=no%40example.com&password=password1";
+	if (strcmp(codes = test_api(ctx, parts), "401") != 0)
+		errx(1, "fw_api_serve: answered \"%s\", not \"401\"", codes);
+	if (fw_mthread()->hist_sum[FW_H_PWHASH] - hashed < 1000000)
+		errx(1, "api_login: unknown email answered without hashing");
+
+	fw_cleanup();
+	unlink(db_path);
+}
+
+/* Copy what follows the first name in the responses, up to a stop */
+static void
+test_resp_field(const char *name, const char *stop, char *buf, size_t len)
+{
+	const char *p;
+	size_t n;
+
+	if ((p = strstr(test_resp, name)) == NULL)
+		errx(1, "fw_api_serve: no %s in the response", name);
+	p += strlen(name);
+	if ((n = strcspn(p, stop)) >= len)
+		errx(1, "fw_api_serve: %s too long", name);
+	memcpy(buf, p, n);
+	buf[n] = '\0';
+}
+
+/* GET /config from the rendered config cache, and its ETag */
+static void
+test_api_config(void)
+{
+	char db_path[] = "/tmp/test_server.XXXXXX";
+	char token[FW_DB_TOKEN_LEN], etag[FW_ETAG_LEN], old[FW_ETAG_LEN];
+	char auth[256], match[320];
+	const char *parts[2], *codes;
+	uint64_t hits;
+	fw_cfg_t cfg, new;
+	fw_ctx_t *ctx;
+
+	test_tmpfile(db_path);
+	test_cfg(&cfg, db_path);
+	cfg.api_port = TEST_API_PORT;
+	ctx = test_start(&cfg);
+	parts[1] = NULL;
+
+	printf("Test API config after signup and login...\n");
+	parts[0] = "POST /signup HTTP/1.1\r\nContent-Length: 41\r\n"
+	    "Connection: close\r\n\r\n"
+	    "email=me%40example.com&password=password1";
+	if (strcmp(codes = test_api(ctx, parts), "201") != 0)
+		errx(1, "api_signup: answered \"%s\", not \"201\"", codes);
+	parts[0] = "POST /login HTTP/1.1\r\nContent-Length: 41\r\n"
+	    "Connection: close\r\n\r\n"
+	    "email=me%40example.com&password=password1";
+	if (strcmp(codes = test_api(ctx, parts), "200") != 0)
+		errx(1, "api_login: answered \"%s\", not \"200\"", codes);
+	test_resp_field("\"token\":\"", "\"", token, sizeof(token));
+	snprintf(auth, sizeof(auth), "GET /config HTTP/1.1\r\n"
+	    "Authorization: Bearer %s\r\nConnection: close\r\n\r\n", token);
+	parts[0] = auth;
+	if (strcmp(codes = test_api(ctx, parts), "200") != 0)
+		errx(1, "api_config: answered \"%s\", not \"200\"", codes);
+	test_resp_field("ETag: ", "\r", etag, sizeof(etag));
+	if (strstr(test_resp, "[Interface]") == NULL)
+		errx(1, "api_config: no config in the response");
+
+	printf("Test API config 304 for a current ETag...\n");
+	hits = fw_mthread()->counters[FW_C_CFG_HITS];
+	snprintf(match, sizeof(match), "GET /config HTTP/1.1\r\n"
+	    "Authorization: Bearer %s\r\nIf-None-Match: %s\r\n"
+	    "Connection: close\r\n\r\n", token, etag);
+	parts[0] = match;
+	if (strcmp(codes = test_api(ctx, parts), "304") != 0)
+		errx(1, "api_config: answered \"%s\", not \"304\"", codes);
+	if (fw_mthread()->counters[FW_C_CFG_HITS] != hits + 1)
+		errx(1, "api_config: 304 not served from the cache");
+	if (strstr(test_resp, "[Interface]") != NULL)
+		errx(1, "api_config: 304 carried a body");
+
+	printf("Test API config new ETag after the endpoint moves...\n");
+	memcpy(&new, &cfg, sizeof(new));
+	new.listen_port = 51821;
+	if (fw_reload(&new) != FW_OK)
+		errx(1, "fw_reload: failed");
+	if (strcmp(codes = test_api(ctx, parts), "200") != 0)
+		errx(1, "api_config: answered \"%s\" for a stale ETag", codes);
+	strlcpy(old, etag, sizeof(old));
+	test_resp_field("ETag: ", "\r", etag, sizeof(etag));
+	if (strcmp(old, etag) == 0 ||
+	    strstr(test_resp, "Endpoint = 10.0.0.1:51821") == NULL)
+		errx(1, "api_config: served the config from before the move");
+
+	fw_cleanup();
+	unlink(db_path);
+}
+
+/* Auth rate limiting, and which buckets a full set gives up */
+static void
+test_ratelimit(void)
+{
+	uint8_t h[crypto_shorthash_BYTES];
+	uint32_t keys[FW_RL_WAYS + 1], key, wait;
+	fw_ratelimit_t *rl;
+	uint64_t hash, set = 0;
+	size_t n;
+
+	if ((rl = fw_rl_new()) == NULL)
+		err(1, "fw_rl_new");
+
+	/* Keys that share one set */
+	for (key = 0, n = 0; n < FW_RL_WAYS + 1; key++) {
+		crypto_shorthash(h, (uint8_t *)&key, sizeof(key), rl->seed);
+		memcpy(&hash, h, sizeof(hash));
+		hash &= FW_RL_SETS - 1;
+		if (n == 0)
+			set = hash;
+		if (hash == set)
+			keys[n++] = key;
+	}
+
+	printf("Test ratelimit drain a bucket...\n");
+	if (!fw_rl_take(rl, &keys[0], sizeof(keys[0]), 1, 1, &wait) ||
+	    fw_rl_take(rl, &keys[0], sizeof(keys[0]), 1, 1, &wait) ||
+	    wait != 60)
+		errx(1, "fw_rl_take: burst of 1 at 1/minute not enforced");
+
+	printf("Test ratelimit keep a repeat key over one-shot keys...\n");
+	for (n = 1; n < FW_RL_WAYS + 1; n++)
+		if (!fw_rl_take(rl, &keys[n], sizeof(keys[n]), 1, 1, &wait))
+			errx(1, "fw_rl_take: refused a new key");
+	if (fw_rl_take(rl, &keys[0], sizeof(keys[0]), 1, 1, &wait))
+		errx(1, "fw_rl_take: evicted a drained repeat key");
+	if (!fw_rl_take(rl, &keys[1], sizeof(keys[1]), 1, 1, &wait))
+		errx(1, "fw_rl_take: kept a one-shot key over a repeat key");
+
+	fw_rl_free(rl);
+}
+
+/* Key and tunnel address of test peer i */
+static void
+test_peer(size_t i, uint8_t key[WG_KEY_LEN], struct in_addr *addr)
+{
+	memset(key, 0x77, WG_KEY_LEN);
+	key[0] = i & 0xff;
+	key[1] = i >> 8;
+	addr->s_addr = htonl(0x0a090001 + i);
+}
+
+/*
+ * wg(4) through the privileged process: dumps of every peer that wrap
+ * the rings, and a buffer the rings can't carry
+ */
+static void
+test_privsep(void)
+{
+	static uint8_t keys[WG_PEERS_MAX][WG_KEY_LEN];
+	static struct in_addr addrs[WG_PEERS_MAX];
+	uint8_t key[WG_KEY_LEN];
+	struct wg_interface_io *iface;
+	struct wg_data_io dio;
+	struct wg_peer_io *p;
+	struct in_addr addr;
+	wg_handle_t wg;
+	size_t i, n, round, size;
+
+	printf("Test privsep open a mock interface...\n");
+	if (wg_open_priv(&wg, "wg9", WG_BACKEND_MOCK) != FW_OK ||
+	    wg_create_iface(&wg) != FW_OK)
+		errx(1, "wg_open_priv: failed");
+
+	printf("Test privsep install peers in batches...\n");
+	for (i = 0; i < WG_PEERS_MAX; i++)
+		test_peer(i, keys[i], &addrs[i]);
+	for (i = 0; i < WG_PEERS_MAX; i += n) {
+		n = WG_PEERS_MAX - i < FW_INSTALL_BATCH ?
+		    WG_PEERS_MAX - i : FW_INSTALL_BATCH;
+		if (wg_add_peers(&wg, &keys[i], &addrs[i], n) != FW_OK)
+			err(1, "wg_add_peers");
+	}
+
+	printf("Test privsep dump every peer around the rings...\n");
+	for (round = 0; round < 16; round++) {
+		if (wg_get_peers(&wg, &iface, &size) != FW_OK)
+			err(1, "wg_get_peers: round %zu", round);
+		if (iface->i_peers_count != WG_PEERS_MAX)
+			errx(1, "wg_get_peers: %zu peers, not %d",
+			    iface->i_peers_count, WG_PEERS_MAX);
+		for (i = 0, p = iface->i_peers; i < WG_PEERS_MAX;
+		    i++, p = WG_PEER_NEXT(p)) {
+			test_peer(p->p_public[0] | p->p_public[1] << 8, key,
+			    &addr);
+			if (memcmp(p->p_public, key, sizeof(key)) != 0 ||
+			    p->p_aips_count != 1 ||
+			    p->p_aips[0].a_ipv4.s_addr != addr.s_addr)
+				errx(1, "wg_get_peers: peer %zu does not match",
+				    i);
+		}
+		free(iface);
+	}
+
+	printf("Test privsep refuse a buffer the size of a ring...\n");
+	memset(&dio, 0, sizeof(dio));
+	strlcpy(dio.wgd_name, wg.ifname, IFNAMSIZ);
+	dio.wgd_size = 1 << 20;
+	if ((dio.wgd_interface = calloc(1, dio.wgd_size)) == NULL)
+		err(1, "calloc");
+	if (wg_ioctl(&wg, SIOCGWG, &dio) != -1 || errno != E2BIG)
+		errx(1, "wg_priv_ioctl: passed on a buffer the size of a ring");
+	free(dio.wgd_interface);
+
+	printf("Test privsep remove peers in batches...\n");
+	for (i = 0; i < WG_PEERS_MAX; i += n) {
+		n = WG_PEERS_MAX - i < FW_EVICT_BATCH ?
+		    WG_PEERS_MAX - i : FW_EVICT_BATCH;
+		if (wg_remove_peers(&wg, &keys[i], n) != FW_OK)
+			err(1, "wg_remove_peers");
+	}
+	if (wg_get_peers(&wg, &iface, NULL) != FW_OK ||
+	    iface->i_peers_count != 0)
+		errx(1, "wg_remove_peers: peers left");
+	free(iface);
+
+	wg_close_iface(&wg);
+}
+
+/* Last login of a user, -1 if none */
+static long long
+test_last_login(sqlite3 *db, const char *id)
+{
+	sqlite3_stmt *stmt;
+	long long v = -1;
+
+	if (sqlite3_prepare_v2(db, "SELECT last_login FROM users "
+	    "WHERE hex(id) = upper(?)", -1, &stmt, NULL) != SQLITE_OK)
+		errx(1, "sqlite3_prepare_v2: %s", sqlite3_errmsg(db));
+	sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW &&
+	    sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+		v = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	return v;
+}
+
+/* Coalesced last-login stamps and their write-back */
+static void
+test_wback(void)
+{
+	char path[] = "/tmp/test_server.XXXXXX";
+	char email[MAX_EMAIL_LEN];
+	fw_db_user_t users[3];
+	fw_wback_t wb;
+	sqlite3 *db;
+	size_t i;
+
+	test_tmpfile(path);
+	if (fw_db_open(path, &db) != FW_OK)
+		errx(1, "fw_db_open: failed to create %s", path);
+	for (i = 0; i < 3; i++) {
+		memset(&users[i], 0, sizeof(users[i]));
+		snprintf(users[i].id, sizeof(users[i].id), "%032zx", i + 1);
+		test_b64(users[i].private_key, 0x50 + i);
+		test_b64(users[i].public_key, 0x60 + i);
+		snprintf(users[i].assigned_ip, sizeof(users[i].assigned_ip),
+		    "10.8.0.%zu", i + 2);
+		snprintf(email, sizeof(email), "wback%zu@example.com", i);
+		if (fw_db_add_user(db, &users[i], email, "x", 1) != FW_OK)
+			errx(1, "fw_db_add_user: %s", sqlite3_errmsg(db));
+	}
+	fw_wb_init(&wb);
+
+	printf("Test write-back coalesce stamps of one user...\n");
+	if (fw_wb_mark(&wb, FW_WB_LOGIN, users[0].id, 200) != FW_OK ||
+	    fw_wb_mark(&wb, FW_WB_LOGIN, users[0].id, 100) != FW_OK ||
+	    fw_wb_mark(&wb, FW_WB_LOGIN, users[0].id, 300) != FW_OK)
+		err(1, "fw_wb_mark");
+	if (fw_wb_dirty(&wb) != 1 || test_last_login(db, users[0].id) != -1)
+		errx(1, "fw_wb_mark: not held back as one stamp");
+	if (fw_wb_flush(&wb, db, FW_WB_BATCH) != FW_OK ||
+	    fw_wb_dirty(&wb) != 0 || test_last_login(db, users[0].id) != 300)
+		errx(1, "fw_wb_flush: newest stamp not written");
+
+	printf("Test write-back never move a stamp back...\n");
+	if (fw_wb_mark(&wb, FW_WB_LOGIN, users[0].id, 250) != FW_OK ||
+	    fw_wb_flush(&wb, db, FW_WB_BATCH) != FW_OK ||
+	    test_last_login(db, users[0].id) != 300)
+		errx(1, "fw_wb_flush: moved last_login back");
+
+	printf("Test write-back drain a backlog in batches...\n");
+	for (i = 0; i < 3; i++)
+		if (fw_wb_mark(&wb, FW_WB_LOGIN, users[i].id, 400 + i) != FW_OK)
+			err(1, "fw_wb_mark");
+	if (fw_wb_flush(&wb, db, 2) != FW_OK || fw_wb_dirty(&wb) != 1 ||
+	    fw_wb_flush(&wb, db, 2) != FW_OK || fw_wb_dirty(&wb) != 0)
+		errx(1, "fw_wb_flush: batch bound not kept");
+	for (i = 0; i < 3; i++)
+		if (test_last_login(db, users[i].id) != (long long)(400 + i))
+			errx(1, "fw_wb_flush: user %zu not written", i);
+
+	fw_wb_free(&wb);
+	sqlite3_close(db);
+	unlink(path);
+}
+
+/* Peer views pinned by readers and freed once they leave */
+static void
+test_pview(void)
+{
+	uint8_t key[WG_KEY_LEN];
+	const fw_pview_t *v, *cur;
+	struct in_addr addr;
+	fw_ptab_t pt;
+	size_t i;
+
+	fw_pv_clear();
+	if (fw_ptab_init(&pt, 16) != FW_OK)
+		err(1, "fw_ptab_init");
+	for (i = 0; i < 2; i++) {
+		test_peer(i, key, &addr);
+		if (fw_ptab_add(&pt, key, addr, NULL) != FW_OK)
+			err(1, "fw_ptab_add");
+	}
+
+	printf("Test pview publish and look up...\n");
+	if (fw_pv_publish(&pt) != FW_OK)
+		err(1, "fw_pv_publish");
+	v = fw_pv_enter();
+	test_peer(1, key, &addr);
+	if (v == NULL || v->count != 2 || fw_pv_find(v, key) == NULL ||
+	    fw_pv_owner(v, addr) != fw_pv_find(v, key))
+		errx(1, "fw_pv_publish: view does not match the table");
+
+	printf("Test pview keep a pinned view across publishes...\n");
+	test_peer(0, key, &addr);
+	if (fw_ptab_del(&pt, key) != FW_OK || fw_pv_publish(&pt) != FW_OK)
+		err(1, "fw_pv_publish");
+	if (fw_pv_find(v, key) == NULL || fw_pv_reclaim() != 1)
+		errx(1, "fw_pv_reclaim: freed a view still pinned");
+	cur = fw_pv_enter();
+	if (cur == v || cur->count != 1 || fw_pv_find(cur, key) != NULL)
+		errx(1, "fw_pv_enter: nested enter did not see the new view");
+	fw_pv_leave();
+	fw_pv_leave();
+
+	printf("Test pview reclaim once the reader leaves...\n");
+	if (fw_pv_reclaim() != 0)
+		errx(1, "fw_pv_reclaim: kept a view nobody holds");
+
+	fw_pv_clear();
+	fw_ptab_free(&pt);
+}
+
+/* Consistent hashing with bounded loads */
+static void
+test_ring(void)
+{
+	fw_db_node_t nodes[3], left[2];
+	char user[FW_DB_ID_LEN];
+	fw_ring_t ring, ring2;
+	size_t i, n, m, placed;
+
+	memset(nodes, 0, sizeof(nodes));
+	for (i = 0; i < 3; i++) {
+		snprintf(nodes[i].name, sizeof(nodes[i].name), "node%zu", i);
+		nodes[i].capacity = 10000;
+	}
+	left[0] = nodes[0];
+	left[1] = nodes[2];
+
+	printf("Test ring move only the keys of a node that leaves...\n");
+	if (fw_ring_init(&ring, nodes, 3, 3000) != FW_OK ||
+	    fw_ring_init(&ring2, left, 2, 3000) != FW_OK)
+		err(1, "fw_ring_init");
+	for (i = 0; i < 300; i++) {
+		snprintf(user, sizeof(user), "%032zx", i);
+		if (fw_ring_pick(&ring, user, &n) != FW_OK ||
+		    fw_ring_pick(&ring2, user, &m) != FW_OK)
+			err(1, "fw_ring_pick");
+		if (n != 1 && strcmp(nodes[n].name, left[m].name) != 0)
+			errx(1, "fw_ring_pick: %s moved off %s", user,
+			    nodes[n].name);
+	}
+	if (nodes[1].placed == 0)
+		errx(1, "fw_ring_pick: node1 got no keys");
+	fw_ring_free(&ring);
+	fw_ring_free(&ring2);
+
+	printf("Test ring place within each node's bound...\n");
+	for (i = 0; i < 3; i++) {
+		nodes[i].capacity = i == 2 ? 2000 : 1000;
+		nodes[i].placed = 0;
+	}
+	if (fw_ring_init(&ring, nodes, 3, 1200) != FW_OK)
+		err(1, "fw_ring_init");
+	if (fw_ring_bound(&ring, 0) != 375 || fw_ring_bound(&ring, 2) != 750)
+		errx(1, "fw_ring_bound: bounds not in proportion to capacity");
+	for (i = 0; i < 1200; i++) {
+		snprintf(user, sizeof(user), "%032zx", i);
+		if (fw_ring_pick(&ring, user, &n) != FW_OK)
+			err(1, "fw_ring_pick");
+	}
+	for (i = 0, placed = 0; i < 3; i++) {
+		if (nodes[i].placed > fw_ring_bound(&ring, i))
+			errx(1, "fw_ring_pick: node%zu holds %zu, over %zu", i,
+			    nodes[i].placed, fw_ring_bound(&ring, i));
+		placed += nodes[i].placed;
+	}
+	if (placed != 1200)
+		errx(1, "fw_ring_pick: placed %zu of 1200", placed);
+	fw_ring_free(&ring);
+
+	printf("Test ring refuse a key when every node is full...\n");
+	for (i = 0; i < 2; i++) {
+		nodes[i].capacity = 1;
+		nodes[i].placed = 0;
+	}
+	if (fw_ring_init(&ring, nodes, 2, 2) != FW_OK)
+		err(1, "fw_ring_init");
+	if (fw_ring_pick(&ring, "a", &n) != FW_OK ||
+	    fw_ring_pick(&ring, "b", &n) != FW_OK ||
+	    fw_ring_pick(&ring, "c", &n) != FW_ERR || errno != ENOSPC)
+		errx(1, "fw_ring_pick: placed past every node's capacity");
+	fw_ring_free(&ring);
+}
+
+/* Empty and remove the test directory dir */
+static void
+test_rmdir(const char *dir)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+
+	if ((d = opendir(dir)) == NULL)
+		err(1, "%s", dir);
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (unlink(path) == -1 && errno == EISDIR)
+			test_rmdir(path);
+	}
+	closedir(d);
+	if (rmdir(dir) == -1)
+		err(1, "%s", dir);
+}
+
+/* Add a user with key byte b to db */
+static void
+test_add_user(sqlite3 *db, uint8_t b)
+{
+	char email[MAX_EMAIL_LEN];
+	fw_db_user_t user;
+
+	memset(&user, 0, sizeof(user));
+	snprintf(user.id, sizeof(user.id), "%032x", b);
+	test_b64(user.private_key, b);
+	test_b64(user.public_key, b + 0x80);
+	snprintf(user.assigned_ip, sizeof(user.assigned_ip), "10.8.0.%u", b);
+	snprintf(email, sizeof(email), "backup%u@example.com", b);
+	if (fw_db_add_user(db, &user, email, "x", 1) != FW_OK)
+		errx(1, "fw_db_add_user: %s", sqlite3_errmsg(db));
+}
+
+/* Does the database at path hold the user with key byte b? */
+static int
+test_has_user(const char *path, uint8_t b)
+{
+	char id[FW_DB_ID_LEN];
+	fw_db_user_t user;
+	sqlite3 *db;
+	int ret;
+
+	if (fw_db_open(path, &db) != FW_OK)
+		errx(1, "fw_db_open: can't open %s", path);
+	snprintf(id, sizeof(id), "%032x", b);
+	ret = fw_db_get_user(db, id, &user) == FW_OK;
+	sqlite3_close(db);
+
+	return ret;
+}
+
+/* Online backup, and a standby rebuilt from shipped WAL */
+static void
+test_backup(void)
+{
+	char dir[] = "/tmp/test_server.XXXXXX";
+	char path[PATH_MAX], copy[PATH_MAX], standby[PATH_MAX];
+	fw_walship_t ws;
+	fw_backup_t bk;
+	sqlite3 *db;
+	uint64_t applied;
+	int done;
+
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	snprintf(path, sizeof(path), "%s/vpn.db", dir);
+	snprintf(copy, sizeof(copy), "%s/copy.db", dir);
+	snprintf(standby, sizeof(standby), "%s/standby", dir);
+	if (fw_db_open(path, &db) != FW_OK)
+		errx(1, "fw_db_open: failed to create %s", path);
+	test_add_user(db, 2);
+
+	printf("Test backup copy a live database...\n");
+	memset(&bk, 0, sizeof(bk));
+	if (fw_bk_start(&bk, db, copy) != FW_OK ||
+	    fw_bk_work(&bk, UINT64_MAX, &done) != FW_OK || !done ||
+	    fw_bk_running(&bk))
+		errx(1, "fw_bk_work: copy did not finish");
+	if (!test_has_user(copy, 2))
+		errx(1, "fw_bk_work: copy lost a user");
+
+	printf("Test backup ship the WAL to a standby...\n");
+	if (fw_ws_open(&ws, db, path, standby) != FW_OK)
+		err(1, "fw_ws_open");
+	do {
+		if (fw_ws_work(&ws, db, FW_BK_BUDGET) != FW_OK)
+			err(1, "fw_ws_work");
+	} while (fw_bk_running(&ws.base));
+	test_add_user(db, 3);
+	test_add_user(db, 4);
+	if (fw_ws_work(&ws, db, FW_BK_BUDGET) != FW_OK || ws.off == 0)
+		errx(1, "fw_ws_work: shipped nothing");
+	fw_ws_close(&ws);
+
+	printf("Test backup restore the standby...\n");
+	snprintf(copy, sizeof(copy), "%s/restored.db", dir);
+	if (fw_ws_restore(standby, copy, &applied) != FW_OK || applied == 0)
+		errx(1, "fw_ws_restore: applied no log");
+	if (!test_has_user(copy, 2) || !test_has_user(copy, 3) ||
+	    !test_has_user(copy, 4))
+		errx(1, "fw_ws_restore: standby lost a user");
+
+	sqlite3_close(db);
+	test_rmdir(dir);
+}
+
+/* Milliseconds in admission control's nanoseconds */
+#define TEST_MS  1000000ULL
+
+/*
+ * One event loop turn offering n logins that each hash for service ns;
+ * returns those admitted and advances *now past the turn
+ */
+static int
+test_admit_turn(fw_admit_t *a, uint64_t *now, uint64_t target,
+    uint64_t service, int n)
+{
+	int i, taken = 0;
+
+	fw_admit_begin(a, *now, target);
+	for (i = 0; i < n; i++) {
+		if (!fw_admit_take(a, FW_PRIO_MEDIUM, *now))
+			continue;
+		*now += service;
+		fw_admit_done(a, FW_PRIO_MEDIUM, service);
+		taken++;
+	}
+	fw_admit_end(a, *now);
+	*now += TEST_MS;
+
+	return taken;
+}
+
+/* Admission control and its adaptive hashing limit */
+static void
+test_admit(void)
+{
+	const uint64_t target = 100 * TEST_MS;
+	uint64_t now = 0, start;
+	fw_admit_t a;
+	double limit;
+	int i, taken;
+
+	printf("Test admit high priority work...\n");
+	fw_admit_init(&a);
+	fw_admit_begin(&a, now, target);
+	if (!fw_admit_take(&a, FW_PRIO_HIGH, FW_ADMIT_HIGH * target) ||
+	    fw_admit_take(&a, FW_PRIO_HIGH, FW_ADMIT_HIGH * target + 1))
+		errx(1, "fw_admit_take: high priority shed at the wrong delay");
+	fw_admit_end(&a, FW_ADMIT_HIGH * target);
+	if (a.limit != 8)
+		errx(1, "fw_admit_end: a turn without hashing moved the limit");
+
+	printf("Test admit one hashing request per turn...\n");
+	now = 10 * target;
+	fw_admit_begin(&a, 0, target);
+	if (!fw_admit_take(&a, FW_PRIO_LOW, now) ||
+	    fw_admit_take(&a, FW_PRIO_LOW, now))
+		errx(1, "fw_admit_take: not exactly one admitted late in a turn");
+	fw_admit_end(&a, now);
+	if (a.limit != 4)
+		errx(1, "fw_admit_end: cut an overrun by %g, not by half",
+		    a.limit / 8);
+
+	printf("Test admit limit converging on the hashing rate...\n");
+	for (i = 0; i < 20; i++) {
+		start = now;
+		taken = test_admit_turn(&a, &now, target, 10 * TEST_MS, 50);
+	}
+	if (taken != 10 || now - start - TEST_MS > target ||
+	    a.limit < 10 || a.limit > 12)
+		errx(1, "fw_admit_end: limit %g admits %d per turn, not 10",
+		    a.limit, taken);
+
+	printf("Test admit limit backing off as hashing slows...\n");
+	limit = a.limit;
+	for (i = 0; i < 20; i++) {
+		start = now;
+		taken = test_admit_turn(&a, &now, target, 40 * TEST_MS, 50);
+	}
+	if (taken != 2 || now - start - TEST_MS > target || a.limit >= limit)
+		errx(1, "fw_admit_end: limit %g admits %d per turn, not 2",
+		    a.limit, taken);
+
+	printf("Test admit limit bounds...\n");
+	for (i = 0; i < 2 * FW_ADMIT_MAX; i++)
+		test_admit_turn(&a, &now, target, 1000, 2 * FW_ADMIT_MAX);
+	if (a.limit != FW_ADMIT_MAX)
+		errx(1, "fw_admit_end: limit %g, not %d", a.limit,
+		    FW_ADMIT_MAX);
+	for (i = 0; i < 20; i++)
+		test_admit_turn(&a, &now, target, 4 * target, 2);
+	if (a.limit != FW_ADMIT_MIN)
+		errx(1, "fw_admit_end: limit %g, not %d", a.limit,
+		    FW_ADMIT_MIN);
+
+	printf("Test admit Retry-After...\n");
+	fw_admit_init(&a);
+	fw_admit_done(&a, FW_PRIO_LOW, 2000 * TEST_MS);
+	if (fw_admit_retry(&a, 0) != 1 || fw_admit_retry(&a, 3) != 7 ||
+	    fw_admit_retry(&a, 1000) != FW_ADMIT_RETRY)
+		errx(1, "fw_admit_retry: wrong wait");
+}
+
+/* Runs of the loop jobs in test_jobs(), in order */
+static char test_jlog[16];
+
+/* Loop job: log its name */
+static int
+test_job(void *arg, uint64_t budget)
+{
+	strlcat(test_jlog, arg, sizeof(test_jlog));
+	return FW_JOB_DONE;
+}
+
+/* Move the scheduler's clock to ms past its start */
+static void
+test_jclock(fw_sched_t *s, uint64_t start, uint64_t ms)
+{
+	s->start = start - ms;
+}
+
+/* Timer wheel firing order, across a late turn and a full lap */
+static void
+test_jobs(void)
+{
+	fw_job_t a, b, c;
+	fw_sched_t s;
+	uint64_t start;
+	int wait;
+
+	if (fw_sched_init(&s, 0) != FW_OK)
+		err(1, "fw_sched_init");
+	start = s.start;
+	memset(&a, 0, sizeof(a));
+	memset(&b, 0, sizeof(b));
+	memset(&c, 0, sizeof(c));
+	a.name = a.arg = "a";
+	b.name = b.arg = "b";
+	c.name = c.arg = "c";
+	a.fn = b.fn = c.fn = test_job;
+	a.flags = b.flags = c.flags = FW_JOB_LOOP;
+	a.interval = 3 * FW_SCHED_TICK;
+	b.interval = c.interval = FW_SCHED_TICK;
+	fw_sched_add(&s, &a, 3 * FW_SCHED_TICK);
+	fw_sched_add(&s, &b, FW_SCHED_TICK);
+	fw_sched_add(&s, &c, (FW_SCHED_SLOTS + 1) * FW_SCHED_TICK);
+
+	printf("Test jobs fire only what is due in a slot...\n");
+	test_jclock(&s, start, FW_SCHED_TICK + FW_SCHED_TICK / 2);
+	wait = fw_sched_run(&s);
+	if (strcmp(test_jlog, "b") != 0)
+		errx(1, "fw_sched_run: ran \"%s\", not \"b\"", test_jlog);
+	if (wait <= 0 || wait > FW_SCHED_TICK / 2)
+		errx(1, "fw_sched_run: next run in %d ms", wait);
+
+	printf("Test jobs catch up in tick order on a late turn...\n");
+	test_jclock(&s, start, 3 * FW_SCHED_TICK + FW_SCHED_TICK / 2);
+	fw_sched_run(&s);
+	if (strcmp(test_jlog, "bba") != 0)
+		errx(1, "fw_sched_run: ran \"%s\", not \"bba\"", test_jlog);
+
+	printf("Test jobs fire a job one lap out...\n");
+	test_jclock(&s, start, (FW_SCHED_SLOTS + 1) * FW_SCHED_TICK +
+	    FW_SCHED_TICK / 2);
+	fw_sched_run(&s);
+	if (strcmp(test_jlog, "bbabac") != 0)
+		errx(1, "fw_sched_run: ran \"%s\", not \"bbabac\"",
+		    test_jlog);
+
+	printf("Test jobs turned off...\n");
+	fw_sched_interval(&s, &a, 0);
+	fw_sched_interval(&s, &b, 0);
+	fw_sched_interval(&s, &c, 0);
+	if (fw_sched_run(&s) != -1 || strcmp(test_jlog, "bbabac") != 0)
+		errx(1, "fw_sched_run: ran a job turned off");
+
+	fw_sched_free(&s);
+}
+
 int
 main()
 {
@@ -27,22 +1776,64 @@ main()
 	uint8_t peer_pubkey[WG_KEY_LEN];
 
 	char b64_buf[WG_KEY_B64_LEN];
+	char other_b64[WG_KEY_B64_LEN];
 
 	uint8_t decoded_key[WG_KEY_LEN];
 	uint8_t privkey[WG_KEY_LEN];
 	uint8_t pubkey[WG_KEY_LEN];
 
+	fw_cursor_t cursor;
+	fw_ctx_t *ctx;
 	fw_err_t ret;
+	fw_peer_t fw_peer, *fw_peers;
+	size_t fw_peers_count;
 	wg_handle_t wg;
 
-    /* Check if we're running as root */
+    /*
+     * START database tests
+     */
+	printf("Starting database tests...\n");
+	test_db_migrate();
+	test_mig_online();
+	test_snapshot();
+	test_conf();
+	test_reload();
+	test_metrics();
+	test_trace();
+	test_api_parse(0);
+	test_api_parse(1);
+	test_api_config();
+	test_ratelimit();
+	test_privsep();
+	test_wback();
+	test_pview();
+	test_ring();
+	test_backup();
+	test_admit();
+	test_jobs();
+
+    /*
+     * END database tests
+     */
+
+    /*
+     * START Noise tests
+     */
+	printf("\nStarting Noise tests...\n");
+	test_noise();
+
+    /*
+     * END Noise tests
+     */
+
+    /* The rest needs wg(4): check if we're running as root */
 	if (getuid() != 0)
 		errx(1, "must run as root");
 
     /*
      * START wg(4) tests
      */
-	printf("Starting wg(4) tests...\n");
+	printf("\nStarting wg(4) tests...\n");
 
     /*
      * TEST
@@ -215,6 +2006,106 @@ main()
 	if ((ret = fw_start()) != FW_OK)
 		errx(1, "fw_start: second start should return OK");
 
+    /*
+     * TEST
+     */
+	printf("Test fwvpnd add peer...\n");
+	ctx = fw_get_ctx();
+	if ((ret = wg_gen_keypair(peer_privkey, peer_pubkey)) != FW_OK)
+		errx(1, "wg_gen_keypair: failed to generate peer keypair");
+	if ((ret = wg_key_to_b64(b64_buf, sizeof(b64_buf), peer_pubkey)) !=
+	    FW_OK)
+		errx(1, "wg_key_to_b64: failed to encode peer public key");
+	if ((ret = fw_add_peer(ctx, b64_buf, "10.0.0.2/32")) != FW_OK)
+		errx(1, "fw_add_peer: failed to add peer");
+
+    /*
+     * TEST
+     */
+	printf("Test fwvpnd get peer...\n");
+	if ((ret = fw_get_peer(ctx, b64_buf, &fw_peer)) != FW_OK)
+		errx(1, "fw_get_peer: failed to get peer");
+	if (strcmp(fw_peer.allowed_ips, "10.0.0.2") != 0 ||
+	    strcmp(fw_peer.pubkey, b64_buf) != 0)
+		errx(1, "fw_get_peer: peer information does not match");
+
+    /*
+     * TEST
+     */
+	printf("Test fwvpnd get peer by address...\n");
+	if ((ret = fw_get_peer_by_addr(ctx, "10.0.0.2", &fw_peer)) != FW_OK ||
+	    strcmp(fw_peer.pubkey, b64_buf) != 0)
+		errx(1, "fw_get_peer_by_addr: wrong owner for 10.0.0.2");
+	if (fw_get_peer_by_addr(ctx, "10.0.0.3", &fw_peer) != FW_ERR)
+		errx(1, "fw_get_peer_by_addr: found owner for free address");
+
+    /*
+     * TEST
+     */
+	printf("Test fwvpnd add peer with a taken address...\n");
+	if ((ret = wg_gen_keypair(privkey, pubkey)) != FW_OK ||
+	    (ret = wg_key_to_b64(other_b64, sizeof(other_b64), pubkey)) !=
+	    FW_OK)
+		errx(1, "wg_gen_keypair: failed to generate second keypair");
+	if (fw_add_peer(ctx, other_b64, "10.0.0.2/32") != FW_ERR ||
+	    errno != EADDRINUSE)
+		errx(1, "fw_add_peer: added a peer on a taken address");
+
+    /*
+     * TEST
+     */
+	printf("Test fwvpnd peer installed on interface...\n");
+	if ((ret = wg_get_peer(ctx->wg_handle, peer_pubkey, &peer)) != FW_OK)
+		errx(1, "wg_get_peer: registered peer is not installed");
+
+    /*
+     * TEST
+     */
+	printf("Test fwvpnd poll peers...\n");
+	if ((ret = fw_poll_peers(ctx)) != FW_OK)
+		errx(1, "fw_poll_peers: failed to poll peers");
+	if (ctx->peer_count != 1)
+		errx(1, "fw_poll_peers: expected one active peer");
+
+    /*
+     * TEST
+     */
+	printf("Test fwvpnd list peers...\n");
+	if ((ret = fw_list_peers(ctx, &fw_peers, &fw_peers_count)) != FW_OK)
+		errx(1, "fw_list_peers: failed to list peers");
+	if (fw_peers_count != 1 || strcmp(fw_peers[0].pubkey, b64_buf) != 0)
+		errx(1, "fw_list_peers: peer list does not match");
+	free(fw_peers);
+
+    /*
+     * TEST
+     */
+	printf("Test fwvpnd list peers by page...\n");
+	memset(&cursor, 0, sizeof(cursor));
+	if ((ret = fw_list_peers_page(ctx, &cursor, &fw_peer, 1,
+	    &fw_peers_count)) != FW_OK || fw_peers_count != 1 ||
+	    strcmp(fw_peer.pubkey, b64_buf) != 0)
+		errx(1, "fw_list_peers_page: first page does not match");
+	if ((ret = fw_list_peers_page(ctx, &cursor, &fw_peer, 1,
+	    &fw_peers_count)) != FW_OK || fw_peers_count != 0)
+		errx(1, "fw_list_peers_page: listing did not end");
+	memset(&cursor, 0, sizeof(cursor));
+	cursor.states = 1U << FW_PEER_ERR;
+	if ((ret = fw_list_peers_page(ctx, &cursor, &fw_peer, 1,
+	    &fw_peers_count)) != FW_OK || fw_peers_count != 0)
+		errx(1, "fw_list_peers_page: state filter not applied");
+
+    /*
+     * TEST
+     */
+	printf("Test fwvpnd remove peer...\n");
+	if ((ret = fw_remove_peer(ctx, b64_buf)) != FW_OK)
+		errx(1, "fw_remove_peer: failed to remove peer");
+	if (fw_get_peer(ctx, b64_buf, &fw_peer) != FW_ERR)
+		errx(1, "fw_remove_peer: peer still registered");
+	if (fw_get_peer_by_addr(ctx, "10.0.0.2", &fw_peer) != FW_ERR)
+		errx(1, "fw_remove_peer: address still taken");
+
     /*
      * Clean up test environment
      */
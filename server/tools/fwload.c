@@ -0,0 +1,502 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * fwload.c - Open-loop load generator for the fwvpnd HTTP API. Clients
+ * arrive at a fixed rate and each runs signup -> login -> config, then
+ * polls status at an interval, over one keep-alive connection.
+ *
+ * Latency is measured from when a step was due, not when it was sent,
+ * so a stalled server (or an overloaded generator) shows up in the
+ * numbers instead of silently lowering the offered load. Run fwvpnd
+ * with "wg_mock yes" to load the API, DB and peer provisioning without
+ * a real interface.
+ *
+ * With -s, one account is set up front and every client starts at
+ * config with its session: no password hashing, so the load is almost
+ * all connection and request handling.
+ */
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Histogram: 2^HDR_SUB_BITS linear sub-buckets per power of two */
+#define HDR_SUB_BITS  7
+#define HDR_SUB       (1 << HDR_SUB_BITS)
+#define HDR_BUCKETS   ((64 - HDR_SUB_BITS + 1) * HDR_SUB)
+
+/* Response buffer */
+#define RESP_MAX      8192
+
+/* Socket timeout in seconds */
+#define IO_TIMEOUT    30
+
+/* Client flow steps */
+enum step {
+	STEP_SIGNUP,
+	STEP_LOGIN,
+	STEP_CONFIG,
+	STEP_STATUS,
+	STEP_MAX
+};
+
+static const char *step_names[STEP_MAX] = {
+	[STEP_SIGNUP] = "signup",
+	[STEP_LOGIN]  = "login",
+	[STEP_CONFIG] = "config",
+	[STEP_STATUS] = "status",
+};
+
+/* Per-step results */
+struct stats {
+	uint64_t ok;
+	uint64_t errors;
+	uint64_t hist[HDR_BUCKETS];  /* Latency in ns */
+};
+
+/* Worker thread state */
+struct worker {
+	pthread_t thread;
+	struct stats steps[STEP_MAX];
+	uint64_t max_lag;            /* Worst late client start, ns */
+};
+
+/* Settings */
+static struct sockaddr_in g_addr;
+static double g_rate = 10;           /* Client arrivals per second   */
+static uint64_t g_duration = 10;     /* Seconds of arrivals          */
+static unsigned int g_polls = 5;     /* Status polls per client      */
+static uint64_t g_interval = 1000;   /* Milliseconds between polls   */
+static int g_shared;                 /* Clients share one session    */
+
+/* Run state */
+static uint64_t g_start;             /* Arrival schedule origin, ns  */
+static uint64_t g_next_client;       /* Next client index            */
+static uint64_t g_run_id;            /* Keeps emails unique per run  */
+static char g_token[128];            /* Shared session (-s)          */
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sleep_until(uint64_t when)
+{
+	struct timespec ts;
+
+	ts.tv_sec = when / 1000000000;
+	ts.tv_nsec = when % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	    EINTR)
+		;
+}
+
+/*
+ * START histogram
+ */
+
+static unsigned int
+hdr_bucket(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < HDR_SUB)
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	return (e - HDR_SUB_BITS + 1) * HDR_SUB +
+	    ((v >> (e - HDR_SUB_BITS)) & (HDR_SUB - 1));
+}
+
+/* Lowest value in bucket b */
+static uint64_t
+hdr_value(unsigned int b)
+{
+	unsigned int e;
+
+	if (b < HDR_SUB)
+		return b;
+
+	e = b / HDR_SUB + HDR_SUB_BITS - 1;
+	return (uint64_t)(HDR_SUB + b % HDR_SUB) << (e - HDR_SUB_BITS);
+}
+
+/* Value at quantile q */
+static uint64_t
+hdr_quantile(const struct stats *s, double q)
+{
+	uint64_t total = s->ok, want, seen;
+	unsigned int b;
+
+	if (total == 0)
+		return 0;
+
+	want = q * total;
+	if (want >= total)
+		want = total - 1;
+	for (b = 0, seen = 0; b < HDR_BUCKETS; b++) {
+		seen += s->hist[b];
+		if (seen > want)
+			return hdr_value(b);
+	}
+
+	return hdr_value(HDR_BUCKETS - 1);
+}
+
+/*
+ * END histogram
+ */
+
+/*
+ * START HTTP client
+ */
+
+static int
+http_connect(void)
+{
+	struct timeval tv;
+	int fd, on = 1;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		return -1;
+
+	tv.tv_sec = IO_TIMEOUT;
+	tv.tv_usec = 0;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1 ||
+	    connect(fd, (struct sockaddr *)&g_addr, sizeof(g_addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Send a request and read the response into resp (NUL-terminated body
+ * returned via bodyp). Returns the HTTP status, or -1 on I/O errors.
+ */
+static int
+http_request(int fd, const char *method, const char *path,
+    const char *token, const char *body, char *resp, char **bodyp)
+{
+	char req[1024], *end, *p;
+	size_t off, want;
+	ssize_t n, w;
+	int status;
+
+	n = snprintf(req, sizeof(req), "%s %s HTTP/1.1\r\nHost: fwvpnd\r\n"
+	    "%s%s%s"
+	    "Content-Type: application/x-www-form-urlencoded\r\n"
+	    "Content-Length: %zu\r\n\r\n%s", method, path,
+	    token != NULL ? "Authorization: Bearer " : "",
+	    token != NULL ? token : "", token != NULL ? "\r\n" : "",
+	    body != NULL ? strlen(body) : 0, body != NULL ? body : "");
+	if (n < 0 || (size_t)n >= sizeof(req))
+		return -1;
+
+	for (off = 0; off < (size_t)n; off += w) {
+		if ((w = write(fd, req + off, n - off)) == -1)
+			return -1;
+	}
+
+	/* Headers, then Content-Length bytes of body */
+	off = 0;
+	end = NULL;
+	want = 0;
+	for (;;) {
+		if (off >= RESP_MAX - 1)
+			return -1;
+		if ((n = read(fd, resp + off, RESP_MAX - 1 - off)) <= 0)
+			return -1;
+		off += n;
+		resp[off] = '\0';
+
+		if (end == NULL) {
+			if ((end = strstr(resp, "\r\n\r\n")) == NULL)
+				continue;
+			want = end + 4 - resp;
+			if ((p = strcasestr(resp, "\r\nContent-Length:")) !=
+			    NULL && p < end)
+				want += strtoul(p + 17, NULL, 10);
+		}
+		if (off >= want)
+			break;
+	}
+
+	if (sscanf(resp, "HTTP/1.%*d %d", &status) != 1)
+		return -1;
+	resp[want] = '\0';
+	*bodyp = end + 4;
+
+	return status;
+}
+
+/*
+ * END HTTP client
+ */
+
+/* Record a step that was due at due */
+static void
+record(struct worker *w, enum step step, uint64_t due, int ok)
+{
+	struct stats *s = &w->steps[step];
+
+	if (!ok) {
+		s->errors++;
+		return;
+	}
+	s->ok++;
+	s->hist[hdr_bucket(now_ns() - due)]++;
+}
+
+/* Run one client's flow */
+static void
+client(struct worker *w, uint64_t id, uint64_t due)
+{
+	char form[256], token[128], resp[RESP_MAX], *body, *p;
+	unsigned int i;
+	int fd, status;
+
+	if ((fd = http_connect()) == -1) {
+		record(w, STEP_SIGNUP, due, 0);
+		return;
+	}
+
+	if (g_shared) {
+		memcpy(token, g_token, sizeof(token));
+		goto config;
+	}
+
+	snprintf(form, sizeof(form),
+	    "email=load-%llu-%llu%%40example.com&password=load-password",
+	    (unsigned long long)g_run_id, (unsigned long long)id);
+
+	status = http_request(fd, "POST", "/signup", NULL, form, resp, &body);
+	record(w, STEP_SIGNUP, due, status == 201);
+	if (status != 201)
+		goto done;
+
+	due = now_ns();
+	status = http_request(fd, "POST", "/login", NULL, form, resp, &body);
+	if (status == 200 && (p = strstr(body, "\"token\":\"")) != NULL &&
+	    sscanf(p + 9, "%127[0-9a-f]", token) == 1) {
+		record(w, STEP_LOGIN, due, 1);
+	} else {
+		record(w, STEP_LOGIN, due, 0);
+		goto done;
+	}
+
+	due = now_ns();
+config:
+	status = http_request(fd, "GET", "/config", token, NULL, resp, &body);
+	record(w, STEP_CONFIG, due, status == 200 &&
+	    strstr(body, "[Interface]") != NULL);
+	if (status != 200)
+		goto done;
+
+	/* Polls stay on schedule even if one runs long */
+	due = now_ns();
+	for (i = 0; i < g_polls; i++) {
+		due += g_interval * 1000000;
+		sleep_until(due);
+		status = http_request(fd, "GET", "/status", token, NULL, resp,
+		    &body);
+		record(w, STEP_STATUS, due, status == 200);
+		if (status == -1)
+			break;
+	}
+
+done:
+	close(fd);
+}
+
+/* Sign up and log in the account every client shares */
+static void
+shared_session(void)
+{
+	char form[256], resp[RESP_MAX], *body, *p;
+	int fd, status;
+
+	if ((fd = http_connect()) == -1)
+		err(1, "connect");
+	snprintf(form, sizeof(form),
+	    "email=load-%llu-shared%%40example.com&password=load-password",
+	    (unsigned long long)g_run_id);
+	if ((status = http_request(fd, "POST", "/signup", NULL, form, resp,
+	    &body)) != 201)
+		errx(1, "signup: HTTP %d", status);
+	if ((status = http_request(fd, "POST", "/login", NULL, form, resp,
+	    &body)) != 200 || (p = strstr(body, "\"token\":\"")) == NULL ||
+	    sscanf(p + 9, "%127[0-9a-f]", g_token) != 1)
+		errx(1, "login: HTTP %d", status);
+	close(fd);
+}
+
+/* Take clients off the arrival schedule until it runs out */
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t id, due, now, end;
+
+	end = g_start + g_duration * 1000000000;
+	for (;;) {
+		id = __atomic_fetch_add(&g_next_client, 1, __ATOMIC_RELAXED);
+		due = g_start + (uint64_t)(id * 1e9 / g_rate);
+		if (due >= end)
+			break;
+
+		sleep_until(due);
+		if ((now = now_ns()) - due > w->max_lag)
+			w->max_lag = now - due;
+		client(w, id, due);
+	}
+
+	return NULL;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: fwload [-js] [-d seconds] [-i msec] "
+	    "[-n polls] [-r rate] [-t threads] host port\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct worker *workers;
+	struct stats total[STEP_MAX], *t;
+	const char *errstr;
+	uint64_t elapsed, max_lag = 0;
+	unsigned int i, s, b, nthreads = 64;
+	int ch, json = 0, port;
+
+	while ((ch = getopt(argc, argv, "d:i:jn:r:st:")) != -1) {
+		switch (ch) {
+		case 'd':
+			g_duration = strtonum(optarg, 1, 86400, &errstr);
+			if (errstr != NULL)
+				errx(1, "seconds %s: %s", errstr, optarg);
+			break;
+		case 'i':
+			g_interval = strtonum(optarg, 1, 3600000, &errstr);
+			if (errstr != NULL)
+				errx(1, "msec %s: %s", errstr, optarg);
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'n':
+			g_polls = strtonum(optarg, 0, 100000, &errstr);
+			if (errstr != NULL)
+				errx(1, "polls %s: %s", errstr, optarg);
+			break;
+		case 'r':
+			g_rate = strtod(optarg, NULL);
+			if (g_rate <= 0)
+				errx(1, "rate must be positive: %s", optarg);
+			break;
+		case 's':
+			g_shared = 1;
+			break;
+		case 't':
+			nthreads = strtonum(optarg, 1, 10000, &errstr);
+			if (errstr != NULL)
+				errx(1, "threads %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2)
+		usage();
+
+	memset(&g_addr, 0, sizeof(g_addr));
+	g_addr.sin_family = AF_INET;
+	if (inet_pton(AF_INET, argv[0], &g_addr.sin_addr) != 1)
+		errx(1, "host must be an IPv4 address: %s", argv[0]);
+	port = strtonum(argv[1], 1, 65535, &errstr);
+	if (errstr != NULL)
+		errx(1, "port %s: %s", errstr, argv[1]);
+	g_addr.sin_port = htons(port);
+
+	if ((workers = calloc(nthreads, sizeof(*workers))) == NULL)
+		err(1, NULL);
+
+	g_run_id = time(NULL);
+	if (g_shared)
+		shared_session();
+	g_start = now_ns() + 100000000;
+	for (i = 0; i < nthreads; i++)
+		if ((errno = pthread_create(&workers[i].thread, NULL,
+		    worker_main, &workers[i])) != 0)
+			err(1, "pthread_create");
+
+	memset(total, 0, sizeof(total));
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		for (s = 0; s < STEP_MAX; s++) {
+			total[s].ok += workers[i].steps[s].ok;
+			total[s].errors += workers[i].steps[s].errors;
+			for (b = 0; b < HDR_BUCKETS; b++)
+				total[s].hist[b] += workers[i].steps[s].hist[b];
+		}
+		if (workers[i].max_lag > max_lag)
+			max_lag = workers[i].max_lag;
+	}
+	elapsed = now_ns() - g_start;
+
+	if (!json)
+		printf("%-8s %10s %8s %10s %10s %10s %10s %10s %10s\n", "step",
+		    "ok", "errors", "ok/s", "p50_ms", "p90_ms", "p99_ms",
+		    "p999_ms", "max_ms");
+	for (s = 0; s < STEP_MAX; s++) {
+		t = &total[s];
+		printf(json ? "{\"step\":\"%s\",\"ok\":%llu,\"errors\":%llu,"
+		    "\"rate\":%.1f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,"
+		    "\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f}\n" :
+		    "%-8s %10llu %8llu %10.1f %10.3f %10.3f %10.3f %10.3f "
+		    "%10.3f\n", step_names[s], (unsigned long long)t->ok,
+		    (unsigned long long)t->errors, t->ok / (elapsed / 1e9),
+		    hdr_quantile(t, 0.50) / 1e6, hdr_quantile(t, 0.90) / 1e6,
+		    hdr_quantile(t, 0.99) / 1e6, hdr_quantile(t, 0.999) / 1e6,
+		    hdr_quantile(t, 1.0) / 1e6);
+	}
+
+	/* Late starts mean the generator, not the server, was saturated */
+	if (max_lag > 10000000)
+		warnx("clients started up to %.1f ms late; raise -t",
+		    max_lag / 1e6);
+
+	free(workers);
+
+	return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * fwmigrate.c - Migrate an fwvpnd database to the current schema while
+ * the fwvpnd processes using it keep running (see src/migrate.c). Each
+ * step is one transaction of at most -b rows, with -p milliseconds in
+ * between for the other writers. Once it reports done, restart every
+ * fwvpnd on the new version.
+ *
+ * fwvpnd migrates an old database itself when it starts, in one go.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "db.h"
+#include "migrate.h"
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: fwmigrate [-b batch] [-p pause_ms] file\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct timespec pause = { 0, 0 };
+	const char *errstr;
+	fw_migrate_t m;
+	sqlite3 *db;
+	size_t batch = FW_MIG_BATCH;
+	long long ms = 10;
+	time_t report = 0;
+	int ch, version;
+
+	while ((ch = getopt(argc, argv, "b:p:")) != -1) {
+		switch (ch) {
+		case 'b':
+			batch = strtonum(optarg, 1, 1000000, &errstr);
+			if (errstr != NULL)
+				errx(1, "batch is %s: %s", errstr, optarg);
+			break;
+		case 'p':
+			ms = strtonum(optarg, 0, 60000, &errstr);
+			if (errstr != NULL)
+				errx(1, "pause is %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+	pause.tv_sec = ms / 1000;
+	pause.tv_nsec = ms % 1000 * 1000000;
+
+	if (sqlite3_open_v2(argv[0], &db, SQLITE_OPEN_READWRITE, NULL) !=
+	    SQLITE_OK)
+		errx(1, "%s: %s", argv[0], sqlite3_errmsg(db));
+	sqlite3_busy_timeout(db, FW_DB_BUSY_MS);
+
+	if (fw_mig_start(&m, db, batch) != FW_OK) {
+		if (errno != EALREADY)
+			errx(1, "%s: can't start migration", argv[0]);
+		if (fw_mig_version(db, &version) == FW_OK)
+			printf("%s: schema version %d, nothing to do\n",
+			    argv[0], version);
+		sqlite3_close(db);
+		return 0;
+	}
+
+	while (m.stage != FW_MIG_DONE) {
+		if (fw_mig_step(&m) != FW_OK) {
+			fw_mig_abort(&m);
+			errx(1, "%s: migration failed, v1 schema left in place",
+			    argv[0]);
+		}
+		if (time(NULL) != report) {
+			report = time(NULL);
+			fprintf(stderr, "%s: %s, %llu rows copied, "
+			    "%llu changes replayed\n", argv[0],
+			    m.stage == FW_MIG_COPY ? "copying" : "replaying",
+			    (unsigned long long)m.copied,
+			    (unsigned long long)m.replayed);
+		}
+		nanosleep(&pause, NULL);
+	}
+
+	printf("%s: migrated to schema version %d, %llu rows copied, "
+	    "%llu changes replayed\n", argv[0], FW_DB_VERSION,
+	    (unsigned long long)m.copied, (unsigned long long)m.replayed);
+	sqlite3_close(db);
+
+	return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * fwtrace.c - Decode an fwvpnd trace dump (see include/trace.h) into a
+ * timeline of probe spans, one line per completed span:
+ *
+ *	start_us  tid  probe  duration_us  a0  a1
+ *
+ * With -s, print only per-probe totals.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* Open spans per thread and probe */
+#define SPAN_DEPTH 16
+
+#define FW_PROBE_NAME(id, name) [id] = name,
+static const char *probe_names[FW_P_MAX] = {
+	FW_PROBES(FW_PROBE_NAME)
+};
+#undef FW_PROBE_NAME
+
+/* Open span stack for one thread and probe */
+struct span_stack {
+	uint32_t tid;
+	uint16_t probe;
+	size_t depth;
+	struct fw_tevent begin[SPAN_DEPTH];
+};
+
+/* Per-probe totals */
+static struct {
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+} totals[FW_P_MAX];
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: fwtrace [-s] file\n");
+	exit(1);
+}
+
+/* Order events by timestamp */
+static int
+ev_cmp(const void *a, const void *b)
+{
+	const struct fw_tevent *x = a, *y = b;
+
+	if (x->ts != y->ts)
+		return x->ts < y->ts ? -1 : 1;
+	return 0;
+}
+
+/* Load every event in the dump */
+static struct fw_tevent *
+load(const char *path, size_t *countp)
+{
+	struct fw_trace_hdr hdr;
+	struct fw_trace_rhdr rhdr;
+	struct fw_tevent *evs = NULL;
+	size_t count = 0;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1)
+		errx(1, "%s: short header", path);
+	if (hdr.magic != FW_TRACE_MAGIC || hdr.version != FW_TRACE_VERSION ||
+	    hdr.evsize != sizeof(struct fw_tevent))
+		errx(1, "%s: not an fwvpnd trace dump", path);
+
+	/* Rings may be fewer than hdr.nrings if a thread was starting up */
+	while (fread(&rhdr, sizeof(rhdr), 1, fp) == 1) {
+		evs = reallocarray(evs, count + rhdr.count, sizeof(*evs));
+		if (evs == NULL)
+			err(1, NULL);
+		if (fread(&evs[count], sizeof(*evs), rhdr.count, fp) !=
+		    rhdr.count)
+			errx(1, "%s: truncated ring %u", path, rhdr.tid);
+		count += rhdr.count;
+	}
+	fclose(fp);
+
+	*countp = count;
+
+	return evs;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct span_stack *stacks = NULL, *st;
+	struct fw_tevent *evs, *ev, *b;
+	size_t count, nstacks = 0, i, j;
+	uint64_t dur, origin;
+	int ch, summary = 0;
+
+	while ((ch = getopt(argc, argv, "s")) != -1) {
+		switch (ch) {
+		case 's':
+			summary = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+
+	evs = load(argv[0], &count);
+	qsort(evs, count, sizeof(*evs), ev_cmp);
+	origin = count > 0 ? evs[0].ts : 0;
+
+	if (!summary)
+		printf("%12s %4s %-12s %12s %18s %18s\n", "start_us", "tid",
+		    "probe", "duration_us", "a0", "a1");
+
+	for (i = 0; i < count; i++) {
+		ev = &evs[i];
+		if (ev->probe >= FW_P_MAX)
+			continue;
+
+		for (j = 0, st = NULL; j < nstacks; j++) {
+			if (stacks[j].tid == ev->tid &&
+			    stacks[j].probe == ev->probe) {
+				st = &stacks[j];
+				break;
+			}
+		}
+		if (st == NULL) {
+			stacks = reallocarray(stacks, nstacks + 1,
+			    sizeof(*stacks));
+			if (stacks == NULL)
+				err(1, NULL);
+			st = &stacks[nstacks++];
+			memset(st, 0, sizeof(*st));
+			st->tid = ev->tid;
+			st->probe = ev->probe;
+		}
+
+		if (ev->phase == FW_TR_BEGIN) {
+			if (st->depth < SPAN_DEPTH)
+				st->begin[st->depth] = *ev;
+			st->depth++;
+			continue;
+		}
+
+		/* An END whose BEGIN was overwritten in the ring */
+		if (st->depth == 0)
+			continue;
+		if (--st->depth >= SPAN_DEPTH)
+			continue;
+
+		b = &st->begin[st->depth];
+		dur = ev->ts - b->ts;
+		totals[ev->probe].count++;
+		totals[ev->probe].total += dur;
+		if (dur > totals[ev->probe].max)
+			totals[ev->probe].max = dur;
+
+		if (!summary)
+			printf("%12.3f %4u %-12s %12.3f %#18llx %#18llx\n",
+			    (b->ts - origin) / 1e3, ev->tid,
+			    probe_names[ev->probe], dur / 1e3,
+			    (unsigned long long)ev->a0,
+			    (unsigned long long)ev->a1);
+	}
+
+	if (!summary)
+		printf("\n");
+	printf("%-12s %10s %14s %12s %12s\n", "probe", "count", "total_us",
+	    "mean_us", "max_us");
+	for (i = 0; i < FW_P_MAX; i++) {
+		if (totals[i].count == 0)
+			continue;
+		printf("%-12s %10llu %14.3f %12.3f %12.3f\n", probe_names[i],
+		    (unsigned long long)totals[i].count, totals[i].total / 1e3,
+		    totals[i].total / 1e3 / totals[i].count,
+		    totals[i].max / 1e3);
+	}
+
+	free(stacks);
+	free(evs);
+
+	return 0;
+}
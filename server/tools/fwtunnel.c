@@ -0,0 +1,425 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * fwtunnel.c - Drive the userspace data plane (see wguser.c) outside
+ * fwvpnd:
+ *
+ *	fwtunnel keypair
+ *	fwtunnel up -i ifname -k privkey -p port -P peerkey -e addr:port \
+ *	    -a allowed/cidr [-K keepalive]
+ *	fwtunnel bench [-j] [-d seconds] [-s size] [-p port]
+ *
+ * "up" brings one interface up on a tun(4) device and runs until
+ * signalled; addresses and routes are left to ifconfig(8)/ip(8). "bench"
+ * runs two interfaces in one process talking over loopback UDP, feeds one
+ * through a socketpair instead of tun(4) and counts what comes out of the
+ * other, so it needs no privileges.
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wireguard.h"
+
+/* Inner addresses of the bench tunnel */
+#define BENCH_SRC  "10.99.0.1"
+#define BENCH_DST  "10.99.0.2"
+
+/* Largest bench packet */
+#define BENCH_MAX  1420
+
+/* Bench traffic, shared with its threads */
+static int g_in = -1, g_out = -1;  /* Our ends of both socketpairs  */
+static size_t g_size = BENCH_MAX;  /* Inner packet size             */
+static int g_stop;                 /* Set to stop, by signal too    */
+static uint64_t g_sent, g_recv;    /* Packets in and out            */
+static uint64_t g_first;           /* First packet out (ns)         */
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+on_signal(int sig)
+{
+	__atomic_store_n(&g_stop, 1, __ATOMIC_RELAXED);
+}
+
+/* Parse "addr:port" or "[addr6]:port" into sa */
+static void
+parse_endpoint(const char *s, union wg_peer_endpoint *sa)
+{
+	char host[INET6_ADDRSTRLEN + 2], *p;
+	const char *errstr;
+	in_port_t port;
+
+	if (strlcpy(host, s, sizeof(host)) >= sizeof(host) ||
+	    (p = strrchr(host, ':')) == NULL)
+		errx(1, "bad endpoint: %s", s);
+	*p++ = '\0';
+	port = strtonum(p, 1, 65535, &errstr);
+	if (errstr != NULL)
+		errx(1, "endpoint port %s: %s", errstr, s);
+
+	memset(sa, 0, sizeof(*sa));
+	if (inet_pton(AF_INET, host, &sa->sa_sin.sin_addr) == 1) {
+		sa->sa_sin.sin_family = AF_INET;
+		sa->sa_sin.sin_port = htons(port);
+	} else if (host[0] == '[' && (p = strchr(host, ']')) != NULL &&
+	    (*p = '\0', inet_pton(AF_INET6, host + 1,
+	    &sa->sa_sin6.sin6_addr) == 1)) {
+		sa->sa_sin6.sin6_family = AF_INET6;
+		sa->sa_sin6.sin6_port = htons(port);
+	} else
+		errx(1, "bad endpoint address: %s", s);
+}
+
+/* Parse "addr/cidr" into aip */
+static void
+parse_aip(const char *s, struct wg_aip_io *aip)
+{
+	char addr[INET6_ADDRSTRLEN + 4], *p;
+	const char *errstr;
+
+	if (strlcpy(addr, s, sizeof(addr)) >= sizeof(addr) ||
+	    (p = strchr(addr, '/')) == NULL)
+		errx(1, "bad allowed IP: %s", s);
+	*p++ = '\0';
+
+	memset(aip, 0, sizeof(*aip));
+	if (inet_pton(AF_INET, addr, &aip->a_ipv4) == 1) {
+		aip->a_af = AF_INET;
+		aip->a_cidr = strtonum(p, 0, 32, &errstr);
+	} else if (inet_pton(AF_INET6, addr, &aip->a_ipv6) == 1) {
+		aip->a_af = AF_INET6;
+		aip->a_cidr = strtonum(p, 0, 128, &errstr);
+	} else
+		errx(1, "bad allowed IP: %s", s);
+	if (errstr != NULL)
+		errx(1, "allowed IP prefix %s: %s", errstr, s);
+}
+
+/* Create interface on wg, keyed priv and listening on port, with one peer */
+static void
+tunnel_up(wg_handle_t *wg, const uint8_t priv[WG_KEY_LEN], in_port_t port,
+    struct wg_peer_io *peer)
+{
+	struct wg_interface_io iface;
+
+	memset(&iface, 0, sizeof(iface));
+	iface.i_flags = WG_INTERFACE_HAS_PRIVATE | WG_INTERFACE_HAS_PORT;
+	memcpy(iface.i_private, priv, WG_KEY_LEN);
+	iface.i_port = port;
+
+	if (wg_create_iface(wg) != FW_OK)
+		err(1, "create %s", wg->ifname);
+	if (wg_set_iface(wg, &iface) != FW_OK)
+		err(1, "configure %s", wg->ifname);
+	if (wg_add_peer(wg, peer) != FW_OK)
+		err(1, "add peer to %s", wg->ifname);
+}
+
+/* keypair: print a new private and public key */
+static int
+cmd_keypair(int argc, char *argv[])
+{
+	uint8_t priv[WG_KEY_LEN], pub[WG_KEY_LEN];
+	char b64[2][WG_KEY_B64_LEN];
+
+	if (wg_gen_keypair(priv, pub) != FW_OK ||
+	    wg_key_to_b64(b64[0], sizeof(b64[0]), priv) != FW_OK ||
+	    wg_key_to_b64(b64[1], sizeof(b64[1]), pub) != FW_OK)
+		errx(1, "keypair");
+	printf("%s %s\n", b64[0], b64[1]);
+
+	return 0;
+}
+
+/* up: one interface on a tun(4) device, until signalled */
+static int
+cmd_up(int argc, char *argv[])
+{
+	struct {
+		struct wg_peer_io p;
+		struct wg_aip_io aip;
+	} peer;
+	uint8_t priv[WG_KEY_LEN];
+	const char *ifname = NULL, *errstr;
+	in_port_t port = 0;
+	wg_handle_t wg;
+	int ch, have = 0;
+
+	memset(&peer, 0, sizeof(peer));
+	while ((ch = getopt(argc, argv, "a:e:i:K:k:P:p:")) != -1) {
+		switch (ch) {
+		case 'a':
+			parse_aip(optarg, &peer.p.p_aips[0]);
+			peer.p.p_aips_count = 1;
+			break;
+		case 'e':
+			parse_endpoint(optarg, &peer.p.p_endpoint);
+			peer.p.p_flags |= WG_PEER_HAS_ENDPOINT;
+			break;
+		case 'i':
+			ifname = optarg;
+			break;
+		case 'K':
+			peer.p.p_pka = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr != NULL)
+				errx(1, "keepalive %s: %s", errstr, optarg);
+			peer.p.p_flags |= WG_PEER_HAS_PKA;
+			break;
+		case 'k':
+			if (wg_key_from_b64(priv, optarg) != FW_OK)
+				errx(1, "bad private key");
+			have |= 1;
+			break;
+		case 'P':
+			if (wg_key_from_b64(peer.p.p_public, optarg) != FW_OK)
+				errx(1, "bad peer key");
+			peer.p.p_flags |= WG_PEER_HAS_PUBLIC;
+			have |= 2;
+			break;
+		case 'p':
+			port = strtonum(optarg, 1, 65535, &errstr);
+			if (errstr != NULL)
+				errx(1, "port %s: %s", errstr, optarg);
+			break;
+		default:
+			return -1;
+		}
+	}
+	if (ifname == NULL || have != 3 || port == 0)
+		return -1;
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	if (wg_open_user(&wg, ifname, -1) != FW_OK)
+		err(1, "open %s", ifname);
+	tunnel_up(&wg, priv, port, &peer.p);
+
+	while (!__atomic_load_n(&g_stop, __ATOMIC_RELAXED))
+		pause();
+
+	wg_destroy_iface(&wg);
+	wg_close_iface(&wg);
+
+	return 0;
+}
+
+/* Bench sender: inner IPv4 packets into the first interface */
+static void *
+bench_send(void *arg)
+{
+	uint8_t pkt[BENCH_MAX];
+
+	memset(pkt, 0, sizeof(pkt));
+	pkt[0] = 0x45;
+	pkt[2] = g_size >> 8;
+	pkt[3] = g_size & 0xff;
+	pkt[8] = 64;
+	pkt[9] = IPPROTO_UDP;
+	inet_pton(AF_INET, BENCH_SRC, pkt + 12);
+	inet_pton(AF_INET, BENCH_DST, pkt + 16);
+
+	while (!__atomic_load_n(&g_stop, __ATOMIC_RELAXED)) {
+		if (write(g_in, pkt, g_size) == -1 && errno != EINTR &&
+		    errno != ENOBUFS)
+			err(1, "bench write");
+		__atomic_add_fetch(&g_sent, 1, __ATOMIC_RELAXED);
+
+		/* Until the handshake is done, don't flood the initiator */
+		if (__atomic_load_n(&g_first, __ATOMIC_RELAXED) == 0)
+			usleep(1000);
+	}
+
+	return NULL;
+}
+
+/* Bench receiver: count what comes out of the second interface */
+static void *
+bench_recv(void *arg)
+{
+	uint8_t pkt[BENCH_MAX + 64];
+	struct pollfd pfd;
+
+	pfd.fd = g_out;
+	pfd.events = POLLIN;
+	while (!__atomic_load_n(&g_stop, __ATOMIC_RELAXED)) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		if (read(g_out, pkt, sizeof(pkt)) <= 0)
+			continue;
+		if (__atomic_load_n(&g_first, __ATOMIC_RELAXED) == 0)
+			__atomic_store_n(&g_first, now_ns(), __ATOMIC_RELAXED);
+		__atomic_add_fetch(&g_recv, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/* Interface io with one peer allowed to use addr/32 */
+static void
+bench_peer(struct wg_peer_io *p, const uint8_t pub[WG_KEY_LEN],
+    const char *addr, in_port_t port)
+{
+	memset(p, 0, sizeof(*p) + sizeof(struct wg_aip_io));
+	memcpy(p->p_public, pub, WG_KEY_LEN);
+	p->p_flags = WG_PEER_HAS_PUBLIC | WG_PEER_HAS_ENDPOINT;
+	p->p_sin.sin_family = AF_INET;
+	p->p_sin.sin_port = htons(port);
+	p->p_sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	p->p_aips_count = 1;
+	p->p_aips[0].a_af = AF_INET;
+	p->p_aips[0].a_cidr = 32;
+	inet_pton(AF_INET, addr, &p->p_aips[0].a_ipv4);
+}
+
+/* bench: two interfaces over loopback, fed through socketpairs */
+static int
+cmd_bench(int argc, char *argv[])
+{
+	struct {
+		struct wg_peer_io p;
+		struct wg_aip_io aip;
+	} peer;
+	uint8_t priv[2][WG_KEY_LEN], pub[2][WG_KEY_LEN];
+	const char *errstr;
+	pthread_t thr[2];
+	wg_handle_t wg[2];
+	uint64_t secs = 5, start = 0, sent, recv, elapsed;
+	in_port_t port = 51820;
+	int ch, json = 0, sp[2][2], i;
+
+	while ((ch = getopt(argc, argv, "d:jp:s:")) != -1) {
+		switch (ch) {
+		case 'd':
+			secs = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr != NULL)
+				errx(1, "seconds %s: %s", errstr, optarg);
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'p':
+			port = strtonum(optarg, 1, 65534, &errstr);
+			if (errstr != NULL)
+				errx(1, "port %s: %s", errstr, optarg);
+			break;
+		case 's':
+			g_size = strtonum(optarg, 28, BENCH_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "size %s: %s", errstr, optarg);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sp[i]) == -1)
+			err(1, "socketpair");
+		if (wg_gen_keypair(priv[i], pub[i]) != FW_OK)
+			errx(1, "keypair");
+		if (wg_open_user(&wg[i], i == 0 ? "bench0" : "bench1",
+		    sp[i][0]) != FW_OK)
+			err(1, "open");
+	}
+	g_in = sp[0][1];
+	g_out = sp[1][1];
+
+	bench_peer(&peer.p, pub[1], BENCH_DST, port + 1);
+	tunnel_up(&wg[0], priv[0], port, &peer.p);
+	bench_peer(&peer.p, pub[0], BENCH_SRC, port);
+	tunnel_up(&wg[1], priv[1], port + 1, &peer.p);
+
+	if ((errno = pthread_create(&thr[0], NULL, bench_send, NULL)) != 0 ||
+	    (errno = pthread_create(&thr[1], NULL, bench_recv, NULL)) != 0)
+		err(1, "pthread_create");
+
+	/* Time from the first packet through, so the handshake doesn't count */
+	for (i = 0; i < 5000 && (start = __atomic_load_n(&g_first,
+	    __ATOMIC_RELAXED)) == 0; i++)
+		usleep(1000);
+	if (start == 0)
+		errx(1, "no packets came through the tunnel");
+	start = now_ns();
+	sent = __atomic_load_n(&g_sent, __ATOMIC_RELAXED);
+	recv = __atomic_load_n(&g_recv, __ATOMIC_RELAXED);
+	sleep(secs);
+	sent = __atomic_load_n(&g_sent, __ATOMIC_RELAXED) - sent;
+	recv = __atomic_load_n(&g_recv, __ATOMIC_RELAXED) - recv;
+	elapsed = now_ns() - start;
+	__atomic_store_n(&g_stop, 1, __ATOMIC_RELAXED);
+	pthread_join(thr[0], NULL);
+	pthread_join(thr[1], NULL);
+
+	printf(json ? "{\"bench\":\"dataplane\",\"size\":%zu,\"sent\":%llu,"
+	    "\"received\":%llu,\"pps\":%.0f,\"gbps\":%.3f}\n" :
+	    "size %zu sent %llu received %llu pps %.0f gbps %.3f\n", g_size,
+	    (unsigned long long)sent, (unsigned long long)recv,
+	    recv / (elapsed / 1e9), recv * g_size * 8 / (double)elapsed);
+
+	for (i = 0; i < 2; i++) {
+		wg_destroy_iface(&wg[i]);
+		wg_close_iface(&wg[i]);
+		close(sp[i][1]);
+	}
+
+	return 0;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: fwtunnel keypair\n"
+	    "       fwtunnel up -i ifname -k privkey -p port -P peerkey "
+	    "-e addr:port\n"
+	    "                -a allowed/cidr [-K keepalive]\n"
+	    "       fwtunnel bench [-j] [-d seconds] [-s size] [-p port]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int ret = -1;
+
+	if (argc < 2)
+		usage();
+
+	optind = 1;
+	if (strcmp(argv[1], "keypair") == 0)
+		ret = cmd_keypair(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "up") == 0)
+		ret = cmd_up(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "bench") == 0)
+		ret = cmd_bench(argc - 1, argv + 1);
+	if (ret == -1)
+		usage();
+
+	return ret;
+}